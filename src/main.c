@@ -16,6 +16,27 @@
 #include <unistd.h>
 #include <ftw.h>
 #include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <regex.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#ifdef __APPLE__
+extern char **environ;
+#endif
 
 #define MIN(a,b) (((a)<(b))?(a):(b))
 #define MAX(a,b) (((a)>(b))?(a):(b))
@@ -69,35 +90,961 @@ const gitsi_help_entry help_entries[] = {
     {.key = "g", .name = "top", .desc = "Jump to the top of the list"},
     {.key = "m", .name = "mark", .desc = "Mark / Unmark the selected file"},
     {.key = "M", .name = "mark section", .desc = "Mark / Unmark all files in section"},
+    {.key = "*", .name = "mark matches", .desc = "Mark / Unmark all files that match the filter"},
     {.key = "V", .name = "visual mark mode", .desc = "Toggle Visual Mark mode to mark files by moving. ESC cancels"},
     {.key = "C", .name = "amend", .desc = "Run `git commit --amend`"},
-    {.key = "p", .name = "push", .desc = "Run `git push`"},
-    {.key = "P", .name = "push -u", .desc = "Run `git push -u`"},
+    {.key = "p", .name = "push", .desc = "Run `git push` in the background"},
+    {.key = "P", .name = "push -u", .desc = "Run `git push -u` in the background"},
     {.key = "S", .name = "s action on marked", .desc = "Perform the add/stage action on all marked files"},
     {.key = "U", .name = "u action on marked", .desc = "Perform the unstage/delete action on all marked files"},
     {.key = "x", .name = "Reset", .desc = "Remove / Reset all changes this file has. Like `git checkout -- file`"},
-    {.key = ":", .name = "Command", .desc = "Run git command. I.e. :log for git log"},
+    {.key = ":", .name = "Command", .desc = "Run git command in the background. I.e. :fetch. :!cmd runs it in the terminal"},
+    {.key = "t", .name = "tree", .desc = "Toggle between the flat list and the directory tree"},
+    {.key = "o", .name = "fold", .desc = "Collapse / Expand the selected directory in tree mode [Left / Right]"},
+    {.key = "O", .name = "output", .desc = "Show / Hide the output of push and git commands"},
+    {.key = "{", .name = "output up", .desc = "Scroll the output up"},
+    {.key = "}", .name = "output down", .desc = "Scroll the output down"},
+    {.key = "R", .name = "renames", .desc = "Cycle rename detection: off, index, index and workspace"},
+    {.key = "D", .name = "preview", .desc = "Show / Hide the diff of the selected file next to the list"},
+    {.key = "L", .name = "history", .desc = "Show / Hide the commits that changed the selected file"},
+    {.key = "[", .name = "history up", .desc = "Scroll the history up"},
+    {.key = "]", .name = "history down", .desc = "Scroll the history down, older commits are loaded on the way"},
+    {.key = "f", .name = "grep section", .desc = "Only show files of the current section that contain a text. ESC clears"},
+    {.key = "F", .name = "grep", .desc = "Only show files that contain a text. ESC clears"},
+    {.key = ",", .name = "sort", .desc = "Cycle the order of the files: path, mtime, size, extension, status"},
+    {.key = ";", .name = "columns", .desc = "Show / Hide the modification time and size of the files"},
 };
 
 #define help_entries_length (sizeof (help_entries) / sizeof (const gitsi_help_entry))
 
-/* Each entry in the list is of this type */
-typedef struct gitsi_status_entry {
-    const char *filename;
-    const char *description;
+/* The descriptions an entry can have. Tree mode aggregates directories by these */
+const char *const status_descriptions[] = {
+    "new file", "modified", "deleted", "renamed", "typechange", "untracked",
+};
+
+#define status_descriptions_length (sizeof (status_descriptions) / sizeof (const char *))
+
+/* The names of the sections, in the order of GITSI_STATUS_TYPE */
+const char *const status_type_names[] = { "workspace", "index", "untracked" };
+
+/* One letter codes for --porcelain, in the order of GITSI_STATUS_TYPE and
+ * `status_descriptions` */
+const char status_type_codes[] = "WIU";
+const char status_description_codes[] = "AMDRT?";
+
+/* The index of a description in `status_descriptions` */
+enum GITSI_DESCRIPTION {
+    DESCRIPTION_NEW_FILE,
+    DESCRIPTION_MODIFIED,
+    DESCRIPTION_DELETED,
+    DESCRIPTION_RENAMED,
+    DESCRIPTION_TYPECHANGE,
+    DESCRIPTION_UNTRACKED,
+    // Headlines have no description
+    DESCRIPTION_NONE,
+};
+
+#define NO_PATH UINT32_MAX
+
+/* All entries of the status as a structure of arrays, an entry is an index
+ * into these. The section and the description of an entry are packed into
+ * one byte of `kinds`, see `gitsi_entry_type` and `gitsi_entry_description` */
+typedef struct gitsi_entries {
+    uint32_t count;
+    uint32_t capacity;
+    // All paths back to back, each one terminated by a NUL
+    char *paths;
+    size_t paths_length;
+    size_t paths_capacity;
+    uint32_t *path_offsets;
+    // Without the terminating NUL, the filter compares suffixes with them
+    uint32_t *path_lengths;
+    // The old path of renames, NO_PATH for everything else
+    uint32_t *old_path_offsets;
+    uint8_t *kinds;
+    uint16_t *git_statuses;
+    // One bit per entry
+    uint64_t *marked;
+    // The blobs that are compared for the diffstat. The new side of
+    // workspace and untracked entries is the file in the workdir
+    git_oid *old_ids;
+    git_oid *new_ids;
+    // Filled in from the diffstat worker. Headlines hold the section totals
+    uint64_t *has_diffstat;
+    uint64_t *is_binary;
+    uint32_t *lines_added;
+    uint32_t *lines_removed;
+    // Open addressing from the section and the path to the entry, built on
+    // the first lookup and dropped when an entry is appended
+    uint32_t *path_index;
+    size_t path_index_capacity;
+} gitsi_entries;
+
+/* A row of the list. It is the index of an entry, or for directory rows of the
+ * tree, the index into `tree->directory_nodes` with `ROW_DIRECTORY` set */
+typedef uint32_t gitsi_row;
+
+#define ROW_DIRECTORY 0x80000000u
+#define ROW_NONE UINT32_MAX
+
+/* In tree mode, each section is a prefix tree of its paths. Every directory
+ * path is interned once and shared by all of the files below it */
+typedef struct gitsi_tree_node {
+    const char *path;
+    // The part of `path` that is displayed. Chains of directories with only
+    // one subdirectory are collapsed into one row, i.e. `src/main`
+    const char *name;
+    size_t depth;
     enum GITSI_STATUS_TYPE type;
+    struct gitsi_tree_node *parent;
+    struct gitsi_tree_node *first_child;
+    struct gitsi_tree_node *last_child;
+    struct gitsi_tree_node *next_sibling;
+    size_t child_count;
+    // The row of the node. This is the entry for leaves
+    gitsi_row row;
+    bool is_directory;
+    // Directories carry their own mark, files use the bitset of the entries
     bool marked;
-    git_status_t git_status;
-} gitsi_status_entry;
+    // Set from `collapsed_directories` when the tree is built
+    bool is_collapsed;
+    size_t counts[status_descriptions_length];
+} gitsi_tree_node;
+
+#define TREE_BLOCK_SIZE 1024
+
+/* Tree nodes are allocated in blocks so that pointers to them stay valid */
+typedef struct gitsi_tree_block {
+    struct gitsi_tree_block *next;
+    size_t used;
+    gitsi_tree_node nodes[TREE_BLOCK_SIZE];
+} gitsi_tree_block;
+
+typedef struct gitsi_tree {
+    gitsi_tree_block *blocks;
+    // One root per section (workspace, index, untracked)
+    gitsi_tree_node roots[STATUS_TYPE_CATEGORY];
+    // Open addressing hash table from (section, directory path) to node
+    gitsi_tree_node **directories;
+    size_t directory_count;
+    size_t directory_capacity;
+    // The directories in the order of their creation, for directory rows
+    gitsi_tree_node **directory_nodes;
+    size_t directory_node_count;
+    size_t directory_node_capacity;
+    // The leaf of every entry, indexed by entry
+    gitsi_tree_node **leaves;
+} gitsi_tree;
+
+/* How the path part of a filter is matched */
+enum GITSI_FILTER_KIND {
+    // Empty filters, or filters with only predicates
+    FILTER_ALL,
+    FILTER_SUBSTRING,
+    // `*.proto`, compared as a suffix
+    FILTER_EXTENSION,
+    FILTER_GLOB,
+    // Starts with `^`
+    FILTER_REGEX,
+};
+
+/* The search term compiled into a matcher. It is compiled once for every change
+ * of the term, not for every entry. `status:` and `section:` restrict the
+ * matches to a set of descriptions or sections */
+typedef struct gitsi_filter {
+    char *source;
+    enum GITSI_FILTER_KIND kind;
+    char *pattern;
+    size_t pattern_length;
+    regex_t regex;
+    // An invalid regex or an unknown word is ignored, the status bar says so
+    bool is_invalid;
+    // Bit masks of GITSI_DESCRIPTION and GITSI_STATUS_TYPE values, 0 matches all
+    unsigned descriptions;
+    unsigned sections;
+} gitsi_filter;
+
+/* Directories that the user collapsed in tree mode. These survive refreshes */
+typedef struct gitsi_collapsed_directory {
+    enum GITSI_STATUS_TYPE type;
+    char *path;
+} gitsi_collapsed_directory;
+
+/* A marked or selected row of the last status, by its path */
+typedef struct gitsi_carried_row {
+    enum GITSI_STATUS_TYPE type;
+    bool is_directory;
+    char *path;
+} gitsi_carried_row;
+
+/* The marks and the selection are remembered by path when the entries are
+ * freed and restored once the entries of the next status are shown */
+typedef struct gitsi_carry {
+    gitsi_carried_row *marked;
+    size_t marked_count;
+    bool has_position;
+    gitsi_carried_row position;
+} gitsi_carry;
 
 #define MAX_INPUT_CHARS 512
 #define MAX_NUMBER_STACK 8
+// The most keys that are processed before the next frame is drawn
+#define MAX_INPUT_BATCH 256
 
 // #define DEBUG 1
 
-#if DEBUG
 #define LOGFILE_NAME "/tmp/gitsi.log"
-#endif
+// The log is kept in memory and only written to the file on exit, on a
+// crash or on SIGUSR1. Older lines are overwritten once it is full
+#define LOG_BUFFER_SIZE (256 * 1024)
+#define LOG_LINE_MAX 512
+
+/* How much is logged, set with --log. Debug builds log everything */
+enum GITSI_LOG_LEVEL {
+    GITSI_LOG_OFF,
+    GITSI_LOG_ERROR,
+    GITSI_LOG_WARN,
+    GITSI_LOG_INFO,
+    GITSI_LOG_DEBUG,
+};
+
+const char *const log_level_names[] = { "off", "error", "warn", "info", "debug" };
+const char log_level_codes[] = "-EWID";
+
+#define log_level_names_length (sizeof (log_level_names) / sizeof (const char *))
+
+/* The log is a ring of bytes that all threads append lines to. A line
+ * reserves its space by moving `head` forward, so writers can copy their lines
+ * at the same time. Once it is copied, a line is published by moving
+ * `committed` past it, in the order of the reservations. A flush only writes
+ * what is committed, never a half copied line. Everything up to `flushed` is
+ * in the file. It is a global so that the workers and the signal handlers can
+ * reach it */
+typedef struct gitsi_log {
+    enum GITSI_LOG_LEVEL level;
+    int fd;
+    char *buffer;
+    atomic_size_t head;
+    atomic_size_t committed;
+    atomic_size_t flushed;
+    double started_at;
+} gitsi_log;
+
+gitsi_log gitsi_log_state = { .level = GITSI_LOG_OFF, .fd = -1 };
+
+/* Log a line if the level is enabled. When logging is off, this is a single
+ * comparison and the arguments are not even evaluated */
+#define GITSI_LOG(log_level, ...) do { \
+        if ((log_level) <= gitsi_log_state.level)gitsi_log_write((log_level), __VA_ARGS__); \
+    } while (0)
+
+/* A formatted row of the list. Rows are formatted once when they scroll into
+ * view and kept in a ring until the rows change */
+typedef struct gitsi_row_cache {
+    size_t row;
+    size_t generation;
+    char *text;
+    size_t capacity;
+} gitsi_row_cache;
+
+// --replay draws into a screen of this size that is never shown
+#define REPLAY_LINES 50
+#define REPLAY_COLUMNS 160
+// The latency histogram has a bucket per power of two microseconds
+#define REPLAY_BUCKETS 24
+// Ends the keys of a line of a session, they are handled as one batch
+#define REPLAY_BATCH_END (-2)
+
+/* What the time of a replayed batch of keys is spent on. `status` is reading
+ * the status or reloading the index */
+enum GITSI_REPLAY_PHASE {
+    REPLAY_INPUT,
+    REPLAY_STATUS,
+    REPLAY_RENDER,
+    REPLAY_TOTAL,
+    REPLAY_PHASES,
+};
+
+const char *const replay_phase_names[] = { "input", "status", "render", "total" };
+
+/* The keys of a --replay session and the time every batch of them took.
+ * `next` is the key that is read next. A dialog without an answer in the
+ * session sets `is_failed` */
+typedef struct gitsi_replay {
+    int *keys;
+    size_t key_count;
+    size_t key_capacity;
+    size_t next;
+    bool is_failed;
+    double *samples[REPLAY_PHASES];
+    size_t sample_counts[REPLAY_PHASES];
+} gitsi_replay;
+
+/* The state a line of the list pad was drawn with */
+enum GITSI_LINE_STATE {
+    GITSI_LINE_SELECTED = 1,
+    GITSI_LINE_MARKED = 2,
+    GITSI_LINE_VISUAL = 4,
+};
+
+/* What a line of the list pad currently shows */
+typedef struct gitsi_drawn_line {
+    size_t row;
+    int state;
+} gitsi_drawn_line;
+
+#define MAX_JOBS 8
+#define OUTPUT_LINES 1000
+
+/* What has to be reloaded once a background job finished */
+enum GITSI_REFRESH {
+    GITSI_REFRESH_NONE,
+    GITSI_REFRESH_STATUS,
+};
+
+/* A non-interactive git command that runs in the background, i.e. `git push`.
+ * Its output is shown in the output pane */
+typedef struct gitsi_job {
+    int id;
+    pid_t pid;
+    // The read end of the pipe for stdout and stderr. -1 once it is closed
+    int fd;
+    char *title;
+    enum GITSI_REFRESH refresh;
+    bool is_running;
+    int exit_status;
+    // The line that is currently being received
+    char line[MAX_INPUT_CHARS];
+    size_t line_length;
+} gitsi_job;
+
+/* The output of all jobs, a ring of lines */
+typedef struct gitsi_output {
+    char *lines[OUTPUT_LINES];
+    size_t first;
+    size_t count;
+    // How many lines the user scrolled up from the bottom
+    size_t scroll;
+    bool is_visible;
+} gitsi_output;
+
+/* The line counts of one entry */
+typedef struct gitsi_diffstat_result {
+    size_t lines_added;
+    size_t lines_removed;
+    bool is_binary;
+} gitsi_diffstat_result;
+
+/* What the diffstat of an entry depends on. Blobs are identified by their
+ * id, files in the workdir by their stat data */
+typedef struct gitsi_diffstat_key {
+    git_oid old_id;
+    git_oid new_id;
+    int64_t mtime_seconds;
+    int64_t mtime_nanoseconds;
+    int64_t size;
+    uint64_t inode;
+} gitsi_diffstat_key;
+
+typedef struct gitsi_diffstat_slot {
+    bool is_used;
+    gitsi_diffstat_key key;
+    gitsi_diffstat_result result;
+} gitsi_diffstat_slot;
+
+/* One request per entry of the current status */
+typedef struct gitsi_diffstat_request {
+    char *path;
+    enum GITSI_STATUS_TYPE type;
+    git_oid old_id;
+    git_oid new_id;
+    bool is_done;
+    gitsi_diffstat_result result;
+} gitsi_diffstat_request;
+
+#define DIFFSTAT_CACHE_MAX 65536
+
+/* The diffstat worker computes the line counts of all entries with its own
+ * repository handle. Everything but the cache is protected by `lock` */
+typedef struct gitsi_diffstat {
+    pthread_t thread;
+    bool is_running;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    bool should_stop;
+    char *repo_path;
+    // Replaced by the main thread after every status refresh
+    gitsi_diffstat_request *requests;
+    size_t request_count;
+    size_t generation;
+    size_t next_request;
+    // The requests of the rows on screen are computed first
+    size_t *priority;
+    size_t priority_count;
+    bool has_results;
+    // Only used by the worker, it survives status refreshes
+    gitsi_diffstat_slot *cache;
+    size_t cache_count;
+    size_t cache_capacity;
+} gitsi_diffstat;
+
+#define PREVIEW_CACHE_SIZE 16
+#define PREVIEW_MAX_LINES 2000
+// The screen has to be at least this wide for the preview to go on the side
+#define PREVIEW_SIDE_MIN_WIDTH 140
+// The header with the branch is the first line of the screen
+#define HEADER_HEIGHT 1
+
+/* A computed diff in the preview cache */
+typedef struct gitsi_preview_slot {
+    bool is_used;
+    char *path;
+    enum GITSI_STATUS_TYPE type;
+    git_oid old_id;
+    git_oid new_id;
+    size_t status_generation;
+    size_t last_used;
+    char **lines;
+    size_t line_count;
+} gitsi_preview_slot;
+
+/* The diff preview of the selected entry. It is computed by a worker with its
+ * own repository handle. A new request cancels the one that is computed */
+typedef struct gitsi_preview {
+    bool is_visible;
+    pthread_t thread;
+    bool is_running;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    bool should_stop;
+    char *repo_path;
+    // Changes with every request, the worker stops once it differs from the
+    // generation it is working on
+    atomic_size_t request_generation;
+    gitsi_diffstat_request request;
+    size_t result_generation;
+    char **result_lines;
+    size_t result_count;
+    bool has_result;
+    // Only used by the main thread
+    gitsi_preview_slot cache[PREVIEW_CACHE_SIZE];
+    size_t use_counter;
+    // The slot that is shown, -1 while it is computed
+    int shown_slot;
+    gitsi_preview_slot shown_key;
+    bool is_shown;
+    // What the current request of the worker is for
+    gitsi_preview_slot request_key;
+} gitsi_preview;
+
+// The history is walked until this many more commits than are on screen are found
+#define HISTORY_PAGE 50
+// The worker checks for a new request after this many commits
+#define HISTORY_WALK_BATCH 256
+
+/* The commits that changed the selected path. A worker walks the history
+ * from HEAD and hands the commits it finds to the main thread in batches.
+ * It stops once `wanted` commits are found and continues when the pane is
+ * scrolled towards the end */
+typedef struct gitsi_history {
+    bool is_visible;
+    pthread_t thread;
+    bool is_running;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    bool should_stop;
+    char *repo_path;
+    // Changes with every request, the worker starts a new walk once it
+    // differs from the generation it is working on
+    atomic_size_t request_generation;
+    char *request_path;
+    size_t wanted;
+    // The found commits that were not collected yet
+    size_t result_generation;
+    char **result_lines;
+    size_t result_count;
+    size_t result_walked;
+    bool result_complete;
+    bool has_result;
+    // Why the worker could not walk the history, it stops after setting it
+    char *error;
+    // Only used by the main thread
+    char *failure;
+    char *shown_path;
+    git_oid head_id;
+    size_t status_generation;
+    size_t requested;
+    char **lines;
+    size_t count;
+    size_t capacity;
+    size_t walked;
+    bool is_complete;
+    size_t scroll;
+} gitsi_history;
+
+/* The upstream of the checked out branch for the header. The name and the
+ * tips are read with the branch. Counting how far they are apart walks the
+ * history, so a worker does that and the counts are kept for the tips they
+ * were counted for */
+typedef struct gitsi_upstream {
+    // Like `refs/remotes/origin/main` without `refs/remotes/`, NULL if there is none
+    char *name;
+    // Resolving the upstream reads the remotes from the config, so it is kept
+    // until the branch or the config changes
+    char *branch_ref;
+    char *upstream_ref;
+    int64_t config_mtime;
+    // The upstream is configured, but its branch does not exist
+    bool is_gone;
+    git_oid local_id;
+    git_oid upstream_id;
+    pthread_t thread;
+    bool is_running;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    bool should_stop;
+    char *repo_path;
+    bool has_request;
+    git_oid request_local_id;
+    git_oid request_upstream_id;
+    bool has_result;
+    git_oid result_local_id;
+    git_oid result_upstream_id;
+    size_t result_ahead;
+    size_t result_behind;
+    // Only used by the main thread
+    bool is_requested;
+    git_oid requested_local_id;
+    git_oid requested_upstream_id;
+    bool has_counts;
+    git_oid counted_local_id;
+    git_oid counted_upstream_id;
+    size_t ahead;
+    size_t behind;
+} gitsi_upstream;
+
+#define GREP_MAX_THREADS 8
+// Files with a NUL byte in this many bytes count as binary, the same as git
+#define GREP_BINARY_CHECK 8000
+// Files of the workspace are searched in blocks of this size
+#define GREP_READ_SIZE (256 * 1024)
+
+/* A file for the content search. Staged files are searched in their blob */
+typedef struct gitsi_grep_item {
+    char *path;
+    bool is_blob;
+    git_oid id;
+} gitsi_grep_item;
+
+/* The content search greps the changed files with a pool of workers. The items
+ * are indexed like the entries and are taken by the workers one at a time.
+ * Matches are handed to the main thread in `found`, protected by `lock` */
+typedef struct gitsi_grep {
+    bool is_input;
+    bool is_active;
+    // STATUS_TYPE_CATEGORY searches all sections
+    enum GITSI_STATUS_TYPE scope;
+    char term[MAX_INPUT_CHARS];
+    char *repo_path;
+    pthread_t threads[GREP_MAX_THREADS];
+    size_t thread_count;
+    gitsi_grep_item *items;
+    uint32_t item_count;
+    atomic_uint next_item;
+    atomic_uint done_count;
+    atomic_bool should_stop;
+    pthread_mutex_t lock;
+    uint32_t *found;
+    size_t found_count;
+    size_t found_capacity;
+    // Only used by the main thread. One bit per entry
+    uint64_t *matched;
+    size_t match_count;
+    bool is_finished;
+} gitsi_grep;
+
+#define STAGE_MAX_THREADS 8
+// Files are hashed in chunks of this size, a cancel is noticed between them
+#define STAGE_CHUNK_SIZE (1024 * 1024)
+// The main loop is woken up to show the progress after this many bytes
+#define STAGE_PROGRESS_BYTES (16 * 1024 * 1024)
+// Batches with more files or bytes are staged in the background
+#define STAGE_BACKGROUND_FILES 256
+#define STAGE_BACKGROUND_BYTES (32 * 1024 * 1024)
+
+/* What a worker did with a file of a staging batch */
+enum GITSI_STAGE_RESULT {
+    STAGE_RESULT_PENDING,
+    // The blob was written, `id` and `file_stat` belong to it
+    STAGE_RESULT_HASHED,
+    // The file is gone, so it is removed from the index
+    STAGE_RESULT_MISSING,
+    // Everything else, i.e. a nested repository, is added by libgit2
+    STAGE_RESULT_FALLBACK,
+};
+
+/* A file of a staging batch */
+typedef struct gitsi_stage_item {
+    char *path;
+    int64_t size;
+    enum GITSI_STAGE_RESULT result;
+    git_oid id;
+    struct stat file_stat;
+} gitsi_stage_item;
+
+/* Staging writes the blobs of a batch with a pool of workers, the largest
+ * files first, and streams them into the object database. The index is only
+ * updated and written once all of them are done, so a cancelled batch leaves
+ * it as it was. `removals` are the deleted and renamed paths of the batch */
+typedef struct gitsi_stage {
+    bool is_running;
+    char *repo_path;
+    pthread_t threads[STAGE_MAX_THREADS];
+    size_t thread_count;
+    gitsi_stage_item *items;
+    uint32_t item_count;
+    char **removals;
+    size_t removal_count;
+    atomic_uint next_item;
+    atomic_uint done_count;
+    atomic_ullong done_bytes;
+    uint64_t total_bytes;
+    atomic_bool should_stop;
+    // The mode of a file follows its executable bit, like core.filemode
+    bool trust_filemode;
+    // Where the cursor goes once a batch in the background is done
+    size_t position_index;
+    // The batch of `S` clears the marks once it is written
+    bool clears_marks;
+    double started_at;
+} gitsi_stage;
+
+/* Which renames are detected when the status is loaded */
+enum GITSI_RENAMES {
+    GITSI_RENAMES_OFF,
+    GITSI_RENAMES_INDEX,
+    GITSI_RENAMES_WORKDIR,
+};
+
+const char *const rename_mode_names[] = { "off", "index", "all" };
+
+/* The order of the files within their section */
+enum GITSI_SORT {
+    GITSI_SORT_PATH,
+    // The most recently modified files first
+    GITSI_SORT_MTIME,
+    // The largest files first
+    GITSI_SORT_SIZE,
+    GITSI_SORT_EXTENSION,
+    GITSI_SORT_STATUS,
+};
+
+const char *const sort_names[] = { "path", "mtime", "size", "extension", "status" };
+
+#define sort_names_length (sizeof (sort_names) / sizeof (const char *))
+
+/* The key of an entry for sorting. Entries with equal keys keep the path order */
+typedef struct gitsi_sort_item {
+    int64_t key;
+    // The extension for GITSI_SORT_EXTENSION, NULL for all other keys
+    const char *text;
+    uint32_t entry;
+} gitsi_sort_item;
+
+/* The order of the entries in the list. The modification time and size of the
+ * files are only read if the sort key or the columns need them, once per
+ * status. Sorting by another key only sorts `order` again */
+typedef struct gitsi_sort {
+    enum GITSI_SORT key;
+    bool show_metadata;
+    // The status generation that `mtimes` and `sizes` were read for
+    size_t metadata_generation;
+    // What `order` was sorted for
+    size_t order_generation;
+    enum GITSI_SORT order_key;
+    // -1 for files that are not in the workdir
+    int64_t *mtimes;
+    int64_t *sizes;
+    uint32_t *order;
+    gitsi_sort_item *items;
+    uint32_t capacity;
+} gitsi_sort;
+
+/* With --porcelain or --json the status is written to stdout without ui */
+enum GITSI_OUTPUT {
+    GITSI_OUTPUT_NONE,
+    GITSI_OUTPUT_PORCELAIN,
+    GITSI_OUTPUT_JSON,
+};
+
+/* The commands of --batch, in the order of `batch_command_names` */
+enum GITSI_BATCH_COMMAND {
+    BATCH_STAGE,
+    BATCH_UNSTAGE,
+    BATCH_DISCARD,
+    BATCH_DELETE,
+    BATCH_NONE,
+};
+
+const char *const batch_command_names[] = { "stage", "unstage", "discard", "delete" };
+
+/* A command line of --batch and what came of it */
+typedef struct gitsi_batch_result {
+    char *line;
+    size_t matches;
+    const char *error;
+} gitsi_batch_result;
+
+/* A path of the status, sorted so that literal pathspecs can be looked up */
+typedef struct gitsi_batch_path {
+    const char *path;
+    uint32_t entry;
+} gitsi_batch_path;
+
+/* Consecutive commands of the same kind are collected into one run, which
+ * is applied with a single index write, reset or checkout. The status is
+ * only loaded again when a run changed it. `matched_by` holds the number of
+ * the last command that matched an entry, commands from `run_serial` on
+ * belong to the current run */
+typedef struct gitsi_batch {
+    enum GITSI_BATCH_COMMAND command;
+    gitsi_batch_result *results;
+    size_t result_count;
+    size_t result_capacity;
+    uint32_t *entries;
+    size_t entry_count;
+    uint32_t *matched_by;
+    uint32_t serial;
+    uint32_t run_serial;
+    gitsi_batch_path *paths;
+    size_t path_count;
+    bool is_stale;
+    bool failed;
+    // The commands that were read but not parsed yet. A run is applied as
+    // soon as no further command is waiting, so that a driver that sends one
+    // command at a time gets its answer
+    int input_fd;
+    char *input;
+    size_t input_start;
+    size_t input_length;
+    size_t input_capacity;
+} gitsi_batch;
+
+// The batch input is read in blocks of this size
+#define BATCH_READ_SIZE 65536
+
+#define DEFAULT_RENAME_LIMIT 200
+#define DEFAULT_RENAME_THRESHOLD 50
+// With more changed paths, a reload of the index reads the full status
+#define INDEX_RELOAD_LIMIT 4096
+// File systems take their timestamps from a coarser clock, so a file that
+// was changed this many seconds before a status could still be newer
+#define INDEX_RELOAD_CLOCK_SLACK 1
+
+/* A rename that was found between a deleted and an added path */
+typedef struct gitsi_rename {
+    char *old_path;
+    char *new_path;
+} gitsi_rename;
+
+/* The renames of one section, sorted by old and by new path for lookups */
+typedef struct gitsi_renames {
+    gitsi_rename *renames;
+    size_t count;
+    gitsi_rename **by_old_path;
+    gitsi_rename **by_new_path;
+} gitsi_renames;
+
+/* The entries of one or more status lists, sorted by path. A status that was
+ * read in shards is classified like a single list */
+typedef struct gitsi_status_view {
+    const git_status_entry **entries;
+    size_t count;
+} gitsi_status_view;
+
+// The workdir is read by at most this many workers at once
+#define STATUS_MAX_SHARDS 16
+// With fewer index entries, the status is read in one go
+#define STATUS_SHARD_MIN_ENTRIES 8192
+// Large directories are split into their children up to this many paths
+#define STATUS_SHARD_MAX_PATHS 4096
+
+/* A path below which one worker reads the workdir. The weight is the
+ * number of tracked files below it */
+typedef struct gitsi_shard_path {
+    char *path;
+    size_t weight;
+    // A directory with tracked files, which can be split further
+    bool is_tree;
+} gitsi_shard_path;
+
+/* A worker that reads the workdir status below the paths of `pathspec`,
+ * with a repository of its own. The first shard is read by the thread that
+ * reads the status, with `shared_repo`, as that has the index loaded already */
+typedef struct gitsi_status_shard {
+    pthread_t thread;
+    bool is_running;
+    const char *repo_path;
+    char **pathspec;
+    size_t pathspec_count;
+    size_t weight;
+    git_repository *shared_repo;
+    git_repository *repo;
+    git_status_list *status;
+    int error;
+} gitsi_status_shard;
+
+/* The directories of a cone mode sparse checkout, sorted and without a
+ * trailing slash. Everything below a `recursive` directory is checked out,
+ * of a `parents` directory only the files directly in it. The root is
+ * always a parent, as "" */
+typedef struct gitsi_sparse_cone {
+    char **recursive;
+    size_t recursive_count;
+    char **parents;
+    size_t parent_count;
+} gitsi_sparse_cone;
+
+// Like git, --preload-index uses at most this many workers, each for at
+// least this many index entries
+#define PRELOAD_MAX_THREADS 20
+#define PRELOAD_ENTRIES_PER_THREAD 500
+
+/* A worker of --preload-index, that lstat()s the index entries from `first`
+ * up to `last` */
+typedef struct gitsi_preload {
+    pthread_t thread;
+    git_index *index;
+    const char *workdir;
+    size_t first;
+    size_t last;
+} gitsi_preload;
+
+/* A worker that compares the index entries from `first` up to `last` and
+ * their directories with the time of the last status. Like the preload, the
+ * workers share the index entries */
+typedef struct gitsi_workdir_check {
+    pthread_t thread;
+    git_index *index;
+    const char *workdir;
+    size_t first;
+    size_t last;
+    time_t since;
+    // Set by the first worker that finds a change, the others stop then
+    atomic_bool *is_changed;
+} gitsi_workdir_check;
+
+struct gitsi_context;
+
+/* Everything that is needed to read the status into `entries`. It does not
+ * depend on the context, so the status can also be read by a worker with
+ * its own repository. `output` is the context to stream the entries of
+ * --porcelain and --json to */
+typedef struct gitsi_status_request {
+    git_repository *repo;
+    git_index *index;
+    enum GITSI_RENAMES rename_mode;
+    size_t rename_limit;
+    uint16_t rename_threshold;
+    gitsi_entries *entries;
+    bool renames_skipped;
+    struct gitsi_context *output;
+    // How many workers read the workdir, 1 reads it in one go
+    size_t thread_count;
+    // lstat() the index entries with several workers first, for --preload-index
+    bool preload_index;
+    // The index and HEAD tree that the status was read against
+    git_oid index_checksum;
+    git_oid head_tree;
+    // A reload of the index only reads the workdir below `pathspec`. The
+    // workspace and untracked entries of `previous` outside of it are kept,
+    // `previous_next` is where the merge with them stands
+    const gitsi_entries *previous;
+    char **pathspec;
+    size_t pathspec_count;
+    uint32_t previous_next;
+    // The first libgit error while reading. Workers read the status too, so
+    // it is reported by the main thread once the request is taken
+    char *error;
+} gitsi_status_request;
+
+/* The first status is read by a worker, so that the first frame does not
+ * have to wait for the walk of the workdir */
+typedef struct gitsi_status_loader {
+    pthread_t thread;
+    bool is_running;
+    atomic_bool is_done;
+    char *repo_path;
+    gitsi_entries entries;
+    gitsi_status_request request;
+    bool from_daemon;
+} gitsi_status_loader;
+
+// The socket of --daemon, in the git directory of the repository
+#define DAEMON_SOCKET_NAME "gitsi.sock"
+#define DAEMON_MAGIC "gitsid1"
+// Part of the request and the answer, a daemon of another version of gitsi
+// is not asked. Increase it with every change of the structures below
+#define DAEMON_VERSION 2
+// An answer beyond these limits is not from a gitsi daemon
+#define DAEMON_MAX_ENTRIES (1u << 24)
+#define DAEMON_MAX_PATHS_LENGTH (1u << 30)
+// Without clients, the daemon exits after an hour
+#define DAEMON_IDLE_TIMEOUT (60 * 60 * 1000)
+// Changes are read once the workdir was quiet for this many milliseconds
+#define DAEMON_SETTLE_TIME 200
+// How many seconds a client waits for the status of the daemon
+#define DAEMON_CLIENT_TIMEOUT 10
+
+/* What a client of --daemon asks for. The status depends on the rename
+ * settings, so they are part of it. The daemon reads it with the thread
+ * count and preload of the client from then on */
+typedef struct gitsi_daemon_request {
+    char magic[8];
+    uint32_t version;
+    uint32_t rename_mode;
+    uint32_t rename_threshold;
+    uint32_t preload_index;
+    uint64_t rename_limit;
+    uint64_t thread_count;
+} gitsi_daemon_request;
+
+/* The answer of the daemon. Client and daemon are the same binary on the same
+ * machine, so the arrays of the entries follow as they are in memory */
+typedef struct gitsi_daemon_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint32_t renames_skipped;
+    uint64_t paths_length;
+    git_oid index_checksum;
+    git_oid head_tree;
+} gitsi_daemon_header;
+
+/* A directory that the daemon watches. The path ends with a slash, it is
+ * relative to the workdir, or absolute for the git directory and its refs */
+typedef struct gitsi_daemon_watch {
+    char *path;
+    bool is_git;
+    bool is_used;
+} gitsi_daemon_watch;
+
+/* The state of --daemon. The paths that changed in the workdir are collected
+ * until it is quiet, then only they are read again. Without inotify, or if
+ * not all directories could be watched, every client gets a full status */
+typedef struct gitsi_daemon {
+    int listen_fd;
+    int notify_fd;
+    char *socket_path;
+    gitsi_daemon_watch *watches;
+    size_t watch_capacity;
+    bool is_watching;
+    char **changed;
+    size_t changed_count;
+    size_t changed_capacity;
+    bool index_changed;
+    bool is_stale;
+} gitsi_daemon;
 
 /* The context stores what the current UI looks like.
  - All the git status entries
@@ -112,38 +1059,131 @@ typedef struct gitsi_context {
     int max_x;
     int max_y;
     
-    // Repositories State
+    // Repositories State. `branch` is what the header shows
     char *repo_dir;
     git_repository *repo;
     git_index *repo_index;
+    char *branch;
+    
+    // Rename detection. `renames_skipped` is set if there were more candidates
+    // than the limit allows, the status bar shows that
+    enum GITSI_RENAMES rename_mode;
+    size_t rename_limit;
+    uint16_t rename_threshold;
+    bool renames_skipped;
+    
+    // How many workers read the status, 0 for one per processor
+    size_t status_threads;
+    // --preload-index
+    bool preload_index;
+    
+    // The index and HEAD tree of the status. After actions that only write
+    // the index, the paths that changed since are read again
+    git_oid status_index_checksum;
+    git_oid status_head_tree;
+    // When the last status started to read the workdir. Files and directories
+    // that changed since are not known to a reload of the index
+    time_t status_read_at;
+    // The last status could not be read, the list says so instead of that
+    // the working tree is clean
+    bool status_failed;
+    
+    // Script output. `output_nul` terminates porcelain lines with NUL (-z).
+    // `batch_path` is the command file of --batch, "-" is stdin
+    enum GITSI_OUTPUT output_format;
+    bool output_nul;
+    bool is_batch;
+    const char *batch_path;
+    
+    // --daemon serves the status of the repository over a socket
+    bool is_daemon;
+    
+    // --log, the log itself is global
+    enum GITSI_LOG_LEVEL log_level;
+    
+    // --record writes the keys to `record_file`, --replay runs a session of
+    // them on `replay_screen`, the keys are read from `replay` then.
+    // `status_work_ms` adds up the time spent on reading the status for the
+    // latency of a key
+    const char *record_path;
+    FILE *record_file;
+    const char *replay_path;
+    SCREEN *replay_screen;
+    gitsi_replay *replay;
+    double status_work_ms;
     
     // Entries state
-    gitsi_status_entry **entries;
-    size_t entry_count;
+    gitsi_entries entries;
     
-    // Search / Filter State
+    // Search / Filter State. `rows` are the visible lines of the list
     bool is_search;
     char search_term[MAX_INPUT_CHARS];
-    gitsi_status_entry **filtered_entries;
-    size_t filtered_entry_count;
+    gitsi_row *rows;
+    size_t row_count;
+    gitsi_filter filter;
     
     // Command state
     char command_term[MAX_INPUT_CHARS];
     bool is_in_command_mode;
     
-    // List state
-    gitsi_status_entry *position;
+    // List state. ROW_NONE if nothing is selected
+    gitsi_row position;
+    
+    // List rendering state. The list is drawn into a pad that is as high as the
+    // screen. `list_generation` changes whenever the rows change
+    WINDOW *list_pad;
+    int list_pad_height;
+    int list_pad_width;
+    size_t list_generation;
+    size_t list_drawn_generation;
+    size_t list_drawn_start;
+    size_t list_title_generation;
+    size_t list_title_width;
+    gitsi_drawn_line *list_lines;
+    gitsi_row_cache *row_cache;
+    size_t row_cache_size;
+    size_t position_hint;
+    
+    // Sort state
+    gitsi_sort sort;
+    
+    // Tree state
+    bool is_tree_mode;
+    gitsi_tree *tree;
+    gitsi_collapsed_directory *collapsed_directories;
+    size_t collapsed_directory_count;
+    
+    // Marks and selection between two statuses
+    gitsi_carry carry;
+    
+    // Job state
+    gitsi_job jobs[MAX_JOBS];
+    int job_counter;
+    gitsi_output output;
+    
+    // Background workers write to this pipe to wake up the main loop
+    int wake_pipe[2];
+    gitsi_diffstat diffstat;
+    gitsi_preview preview;
+    gitsi_history history;
+    gitsi_upstream upstream;
+    gitsi_grep grep;
+    gitsi_stage stage;
+    gitsi_status_loader loader;
+    // Changes with every status refresh
+    size_t status_generation;
+    
+    // Startup timings for --trace, in milliseconds of the monotonic clock
+    bool is_trace;
+    double started_at;
+    double first_frame_at;
+    double status_at;
     
     // UI State
     bool is_visual_mark_mode;
     bool is_in_help;
     char number_stack[MAX_NUMBER_STACK];
     int number_stack_count;
-    
-    // Log State
-#if DEBUG
-    FILE *logfile;
-#endif
 } gitsi_context;
 
 /* All the possible keystrokes for navigation and actions are defiend here */
@@ -151,6 +1191,8 @@ enum key_stroke {
     // Actions
     K_SLASH, K_Q, K_S, K_U, K_S_S, K_S_U, K_D, K_I, K_M, K_S_M, K_C, K_E, K_R,
     K_BACKSPACE, K_ESC, K_ENTER, K_YES, K_NO, K_H, K_S_V, K_S_C, K_X, K_P, K_S_P,
+    K_T, K_O, K_S_O, K_LBRACE, K_RBRACE, K_S_R, K_S_D, K_F, K_S_F, K_STAR,
+    K_COMMA, K_SEMICOLON, K_S_L, K_LBRACKET, K_RBRACKET,
     // Navigation
     K_G, K_C_U, K_C_D, K_J, K_K, K_S_G, K_S_1, K_S_2, K_S_3,
     K_ARROW_LEFT, K_ARROW_RIGHT, K_ARROW_UP, K_ARROW_DOWN,
@@ -159,88 +1201,150 @@ enum key_stroke {
     K_OTHER
 };
 
-void gitsi_debug_str(gitsi_context *context, const char *format, ...);
+void gitsi_log_write(enum GITSI_LOG_LEVEL level, const char *format, ...);
 
 // --------------------------------------------------
 #pragma mark Helpers
 // --------------------------------------------------
 
-/* Translate what the user entered into one of our key constants */
+/* The keys we react to. Everything else is K_OTHER */
+const struct gitsi_key_binding {
+    int ch;
+    enum key_stroke key;
+} key_bindings[] = {
+    {'/', K_SLASH}, {'q', K_Q}, {'j', K_J}, {'k', K_K}, {'r', K_R}, {':', K_COMMAND},
+    {'s', K_S}, {'u', K_U}, {'?', K_HELP}, {'S', K_S_S}, {'U', K_S_U}, {'m', K_M},
+    {'M', K_S_M}, {'V', K_S_V}, {'c', K_C}, {'C', K_S_C}, {'x', K_X}, {'h', K_H},
+    {'p', K_P}, {'P', K_S_P}, {'t', K_T}, {'o', K_O}, {'O', K_S_O}, {'{', K_LBRACE},
+    {'}', K_RBRACE}, {'R', K_S_R}, {'D', K_S_D}, {'f', K_F}, {'F', K_S_F}, {'*', K_STAR}, {',', K_COMMA}, {';', K_SEMICOLON}, {'L', K_S_L}, {'[', K_LBRACKET}, {']', K_RBRACKET}, {'d', K_D}, {'e', K_E}, {'g', K_G}, {'i', K_I}, {'!', K_S_1},
+    {'@', K_S_2}, {'#', K_S_3}, {'Y', K_YES}, {'N', K_NO}, {'G', K_S_G},
+    // ^U, ^D, ^?, ^H, ^[, ^M
+    {21, K_C_U}, {4, K_C_D}, {127, K_BACKSPACE}, {8, K_BACKSPACE}, {27, K_ESC},
+    {13, K_ENTER}, {10, K_ENTER},
+    {KEY_ENTER, K_ENTER}, {KEY_BACKSPACE, K_BACKSPACE},
+    {KEY_UP, K_ARROW_UP}, {KEY_DOWN, K_ARROW_DOWN}, {KEY_LEFT, K_ARROW_LEFT}, {KEY_RIGHT, K_ARROW_RIGHT},
+};
+
+#define key_bindings_length (sizeof (key_bindings) / sizeof (const struct gitsi_key_binding))
+
+/* Translate what the user entered into one of our key constants. This is a
+ * direct lookup in a table that is built from `key_bindings` on first use */
 enum key_stroke translate_key(gitsi_context *context, int ch) {
-    if (ch == 10)return K_ENTER;
-    if (ch == 259)return K_ARROW_UP;
-    if (ch == 258)return K_ARROW_DOWN;
-    if (ch == 260)return K_ARROW_LEFT;
-    if (ch == 261)return K_ARROW_RIGHT;
-    
-    // This returns a pointer, but I could not figure out via the docs
-    // whether the pointer needs to be freed. Valgrind laments that we're
-    // leaking here, but in one document, it says:
-    // http://pubs.opengroup.org/onlinepubs/7908799/xcurses/keyname.html
-    // "The return value of keyname() and key_name() may point to a static area which is overwritten by a subsequent call to either of these functions."
-    const char *key = keyname(ch);
-#define CMP(arg) strcmp(key, arg) == 0
-    if (CMP("/"))return K_SLASH;
-    if (CMP("q"))return K_Q;
-    if (CMP("j"))return K_J;
-    if (CMP("k"))return K_K;
-    if (CMP("r"))return K_R;
-    
-    if (CMP(":"))return K_COMMAND;
-    
-    if (CMP("s"))return K_S;
-    if (CMP("u"))return K_U;
-    
-    if (CMP("?"))return K_HELP;
-    
-    if (CMP("S"))return K_S_S;
-    if (CMP("U"))return K_S_U;
-    if (CMP("m"))return K_M;
-    if (CMP("M"))return K_S_M;
-    if (CMP("V"))return K_S_V;
-    if (CMP("c"))return K_C;
-    if (CMP("C"))return K_S_C;
-    if (CMP("x"))return K_X;
-    if (CMP("h"))return K_H;
-    if (CMP("p"))return K_P;
-    if (CMP("P"))return K_S_P;
-    
-    if (CMP("d"))return K_D;
-    if (CMP("e"))return K_E;
-    if (CMP("g"))return K_G;
-    if (CMP("i"))return K_I;
-    if (CMP("!"))return K_S_1;
-    if (CMP("@"))return K_S_2;
-    if (CMP("#"))return K_S_3;
-    
-    if (CMP("Y"))return K_YES;
-    if (CMP("N"))return K_NO;
-    if (CMP("G"))return K_S_G;
-    
-    if (CMP("^U"))return K_C_U;
-    if (CMP("^D"))return K_C_D;
-    
-    if (CMP("^?"))return K_BACKSPACE;
-    if (CMP("^["))return K_ESC;
-    if (CMP("^M"))return K_ENTER;
-    
-    gitsi_debug_str(context, "(%i)\n", ch);
-    
-    return K_OTHER;
-}
-
-/* Small abstraction to append debug strings to the /tmp/gitsi.log logfile */
-void gitsi_debug_str(gitsi_context *context, const char *format, ...) {
-#if DEBUG
+    static enum key_stroke table[KEY_MAX + 1];
+    static bool has_table = false;
+    if (!has_table) {
+        for (size_t i = 0; i <= KEY_MAX; i++) {
+            table[i] = K_OTHER;
+        }
+        for (size_t i = 0; i < key_bindings_length; i++) {
+            table[key_bindings[i].ch] = key_bindings[i].key;
+        }
+        has_table = true;
+    }
+    if (ch < 0 || ch > KEY_MAX)return K_OTHER;
+    return table[ch];
+}
+
+/* The monotonic clock in milliseconds */
+double gitsi_now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec * 1000.0 + (double)now.tv_nsec / 1000000.0;
+}
+
+/* Append a line with the time since the start and the level to the log. The
+ * newline is added if it is missing */
+void gitsi_log_write(enum GITSI_LOG_LEVEL level, const char *format, ...) {
+    gitsi_log *log = &gitsi_log_state;
+    if (log->buffer == NULL)return;
+    char line[LOG_LINE_MAX];
+    int prefix = snprintf(line, sizeof(line), "[%10.3f] %c ",
+                          (gitsi_now_ms() - log->started_at) / 1000.0, log_level_codes[level]);
     va_list args;
     va_start(args, format);
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wformat-nonliteral"
-    vfprintf(context->logfile, format, args);
+    int written = vsnprintf(line + prefix, sizeof(line) - (size_t)prefix, format, args);
 #pragma clang diagnostic pop
-    fflush(context->logfile);
     va_end(args);
-#endif
+    if (written < 0)return;
+    // Long lines are cut, but they still end with a newline
+    size_t length = MIN((size_t)prefix + (size_t)written, sizeof(line) - 2);
+    if (line[length - 1] != '\n')line[length++] = '\n';
+    
+    size_t reserved = atomic_fetch_add(&log->head, length);
+    size_t start = reserved % LOG_BUFFER_SIZE;
+    size_t first = MIN(length, LOG_BUFFER_SIZE - start);
+    memcpy(log->buffer + start, line, first);
+    memcpy(log->buffer, line + first, length - first);
+    // The lines before this one are published first, their copy is short
+    while (atomic_load(&log->committed) != reserved) {
+        sched_yield();
+    }
+    atomic_store(&log->committed, reserved + length);
+}
+
+/* Write everything that was logged since the last flush to the file. This
+ * only uses write(2), so that the crash handlers can call it */
+void gitsi_log_flush(void) {
+    gitsi_log *log = &gitsi_log_state;
+    if (log->buffer == NULL || log->fd < 0)return;
+    size_t head = atomic_load(&log->committed);
+    size_t flushed = atomic_exchange(&log->flushed, head);
+    if (head <= flushed)return;
+    if (head - flushed > LOG_BUFFER_SIZE) {
+        const char marker[] = "[older lines were overwritten]\n";
+        if (write(log->fd, marker, sizeof(marker) - 1) < 0)return;
+        flushed = head - LOG_BUFFER_SIZE;
+    }
+    size_t start = flushed % LOG_BUFFER_SIZE;
+    size_t length = head - flushed;
+    size_t first = MIN(length, LOG_BUFFER_SIZE - start);
+    if (write(log->fd, log->buffer + start, first) < 0)return;
+    if (length > first && write(log->fd, log->buffer, length - first) < 0)return;
+}
+
+/* Write the log before the process dies, then die the way it would have.
+ * Formatting is not safe in a signal handler, so the message is fixed */
+void gitsi_log_crash_handler(int sig_num) {
+    gitsi_log_flush();
+    const char *message;
+    switch (sig_num) {
+        case SIGSEGV: message = "[crashed with SIGSEGV]\n"; break;
+        case SIGBUS: message = "[crashed with SIGBUS]\n"; break;
+        case SIGABRT: message = "[crashed with SIGABRT]\n"; break;
+        case SIGFPE: message = "[crashed with SIGFPE]\n"; break;
+        case SIGILL: message = "[crashed with SIGILL]\n"; break;
+        default: message = "[crashed]\n"; break;
+    }
+    if (gitsi_log_state.fd >= 0) {
+        ssize_t written = write(gitsi_log_state.fd, message, strlen(message));
+        (void)written;
+    }
+    signal(sig_num, SIG_DFL);
+    raise(sig_num);
+}
+
+/* SIGUSR1 writes the log on demand */
+void gitsi_log_flush_handler(int sig_num) {
+    gitsi_log_flush();
+}
+
+/* Allocate the ring and open the log file if logging is enabled at all */
+void gitsi_log_start(enum GITSI_LOG_LEVEL level) {
+    gitsi_log *log = &gitsi_log_state;
+    log->started_at = gitsi_now_ms();
+    if (level == GITSI_LOG_OFF)return;
+    log->fd = open(LOGFILE_NAME, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (log->fd < 0)return;
+    log->buffer = malloc(LOG_BUFFER_SIZE);
+    log->level = level;
+    atexit(gitsi_log_flush);
+    const int crash_signals[] = { SIGSEGV, SIGBUS, SIGABRT, SIGFPE, SIGILL };
+    for (size_t i = 0; i < sizeof(crash_signals) / sizeof(crash_signals[0]); i++) {
+        signal(crash_signals[i], gitsi_log_crash_handler);
+    }
+    signal(SIGUSR1, gitsi_log_flush_handler);
 }
 
 /* Helper function to determine the file type of a filename */
@@ -277,6 +1381,46 @@ int unlink_cb(const char *fpath, const struct stat *sb, int typeflag, struct FTW
 #pragma mark Ncurses Abstractions
 // --------------------------------------------------
 
+/* Append a key to the --record file. Printable keys are written as they are,
+ * everything else as `\e`, `\r`, or its code like `\259;`. `#` is escaped
+ * too, it starts a comment at the beginning of a line */
+void gitsi_record_key(gitsi_context *context, int ch) {
+    FILE *file = context->record_file;
+    if (file == NULL || ch == ERR)return;
+    if (ch == 27) {
+        fputs("\\e", file);
+    } else if (ch == 13 || ch == 10 || ch == KEY_ENTER) {
+        fputs("\\r", file);
+    } else if (ch == '\\') {
+        fputs("\\\\", file);
+    } else if (ch >= 32 && ch < 127 && ch != '#') {
+        fputc(ch, file);
+    } else {
+        fprintf(file, "\\%d;", ch);
+    }
+}
+
+/* Wait for the next key and record it. A replay takes it from the session,
+ * across the end of a line. If the session has no more keys, the replay
+ * fails and ERR is returned */
+int gitsi_wait_key(gitsi_context *context) {
+    gitsi_replay *replay = context->replay;
+    if (replay != NULL) {
+        while (replay->next < replay->key_count && replay->keys[replay->next] == REPLAY_BATCH_END) {
+            replay->next++;
+        }
+        if (replay->next == replay->key_count) {
+            replay->is_failed = true;
+            return ERR;
+        }
+        return replay->keys[replay->next++];
+    }
+    timeout(-1);
+    int ch = getch();
+    gitsi_record_key(context, ch);
+    return ch;
+}
+
 /* Small helper function to display a dialog and let the user
  * respond with Yes or No */
 bool gitsi_dialog(gitsi_context *context, const char *title) {
@@ -287,7 +1431,9 @@ bool gitsi_dialog(gitsi_context *context, const char *title) {
         clrtoeol();
         mvprintw(context->max_y - 1, 0, "    %s %s [Y]es or [N]o", verbose ? "PLEASE ENTER" : "", title);
         standend();
-        int ch = getch();
+        // The main loop polls, but here we wait for the answer
+        int ch = gitsi_wait_key(context);
+        if (context->replay != NULL && context->replay->is_failed)return false;
         enum key_stroke key = translate_key(context, ch);
         if (key == K_YES) {
             return true;
@@ -300,29 +1446,25 @@ bool gitsi_dialog(gitsi_context *context, const char *title) {
     return false;
 }
 
-/* clear one line on the screen */
+/* clear one line on the screen with the current attributes. This works for
+ * any terminal width */
 void gitsi_clear_line(gitsi_context *context, size_t row) {
-    // This will be reported as a leak as it is never free'ed
-    static char *clean_line = NULL;
-    // we imagine a max terminal size of 4096
-    const size_t line_size = 4096;
-    if (clean_line == NULL) {
-        clean_line = malloc(line_size * sizeof(char));
-    }
-    size_t max_clean = MIN((int)line_size, context->max_x);
-    memset(clean_line, ' ', sizeof(char) * max_clean);
-    clean_line[context->max_x] = '\0';
-    mvprintw((int)row, 0, "%s", clean_line);
+    mvhline((int)row, 0, ' ', context->max_x);
 }
 
 /* Startup ncurses and set the proper flags */
 void gitsi_curses_start(gitsi_context *context) {
-    initscr();
+    // --replay created a screen of its own
+    if (context->replay_screen == NULL) {
+        initscr();
+    }
     keypad(stdscr, TRUE);
     noecho();
     curs_set(0);
     nonl();
     meta(stdscr, true);
+    // Whatever was on the screen before is gone
+    context->list_drawn_generation = 0;
     context->has_color = has_colors();
     if (context->has_color) {
         start_color();
@@ -346,538 +1488,6042 @@ void gitsi_curses_stop(bool keepPage) {
 }
 
 // --------------------------------------------------
-#pragma mark Selection & Index Helpers
+#pragma mark Entries
 // --------------------------------------------------
 
-/* Select the first non-category item in the list */
-void gitsi_select_first_entry(gitsi_context *context) {
-    for (size_t i = 0; i < context->filtered_entry_count; ++i) {
-        if (context->filtered_entries[i]->type != STATUS_TYPE_CATEGORY) {
-            context->position = context->filtered_entries[i];
-            return;
-        }
+/* Is bit `index` of the bitset set? */
+bool gitsi_bit_get(const uint64_t *bits, size_t index) {
+    return (bits[index / 64] >> (index % 64)) & 1;
+}
+
+/* Set or clear bit `index` of the bitset */
+void gitsi_bit_set(uint64_t *bits, size_t index, bool value) {
+    if (value) {
+        bits[index / 64] |= (uint64_t)1 << (index % 64);
+    } else {
+        bits[index / 64] &= ~((uint64_t)1 << (index % 64));
     }
 }
 
-/* Select the first item in the given category */
-void gitsi_select_category(gitsi_context *context, enum GITSI_STATUS_TYPE type) {
-    if (type == STATUS_TYPE_CATEGORY)return;
-    for (size_t i = 0; i < context->filtered_entry_count; ++i) {
-        if (context->filtered_entries[i]->type == type) {
-            context->position = context->filtered_entries[i];
-            break;
+/* The number of words of a bitset with `count` bits */
+size_t gitsi_bit_words(size_t count) {
+    return (count + 63) / 64;
+}
+
+/* Set or clear the bits from `first` up to `end`, a word at a time */
+void gitsi_bit_set_range(uint64_t *bits, size_t first, size_t end, bool value) {
+    while (first < end) {
+        size_t offset = first % 64, span = MIN(64 - offset, end - first);
+        uint64_t mask = span == 64 ? UINT64_MAX : (((uint64_t)1 << span) - 1) << offset;
+        if (value) {
+            bits[first / 64] |= mask;
+        } else {
+            bits[first / 64] &= ~mask;
         }
+        first += span;
     }
 }
 
-/* Select the last entry in the list */
-void gitsi_select_last_entry(gitsi_context *context) {
-    context->position = context->filtered_entries[context->filtered_entry_count - 1];
+/* The section of an entry */
+enum GITSI_STATUS_TYPE gitsi_entry_type(gitsi_context *context, uint32_t entry) {
+    return (enum GITSI_STATUS_TYPE)(context->entries.kinds[entry] & 0x3);
 }
 
-/* Get the index of the current context->position entry */
-size_t gitsi_position_index(gitsi_context *context) {
-    // find the current selection position on screen
-    for (size_t cursor_pos = 0; cursor_pos < context->filtered_entry_count; cursor_pos++) {
-        if (context->position == context->filtered_entries[cursor_pos])return cursor_pos;
+/* The description of an entry, DESCRIPTION_NONE for headlines */
+enum GITSI_DESCRIPTION gitsi_entry_kind(gitsi_context *context, uint32_t entry) {
+    return (enum GITSI_DESCRIPTION)(context->entries.kinds[entry] >> 2);
+}
+
+/* The path of an entry, or the title for headlines */
+const char *gitsi_entry_path(gitsi_context *context, uint32_t entry) {
+    return context->entries.paths + context->entries.path_offsets[entry];
+}
+
+/* The old path of a rename, NULL for everything else */
+const char *gitsi_entry_old_path(gitsi_context *context, uint32_t entry) {
+    uint32_t offset = context->entries.old_path_offsets[entry];
+    return offset == NO_PATH ? NULL : context->entries.paths + offset;
+}
+
+/* FNV-1a over the section and the path */
+size_t gitsi_path_hash(enum GITSI_STATUS_TYPE type, const char *path, size_t length) {
+    size_t hash = 14695981039346656037ULL ^ (size_t)type;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)path[i];
+        hash *= 1099511628211ULL;
     }
-    return 0;
+    return hash;
 }
 
-/* Select the next entry that is `direction` entries away from the
- * currently selected entry */
-void gitsi_select_entry(gitsi_context *context, int direction) {
-    int position = 0;
-    bool found = false;
-    for (size_t i = 0; i < context->filtered_entry_count; ++i) {
-        if (context->filtered_entries[i]->type == STATUS_TYPE_CATEGORY)continue;
-        if (context->position == context->filtered_entries[i]) {
-            position = (int)i;
-            found = true;
-            break;
-        }
+/* Copy a path into the path pool and return its offset */
+uint32_t gitsi_entries_intern(gitsi_entries *entries, const char *path) {
+    size_t length = strlen(path) + 1;
+    if (entries->paths_length + length > entries->paths_capacity) {
+        size_t capacity = entries->paths_capacity == 0 ? 4096 : entries->paths_capacity;
+        while (entries->paths_length + length > capacity)capacity *= 2;
+        entries->paths = realloc(entries->paths, capacity);
+        entries->paths_capacity = capacity;
     }
-    // Due to search, the entry is not in the filtered list anymore
-    if (found == false) {
-        gitsi_select_first_entry(context);
-        return;
+    uint32_t offset = (uint32_t)entries->paths_length;
+    memcpy(entries->paths + offset, path, length);
+    entries->paths_length += length;
+    return offset;
+}
+
+/* Make room for `capacity` entries in all the arrays. New slots are zeroed */
+void gitsi_entries_reserve(gitsi_entries *entries, uint32_t capacity) {
+    if (capacity <= entries->capacity)return;
+    size_t old = entries->capacity;
+    size_t old_words = gitsi_bit_words(old), words = gitsi_bit_words(capacity);
+#define GITSI_GROW(array, size) do { \
+        entries->array = realloc(entries->array, (size) * sizeof(*entries->array)); \
+    } while (0)
+    GITSI_GROW(path_offsets, capacity);
+    GITSI_GROW(path_lengths, capacity);
+    GITSI_GROW(old_path_offsets, capacity);
+    GITSI_GROW(kinds, capacity);
+    GITSI_GROW(git_statuses, capacity);
+    GITSI_GROW(old_ids, capacity);
+    GITSI_GROW(new_ids, capacity);
+    GITSI_GROW(lines_added, capacity);
+    GITSI_GROW(lines_removed, capacity);
+    GITSI_GROW(marked, words);
+    GITSI_GROW(has_diffstat, words);
+    GITSI_GROW(is_binary, words);
+#undef GITSI_GROW
+    memset(entries->old_ids + old, 0, (capacity - old) * sizeof(git_oid));
+    memset(entries->new_ids + old, 0, (capacity - old) * sizeof(git_oid));
+    memset(entries->lines_added + old, 0, (capacity - old) * sizeof(uint32_t));
+    memset(entries->lines_removed + old, 0, (capacity - old) * sizeof(uint32_t));
+    memset(entries->marked + old_words, 0, (words - old_words) * sizeof(uint64_t));
+    memset(entries->has_diffstat + old_words, 0, (words - old_words) * sizeof(uint64_t));
+    memset(entries->is_binary + old_words, 0, (words - old_words) * sizeof(uint64_t));
+    entries->capacity = capacity;
+}
+
+/* Append an entry and return its index */
+uint32_t gitsi_entries_append(gitsi_entries *entries, enum GITSI_STATUS_TYPE type,
+                              const char *path, const char *old_path,
+                              enum GITSI_DESCRIPTION description, git_status_t git_status) {
+    if (entries->count == entries->capacity) {
+        gitsi_entries_reserve(entries, entries->capacity == 0 ? 64 : entries->capacity * 2);
     }
-    while (true) {
-        position += direction;
-        if (context->is_visual_mark_mode == true) {
-            context->filtered_entries[position]->marked = true;
-        }
-        if (position < 0) {
-            gitsi_select_last_entry(context);
-            break;
+    if (entries->path_index != NULL) {
+        free(entries->path_index);
+        entries->path_index = NULL;
+        entries->path_index_capacity = 0;
+    }
+    uint32_t entry = entries->count++;
+    entries->path_offsets[entry] = gitsi_entries_intern(entries, path);
+    entries->path_lengths[entry] = (uint32_t)strlen(path);
+    entries->old_path_offsets[entry] = old_path != NULL ? gitsi_entries_intern(entries, old_path) : NO_PATH;
+    entries->kinds[entry] = (uint8_t)((unsigned)type | ((unsigned)description << 2));
+    entries->git_statuses[entry] = (uint16_t)git_status;
+    return entry;
+}
+
+/* Free all the arrays of the entries */
+void gitsi_entries_free(gitsi_entries *entries) {
+    free(entries->paths);
+    free(entries->path_offsets);
+    free(entries->path_lengths);
+    free(entries->old_path_offsets);
+    free(entries->kinds);
+    free(entries->git_statuses);
+    free(entries->marked);
+    free(entries->old_ids);
+    free(entries->new_ids);
+    free(entries->has_diffstat);
+    free(entries->is_binary);
+    free(entries->lines_added);
+    free(entries->lines_removed);
+    free(entries->path_index);
+    memset(entries, 0, sizeof(gitsi_entries));
+}
+
+/* Find the entry of a path in a section in O(1). The index is built with the
+ * first lookup after the entries changed. Returns ROW_NONE if there is none */
+uint32_t gitsi_entries_find(gitsi_entries *entries, enum GITSI_STATUS_TYPE type, const char *path) {
+    if (entries->count == 0)return ROW_NONE;
+    if (entries->path_index == NULL) {
+        size_t capacity = 64;
+        while (capacity < (size_t)entries->count * 2)capacity *= 2;
+        entries->path_index = malloc(capacity * sizeof(uint32_t));
+        memset(entries->path_index, 0xff, capacity * sizeof(uint32_t));
+        entries->path_index_capacity = capacity;
+        for (uint32_t i = 0; i < entries->count; i++) {
+            enum GITSI_STATUS_TYPE entry_type = (enum GITSI_STATUS_TYPE)(entries->kinds[i] & 0x3);
+            // Headlines are no paths
+            if (entry_type == STATUS_TYPE_CATEGORY)continue;
+            size_t slot = gitsi_path_hash(entry_type, entries->paths + entries->path_offsets[i],
+                                          entries->path_lengths[i]) & (capacity - 1);
+            while (entries->path_index[slot] != ROW_NONE) {
+                slot = (slot + 1) & (capacity - 1);
+            }
+            entries->path_index[slot] = i;
         }
-        if (position >= (int)context->filtered_entry_count) {
-            gitsi_select_first_entry(context);
-            break;
+    }
+    size_t mask = entries->path_index_capacity - 1;
+    size_t length = strlen(path);
+    size_t slot = gitsi_path_hash(type, path, length) & mask;
+    for (uint32_t entry = entries->path_index[slot]; entry != ROW_NONE; entry = entries->path_index[slot]) {
+        if ((enum GITSI_STATUS_TYPE)(entries->kinds[entry] & 0x3) == type && entries->path_lengths[entry] == length &&
+            memcmp(entries->paths + entries->path_offsets[entry], path, length) == 0) {
+            return entry;
         }
-        if (context->filtered_entries[position]->type == STATUS_TYPE_CATEGORY)continue;
-        context->position = context->filtered_entries[position];
-        break;
+        slot = (slot + 1) & mask;
     }
+    return ROW_NONE;
 }
 
-/* Select the entry at the position `index` */
-void gitsi_select_entry_by_index(gitsi_context *context, size_t index) {
-    if (context->filtered_entry_count == 0)return;
-    if (index > context->filtered_entry_count) {
-        context->position = context->filtered_entries[context->filtered_entry_count - 1];
-        return;
+/* Is the entry marked? */
+bool gitsi_entry_marked(gitsi_context *context, uint32_t entry) {
+    return gitsi_bit_get(context->entries.marked, entry);
+}
+
+/* Mark or unmark an entry */
+void gitsi_entry_set_marked(gitsi_context *context, uint32_t entry, bool marked) {
+    gitsi_bit_set(context->entries.marked, entry, marked);
+}
+
+/* The position of the section of an entry in the list. The headline of a
+ * section comes first, so it counts as the section below it */
+int gitsi_entry_section_rank(gitsi_context *context, uint32_t entry) {
+    while (entry < context->entries.count && gitsi_entry_type(context, entry) == STATUS_TYPE_CATEGORY) {
+        entry++;
     }
-    if (context->filtered_entries[index]->type == STATUS_TYPE_CATEGORY) {
-        gitsi_select_entry_by_index(context, index + 1);
-        return;
+    if (entry == context->entries.count)return 3;
+    enum GITSI_STATUS_TYPE type = gitsi_entry_type(context, entry);
+    return type == STATUS_TYPE_INDEX ? 0 : (type == STATUS_TYPE_WORKSPACE ? 1 : 2);
+}
+
+/* The first entry of the section `type` and the one after its last, without
+ * the headline. The entries are stored as the Index, Workspace and Untracked
+ * sections, each below its headline, so the bounds are found by bisection */
+void gitsi_entries_section(gitsi_context *context, enum GITSI_STATUS_TYPE type, uint32_t *first, uint32_t *end) {
+    int rank = type == STATUS_TYPE_INDEX ? 0 : (type == STATUS_TYPE_WORKSPACE ? 1 : 2);
+    for (int bound = 0; bound < 2; bound++) {
+        uint32_t low = 0, high = context->entries.count;
+        while (low < high) {
+            uint32_t middle = low + (high - low) / 2;
+            if (gitsi_entry_section_rank(context, middle) < rank + bound) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        if (bound == 0) {
+            *first = low;
+        } else {
+            *end = low;
+        }
     }
-    context->position = context->filtered_entries[index];
+    if (*first < *end && gitsi_entry_type(context, *first) == STATUS_TYPE_CATEGORY)*first += 1;
 }
 
-// --------------------------------------------------
-#pragma mark Commandline and Git functions
-// --------------------------------------------------
+/* Mark or unmark all entries, a word at a time. Headlines are never marked */
+void gitsi_entries_set_all_marked(gitsi_context *context, bool marked) {
+    size_t words = gitsi_bit_words(context->entries.count);
+    memset(context->entries.marked, 0, words * sizeof(uint64_t));
+    if (!marked)return;
+    // Everything but the headlines
+    const enum GITSI_STATUS_TYPE types[] = { STATUS_TYPE_INDEX, STATUS_TYPE_WORKSPACE, STATUS_TYPE_UNTRACKED };
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+        uint32_t first, end;
+        gitsi_entries_section(context, types[i], &first, &end);
+        gitsi_bit_set_range(context->entries.marked, first, end, true);
+    }
+}
 
-/* Print the command line help */
-void gitsi_print_help() {
-    printf("usage:\t\tgitsi [repository]\n");
-    printf("\t\tgitsi without parameters uses the current repository\n");
-    exit(0);
+/* Is a row a directory of the tree? */
+bool gitsi_row_is_directory(gitsi_row row) {
+    return row != ROW_NONE && (row & ROW_DIRECTORY) != 0;
 }
 
-/* Parse the command line parameters */
-void gitsi_parse_parameters(gitsi_context *context, int argc, char *argv[]) {
-    const char *repo_dir = ".";
-    
-    if (argc == 2) {
-        if (strcmp(argv[1], "-h") == 0) {
-            gitsi_print_help();
-        }
-        repo_dir = argv[1];
+/* The tree node of a row. NULL outside of tree mode */
+gitsi_tree_node *gitsi_row_node(gitsi_context *context, gitsi_row row) {
+    if (context->tree == NULL || row == ROW_NONE)return NULL;
+    if (gitsi_row_is_directory(row)) {
+        return context->tree->directory_nodes[row & ~ROW_DIRECTORY];
     }
-    context->repo_dir = strdup(repo_dir);
+    return context->tree->leaves[row];
+}
+
+/* The section of a row. Nothing behaves like a headline */
+enum GITSI_STATUS_TYPE gitsi_row_type(gitsi_context *context, gitsi_row row) {
+    if (row == ROW_NONE)return STATUS_TYPE_CATEGORY;
+    if (gitsi_row_is_directory(row))return gitsi_row_node(context, row)->type;
+    return gitsi_entry_type(context, row);
+}
+
+/* The path of a row */
+const char *gitsi_row_path(gitsi_context *context, gitsi_row row) {
+    if (gitsi_row_is_directory(row))return gitsi_row_node(context, row)->path;
+    return gitsi_entry_path(context, row);
+}
+
+/* Is the row marked? */
+bool gitsi_row_marked(gitsi_context *context, gitsi_row row) {
+    if (gitsi_row_is_directory(row))return gitsi_row_node(context, row)->marked;
+    return gitsi_entry_marked(context, row);
+}
+
+/* Mark or unmark a row */
+void gitsi_row_set_marked(gitsi_context *context, gitsi_row row, bool marked) {
+    if (gitsi_row_is_directory(row)) {
+        gitsi_row_node(context, row)->marked = marked;
+    } else {
+        gitsi_entry_set_marked(context, row, marked);
+        // A marked directory stands for all files below it
+        gitsi_tree_node *node = marked ? NULL : gitsi_row_node(context, row);
+        for (; node != NULL; node = node->parent) {
+            node->marked = false;
+        }
+    }
+}
+
+// --------------------------------------------------
+#pragma mark Selection & Index Helpers
+// --------------------------------------------------
+
+/* Select the first non-category item in the list */
+void gitsi_select_first_entry(gitsi_context *context) {
+    for (size_t i = 0; i < context->row_count; ++i) {
+        if (gitsi_row_type(context, context->rows[i]) != STATUS_TYPE_CATEGORY) {
+            context->position = context->rows[i];
+            return;
+        }
+    }
+}
+
+/* Select the first item in the given category */
+void gitsi_select_category(gitsi_context *context, enum GITSI_STATUS_TYPE type) {
+    if (type == STATUS_TYPE_CATEGORY)return;
+    for (size_t i = 0; i < context->row_count; ++i) {
+        if (gitsi_row_type(context, context->rows[i]) == type) {
+            context->position = context->rows[i];
+            break;
+        }
+    }
+}
+
+/* Select the last entry in the list */
+void gitsi_select_last_entry(gitsi_context *context) {
+    if (context->row_count == 0)return;
+    context->position = context->rows[context->row_count - 1];
+}
+
+/* Find the index of the current context->position row. Returns false if the
+ * row is not part of the filtered list */
+bool gitsi_find_position(gitsi_context *context, size_t *index) {
+    if (context->position == ROW_NONE)return false;
+    // Most of the time the position did not move since the last call
+    size_t hint = context->position_hint;
+    if (hint < context->row_count && context->position == context->rows[hint]) {
+        *index = hint;
+        return true;
+    }
+    // find the current selection position on screen
+    for (size_t cursor_pos = 0; cursor_pos < context->row_count; cursor_pos++) {
+        if (context->position == context->rows[cursor_pos]) {
+            context->position_hint = cursor_pos;
+            *index = cursor_pos;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Get the index of the current context->position row */
+size_t gitsi_position_index(gitsi_context *context) {
+    size_t index = 0;
+    gitsi_find_position(context, &index);
+    return index;
+}
+
+/* Select the next entry that is `direction` entries away from the
+ * currently selected entry */
+void gitsi_select_entry(gitsi_context *context, int direction) {
+    size_t index = 0;
+    bool found = gitsi_find_position(context, &index);
+    // Due to search, the entry is not in the filtered list anymore
+    if (found == false || gitsi_row_type(context, context->position) == STATUS_TYPE_CATEGORY) {
+        gitsi_select_first_entry(context);
+        return;
+    }
+    int position = (int)index;
+    while (true) {
+        position += direction;
+        if (position < 0) {
+            gitsi_select_last_entry(context);
+            break;
+        }
+        if (position >= (int)context->row_count) {
+            gitsi_select_first_entry(context);
+            break;
+        }
+        gitsi_row row = context->rows[position];
+        if (gitsi_row_type(context, row) == STATUS_TYPE_CATEGORY)continue;
+        if (context->is_visual_mark_mode == true) {
+            gitsi_row_set_marked(context, row, true);
+        }
+        context->position = row;
+        context->position_hint = (size_t)position;
+        break;
+    }
+}
+
+/* Move the selection by `steps` lines. Consecutive j / k presses are folded
+ * into one call of this */
+void gitsi_move_selection(gitsi_context *context, int steps) {
+    int direction = steps < 0 ? -1 : 1;
+    for (int i = 0; i < abs(steps); i++) {
+        gitsi_select_entry(context, direction);
+    }
+}
+
+/* Select the entry at the position `index` after the status was read again.
+ * If the selected entry was found again by its path, it stays selected */
+void gitsi_select_entry_by_index(gitsi_context *context, size_t index) {
+    if (context->row_count == 0 || context->position != ROW_NONE)return;
+    if (index >= context->row_count) {
+        context->position = context->rows[context->row_count - 1];
+        return;
+    }
+    if (gitsi_row_type(context, context->rows[index]) == STATUS_TYPE_CATEGORY) {
+        gitsi_select_entry_by_index(context, index + 1);
+        return;
+    }
+    context->position = context->rows[index];
+}
+
+// --------------------------------------------------
+#pragma mark Tree View
+// --------------------------------------------------
+
+/* Get a new zeroed node from the block allocator */
+gitsi_tree_node *gitsi_tree_alloc_node(gitsi_tree *tree) {
+    if (tree->blocks == NULL || tree->blocks->used == TREE_BLOCK_SIZE) {
+        gitsi_tree_block *block = calloc(1, sizeof(gitsi_tree_block));
+        block->next = tree->blocks;
+        tree->blocks = block;
+    }
+    return &tree->blocks->nodes[tree->blocks->used++];
+}
+
+/* Append `child` to the children of `parent` */
+void gitsi_tree_append(gitsi_tree_node *parent, gitsi_tree_node *child) {
+    child->parent = parent;
+    if (parent->last_child != NULL) {
+        parent->last_child->next_sibling = child;
+    } else {
+        parent->first_child = child;
+    }
+    parent->last_child = child;
+    parent->child_count += 1;
+}
+
+/* Insert a directory node into the hash table, growing it when half full */
+void gitsi_tree_insert_directory(gitsi_tree *tree, gitsi_tree_node *node) {
+    if ((tree->directory_count + 1) * 2 > tree->directory_capacity) {
+        size_t old_capacity = tree->directory_capacity;
+        gitsi_tree_node **old_directories = tree->directories;
+        tree->directory_capacity = old_capacity == 0 ? 256 : old_capacity * 2;
+        tree->directories = calloc(tree->directory_capacity, sizeof(gitsi_tree_node*));
+        tree->directory_count = 0;
+        for (size_t i = 0; i < old_capacity; i++) {
+            if (old_directories[i] != NULL) {
+                gitsi_tree_insert_directory(tree, old_directories[i]);
+            }
+        }
+        free(old_directories);
+    }
+    size_t mask = tree->directory_capacity - 1;
+    size_t slot = gitsi_path_hash(node->type, node->path, strlen(node->path)) & mask;
+    while (tree->directories[slot] != NULL) {
+        slot = (slot + 1) & mask;
+    }
+    tree->directories[slot] = node;
+    tree->directory_count += 1;
+}
+
+/* The directory node for the first `length` characters of `path`, NULL if
+ * there is none */
+gitsi_tree_node *gitsi_tree_find_directory(gitsi_tree *tree, enum GITSI_STATUS_TYPE type,
+                                           const char *path, size_t length) {
+    if (tree->directory_capacity == 0)return NULL;
+    size_t mask = tree->directory_capacity - 1;
+    size_t slot = gitsi_path_hash(type, path, length) & mask;
+    while (tree->directories[slot] != NULL) {
+        gitsi_tree_node *node = tree->directories[slot];
+        if (node->type == type && strncmp(node->path, path, length) == 0 && node->path[length] == '\0') {
+            return node;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return NULL;
+}
+
+/* Find or create the directory node for the first `length` characters of `path`.
+ * Missing parents are created on the way */
+gitsi_tree_node *gitsi_tree_directory(gitsi_tree *tree, enum GITSI_STATUS_TYPE type,
+                                      const char *path, size_t length) {
+    if (length == 0)return &tree->roots[type];
+    gitsi_tree_node *existing = gitsi_tree_find_directory(tree, type, path, length);
+    if (existing != NULL)return existing;
+    size_t parent_length = length;
+    while (parent_length > 0 && path[parent_length - 1] != '/')parent_length--;
+    gitsi_tree_node *parent = gitsi_tree_directory(tree, type, path,
+                                                   parent_length > 0 ? parent_length - 1 : 0);
+    gitsi_tree_node *node = gitsi_tree_alloc_node(tree);
+    node->path = strndup(path, length);
+    node->type = type;
+    node->is_directory = true;
+    if (tree->directory_node_count == tree->directory_node_capacity) {
+        tree->directory_node_capacity = tree->directory_node_capacity == 0 ? 256 : tree->directory_node_capacity * 2;
+        tree->directory_nodes = realloc(tree->directory_nodes, tree->directory_node_capacity * sizeof(gitsi_tree_node*));
+    }
+    node->row = ROW_DIRECTORY | (gitsi_row)tree->directory_node_count;
+    tree->directory_nodes[tree->directory_node_count++] = node;
+    gitsi_tree_append(parent, node);
+    gitsi_tree_insert_directory(tree, node);
+    return node;
+}
+
+/* Add a file entry as a leaf. Untracked directories (`dir/`) are leaves, too */
+void gitsi_tree_add_entry(gitsi_context *context, gitsi_tree *tree, uint32_t entry) {
+    const char *path = gitsi_entry_path(context, entry);
+    enum GITSI_STATUS_TYPE type = gitsi_entry_type(context, entry);
+    size_t length = strlen(path);
+    if (length > 0 && path[length - 1] == '/')length--;
+    size_t directory_length = length;
+    while (directory_length > 0 && path[directory_length - 1] != '/')directory_length--;
+    gitsi_tree_node *parent = gitsi_tree_directory(tree, type, path,
+                                                   directory_length > 0 ? directory_length - 1 : 0);
+    gitsi_tree_node *leaf = gitsi_tree_alloc_node(tree);
+    leaf->path = path;
+    leaf->type = type;
+    leaf->row = entry;
+    tree->leaves[entry] = leaf;
+    gitsi_tree_append(parent, leaf);
+    size_t description = gitsi_entry_kind(context, entry);
+    for (gitsi_tree_node *node = parent; node != NULL; node = node->parent) {
+        node->counts[description] += 1;
+    }
+}
+
+/* Free the tree and all interned directory paths */
+void gitsi_tree_free(gitsi_tree *tree) {
+    if (tree == NULL)return;
+    for (size_t i = 0; i < tree->directory_node_count; i++) {
+        free((char*)tree->directory_nodes[i]->path);
+    }
+    free(tree->directories);
+    free(tree->directory_nodes);
+    free(tree->leaves);
+    gitsi_tree_block *block = tree->blocks;
+    while (block != NULL) {
+        gitsi_tree_block *next = block->next;
+        free(block);
+        block = next;
+    }
+    free(tree);
+}
+
+/* Is the directory collapsed? Returns its index in `collapsed_directories` or -1 */
+int gitsi_tree_collapsed_index(gitsi_context *context, gitsi_tree_node *node) {
+    for (size_t i = 0; i < context->collapsed_directory_count; i++) {
+        if (context->collapsed_directories[i].type == node->type &&
+            strcmp(context->collapsed_directories[i].path, node->path) == 0) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+/* Collapse or expand a directory */
+void gitsi_tree_set_collapsed(gitsi_context *context, gitsi_tree_node *node, bool collapsed) {
+    node->is_collapsed = collapsed;
+    int index = gitsi_tree_collapsed_index(context, node);
+    if (collapsed && index < 0) {
+        context->collapsed_directories = realloc(context->collapsed_directories,
+                                                 (context->collapsed_directory_count + 1) * sizeof(gitsi_collapsed_directory));
+        context->collapsed_directories[context->collapsed_directory_count].type = node->type;
+        context->collapsed_directories[context->collapsed_directory_count].path = strdup(node->path);
+        context->collapsed_directory_count += 1;
+    } else if (!collapsed && index >= 0) {
+        free(context->collapsed_directories[index].path);
+        context->collapsed_directories[index] = context->collapsed_directories[context->collapsed_directory_count - 1];
+        context->collapsed_directory_count -= 1;
+    }
+}
+
+/* Append the visible rows below `node` to `rows`. `prefix_length` is the length of
+ * the displayed parent path including the trailing slash */
+void gitsi_tree_flatten(gitsi_context *context, gitsi_tree_node *node, size_t depth,
+                        size_t prefix_length, gitsi_row *rows, size_t *count) {
+    for (gitsi_tree_node *child = node->first_child; child != NULL; child = child->next_sibling) {
+        if (!child->is_directory) {
+            child->name = child->path + prefix_length;
+            child->depth = depth;
+            rows[(*count)++] = child->row;
+            continue;
+        }
+        gitsi_tree_node *display = child;
+        while (display->child_count == 1 && display->first_child->is_directory) {
+            display = display->first_child;
+        }
+        display->name = display->path + prefix_length;
+        display->depth = depth;
+        rows[(*count)++] = display->row;
+        if (!display->is_collapsed) {
+            gitsi_tree_flatten(context, display, depth + 1, strlen(display->path) + 1, rows, count);
+        }
+    }
+}
+
+/* Turn the filtered list into a tree. The filtered rows are replaced with the
+ * visible rows of the tree: headlines, directories and files */
+void gitsi_tree_build(gitsi_context *context) {
+    // The old tree is kept until the marks of its directories are moved over
+    gitsi_tree *old_tree = context->tree;
+    context->tree = calloc(1, sizeof(gitsi_tree));
+    gitsi_tree *tree = context->tree;
+    tree->leaves = calloc(context->entries.count, sizeof(gitsi_tree_node*));
+    for (int type = 0; type < STATUS_TYPE_CATEGORY; type++) {
+        tree->roots[type].type = (enum GITSI_STATUS_TYPE)type;
+        tree->roots[type].path = "";
+        tree->roots[type].row = ROW_NONE;
+        tree->roots[type].is_directory = true;
+    }
+    gitsi_row headlines[STATUS_TYPE_CATEGORY] = { ROW_NONE, ROW_NONE, ROW_NONE };
+    for (size_t i = 0; i < context->row_count; ++i) {
+        gitsi_row row = context->rows[i];
+        if (gitsi_entry_type(context, row) == STATUS_TYPE_CATEGORY) {
+            // The headline belongs to the section of the entry that follows it
+            if (i + 1 < context->row_count &&
+                gitsi_entry_type(context, context->rows[i + 1]) != STATUS_TYPE_CATEGORY) {
+                headlines[gitsi_entry_type(context, context->rows[i + 1])] = row;
+            }
+            continue;
+        }
+        gitsi_tree_add_entry(context, tree, row);
+    }
+    // A lookup per collapsed directory instead of a search per directory
+    for (size_t i = 0; i < context->collapsed_directory_count; i++) {
+        gitsi_collapsed_directory *collapsed = &context->collapsed_directories[i];
+        gitsi_tree_node *node = gitsi_tree_find_directory(tree, collapsed->type, collapsed->path, strlen(collapsed->path));
+        if (node != NULL)node->is_collapsed = true;
+    }
+    for (size_t i = 0; old_tree != NULL && i < old_tree->directory_node_count; i++) {
+        gitsi_tree_node *old_node = old_tree->directory_nodes[i];
+        if (!old_node->marked)continue;
+        gitsi_tree_node *node = gitsi_tree_find_directory(tree, old_node->type, old_node->path, strlen(old_node->path));
+        if (node != NULL)node->marked = true;
+    }
+    gitsi_tree_free(old_tree);
+    size_t capacity = context->row_count + tree->directory_node_count;
+    gitsi_row *rows = calloc(capacity, sizeof(gitsi_row));
+    size_t count = 0;
+    // Keep the order of the sections
+    const enum GITSI_STATUS_TYPE order[] = { STATUS_TYPE_INDEX, STATUS_TYPE_WORKSPACE, STATUS_TYPE_UNTRACKED };
+    for (size_t i = 0; i < sizeof(order) / sizeof(order[0]); i++) {
+        if (headlines[order[i]] == ROW_NONE)continue;
+        rows[count++] = headlines[order[i]];
+        gitsi_tree_flatten(context, &tree->roots[order[i]], 0, 0, rows, &count);
+    }
+    free(context->rows);
+    context->rows = rows;
+    context->row_count = count;
+}
+
+/* Collect all file entries below a tree node. The result has to be freed */
+size_t gitsi_tree_collect(gitsi_tree_node *node, uint32_t **entries) {
+    size_t count = 0, capacity = 64;
+    *entries = malloc(capacity * sizeof(uint32_t));
+    gitsi_tree_node *current = node->first_child;
+    while (current != NULL && current != node) {
+        if (current->first_child != NULL) {
+            current = current->first_child;
+            continue;
+        }
+        if (!current->is_directory) {
+            if (count == capacity) {
+                capacity *= 2;
+                *entries = realloc(*entries, capacity * sizeof(uint32_t));
+            }
+            (*entries)[count++] = current->row;
+        }
+        // Walk up until there's a sibling to continue with
+        while (current != node && current->next_sibling == NULL) {
+            current = current->parent;
+        }
+        if (current != node)current = current->next_sibling;
+    }
+    return count;
+}
+
+/* Move the marks of directories to the files below them, so that actions on
+ * the marked rows only have to walk the bitset of the entries */
+void gitsi_tree_mark_leaves(gitsi_context *context) {
+    gitsi_tree *tree = context->tree;
+    if (tree == NULL)return;
+    for (size_t i = 0; i < tree->directory_node_count; i++) {
+        gitsi_tree_node *node = tree->directory_nodes[i];
+        if (!node->marked)continue;
+        uint32_t *leaves = NULL;
+        size_t count = gitsi_tree_collect(node, &leaves);
+        for (size_t j = 0; j < count; j++) {
+            gitsi_entry_set_marked(context, leaves[j], true);
+        }
+        free(leaves);
+        node->marked = false;
+    }
+}
+
+/* Describe a directory row with the aggregated counts, i.e. `3 modified, 1 deleted` */
+void gitsi_tree_describe(gitsi_tree_node *node, char *buffer, size_t size) {
+    size_t used = 0;
+    buffer[0] = '\0';
+    for (size_t i = 0; i < status_descriptions_length; i++) {
+        if (node->counts[i] == 0)continue;
+        int written = snprintf(buffer + used, size - used, "%s%zu %s",
+                               used > 0 ? ", " : "", node->counts[i], status_descriptions[i]);
+        if (written < 0 || (size_t)written >= size - used)break;
+        used += (size_t)written;
+    }
+}
+
+// --------------------------------------------------
+#pragma mark Filter
+// --------------------------------------------------
+
+/* Free what the compiled filter holds */
+void gitsi_filter_free(gitsi_filter *filter) {
+    if (filter->kind == FILTER_REGEX) {
+        regfree(&filter->regex);
+    }
+    free(filter->source);
+    free(filter->pattern);
+    memset(filter, 0, sizeof(gitsi_filter));
+}
+
+/* The bit mask of all names in `names` that start with `value` */
+unsigned gitsi_filter_names(const char *const names[], size_t count, const char *value, size_t length) {
+    unsigned mask = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (length > 0 && strncmp(names[i], value, length) == 0)mask |= 1u << i;
+    }
+    return mask;
+}
+
+/* Compile `term` into the filter. Words of the form `status:deleted` or
+ * `section:index` are predicates, the rest is the path pattern:
+ * `*.ext` compares the extension, `^regex` is an extended regex and
+ * everything with `*`, `?` or `[` is a glob. Anything else is a substring */
+void gitsi_filter_compile(gitsi_filter *filter, const char *term) {
+    gitsi_filter_free(filter);
+    filter->source = strdup(term);
+    filter->pattern = calloc(strlen(term) + 1, sizeof(char));
+    const char *cursor = term;
+    while (*cursor != '\0') {
+        size_t length = strcspn(cursor, " ");
+        if (length > 7 && strncmp(cursor, "status:", 7) == 0) {
+            unsigned descriptions = gitsi_filter_names(status_descriptions, status_descriptions_length,
+                                                       cursor + 7, length - 7);
+            // An unknown status is left out, like the rest of an invalid filter
+            filter->descriptions |= descriptions;
+            if (descriptions == 0)filter->is_invalid = true;
+        } else if (length > 8 && strncmp(cursor, "section:", 8) == 0) {
+            unsigned sections = gitsi_filter_names(status_type_names, STATUS_TYPE_CATEGORY,
+                                                   cursor + 8, length - 8);
+            filter->sections |= sections;
+            if (sections == 0)filter->is_invalid = true;
+        } else if (length > 0) {
+            // Spaces between the words of the pattern are kept
+            if (filter->pattern_length > 0)filter->pattern[filter->pattern_length++] = ' ';
+            memcpy(filter->pattern + filter->pattern_length, cursor, length);
+            filter->pattern_length += length;
+        }
+        cursor += length;
+        while (*cursor == ' ')cursor++;
+    }
+    filter->pattern[filter->pattern_length] = '\0';
+    
+    const char *pattern = filter->pattern;
+    if (filter->pattern_length == 0) {
+        filter->kind = FILTER_ALL;
+    } else if (pattern[0] == '^') {
+        filter->kind = FILTER_REGEX;
+        if (regcomp(&filter->regex, pattern, REG_EXTENDED | REG_NOSUB) != 0) {
+            filter->kind = FILTER_ALL;
+            filter->is_invalid = true;
+        }
+    } else if (pattern[0] == '*' && pattern[1] == '.' && strpbrk(pattern + 1, "*?[/") == NULL) {
+        // Only the suffix is compared, i.e. `.proto`
+        filter->kind = FILTER_EXTENSION;
+        memmove(filter->pattern, pattern + 1, filter->pattern_length);
+        filter->pattern_length -= 1;
+    } else if (strpbrk(pattern, "*?[") != NULL) {
+        filter->kind = FILTER_GLOB;
+    } else {
+        filter->kind = FILTER_SUBSTRING;
+    }
+}
+
+/* Does `path` match the path pattern of the filter? */
+bool gitsi_filter_path(const gitsi_filter *filter, const char *path, size_t length) {
+    switch (filter->kind) {
+        case FILTER_ALL:
+            return true;
+        case FILTER_SUBSTRING:
+            return strstr(path, filter->pattern) != NULL;
+        case FILTER_EXTENSION:
+            return length >= filter->pattern_length &&
+                memcmp(path + length - filter->pattern_length, filter->pattern, filter->pattern_length) == 0;
+        case FILTER_GLOB:
+            // Like a git pathspec, `*` also matches slashes
+            return fnmatch(filter->pattern, path, 0) == 0;
+        case FILTER_REGEX:
+            return regexec(&filter->regex, path, 0, NULL, 0) == 0;
+    }
+    return false;
+}
+
+/* Does the entry match the filter? Renames match with either path */
+bool gitsi_filter_matches(gitsi_context *context, const gitsi_filter *filter, uint32_t entry) {
+    if (filter->sections != 0 && (filter->sections & (1u << gitsi_entry_type(context, entry))) == 0)return false;
+    if (filter->descriptions != 0 && (filter->descriptions & (1u << gitsi_entry_kind(context, entry))) == 0)return false;
+    if (gitsi_filter_path(filter, gitsi_entry_path(context, entry), context->entries.path_lengths[entry]))return true;
+    const char *old_path = gitsi_entry_old_path(context, entry);
+    return old_path != NULL && gitsi_filter_path(filter, old_path, strlen(old_path));
+}
+
+/* Does the entry show up in the list? The content search narrows the list
+ * down to the files that contain its text */
+bool gitsi_entry_is_visible(gitsi_context *context, const gitsi_filter *filter, uint32_t entry) {
+    if (context->grep.is_active && !gitsi_bit_get(context->grep.matched, entry))return false;
+    return gitsi_filter_matches(context, filter, entry);
+}
+
+/* Compile the search term again if it changed since the last time */
+gitsi_filter *gitsi_current_filter(gitsi_context *context) {
+    gitsi_filter *filter = &context->filter;
+    if (filter->source == NULL || strcmp(filter->source, context->search_term) != 0) {
+        gitsi_filter_compile(filter, context->search_term);
+    }
+    return filter;
+}
+
+/* Mark all entries that match the filter. If they are all marked already,
+ * they are unmarked instead */
+void gitsi_mark_matches(gitsi_context *context) {
+    gitsi_filter *filter = gitsi_current_filter(context);
+    bool is_all_marked = true;
+    for (uint32_t i = 0; i < context->entries.count && is_all_marked; i++) {
+        if (gitsi_entry_type(context, i) == STATUS_TYPE_CATEGORY)continue;
+        if (!gitsi_entry_is_visible(context, filter, i))continue;
+        is_all_marked = gitsi_entry_marked(context, i);
+    }
+    for (uint32_t i = 0; i < context->entries.count; i++) {
+        if (gitsi_entry_type(context, i) == STATUS_TYPE_CATEGORY)continue;
+        if (!gitsi_entry_is_visible(context, filter, i))continue;
+        gitsi_entry_set_marked(context, i, !is_all_marked);
+    }
+}
+
+// --------------------------------------------------
+#pragma mark Sorting
+// --------------------------------------------------
+
+/* Make room for the metadata and the order of `count` entries */
+void gitsi_sort_reserve(gitsi_sort *sort, uint32_t count) {
+    if (count <= sort->capacity)return;
+    sort->mtimes = realloc(sort->mtimes, count * sizeof(int64_t));
+    sort->sizes = realloc(sort->sizes, count * sizeof(int64_t));
+    sort->order = realloc(sort->order, count * sizeof(uint32_t));
+    sort->items = realloc(sort->items, count * sizeof(gitsi_sort_item));
+    sort->capacity = count;
+}
+
+/* Free the metadata and the order */
+void gitsi_sort_free(gitsi_sort *sort) {
+    free(sort->mtimes);
+    free(sort->sizes);
+    free(sort->order);
+    free(sort->items);
+    sort->mtimes = NULL;
+    sort->sizes = NULL;
+    sort->order = NULL;
+    sort->items = NULL;
+    sort->capacity = 0;
+    sort->metadata_generation = 0;
+    sort->order_generation = 0;
+}
+
+/* Does the sort key or the list need the modification time and size? */
+bool gitsi_sort_needs_metadata(gitsi_sort *sort) {
+    return sort->show_metadata || sort->key == GITSI_SORT_MTIME || sort->key == GITSI_SORT_SIZE;
+}
+
+/* The modification time of a stat in nanoseconds */
+int64_t gitsi_stat_mtime_ns(const struct stat *file_stat) {
+#ifdef __APPLE__
+    return (int64_t)file_stat->st_mtimespec.tv_sec * 1000000000 + file_stat->st_mtimespec.tv_nsec;
+#else
+    return (int64_t)file_stat->st_mtim.tv_sec * 1000000000 + file_stat->st_mtim.tv_nsec;
+#endif
+}
+
+/* Read the modification time and size of all files, once per status. The
+ * paths are relative, so they are stat'd against a descriptor of the workdir
+ * instead of building the full path of every file */
+void gitsi_sort_read_metadata(gitsi_context *context) {
+    gitsi_sort *sort = &context->sort;
+    if (sort->metadata_generation == context->status_generation)return;
+    gitsi_sort_reserve(sort, context->entries.count);
+    int workdir = open(context->repo_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    for (uint32_t i = 0; i < context->entries.count; i++) {
+        struct stat file_stat;
+        sort->mtimes[i] = -1;
+        sort->sizes[i] = -1;
+        if (workdir < 0 || gitsi_entry_type(context, i) == STATUS_TYPE_CATEGORY)continue;
+        // Deleted files have no metadata
+        if (fstatat(workdir, gitsi_entry_path(context, i), &file_stat, AT_SYMLINK_NOFOLLOW) != 0)continue;
+        sort->mtimes[i] = gitsi_stat_mtime_ns(&file_stat);
+        sort->sizes[i] = file_stat.st_size;
+    }
+    if (workdir >= 0)close(workdir);
+    sort->metadata_generation = context->status_generation;
+}
+
+/* The extension of the file name of a path, empty if there is none. The dot
+ * of dotfiles does not start an extension */
+const char *gitsi_path_extension(const char *path) {
+    const char *name = strrchr(path, '/');
+    name = name != NULL ? name + 1 : path;
+    const char *dot = strrchr(name, '.');
+    return dot != NULL && dot != name ? dot + 1 : "";
+}
+
+/* Compare by key, then by extension. Equal items keep the path order */
+int gitsi_sort_item_compare(const void *a, const void *b) {
+    const gitsi_sort_item *left = a, *right = b;
+    if (left->key != right->key)return left->key < right->key ? -1 : 1;
+    if (left->text != NULL) {
+        int result = strcmp(left->text, right->text);
+        if (result != 0)return result;
+    }
+    return left->entry < right->entry ? -1 : left->entry > right->entry;
+}
+
+/* The sort item of an entry for the current key. Files without metadata
+ * sort after all others */
+gitsi_sort_item gitsi_sort_item_for(gitsi_context *context, uint32_t entry) {
+    gitsi_sort *sort = &context->sort;
+    gitsi_sort_item item = { .key = 0, .text = NULL, .entry = entry };
+    switch (sort->key) {
+        case GITSI_SORT_PATH:
+            break;
+        case GITSI_SORT_MTIME:
+            item.key = sort->mtimes[entry] < 0 ? INT64_MAX : -sort->mtimes[entry];
+            break;
+        case GITSI_SORT_SIZE:
+            item.key = sort->sizes[entry] < 0 ? INT64_MAX : -sort->sizes[entry];
+            break;
+        case GITSI_SORT_EXTENSION:
+            item.text = gitsi_path_extension(gitsi_entry_path(context, entry));
+            break;
+        case GITSI_SORT_STATUS:
+            item.key = gitsi_entry_kind(context, entry);
+            break;
+    }
+    return item;
+}
+
+/* The entries in the order of the list. Headlines stay in place and the
+ * entries of every section are sorted by the current key. The order is kept
+ * until the key or the status changes */
+const uint32_t *gitsi_sort_entries(gitsi_context *context) {
+    gitsi_sort *sort = &context->sort;
+    if (gitsi_sort_needs_metadata(sort)) {
+        gitsi_sort_read_metadata(context);
+    }
+    if (sort->order_generation == context->status_generation && sort->order_key == sort->key) {
+        return sort->order;
+    }
+    uint32_t count = context->entries.count;
+    gitsi_sort_reserve(sort, count);
+    uint32_t section_start = 0;
+    for (uint32_t i = 0; i <= count; i++) {
+        if (i < count && gitsi_entry_type(context, i) != STATUS_TYPE_CATEGORY) {
+            sort->items[i] = gitsi_sort_item_for(context, i);
+            continue;
+        }
+        // The entries come in path order, that needs no sorting
+        if (sort->key != GITSI_SORT_PATH && i > section_start) {
+            qsort(sort->items + section_start, i - section_start, sizeof(gitsi_sort_item), gitsi_sort_item_compare);
+        }
+        if (i < count) {
+            sort->items[i] = (gitsi_sort_item){ .key = 0, .text = NULL, .entry = i };
+            section_start = i + 1;
+        }
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        sort->order[i] = sort->items[i].entry;
+    }
+    sort->order_generation = context->status_generation;
+    sort->order_key = sort->key;
+    return sort->order;
+}
+
+/* Write a size in bytes like `ls -h` does */
+void gitsi_format_size(int64_t size, char *buffer, size_t length) {
+    const char units[] = "BKMGT";
+    double value = (double)size;
+    size_t unit = 0;
+    while (value >= 1024 && unit + 1 < sizeof(units) - 1) {
+        value /= 1024;
+        unit++;
+    }
+    snprintf(buffer, length, unit == 0 ? "%.0f%c" : "%.1f%c", value, units[unit]);
+}
+
+/* The modification time and size columns of a row. Rows without a file in
+ * the workdir get blanks, so that the columns stay aligned */
+void gitsi_entry_metadata(gitsi_context *context, gitsi_row row, char *buffer, size_t size) {
+    char mtime[32] = "";
+    char file_size[16] = "";
+    gitsi_sort *sort = &context->sort;
+    if (!gitsi_row_is_directory(row) && sort->mtimes[row] >= 0) {
+        time_t seconds = (time_t)(sort->mtimes[row] / 1000000000);
+        struct tm local;
+        localtime_r(&seconds, &local);
+        strftime(mtime, sizeof(mtime), "%Y-%m-%d %H:%M", &local);
+        gitsi_format_size(sort->sizes[row], file_size, sizeof(file_size));
+    }
+    snprintf(buffer, size, "%-16s %7s ", mtime, file_size);
+}
+
+// --------------------------------------------------
+#pragma mark Script Output
+// --------------------------------------------------
+
+/* Write a path for --porcelain, quoted like git does if it contains
+ * characters that would break the line format */
+void gitsi_write_porcelain_path(const char *path) {
+    const char *c;
+    for (c = path; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\' || (unsigned char)*c < 0x20 || *c == 0x7f)break;
+    }
+    if (*c == '\0') {
+        fputs(path, stdout);
+        return;
+    }
+    putchar('"');
+    for (c = path; *c != '\0'; c++) {
+        unsigned char ch = (unsigned char)*c;
+        switch (ch) {
+            case '"': fputs("\\\"", stdout); break;
+            case '\\': fputs("\\\\", stdout); break;
+            case '\t': fputs("\\t", stdout); break;
+            case '\n': fputs("\\n", stdout); break;
+            default:
+                if (ch < 0x20 || ch == 0x7f) {
+                    printf("\\%03o", ch);
+                } else {
+                    putchar(ch);
+                }
+        }
+    }
+    putchar('"');
+}
+
+/* Write a string as a JSON string literal */
+void gitsi_write_json_string(const char *string) {
+    putchar('"');
+    for (const char *c = string; *c != '\0'; c++) {
+        unsigned char ch = (unsigned char)*c;
+        if (ch == '"' || ch == '\\') {
+            putchar('\\');
+            putchar(ch);
+        } else if (ch < 0x20) {
+            printf("\\u%04x", ch);
+        } else {
+            putchar(ch);
+        }
+    }
+    putchar('"');
+}
+
+/* Write one classified entry to stdout. Porcelain lines look like
+ * `I M path` with the section and status codes, renames like git as
+ * `I R old -> new`, or `I R new NUL old NUL` with -z. JSON writes one object
+ * per line so that scripts can consume it while it is still streaming */
+void gitsi_write_entry(gitsi_context *context, uint32_t entry) {
+    enum GITSI_STATUS_TYPE type = gitsi_entry_type(context, entry);
+    enum GITSI_DESCRIPTION kind = gitsi_entry_kind(context, entry);
+    const char *path = gitsi_entry_path(context, entry);
+    const char *old_path = gitsi_entry_old_path(context, entry);
+    
+    if (context->output_format == GITSI_OUTPUT_JSON) {
+        printf("{\"section\":\"%s\",\"status\":\"%s\",\"path\":",
+               status_type_names[type], status_descriptions[kind]);
+        gitsi_write_json_string(path);
+        if (old_path != NULL) {
+            fputs(",\"old_path\":", stdout);
+            gitsi_write_json_string(old_path);
+        }
+        fputs("}\n", stdout);
+        return;
+    }
+    
+    printf("%c %c ", status_type_codes[type], status_description_codes[kind]);
+    if (context->output_nul) {
+        fputs(path, stdout);
+        putchar('\0');
+        if (old_path != NULL) {
+            fputs(old_path, stdout);
+            putchar('\0');
+        }
+        return;
+    }
+    if (old_path != NULL) {
+        gitsi_write_porcelain_path(old_path);
+        fputs(" -> ", stdout);
+    }
+    gitsi_write_porcelain_path(path);
+    putchar('\n');
+}
+
+// --------------------------------------------------
+#pragma mark Commandline and Git functions
+// --------------------------------------------------
+
+/* Print the command line help */
+void gitsi_print_help() {
+    printf("usage:\t\tgitsi [options] [repository]\n");
+    printf("\t\tgitsi without parameters uses the current repository\n");
+    printf("options:\n");
+    printf("\t--renames off|index|all\tDetect renames nowhere, in the index (default) or also in the workspace\n");
+    printf("\t--rename-limit N\tSkip rename detection with more than N deleted and N added files (default %d)\n", DEFAULT_RENAME_LIMIT);
+    printf("\t--rename-threshold N\tHow similar in percent a file has to be to count as renamed (default %d)\n", DEFAULT_RENAME_THRESHOLD);
+    printf("\t--status-threads N\tRead the status of large repositories with N workers (default one per processor, at most %d)\n", STATUS_MAX_SHARDS);
+    printf("\t--preload-index\tlstat() the files of the index with several workers to warm up the stat cache before the status is read, like core.preloadIndex of git\n");
+    printf("\t--sort path|mtime|size|extension|status\tThe order of the files in their section (default path)\n");
+    printf("\t--porcelain [-z]\tWrite the status as `section status path` lines to stdout and exit\n");
+    printf("\t--json\t\tWrite the status as one JSON object per line to stdout and exit\n");
+    printf("\t--batch [file]\tRead stage, unstage, discard and delete commands from the file or stdin\n");
+    printf("\t--trace\t\tPrint the time to the first frame and to the full status on exit\n");
+    printf("\t--record file\tWrite every key to the file, for --replay\n");
+    printf("\t--replay file\tRun the keys of the file without a terminal and print how long they took\n");
+    printf("\t--log off|error|warn|info|debug\tLog to " LOGFILE_NAME ", written on exit, on a crash or on SIGUSR1\n");
+    printf("\t--daemon\tKeep the status of the repository up to date in the background for later runs\n");
+    exit(0);
+}
+
+/* Print an error about a command line parameter and exit */
+void gitsi_parameter_error(const char *parameter, const char *value) {
+    fprintf(stderr, "Invalid value '%s' for %s. See gitsi -h\n", value != NULL ? value : "", parameter);
+    exit(1);
+}
+
+/* Parse a number parameter between `min` and `max` */
+long gitsi_parse_number(const char *parameter, const char *value, long min, long max) {
+    if (value == NULL)gitsi_parameter_error(parameter, value);
+    char *end = NULL;
+    long number = strtol(value, &end, 10);
+    if (*value == '\0' || *end != '\0' || number < min || number > max) {
+        gitsi_parameter_error(parameter, value);
+    }
+    return number;
+}
+
+/* Parse the command line parameters */
+void gitsi_parse_parameters(gitsi_context *context, int argc, char *argv[]) {
+    const char *repo_dir = ".";
+    
+    for (int i = 1; i < argc; i++) {
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(argv[i], "-h") == 0) {
+            gitsi_print_help();
+        }
+        else if (strcmp(argv[i], "--debug-terminal") == 0) {
+            continue;
+        }
+        else if (strcmp(argv[i], "--renames") == 0) {
+            size_t mode = 0;
+            while (mode <= GITSI_RENAMES_WORKDIR && (value == NULL || strcmp(value, rename_mode_names[mode]) != 0)) {
+                mode++;
+            }
+            if (mode > GITSI_RENAMES_WORKDIR)gitsi_parameter_error(argv[i], value);
+            context->rename_mode = (enum GITSI_RENAMES)mode;
+            i++;
+        }
+        else if (strcmp(argv[i], "--sort") == 0) {
+            size_t key = 0;
+            while (key < sort_names_length && (value == NULL || strcmp(value, sort_names[key]) != 0)) {
+                key++;
+            }
+            if (key == sort_names_length)gitsi_parameter_error(argv[i], value);
+            context->sort.key = (enum GITSI_SORT)key;
+            i++;
+        }
+        else if (strcmp(argv[i], "--rename-limit") == 0) {
+            context->rename_limit = (size_t)gitsi_parse_number(argv[i], value, 0, 1000000);
+            i++;
+        }
+        else if (strcmp(argv[i], "--rename-threshold") == 0) {
+            context->rename_threshold = (uint16_t)gitsi_parse_number(argv[i], value, 0, 100);
+            i++;
+        }
+        else if (strcmp(argv[i], "--status-threads") == 0) {
+            context->status_threads = (size_t)gitsi_parse_number(argv[i], value, 1, STATUS_MAX_SHARDS);
+            i++;
+        }
+        else if (strcmp(argv[i], "--preload-index") == 0) {
+            context->preload_index = true;
+        }
+        else if (strcmp(argv[i], "--porcelain") == 0) {
+            context->output_format = GITSI_OUTPUT_PORCELAIN;
+        }
+        else if (strcmp(argv[i], "--json") == 0) {
+            context->output_format = GITSI_OUTPUT_JSON;
+        }
+        else if (strcmp(argv[i], "-z") == 0) {
+            context->output_nul = true;
+        }
+        else if (strcmp(argv[i], "--trace") == 0) {
+            context->is_trace = true;
+        }
+        else if (strcmp(argv[i], "--daemon") == 0) {
+            context->is_daemon = true;
+        }
+        else if (strcmp(argv[i], "--record") == 0) {
+            if (value == NULL)gitsi_parameter_error(argv[i], value);
+            context->record_path = value;
+            i++;
+        }
+        else if (strcmp(argv[i], "--replay") == 0) {
+            if (value == NULL)gitsi_parameter_error(argv[i], value);
+            context->replay_path = value;
+            i++;
+        }
+        else if (strcmp(argv[i], "--log") == 0) {
+            size_t level = 0;
+            while (level < log_level_names_length && (value == NULL || strcmp(value, log_level_names[level]) != 0)) {
+                level++;
+            }
+            if (level == log_level_names_length)gitsi_parameter_error(argv[i], value);
+            context->log_level = (enum GITSI_LOG_LEVEL)level;
+            i++;
+        }
+        else if (strcmp(argv[i], "--batch") == 0) {
+            // The command file is optional, a directory is the repository
+            struct stat st;
+            context->is_batch = true;
+            if (value != NULL && (strcmp(value, "-") == 0 || (stat(value, &st) == 0 && !S_ISDIR(st.st_mode)))) {
+                context->batch_path = value;
+                i++;
+            }
+        }
+        else {
+            repo_dir = argv[i];
+        }
+    }
+    context->repo_dir = strdup(repo_dir);
 }
 
 /* Check if there was an libgit error, if there was, display it and exit */
 void gitsi_check_error(const char *source, int error) {
     if (!error)return;
     const git_error *err = giterr_last();
+    GITSI_LOG(GITSI_LOG_ERROR, "%s failed: %s", source, err != NULL ? err->message : "unknown error");
+    // The message would be lost on the screen of curses
+    if (stdscr != NULL && !isendwin())endwin();
     if (err != NULL) {
         fprintf(stderr, "Source: %s\n", source);
         fprintf(stderr, "Error: %s\n", err->message);
     }
-    exit(1);
+    exit(1);
+}
+
+/* Check for a libgit error while reading the status. It can happen on a
+ * worker, so instead of exiting the first error is kept in the request */
+bool gitsi_status_failed(gitsi_status_request *request, const char *source, int error) {
+    if (!error)return false;
+    const git_error *err = giterr_last();
+    GITSI_LOG(GITSI_LOG_ERROR, "%s failed: %s", source, err != NULL ? err->message : "unknown error");
+    if (request->error == NULL) {
+        asprintf(&request->error, "%s failed: %s", source, err != NULL ? err->message : "unknown error");
+    }
+    return true;
+}
+
+/* Open the git repository */
+void gitsi_open_repository(gitsi_context *context) {
+    int error = git_repository_open_ext(&context->repo, context->repo_dir, 0, NULL);
+    gitsi_check_error("open repository", error);
+    
+    if (git_repository_is_bare(context->repo)) {
+        fprintf(stderr, "Could not report status on bare repository: %s", context->repo_dir);
+        exit(1);
+    }
+    
+    // The `repo_dir` is now the common repo dir that git detected
+    free(context->repo_dir);
+    context->repo_dir = NULL;
+    context->repo_dir = git_repository_workdir(context->repo);
+}
+
+/* Read the upstream of the checked out branch and where both point to.
+ * The counts for the header are computed by a worker, see Upstream */
+void gitsi_read_upstream(gitsi_context *context, git_reference *head) {
+    gitsi_upstream *upstream = &context->upstream;
+    upstream->is_gone = false;
+    memset(&upstream->local_id, 0, sizeof(git_oid));
+    memset(&upstream->upstream_id, 0, sizeof(git_oid));
+    if (head == NULL || !git_reference_is_branch(head) || git_reference_target(head) == NULL) {
+        free(upstream->name);
+        upstream->name = NULL;
+        return;
+    }
+    git_oid_cpy(&upstream->local_id, git_reference_target(head));
+    
+    char *config_path;
+    asprintf(&config_path, "%sconfig", git_repository_path(context->repo));
+    struct stat config_stat;
+    int64_t config_mtime = stat(config_path, &config_stat) == 0 ? gitsi_stat_mtime_ns(&config_stat) : -1;
+    free(config_path);
+    if (upstream->branch_ref == NULL || strcmp(upstream->branch_ref, git_reference_name(head)) != 0 ||
+        upstream->config_mtime != config_mtime) {
+        free(upstream->branch_ref);
+        free(upstream->upstream_ref);
+        free(upstream->name);
+        upstream->branch_ref = strdup(git_reference_name(head));
+        upstream->upstream_ref = NULL;
+        upstream->name = NULL;
+        upstream->config_mtime = config_mtime;
+        git_buf name = {0};
+        if (git_branch_upstream_name(&name, context->repo, upstream->branch_ref) == 0) {
+            const char *shorthand = name.ptr;
+            if (strncmp(shorthand, "refs/remotes/", 13) == 0) {
+                shorthand += 13;
+            } else if (strncmp(shorthand, "refs/heads/", 11) == 0) {
+                shorthand += 11;
+            }
+            upstream->upstream_ref = strdup(name.ptr);
+            upstream->name = strdup(shorthand);
+        }
+        git_buf_dispose(&name);
+    }
+    if (upstream->upstream_ref == NULL)return;
+    upstream->is_gone = git_reference_name_to_id(&upstream->upstream_id, context->repo, upstream->upstream_ref) != 0;
+}
+
+/* Read the name of the checked out branch for the header. This only reads
+ * HEAD, so it is fast enough for the first frame */
+void gitsi_read_branch(gitsi_context *context) {
+    free(context->branch);
+    context->branch = NULL;
+    git_reference *head = NULL;
+    int error = git_repository_head(&head, context->repo);
+    gitsi_read_upstream(context, error == 0 ? head : NULL);
+    if (error == 0 && git_reference_is_branch(head)) {
+        context->branch = strdup(git_reference_shorthand(head));
+    } else if (error == 0 && git_reference_target(head) != NULL) {
+        char oid[GIT_OID_HEXSZ + 1];
+        git_oid_tostr(oid, 8, git_reference_target(head));
+        asprintf(&context->branch, "HEAD detached at %s", oid);
+    } else if (error == GIT_EUNBORNBRANCH) {
+        // A repository without commits, HEAD points to the branch to be
+        git_reference *symbolic = NULL;
+        if (git_reference_lookup(&symbolic, context->repo, "HEAD") == 0 &&
+            git_reference_symbolic_target(symbolic) != NULL) {
+            const char *target = git_reference_symbolic_target(symbolic);
+            if (strncmp(target, "refs/heads/", 11) == 0)target += 11;
+            context->branch = strdup(target);
+        }
+        git_reference_free(symbolic);
+    }
+    if (context->branch == NULL) {
+        context->branch = strdup("HEAD");
+    }
+    git_reference_free(head);
+}
+
+/* Forget the remembered marks and selection */
+void gitsi_carry_clear(gitsi_carry *carry) {
+    for (size_t i = 0; i < carry->marked_count; i++) {
+        free(carry->marked[i].path);
+    }
+    free(carry->marked);
+    free(carry->position.path);
+    memset(carry, 0, sizeof(gitsi_carry));
+}
+
+/* Remember the marked rows and the selected one by their paths */
+void gitsi_carry_save(gitsi_context *context) {
+    gitsi_carry *carry = &context->carry;
+    gitsi_carry_clear(carry);
+    size_t words = gitsi_bit_words(context->entries.count);
+    size_t count = 0;
+    for (size_t word = 0; word < words; word++) {
+        count += (size_t)__builtin_popcountll(context->entries.marked[word]);
+    }
+    gitsi_tree *tree = context->tree;
+    size_t directory_count = tree != NULL ? tree->directory_node_count : 0;
+    for (size_t i = 0; i < directory_count; i++) {
+        if (tree->directory_nodes[i]->marked)count++;
+    }
+    carry->marked = calloc(count + 1, sizeof(gitsi_carried_row));
+    for (size_t word = 0; word < words; word++) {
+        uint64_t bits = context->entries.marked[word];
+        while (bits != 0) {
+            uint32_t entry = (uint32_t)(word * 64 + (size_t)__builtin_ctzll(bits));
+            bits &= bits - 1;
+            carry->marked[carry->marked_count++] = (gitsi_carried_row){
+                gitsi_entry_type(context, entry), false, strdup(gitsi_entry_path(context, entry)) };
+        }
+    }
+    for (size_t i = 0; i < directory_count; i++) {
+        gitsi_tree_node *node = tree->directory_nodes[i];
+        if (!node->marked)continue;
+        carry->marked[carry->marked_count++] = (gitsi_carried_row){ node->type, true, strdup(node->path) };
+    }
+    if (context->position != ROW_NONE && gitsi_row_type(context, context->position) != STATUS_TYPE_CATEGORY) {
+        carry->has_position = true;
+        carry->position = (gitsi_carried_row){
+            gitsi_row_type(context, context->position), gitsi_row_is_directory(context->position),
+            strdup(gitsi_row_path(context, context->position)) };
+    }
+}
+
+/* The row of a remembered path in the current status, ROW_NONE if it is gone */
+gitsi_row gitsi_carry_find(gitsi_context *context, gitsi_carried_row *carried) {
+    if (!carried->is_directory)return gitsi_entries_find(&context->entries, carried->type, carried->path);
+    if (context->tree == NULL)return ROW_NONE;
+    gitsi_tree_node *node = gitsi_tree_find_directory(context->tree, carried->type, carried->path, strlen(carried->path));
+    return node != NULL ? node->row : ROW_NONE;
+}
+
+/* Mark the rows again and select the row that were remembered, each one is
+ * found by its path. Entries that left their section are not selected, the
+ * caller falls back to the old position then */
+void gitsi_carry_restore(gitsi_context *context) {
+    gitsi_carry *carry = &context->carry;
+    for (size_t i = 0; i < carry->marked_count; i++) {
+        gitsi_row row = gitsi_carry_find(context, &carry->marked[i]);
+        if (row != ROW_NONE)gitsi_row_set_marked(context, row, true);
+    }
+    if (carry->has_position && context->position == ROW_NONE) {
+        context->position = gitsi_carry_find(context, &carry->position);
+        // The row might be filtered or in a collapsed directory
+        size_t index;
+        if (!gitsi_find_position(context, &index))context->position = ROW_NONE;
+    }
+    gitsi_carry_clear(carry);
+}
+
+/* Go through all the entries in the context and free them. The marks and
+ * the selection are remembered for the next status */
+void gitsi_free_entries(gitsi_context *context) {
+    gitsi_carry_save(context);
+    // As the `position` is one of our rows, it also needs to be cleared
+    context->position = ROW_NONE;
+    gitsi_entries_free(&context->entries);
+    
+    free(context->rows);
+    context->rows = NULL;
+    context->row_count = 0;
+    
+    gitsi_tree_free(context->tree);
+    context->tree = NULL;
+}
+
+// The diffstat worker gets the new entries after each status and is
+// stopped before the repository is freed
+void gitsi_diffstat_submit(gitsi_context *context);
+void gitsi_diffstat_stop(gitsi_context *context);
+void gitsi_preview_stop(gitsi_context *context);
+void gitsi_history_stop(gitsi_context *context);
+void gitsi_upstream_stop(gitsi_context *context);
+// The content search is started again for every new status
+void gitsi_grep_start(gitsi_context *context);
+void gitsi_grep_stop(gitsi_context *context);
+// A status that is read on the main thread replaces the one of the loader
+void gitsi_status_loader_stop(gitsi_context *context);
+// A batch that is still staged on exit is cancelled
+void gitsi_stage_cancel(gitsi_context *context);
+// Errors of the status are shown in the output pane
+void gitsi_output_append(gitsi_context *context, const char *line);
+
+/* free all the git structures as well as the entries */
+void gitsi_cleanup(gitsi_context *context) {
+    gitsi_status_loader_stop(context);
+    gitsi_stage_cancel(context);
+    gitsi_diffstat_stop(context);
+    gitsi_preview_stop(context);
+    gitsi_history_stop(context);
+    free(context->history.failure);
+    context->history.failure = NULL;
+    gitsi_upstream_stop(context);
+    gitsi_grep_stop(context);
+    gitsi_filter_free(&context->filter);
+    free(context->grep.matched);
+    context->grep.matched = NULL;
+    for (size_t i = 0; i < 2; i++) {
+        if (context->wake_pipe[i] >= 0)close(context->wake_pipe[i]);
+        context->wake_pipe[i] = -1;
+    }
+    free(context->branch);
+    context->branch = NULL;
+    if (context->record_file != NULL) {
+        fclose(context->record_file);
+        context->record_file = NULL;
+    }
+    git_repository_free(context->repo);
+    git_index_free(context->repo_index);
+    context->repo_index = NULL;
+    context->repo = NULL;
+    gitsi_free_entries(context);
+    gitsi_carry_clear(&context->carry);
+    gitsi_sort_free(&context->sort);
+    for (size_t i = 0; i < context->collapsed_directory_count; i++) {
+        free(context->collapsed_directories[i].path);
+    }
+    free(context->collapsed_directories);
+    context->collapsed_directories = NULL;
+    context->collapsed_directory_count = 0;
+    for (size_t i = 0; i < context->row_cache_size; i++) {
+        free(context->row_cache[i].text);
+    }
+    free(context->row_cache);
+    context->row_cache = NULL;
+    for (size_t i = 0; i < MAX_JOBS; i++) {
+        free(context->jobs[i].title);
+        context->jobs[i].title = NULL;
+    }
+    for (size_t i = 0; i < context->output.count; i++) {
+        free(context->output.lines[(context->output.first + i) % OUTPUT_LINES]);
+    }
+    context->output.count = 0;
+    context->row_cache_size = 0;
+    free(context->list_lines);
+    context->list_lines = NULL;
+    if (context->list_pad != NULL) {
+        delwin(context->list_pad);
+        context->list_pad = NULL;
+    }
+    git_libgit2_shutdown();
+}
+
+/* Compare renames by their old path */
+int gitsi_rename_compare_old(const void *a, const void *b) {
+    return strcmp((*(gitsi_rename *const *)a)->old_path, (*(gitsi_rename *const *)b)->old_path);
+}
+
+/* Compare renames by their new path */
+int gitsi_rename_compare_new(const void *a, const void *b) {
+    return strcmp((*(gitsi_rename *const *)a)->new_path, (*(gitsi_rename *const *)b)->new_path);
+}
+
+/* Find the rename of `path` in `renames`. `by_new_path` selects which side is searched */
+gitsi_rename *gitsi_renames_find(gitsi_renames *renames, const char *path, bool by_new_path) {
+    if (renames->count == 0 || path == NULL)return NULL;
+    gitsi_rename key = { .old_path = (char*)path, .new_path = (char*)path };
+    gitsi_rename *key_pointer = &key;
+    gitsi_rename **found = bsearch(&key_pointer, by_new_path ? renames->by_new_path : renames->by_old_path,
+                                   renames->count, sizeof(gitsi_rename*),
+                                   by_new_path ? gitsi_rename_compare_new : gitsi_rename_compare_old);
+    return found != NULL ? *found : NULL;
+}
+
+void gitsi_renames_free(gitsi_renames *renames) {
+    for (size_t i = 0; i < renames->count; i++) {
+        free(renames->renames[i].old_path);
+        free(renames->renames[i].new_path);
+    }
+    free(renames->renames);
+    free(renames->by_old_path);
+    free(renames->by_new_path);
+    memset(renames, 0, sizeof(gitsi_renames));
+}
+
+/* The path of a status entry, which is the same for both of its sides as
+ * the status lists are read without rename detection */
+const char *gitsi_status_entry_path(const git_status_entry *s) {
+    return (s->head_to_index != NULL ? s->head_to_index : s->index_to_workdir)->new_file.path;
+}
+
+/* Compare status entries by path for qsort */
+int gitsi_status_entry_compare(const void *a, const void *b) {
+    return strcmp(gitsi_status_entry_path(*(const git_status_entry *const *)a),
+                  gitsi_status_entry_path(*(const git_status_entry *const *)b));
+}
+
+/* A view of the entries of `lists`. The paths of the lists do not overlap,
+ * so the entries only have to be sorted if there is more than one */
+void gitsi_status_view_init(gitsi_status_view *view, git_status_list *const *lists, size_t list_count) {
+    size_t count = 0;
+    for (size_t i = 0; i < list_count; i++) {
+        count += lists[i] != NULL ? git_status_list_entrycount(lists[i]) : 0;
+    }
+    view->entries = calloc(count + 1, sizeof(git_status_entry*));
+    view->count = 0;
+    for (size_t i = 0; i < list_count; i++) {
+        size_t maxi = lists[i] != NULL ? git_status_list_entrycount(lists[i]) : 0;
+        for (size_t j = 0; j < maxi; j++) {
+            view->entries[view->count++] = git_status_byindex(lists[i], j);
+        }
+    }
+    if (list_count > 1) {
+        qsort(view->entries, view->count, sizeof(git_status_entry*), gitsi_status_entry_compare);
+    }
+}
+
+void gitsi_status_view_free(gitsi_status_view *view) {
+    free(view->entries);
+    memset(view, 0, sizeof(gitsi_status_view));
+}
+
+/* The workdir status of a skip-worktree entry of the index. These are
+ * outside of a sparse checkout and missing from the workdir on purpose, so
+ * like git they are not shown */
+bool gitsi_status_skips_worktree(git_index *index, const git_status_entry *s) {
+    if (s->index_to_workdir == NULL ||
+        !(s->status & (GIT_STATUS_WT_DELETED | GIT_STATUS_WT_MODIFIED | GIT_STATUS_WT_TYPECHANGE)))return false;
+    const git_index_entry *entry = git_index_get_bypath(index, s->index_to_workdir->old_file.path, 0);
+    return entry != NULL && (entry->flags_extended & GIT_INDEX_ENTRY_SKIP_WORKTREE) != 0;
+}
+
+/* The status is loaded without rename detection, as libgit2 would compare
+ * every deleted with every added file of the whole repository. Instead the
+ * deleted and added paths of one section are collected here and, if there are
+ * not more than the rename limit allows, only these paths are diffed again with
+ * rename detection. Otherwise `renames_skipped` is set */
+void gitsi_find_renames(gitsi_status_request *request, const gitsi_status_view *status,
+                        enum GITSI_STATUS_TYPE type, gitsi_renames *renames) {
+    memset(renames, 0, sizeof(gitsi_renames));
+    git_status_t deleted_flag = type == STATUS_TYPE_INDEX ? GIT_STATUS_INDEX_DELETED : GIT_STATUS_WT_DELETED;
+    git_status_t added_flag = type == STATUS_TYPE_INDEX ? GIT_STATUS_INDEX_NEW : GIT_STATUS_WT_NEW;
+    size_t maxi = status->count;
+    char **paths = calloc(maxi + 1, sizeof(char*));
+    size_t deleted = 0, added = 0;
+    for (size_t i = 0; i < maxi; i++) {
+        const git_status_entry *s = status->entries[i];
+        const git_diff_delta *delta = type == STATUS_TYPE_INDEX ? s->head_to_index : s->index_to_workdir;
+        if (delta == NULL)continue;
+        if (type == STATUS_TYPE_WORKSPACE && gitsi_status_skips_worktree(request->index, s))continue;
+        if (s->status & deleted_flag) {
+            paths[deleted + added] = (char*)delta->old_file.path;
+            deleted++;
+        } else if (s->status & added_flag) {
+            paths[deleted + added] = (char*)delta->new_file.path;
+            added++;
+        }
+    }
+    if (deleted == 0 || added == 0) {
+        free(paths);
+        return;
+    }
+    // Like git, give up if there are more pairs than the limit squared
+    if ((double)deleted * (double)added > (double)request->rename_limit * (double)request->rename_limit) {
+        request->renames_skipped = true;
+        free(paths);
+        return;
+    }
+    
+    git_diff_options diffopt = GIT_DIFF_OPTIONS_INIT;
+    diffopt.flags = GIT_DIFF_DISABLE_PATHSPEC_MATCH | GIT_DIFF_SKIP_BINARY_CHECK;
+    diffopt.pathspec.strings = paths;
+    diffopt.pathspec.count = deleted + added;
+    git_diff_find_options findopt = GIT_DIFF_FIND_OPTIONS_INIT;
+    findopt.flags = GIT_DIFF_FIND_RENAMES;
+    findopt.rename_threshold = request->rename_threshold;
+    findopt.rename_limit = request->rename_limit;
+    
+    git_diff *diff = NULL;
+    int error;
+    if (type == STATUS_TYPE_INDEX) {
+        git_object *head_tree = NULL;
+        error = git_revparse_single(&head_tree, request->repo, "HEAD^{tree}");
+        if (gitsi_status_failed(request, "git revparse head tree", error)) {
+            free(paths);
+            return;
+        }
+        error = git_diff_tree_to_index(&diff, request->repo, (git_tree*)head_tree, request->index, &diffopt);
+        git_object_free(head_tree);
+    } else {
+        // The added files might be in an untracked directory
+        diffopt.flags |= GIT_DIFF_INCLUDE_UNTRACKED | GIT_DIFF_RECURSE_UNTRACKED_DIRS;
+        findopt.flags |= GIT_DIFF_FIND_FOR_UNTRACKED;
+        error = git_diff_index_to_workdir(&diff, request->repo, request->index, &diffopt);
+    }
+    if (!gitsi_status_failed(request, "git diff renames", error)) {
+        error = git_diff_find_similar(diff, &findopt);
+        gitsi_status_failed(request, "git diff find similar", error);
+    }
+    if (error != 0) {
+        git_diff_free(diff);
+        free(paths);
+        return;
+    }
+    
+    size_t delta_count = git_diff_num_deltas(diff);
+    renames->renames = calloc(delta_count + 1, sizeof(gitsi_rename));
+    for (size_t i = 0; i < delta_count; i++) {
+        const git_diff_delta *delta = git_diff_get_delta(diff, i);
+        if (delta->status != GIT_DELTA_RENAMED)continue;
+        renames->renames[renames->count].old_path = strdup(delta->old_file.path);
+        renames->renames[renames->count].new_path = strdup(delta->new_file.path);
+        renames->count++;
+    }
+    renames->by_old_path = calloc(renames->count + 1, sizeof(gitsi_rename*));
+    renames->by_new_path = calloc(renames->count + 1, sizeof(gitsi_rename*));
+    for (size_t i = 0; i < renames->count; i++) {
+        renames->by_old_path[i] = &renames->renames[i];
+        renames->by_new_path[i] = &renames->renames[i];
+    }
+    qsort(renames->by_old_path, renames->count, sizeof(gitsi_rename*), gitsi_rename_compare_old);
+    qsort(renames->by_new_path, renames->count, sizeof(gitsi_rename*), gitsi_rename_compare_new);
+    git_diff_free(diff);
+    free(paths);
+}
+
+/* A request to read the status with the repository and settings of the context */
+gitsi_status_request gitsi_status_request_for(gitsi_context *context, git_repository *repo,
+                                              git_index *index, gitsi_entries *entries) {
+    return (gitsi_status_request){
+        .repo = repo,
+        .index = index,
+        .rename_mode = context->rename_mode,
+        .rename_limit = context->rename_limit,
+        .rename_threshold = context->rename_threshold,
+        .entries = entries,
+        .output = context->output_format != GITSI_OUTPUT_NONE ? context : NULL,
+        .thread_count = context->status_threads,
+        .preload_index = context->preload_index,
+    };
+}
+
+/* The tree of HEAD, zero for an unborn branch */
+void gitsi_head_tree_id(git_repository *repo, git_oid *id) {
+    memset(id, 0, sizeof(git_oid));
+    git_object *tree = NULL;
+    if (git_revparse_single(&tree, repo, "HEAD^{tree}") != 0)return;
+    git_oid_cpy(id, git_object_id(tree));
+    git_object_free(tree);
+}
+
+/* Compare two strings for qsort and bsearch */
+int gitsi_string_compare(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Is the path one of the sorted pathspec of a reload, or below one of them? */
+bool gitsi_pathspec_covers(char *const *pathspec, size_t count, const char *path) {
+    char *prefix = strdup(path);
+    size_t length = strlen(prefix);
+    bool covers = false;
+    for (size_t i = 1; i <= length && !covers; i++) {
+        if (i < length && prefix[i] != '/')continue;
+        char saved = prefix[i];
+        prefix[i] = '\0';
+        const char *key = prefix;
+        covers = bsearch(&key, pathspec, count, sizeof(char*), gitsi_string_compare) != NULL;
+        prefix[i] = saved;
+    }
+    free(prefix);
+    return covers;
+}
+
+/* Keep the entries of a section of the previous status that a reload did not
+ * read again, up to the path `before` or all of them for NULL. Both are
+ * sorted by path, so they are merged as the section is classified */
+void gitsi_status_carry(gitsi_status_request *request, enum GITSI_STATUS_TYPE type,
+                        const char *before, bool *category, const char *headline) {
+    const gitsi_entries *previous = request->previous;
+    if (previous == NULL)return;
+    gitsi_entries *entries = request->entries;
+    for (; request->previous_next < previous->count; request->previous_next++) {
+        uint32_t i = request->previous_next;
+        if ((enum GITSI_STATUS_TYPE)(previous->kinds[i] & 0x3) != type)continue;
+        const char *path = previous->paths + previous->path_offsets[i];
+        if (before != NULL && strcmp(path, before) >= 0)return;
+        if (gitsi_pathspec_covers(request->pathspec, request->pathspec_count, path))continue;
+        if (!*category) {
+            *category = true;
+            gitsi_entries_append(entries, STATUS_TYPE_CATEGORY, headline, NULL, DESCRIPTION_NONE, GIT_STATUS_IGNORED);
+        }
+        uint32_t old_path = previous->old_path_offsets[i];
+        uint32_t entry = gitsi_entries_append(entries, type, path,
+                                              old_path != NO_PATH ? previous->paths + old_path : NULL,
+                                              (enum GITSI_DESCRIPTION)(previous->kinds[i] >> 2),
+                                              previous->git_statuses[i]);
+        git_oid_cpy(&entries->old_ids[entry], &previous->old_ids[i]);
+        git_oid_cpy(&entries->new_ids[entry], &previous->new_ids[i]);
+    }
+}
+
+/* The flags of a status entry. A reload reads the index and the workdir into
+ * separate lists, so the flags of the same path in the other list are added,
+ * as a full status has both in one entry. The lists are sorted by path */
+git_status_t gitsi_status_combined(const git_status_entry *s, const gitsi_status_view *index_status,
+                                   const gitsi_status_view *workdir_status) {
+    const gitsi_status_view *other = s->head_to_index != NULL ? workdir_status : index_status;
+    if (index_status == workdir_status || other == NULL)return s->status;
+    const char *path = gitsi_status_entry_path(s);
+    size_t low = 0, high = other->count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        const git_status_entry *o = other->entries[middle];
+        int order = strcmp(gitsi_status_entry_path(o), path);
+        if (order == 0)return s->status | o->status;
+        if (order < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return s->status;
+}
+
+/* Classify the status into the Index, Workspace and Untracked sections. The
+ * index section comes from `index_status`, the others from `workdir_status`.
+ * For a full status both are the same list */
+void gitsi_classify_status(gitsi_status_request *request, const gitsi_status_view *index_status,
+                           const gitsi_status_view *workdir_status) {
+    // Renames are detected separately, so that the limit can be enforced
+    gitsi_renames index_renames = { 0 }, workdir_renames = { 0 };
+    request->renames_skipped = false;
+    if (request->rename_mode >= GITSI_RENAMES_INDEX) {
+        gitsi_find_renames(request, index_status, STATUS_TYPE_INDEX, &index_renames);
+    }
+    if (request->rename_mode >= GITSI_RENAMES_WORKDIR && workdir_status != NULL) {
+        gitsi_find_renames(request, workdir_status, STATUS_TYPE_WORKSPACE, &workdir_renames);
+    }
+    
+    size_t i, maxi = index_status->count;
+    size_t maxw = workdir_status != NULL ? workdir_status->count : 0;
+    const git_status_entry *s;
+    const char *old_path, *new_path, *actual_path;
+    bool category = false;
+    gitsi_entries *entries = request->entries;
+    uint32_t entry;
+    git_status_t flags;
+    
+    // Every status entry shows up at most once in the index and once in the
+    // workspace or untracked section, plus the kept entries of a reload and
+    // the three category headlines
+    size_t kept = request->previous != NULL ? request->previous->count : 0;
+    gitsi_entries_reserve(entries, (uint32_t)(maxi + maxw + kept + 3));
+    
+    // Index
+    for (i = 0; i < maxi; ++i) {
+        enum GITSI_DESCRIPTION istatus = DESCRIPTION_NONE;
+        
+        s = index_status->entries[i];
+        flags = gitsi_status_combined(s, index_status, workdir_status);
+        
+        if (s->status == GIT_STATUS_CURRENT)
+            continue;
+        
+        if (s->status & GIT_STATUS_INDEX_NEW)
+            istatus = DESCRIPTION_NEW_FILE;
+        if (s->status & GIT_STATUS_INDEX_MODIFIED)
+            istatus = DESCRIPTION_MODIFIED;
+        if (s->status & GIT_STATUS_INDEX_DELETED)
+            istatus = DESCRIPTION_DELETED;
+        if (s->status & GIT_STATUS_INDEX_RENAMED)
+            istatus = DESCRIPTION_RENAMED;
+        if (s->status & GIT_STATUS_INDEX_TYPECHANGE)
+            istatus = DESCRIPTION_TYPECHANGE;
+        
+        if (istatus == DESCRIPTION_NONE)
+            continue;
+        
+        // The added side of a rename is shown by the deleted side
+        gitsi_rename *rename = NULL;
+        if (s->status & GIT_STATUS_INDEX_NEW &&
+            gitsi_renames_find(&index_renames, s->head_to_index->new_file.path, true) != NULL)
+            continue;
+        if (s->status & GIT_STATUS_INDEX_DELETED)
+            rename = gitsi_renames_find(&index_renames, s->head_to_index->old_file.path, false);
+        
+        if (!category) {
+            category = true;
+            gitsi_entries_append(entries, STATUS_TYPE_CATEGORY, "Index", NULL, DESCRIPTION_NONE, GIT_STATUS_IGNORED);
+        }
+        
+        old_path = s->head_to_index->old_file.path;
+        new_path = s->head_to_index->new_file.path;
+        if (old_path && new_path && strcmp(old_path, new_path)) {
+            actual_path = old_path;
+        } else {
+            actual_path = old_path ? old_path : new_path;
+        }
+        if (rename != NULL) {
+            git_status_t renamed_status = (flags & ~GIT_STATUS_INDEX_DELETED) | GIT_STATUS_INDEX_RENAMED;
+            entry = gitsi_entries_append(entries, STATUS_TYPE_INDEX, rename->new_path, rename->old_path,
+                                         DESCRIPTION_RENAMED, renamed_status);
+            git_oid_cpy(&entries->old_ids[entry], &s->head_to_index->old_file.id);
+            const git_index_entry *index_entry = git_index_get_bypath(request->index, rename->new_path, 0);
+            if (index_entry != NULL) {
+                git_oid_cpy(&entries->new_ids[entry], &index_entry->id);
+            }
+        } else {
+            entry = gitsi_entries_append(entries, STATUS_TYPE_INDEX, actual_path, NULL, istatus, flags);
+            git_oid_cpy(&entries->old_ids[entry], &s->head_to_index->old_file.id);
+            git_oid_cpy(&entries->new_ids[entry], &s->head_to_index->new_file.id);
+        }
+        if (request->output != NULL)gitsi_write_entry(request->output, entry);
+    }
+    
+    category = false;
+    
+    // Workspace
+    request->previous_next = 0;
+    for (i = 0; i < maxw; ++i) {
+        enum GITSI_DESCRIPTION wstatus = DESCRIPTION_NONE;
+        
+        s = workdir_status->entries[i];
+        flags = gitsi_status_combined(s, index_status, workdir_status);
+        
+        if (s->status == GIT_STATUS_CURRENT || s->index_to_workdir == NULL)
+            continue;
+        if (gitsi_status_skips_worktree(request->index, s))
+            continue;
+        
+        if (s->status & GIT_STATUS_WT_MODIFIED)
+            wstatus = DESCRIPTION_MODIFIED;
+        if (s->status & GIT_STATUS_WT_DELETED)
+            wstatus = DESCRIPTION_DELETED;
+        if (s->status & GIT_STATUS_WT_RENAMED)
+            wstatus = DESCRIPTION_RENAMED;
+        if (s->status & GIT_STATUS_WT_TYPECHANGE)
+            wstatus = DESCRIPTION_TYPECHANGE;
+        
+        if (wstatus == DESCRIPTION_NONE)
+            continue;
+        
+        gitsi_rename *rename = NULL;
+        if (s->status & GIT_STATUS_WT_DELETED)
+            rename = gitsi_renames_find(&workdir_renames, s->index_to_workdir->old_file.path, false);
+        
+        old_path = s->index_to_workdir->old_file.path;
+        new_path = s->index_to_workdir->new_file.path;
+        if (old_path && new_path && strcmp(old_path, new_path)) {
+            actual_path = old_path;
+        } else {
+            actual_path = old_path ? old_path : new_path;
+        }
+        
+        gitsi_status_carry(request, STATUS_TYPE_WORKSPACE, actual_path, &category, "Workspace");
+        if (!category) {
+            category = true;
+            gitsi_entries_append(entries, STATUS_TYPE_CATEGORY, "Workspace", NULL, DESCRIPTION_NONE, GIT_STATUS_IGNORED);
+        }
+        if (rename != NULL) {
+            git_status_t renamed_status = (flags & ~GIT_STATUS_WT_DELETED) | GIT_STATUS_WT_RENAMED;
+            entry = gitsi_entries_append(entries, STATUS_TYPE_WORKSPACE, rename->new_path, rename->old_path,
+                                         DESCRIPTION_RENAMED, renamed_status);
+        } else {
+            entry = gitsi_entries_append(entries, STATUS_TYPE_WORKSPACE, actual_path, NULL, wstatus, flags);
+        }
+        git_oid_cpy(&entries->old_ids[entry], &s->index_to_workdir->old_file.id);
+        if (request->output != NULL)gitsi_write_entry(request->output, entry);
+    }
+    gitsi_status_carry(request, STATUS_TYPE_WORKSPACE, NULL, &category, "Workspace");
+    
+    category = false;
+    
+    // Untracked
+    request->previous_next = 0;
+    for (i = 0; i < maxw; ++i) {
+        s = workdir_status->entries[i];
+        flags = gitsi_status_combined(s, index_status, workdir_status);
+        if (flags == GIT_STATUS_WT_NEW) {
+            // Untracked files that were found as the new path of a rename
+            if (gitsi_renames_find(&workdir_renames, s->index_to_workdir->old_file.path, true) != NULL)
+                continue;
+            gitsi_status_carry(request, STATUS_TYPE_UNTRACKED, s->index_to_workdir->old_file.path,
+                               &category, "Untracked");
+            if (!category) {
+                category = true;
+                gitsi_entries_append(entries, STATUS_TYPE_CATEGORY, "Untracked", NULL, DESCRIPTION_NONE, GIT_STATUS_IGNORED);
+            }
+            entry = gitsi_entries_append(entries, STATUS_TYPE_UNTRACKED, s->index_to_workdir->old_file.path, NULL,
+                                         DESCRIPTION_UNTRACKED, flags);
+            if (request->output != NULL)gitsi_write_entry(request->output, entry);
+        }
+    }
+    gitsi_status_carry(request, STATUS_TYPE_UNTRACKED, NULL, &category, "Untracked");
+    
+    gitsi_renames_free(&index_renames);
+    gitsi_renames_free(&workdir_renames);
+}
+
+/* Is the directory of the given length one of the list of a sparse cone? */
+bool gitsi_sparse_cone_contains(char *const *list, size_t count, const char *directory, size_t length) {
+    for (size_t i = 0; i < count; i++) {
+        if (strncmp(list[i], directory, length) == 0 && list[i][length] == '\0')return true;
+    }
+    return false;
+}
+
+/* Add a directory to a list of a sparse cone, unless it is in there already */
+void gitsi_sparse_cone_add(char ***list, size_t *count, const char *directory, size_t length) {
+    if (gitsi_sparse_cone_contains(*list, *count, directory, length))return;
+    *list = realloc(*list, (*count + 1) * sizeof(char*));
+    (*list)[(*count)++] = strndup(directory, length);
+}
+
+void gitsi_sparse_cone_free(gitsi_sparse_cone *cone) {
+    for (size_t i = 0; i < cone->recursive_count; i++) {
+        free(cone->recursive[i]);
+    }
+    for (size_t i = 0; i < cone->parent_count; i++) {
+        free(cone->parents[i]);
+    }
+    free(cone->recursive);
+    free(cone->parents);
+    memset(cone, 0, sizeof(gitsi_sparse_cone));
+}
+
+/* Read the patterns of a sparse checkout in cone mode. Returns false if the
+ * checkout is not sparse or not in cone mode, or if the patterns are not the
+ * ones that git writes in cone mode. The whole workdir is read then */
+bool gitsi_sparse_cone_read(git_repository *repo, gitsi_sparse_cone *cone) {
+    memset(cone, 0, sizeof(gitsi_sparse_cone));
+    // Cone mode is the default of git, the patterns are checked below anyway
+    git_config *config = NULL, *worktree_config = NULL;
+    int is_sparse = 0, is_cone = 1, has_worktree_config = 0;
+    if (git_repository_config_snapshot(&config, repo) == 0) {
+        git_config_get_bool(&is_sparse, config, "core.sparseCheckout");
+        git_config_get_bool(&is_cone, config, "core.sparseCheckoutCone");
+        git_config_get_bool(&has_worktree_config, config, "extensions.worktreeConfig");
+    }
+    git_config_free(config);
+    // git sparse-checkout writes the settings to config.worktree, which
+    // libgit2 does not read
+    char *config_path = NULL;
+    asprintf(&config_path, "%sconfig.worktree", git_repository_path(repo));
+    if (has_worktree_config && git_config_open_ondisk(&worktree_config, config_path) == 0) {
+        git_config_get_bool(&is_sparse, worktree_config, "core.sparseCheckout");
+        git_config_get_bool(&is_cone, worktree_config, "core.sparseCheckoutCone");
+    }
+    git_config_free(worktree_config);
+    free(config_path);
+    if (!is_sparse || !is_cone)return false;
+    char *file_path = NULL;
+    asprintf(&file_path, "%sinfo/sparse-checkout", git_repository_path(repo));
+    FILE *file = fopen(file_path, "r");
+    free(file_path);
+    if (file == NULL)return false;
+
+    // "/*" and "!/*/" are the files of the root, "/X/" is a directory and a
+    // "!/X/*/" after it means that only the files directly in X are wanted
+    char *line = NULL, *directory = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    bool is_valid = true, has_root = false;
+    while (is_valid && (length = getline(&line, &capacity, file)) >= 0) {
+        while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r'))line[--length] = '\0';
+        if (length == 0 || line[0] == '#' || strcmp(line, "!/*/") == 0)continue;
+        if (strcmp(line, "/*") == 0) {
+            has_root = true;
+            continue;
+        }
+        bool is_negated = line[0] == '!';
+        const char *pattern = line + is_negated;
+        const char *suffix = is_negated ? "/*/" : "/";
+        size_t pattern_length = strlen(pattern), suffix_length = strlen(suffix);
+        if (pattern[0] != '/' || pattern_length <= suffix_length + 1 ||
+            strcmp(pattern + pattern_length - suffix_length, suffix) != 0) {
+            is_valid = false;
+            continue;
+        }
+        // Glob characters in a name are escaped with a backslash
+        size_t end = pattern_length - suffix_length, directory_length = 0;
+        directory = realloc(directory, end);
+        for (size_t i = 1; i < end; i++) {
+            char c = pattern[i];
+            if (c == '\\' && i + 1 < end) {
+                c = pattern[++i];
+            } else if (strchr("*?[\\", c) != NULL) {
+                is_valid = false;
+            }
+            directory[directory_length++] = c;
+        }
+        if (is_negated) {
+            gitsi_sparse_cone_add(&cone->parents, &cone->parent_count, directory, directory_length);
+        } else {
+            gitsi_sparse_cone_add(&cone->recursive, &cone->recursive_count, directory, directory_length);
+        }
+    }
+    free(line);
+    free(directory);
+    fclose(file);
+
+    // The directories with only their files are no recursive ones, and every
+    // directory above one of the cone has to be a parent
+    size_t kept = 0;
+    for (size_t i = 0; i < cone->recursive_count; i++) {
+        const char *recursive = cone->recursive[i];
+        if (gitsi_sparse_cone_contains(cone->parents, cone->parent_count, recursive, strlen(recursive))) {
+            free(cone->recursive[i]);
+            continue;
+        }
+        cone->recursive[kept++] = cone->recursive[i];
+    }
+    cone->recursive_count = kept;
+    for (size_t list = 0; list < 2 && is_valid; list++) {
+        char **directories = list == 0 ? cone->recursive : cone->parents;
+        size_t count = list == 0 ? cone->recursive_count : cone->parent_count;
+        for (size_t i = 0; i < count && is_valid; i++) {
+            for (const char *slash = strchr(directories[i], '/'); slash != NULL && is_valid; slash = strchr(slash + 1, '/')) {
+                is_valid = gitsi_sparse_cone_contains(cone->parents, cone->parent_count, directories[i],
+                                                      (size_t)(slash - directories[i]));
+            }
+        }
+    }
+    if (!is_valid || !has_root) {
+        gitsi_sparse_cone_free(cone);
+        return false;
+    }
+    gitsi_sparse_cone_add(&cone->parents, &cone->parent_count, "", 0);
+    qsort(cone->recursive, cone->recursive_count, sizeof(char*), gitsi_string_compare);
+    qsort(cone->parents, cone->parent_count, sizeof(char*), gitsi_string_compare);
+    return true;
+}
+
+/* Compare shard paths by path for qsort */
+int gitsi_shard_path_compare(const void *a, const void *b) {
+    return strcmp(((const gitsi_shard_path *)a)->path, ((const gitsi_shard_path *)b)->path);
+}
+
+/* Order shard paths by their weight, the heaviest first */
+int gitsi_shard_weight_compare(const void *a, const void *b) {
+    size_t x = ((const gitsi_shard_path *)a)->weight, y = ((const gitsi_shard_path *)b)->weight;
+    return x < y ? 1 : (x > y ? -1 : 0);
+}
+
+/* Append `path` to the shard paths and return it */
+gitsi_shard_path *gitsi_shard_path_append(gitsi_shard_path **paths, size_t *count, size_t *capacity, char *path) {
+    if (*count == *capacity) {
+        *capacity = MAX(*capacity * 2, 64);
+        *paths = realloc(*paths, *capacity * sizeof(gitsi_shard_path));
+    }
+    gitsi_shard_path *appended = &(*paths)[(*count)++];
+    *appended = (gitsi_shard_path){ .path = path };
+    return appended;
+}
+
+/* Append the children of the directory `prefix` to the shard paths. The
+ * prefix is "" for the root and ends with a slash otherwise. Tracked children
+ * are weighted by their files in the index, the ones that are only in the
+ * workdir count as one */
+void gitsi_shard_children(git_index *index, const char *workdir, const char *prefix,
+                          gitsi_shard_path **paths, size_t *count, size_t *capacity) {
+    size_t first = *count;
+    size_t prefix_length = strlen(prefix), position = 0;
+    size_t maxi = git_index_entrycount(index);
+    if (prefix_length > 0 && git_index_find_prefix(&position, index, prefix) != 0)position = maxi;
+    // The entries below a child are next to each other in the sorted index
+    for (size_t i = position; i < maxi; i++) {
+        const char *path = git_index_get_byindex(index, i)->path;
+        if (strncmp(path, prefix, prefix_length) != 0)break;
+        const char *slash = strchr(path + prefix_length, '/');
+        size_t length = slash != NULL ? (size_t)(slash - path) : strlen(path);
+        gitsi_shard_path *child = *count > first ? &(*paths)[*count - 1] : NULL;
+        if (child == NULL || strncmp(child->path, path, length) != 0 || child->path[length] != '\0') {
+            child = gitsi_shard_path_append(paths, count, capacity, strndup(path, length));
+        }
+        child->weight += 1;
+        child->is_tree |= slash != NULL;
+    }
+    
+    char *directory = NULL;
+    asprintf(&directory, "%s%s", workdir, prefix);
+    DIR *dir = opendir(directory);
+    free(directory);
+    struct dirent *dirent;
+    while (dir != NULL && (dirent = readdir(dir)) != NULL) {
+        const char *name = dirent->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || strcmp(name, ".git") == 0)continue;
+        char *path = NULL;
+        asprintf(&path, "%s%s", prefix, name);
+        gitsi_shard_path_append(paths, count, capacity, path)->weight = 1;
+    }
+    if (dir != NULL)closedir(dir);
+    
+    // Children that are in the index and in the workdir show up twice
+    qsort(*paths + first, *count - first, sizeof(gitsi_shard_path), gitsi_shard_path_compare);
+    size_t unique = first;
+    for (size_t i = first; i < *count; i++) {
+        gitsi_shard_path *child = &(*paths)[i];
+        gitsi_shard_path *previous = unique > first ? &(*paths)[unique - 1] : NULL;
+        if (previous != NULL && strcmp(previous->path, child->path) == 0) {
+            previous->weight = MAX(previous->weight, child->weight);
+            previous->is_tree |= child->is_tree;
+            free(child->path);
+            continue;
+        }
+        (*paths)[unique++] = *child;
+    }
+    *count = unique;
+}
+
+/* The paths below which the workdir of a sparse cone is read: the recursive
+ * directories and the files directly in the parent directories. Other
+ * directories are outside of the cone, so neither their skip-worktree
+ * entries nor the untracked files in them are looked at */
+void gitsi_sparse_cone_paths(const gitsi_sparse_cone *cone, git_index *index, const char *workdir,
+                             gitsi_shard_path **paths, size_t *count, size_t *capacity) {
+    for (size_t i = 0; i < cone->parent_count; i++) {
+        char *prefix = NULL;
+        asprintf(&prefix, "%s%s", cone->parents[i], cone->parents[i][0] != '\0' ? "/" : "");
+        size_t first = *count, kept = *count;
+        gitsi_shard_children(index, workdir, prefix, paths, count, capacity);
+        free(prefix);
+        for (size_t j = first; j < *count; j++) {
+            gitsi_shard_path *child = &(*paths)[j];
+            const char *key = child->path;
+            bool is_recursive = bsearch(&key, cone->recursive, cone->recursive_count, sizeof(char*),
+                                        gitsi_string_compare) != NULL;
+            bool is_directory = child->is_tree;
+            if (!is_recursive && !is_directory) {
+                char *full_path = NULL;
+                asprintf(&full_path, "%s%s", workdir, child->path);
+                struct stat file_stat;
+                is_directory = lstat(full_path, &file_stat) == 0 && S_ISDIR(file_stat.st_mode);
+                free(full_path);
+            }
+            // Parent directories are read for their own files above
+            if (is_recursive || !is_directory) {
+                (*paths)[kept++] = *child;
+            } else {
+                free(child->path);
+            }
+        }
+        *count = kept;
+    }
+}
+
+/* Split the workdir into at most `thread_count` shards of about the same
+ * number of tracked files. The top level directories are the shards, a
+ * directory that is more than a fair share of one worker is split into its
+ * children. With a sparse `cone`, only the paths of the cone are read, in
+ * one shard if the repository is small. Returns false if sharding would not
+ * pay off, because the repository is small or there is nothing to split */
+bool gitsi_status_plan_shards(gitsi_status_request *request, const gitsi_sparse_cone *cone, size_t thread_count,
+                              gitsi_status_shard *shards, size_t *shard_count) {
+    const char *workdir = git_repository_workdir(request->repo);
+    bool is_split = thread_count >= 2 && git_index_entrycount(request->index) >= STATUS_SHARD_MIN_ENTRIES;
+    if (workdir == NULL || (!is_split && cone == NULL))return false;
+    gitsi_shard_path *paths = NULL;
+    size_t count = 0, capacity = 0, total = 0;
+    if (cone != NULL) {
+        gitsi_sparse_cone_paths(cone, request->index, workdir, &paths, &count, &capacity);
+    } else {
+        gitsi_shard_children(request->index, workdir, "", &paths, &count, &capacity);
+    }
+    for (size_t i = 0; i < count; i++) {
+        total += paths[i].weight;
+    }
+    while (is_split && count < STATUS_SHARD_MAX_PATHS) {
+        size_t heaviest = count;
+        for (size_t i = 0; i < count; i++) {
+            if (paths[i].is_tree && (heaviest == count || paths[i].weight > paths[heaviest].weight))heaviest = i;
+        }
+        if (heaviest == count || paths[heaviest].weight * thread_count <= total)break;
+        // A directory that is a file or a link in the workdir now is read as
+        // a whole, so that its new type is found
+        char *full_path = NULL;
+        asprintf(&full_path, "%s%s", workdir, paths[heaviest].path);
+        struct stat file_stat;
+        bool is_directory = lstat(full_path, &file_stat) == 0 && S_ISDIR(file_stat.st_mode);
+        free(full_path);
+        if (!is_directory) {
+            paths[heaviest].is_tree = false;
+            continue;
+        }
+        char *prefix = NULL;
+        asprintf(&prefix, "%s/", paths[heaviest].path);
+        free(paths[heaviest].path);
+        paths[heaviest] = paths[--count];
+        gitsi_shard_children(request->index, workdir, prefix, &paths, &count, &capacity);
+        free(prefix);
+    }
+    // Without any path the shard would read the whole workdir
+    if (count == 0 || (count < 2 && cone == NULL)) {
+        for (size_t i = 0; i < count; i++) {
+            free(paths[i].path);
+        }
+        free(paths);
+        return false;
+    }
+    
+    // The heaviest paths first, each to the shard with the least work so far
+    qsort(paths, count, sizeof(gitsi_shard_path), gitsi_shard_weight_compare);
+    // A sparse checkout that is too small to split is read by one shard
+    *shard_count = is_split ? MIN(thread_count, count) : 1;
+    for (size_t i = 0; i < *shard_count; i++) {
+        shards[i].pathspec = calloc(count, sizeof(char*));
+    }
+    for (size_t i = 0; i < count; i++) {
+        gitsi_status_shard *lightest = &shards[0];
+        for (size_t j = 1; j < *shard_count; j++) {
+            if (shards[j].weight < lightest->weight)lightest = &shards[j];
+        }
+        lightest->pathspec[lightest->pathspec_count++] = paths[i].path;
+        lightest->weight += paths[i].weight;
+    }
+    free(paths);
+    return true;
+}
+
+/* Read the workdir status of a shard. libgit2 does not share the state of
+ * a repository between threads, so every shard opens its own */
+void *gitsi_status_shard_worker(void *payload) {
+    gitsi_status_shard *shard = payload;
+    git_repository *repo = shard->shared_repo;
+    if (repo == NULL) {
+        shard->error = git_repository_open(&shard->repo, shard->repo_path);
+        if (shard->error != 0)return NULL;
+        repo = shard->repo;
+    }
+    git_status_options statusopt = GIT_STATUS_OPTIONS_INIT;
+    statusopt.show = GIT_STATUS_SHOW_WORKDIR_ONLY;
+    statusopt.flags = GIT_STATUS_OPT_INCLUDE_UNTRACKED | GIT_STATUS_OPT_SORT_CASE_SENSITIVELY |
+    GIT_STATUS_OPT_DISABLE_PATHSPEC_MATCH;
+    statusopt.pathspec.strings = shard->pathspec;
+    statusopt.pathspec.count = shard->pathspec_count;
+    shard->error = git_status_list_new(&shard->status, repo, &statusopt);
+    return NULL;
+}
+
+/* Read the workdir in shards by workers, while this thread compares HEAD
+ * with the index and reads the first shard. The workdir entries of the shards are merged by path, so
+ * they are classified as if they were read at once. Returns false if a shard
+ * failed, the status is read in one go then */
+bool gitsi_read_status_sharded(gitsi_status_request *request, gitsi_status_shard *shards, size_t shard_count) {
+    double started_at = gitsi_now_ms();
+    const char *repo_path = git_repository_path(request->repo);
+    size_t path_count = 0;
+    shards[0].shared_repo = request->repo;
+    for (size_t i = 0; i < shard_count; i++) {
+        shards[i].repo_path = repo_path;
+        if (i > 0) {
+            shards[i].is_running = pthread_create(&shards[i].thread, NULL, gitsi_status_shard_worker, &shards[i]) == 0;
+        }
+        path_count += shards[i].pathspec_count;
+    }
+    
+    git_status_options statusopt = GIT_STATUS_OPTIONS_INIT;
+    statusopt.show = GIT_STATUS_SHOW_INDEX_ONLY;
+    statusopt.flags = GIT_STATUS_OPT_SORT_CASE_SENSITIVELY;
+    git_status_list *index_status = NULL;
+    int error = git_status_list_new(&index_status, request->repo, &statusopt);
+    
+    // The first shard and the ones without a worker are read here. If
+    // anything failed, the status is read in one go, which reports the error
+    bool failed = error != 0;
+    git_status_list *workdir_lists[STATUS_MAX_SHARDS];
+    for (size_t i = 0; i < shard_count; i++) {
+        if (shards[i].is_running) {
+            pthread_join(shards[i].thread, NULL);
+        } else {
+            gitsi_status_shard_worker(&shards[i]);
+        }
+        failed |= shards[i].error != 0;
+        workdir_lists[i] = shards[i].status;
+    }
+    GITSI_LOG(GITSI_LOG_DEBUG, "status: %zu shards with %zu paths read in %.1f ms%s", shard_count, path_count,
+              gitsi_now_ms() - started_at, failed ? ", a shard failed" : "");
+    
+    if (!failed) {
+        git_oid_cpy(&request->index_checksum, git_index_checksum(request->index));
+        gitsi_head_tree_id(request->repo, &request->head_tree);
+        gitsi_status_view index_view, workdir_view;
+        gitsi_status_view_init(&index_view, &index_status, 1);
+        gitsi_status_view_init(&workdir_view, workdir_lists, shard_count);
+        gitsi_classify_status(request, &index_view, &workdir_view);
+        gitsi_status_view_free(&index_view);
+        gitsi_status_view_free(&workdir_view);
+    }
+    
+    for (size_t i = 0; i < shard_count; i++) {
+        git_status_list_free(shards[i].status);
+        git_repository_free(shards[i].repo);
+        for (size_t j = 0; j < shards[i].pathspec_count; j++) {
+            free(shards[i].pathspec[j]);
+        }
+        free(shards[i].pathspec);
+    }
+    git_status_list_free(index_status);
+    return !failed;
+}
+
+/* lstat() the index entries of a preload worker. The results are not kept,
+ * the lstat() only fills the stat cache of the kernel */
+void *gitsi_preload_worker(void *payload) {
+    gitsi_preload *preload = payload;
+    for (size_t i = preload->first; i < preload->last; i++) {
+        const git_index_entry *entry = git_index_get_byindex(preload->index, i);
+        // The status does not lstat() these either
+        if (GIT_INDEX_ENTRY_STAGE(entry) != 0 || entry->mode == GIT_FILEMODE_COMMIT ||
+            entry->flags_extended & (GIT_INDEX_ENTRY_SKIP_WORKTREE | GIT_INDEX_ENTRY_INTENT_TO_ADD))continue;
+        char *full_path = NULL;
+        asprintf(&full_path, "%s%s", preload->workdir, entry->path);
+        struct stat file_stat;
+        (void)lstat(full_path, &file_stat);
+        free(full_path);
+    }
+    return NULL;
+}
+
+/* lstat() all index entries with several workers to warm up the stat cache,
+ * like core.preloadIndex of git. libgit2 compares the workdir with the index
+ * one file after the other, which is slow if every lstat() waits for a
+ * network or overlay filesystem. After the preload its walk finds their
+ * stat data in the cache. Unlike git, nothing is marked up to date: the
+ * status still compares every file itself */
+void gitsi_status_preload(gitsi_status_request *request) {
+    double started_at = gitsi_now_ms();
+    const char *workdir = git_repository_workdir(request->repo);
+    if (workdir == NULL || git_index_read(request->index, false) != 0)return;
+    size_t count = git_index_entrycount(request->index);
+    size_t thread_count = MIN(count / PRELOAD_ENTRIES_PER_THREAD, PRELOAD_MAX_THREADS);
+    if (thread_count < 2)return;
+    
+    gitsi_preload preloads[PRELOAD_MAX_THREADS];
+    bool is_running[PRELOAD_MAX_THREADS];
+    for (size_t i = 0; i < thread_count; i++) {
+        preloads[i] = (gitsi_preload){
+            .index = request->index,
+            .workdir = workdir,
+            .first = count * i / thread_count,
+            .last = count * (i + 1) / thread_count,
+        };
+        is_running[i] = pthread_create(&preloads[i].thread, NULL, gitsi_preload_worker, &preloads[i]) == 0;
+    }
+    for (size_t i = 0; i < thread_count; i++) {
+        if (is_running[i]) {
+            pthread_join(preloads[i].thread, NULL);
+        } else {
+            gitsi_preload_worker(&preloads[i]);
+        }
+    }
+    GITSI_LOG(GITSI_LOG_DEBUG, "preload: %zu index entries, %zu workers in %.1f ms",
+              count, thread_count, gitsi_now_ms() - started_at);
+}
+
+/* Use libgit to read the repository status and classify it into the
+ * Index, Workspace and Untracked sections. Large repositories are read in
+ * shards by several workers, sparse checkouts only in their cone */
+void gitsi_read_status(gitsi_status_request *request) {
+    size_t thread_count = request->thread_count;
+    if (thread_count == 0) {
+        long processors = sysconf(_SC_NPROCESSORS_ONLN);
+        thread_count = processors > 0 ? (size_t)processors : 1;
+    }
+    thread_count = MIN(thread_count, STATUS_MAX_SHARDS);
+    if (request->preload_index)gitsi_status_preload(request);
+    gitsi_status_shard shards[STATUS_MAX_SHARDS];
+    memset(shards, 0, sizeof(shards));
+    size_t shard_count = 0;
+    gitsi_sparse_cone cone;
+    bool is_sparse = gitsi_sparse_cone_read(request->repo, &cone);
+    bool is_read = gitsi_status_plan_shards(request, is_sparse ? &cone : NULL, thread_count, shards, &shard_count) &&
+    gitsi_read_status_sharded(request, shards, shard_count);
+    gitsi_sparse_cone_free(&cone);
+    if (is_read)return;
+    
+    git_status_options statusopt = GIT_STATUS_OPTIONS_INIT;
+    statusopt.show = GIT_STATUS_SHOW_INDEX_AND_WORKDIR;
+    statusopt.flags = GIT_STATUS_OPT_INCLUDE_UNTRACKED |
+    GIT_STATUS_OPT_SORT_CASE_SENSITIVELY;
+    git_status_list *status = NULL;
+    int error = git_status_list_new(&status, request->repo, &statusopt);
+    if (gitsi_status_failed(request, "git status list", error))return;
+    // The status reads the index again if it changed on disk
+    git_oid_cpy(&request->index_checksum, git_index_checksum(request->index));
+    gitsi_head_tree_id(request->repo, &request->head_tree);
+    
+    gitsi_status_view view;
+    gitsi_status_view_init(&view, &status, 1);
+    gitsi_classify_status(request, &view, &view);
+    gitsi_status_view_free(&view);
+    git_status_list_free(status);
+}
+
+/* The entries of the context were replaced with the ones of the request.
+ * An error of the request is shown in the output pane, or on stderr without
+ * curses. Returns false if there was one */
+bool gitsi_status_taken(gitsi_context *context, gitsi_status_request *request) {
+    context->renames_skipped = request->renames_skipped;
+    git_oid_cpy(&context->status_index_checksum, &request->index_checksum);
+    git_oid_cpy(&context->status_head_tree, &request->head_tree);
+    context->status_generation += 1;
+    gitsi_diffstat_submit(context);
+    context->status_failed = request->error != NULL;
+    if (request->error == NULL)return true;
+    if (stdscr != NULL && !isendwin()) {
+        char *line;
+        asprintf(&line, "Could not read the status: %s", request->error);
+        gitsi_output_append(context, line);
+        free(line);
+        context->output.is_visible = true;
+    } else {
+        fprintf(stderr, "Could not read the status: %s\n", request->error);
+    }
+    free(request->error);
+    request->error = NULL;
+    return false;
+}
+
+/* Read the repository status into the entries of the context. Returns false
+ * if it could not be read */
+bool gitsi_get_repository_status(gitsi_context *context) {
+    gitsi_status_loader_stop(context);
+    if(context->entries.count > 0) {
+        gitsi_free_entries(context);
+    }
+    if (context->repo_index != NULL) {
+        git_index_free(context->repo_index);
+        context->repo_index = NULL;
+    }
+    int error = git_repository_index(&context->repo_index, context->repo);
+    gitsi_check_error("git repository index", error);
+    
+    gitsi_status_request request = gitsi_status_request_for(context, context->repo, context->repo_index, &context->entries);
+    double started_at = gitsi_now_ms();
+    context->status_read_at = time(NULL);
+    gitsi_read_status(&request);
+    bool is_read = gitsi_status_taken(context, &request);
+    GITSI_LOG(GITSI_LOG_INFO, "full status: %u entries in %.1f ms", context->entries.count, gitsi_now_ms() - started_at);
+    return is_read;
+}
+
+/* The pathspec that reads a path again whose index entry may have changed.
+ * libgit2 only finds untracked files below a directory pathspec, and a
+ * directory without tracked files is one untracked entry, so this is the
+ * topmost directory of the path without index entries, or else its parent.
+ * An untracked directory of the previous status that contains the path is
+ * read again as a whole */
+void gitsi_reload_pathspec(gitsi_context *context, char *const *untracked_dirs, size_t dir_count,
+                           const char *path, char **pathspec, size_t *count) {
+    char *prefix = strdup(path);
+    char *parent = NULL;
+    for (char *slash = strchr(prefix, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        // The prefix up to and with the slash
+        char saved = slash[1];
+        slash[1] = '\0';
+        size_t position;
+        bool is_tracked = git_index_find_prefix(&position, context->repo_index, prefix) == 0;
+        const char *key = prefix;
+        bool was_untracked = bsearch(&key, untracked_dirs, dir_count, sizeof(char*), gitsi_string_compare) != NULL;
+        slash[1] = saved;
+        if (!is_tracked || was_untracked) {
+            pathspec[(*count)++] = strndup(prefix, (size_t)(slash - prefix));
+        }
+        if (!is_tracked) {
+            free(prefix);
+            return;
+        }
+        parent = slash;
+    }
+    pathspec[(*count)++] = parent != NULL ? strndup(prefix, (size_t)(parent - prefix)) : strdup(path);
+    free(prefix);
+}
+
+/* Was the file or directory changed or created at `since` or later? */
+bool gitsi_path_changed(const char *full_path, time_t since) {
+    struct stat file_stat;
+    return lstat(full_path, &file_stat) == 0 && (file_stat.st_mtime >= since || file_stat.st_ctime >= since);
+}
+
+/* Compare the index entries of a worker and the directories that hold them,
+ * as a new or deleted file changes its directory */
+void *gitsi_workdir_check_worker(void *payload) {
+    gitsi_workdir_check *check = payload;
+    size_t workdir_length = strlen(check->workdir);
+    char *full_path = NULL;
+    size_t full_capacity = 0;
+    const char *previous = "";
+    for (size_t i = check->first; i < check->last && !atomic_load(check->is_changed); i++) {
+        const git_index_entry *entry = git_index_get_byindex(check->index, i);
+        if (entry->flags_extended & GIT_INDEX_ENTRY_SKIP_WORKTREE)continue;
+        const char *path = entry->path;
+        size_t length = strlen(path);
+        if (workdir_length + length + 1 > full_capacity) {
+            full_capacity = (workdir_length + length + 1) * 2;
+            full_path = realloc(full_path, full_capacity);
+        }
+        memcpy(full_path, check->workdir, workdir_length);
+        memcpy(full_path + workdir_length, path, length + 1);
+        bool is_changed = gitsi_path_changed(full_path, check->since);
+        // The index is sorted, so the directories that the path shares with
+        // the previous one were compared already
+        size_t common = 0;
+        for (size_t j = 0; path[j] != '\0' && path[j] == previous[j]; j++) {
+            if (path[j] == '/')common = j + 1;
+        }
+        for (size_t j = common; j < length && !is_changed; j++) {
+            if (path[j] != '/')continue;
+            full_path[workdir_length + j] = '\0';
+            is_changed = gitsi_path_changed(full_path, check->since);
+            full_path[workdir_length + j] = '/';
+        }
+        if (is_changed)atomic_store(check->is_changed, true);
+        previous = path;
+    }
+    free(full_path);
+    return NULL;
+}
+
+/* Did a file or directory of the workdir change since `since`? The index
+ * entries are compared with several workers, like the preload. Untracked
+ * directories are listed as one entry, so only they are compared themselves */
+bool gitsi_workdir_changed(gitsi_context *context, time_t since) {
+    const char *workdir = git_repository_workdir(context->repo);
+    if (workdir == NULL)return true;
+    since -= INDEX_RELOAD_CLOCK_SLACK;
+    if (gitsi_path_changed(workdir, since))return true;
+    atomic_bool is_changed;
+    atomic_init(&is_changed, false);
+    size_t count = git_index_entrycount(context->repo_index);
+    size_t thread_count = MAX(MIN(count / PRELOAD_ENTRIES_PER_THREAD, PRELOAD_MAX_THREADS), 1);
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    thread_count = MIN(thread_count, processors > 0 ? (size_t)processors : 1);
+    gitsi_workdir_check checks[PRELOAD_MAX_THREADS];
+    bool is_running[PRELOAD_MAX_THREADS];
+    for (size_t i = 0; i < thread_count; i++) {
+        checks[i] = (gitsi_workdir_check){
+            .index = context->repo_index,
+            .workdir = workdir,
+            .first = count * i / thread_count,
+            .last = count * (i + 1) / thread_count,
+            .since = since,
+            .is_changed = &is_changed,
+        };
+        is_running[i] = i > 0 && pthread_create(&checks[i].thread, NULL, gitsi_workdir_check_worker, &checks[i]) == 0;
+    }
+    for (size_t i = 0; i < thread_count; i++) {
+        if (is_running[i]) {
+            pthread_join(checks[i].thread, NULL);
+        } else {
+            gitsi_workdir_check_worker(&checks[i]);
+        }
+    }
+    
+    for (uint32_t i = 0; i < context->entries.count && !atomic_load(&is_changed); i++) {
+        const char *path = gitsi_entry_path(context, i);
+        if (gitsi_entry_type(context, i) != STATUS_TYPE_UNTRACKED || path[strlen(path) - 1] != '/')continue;
+        char *full_path;
+        asprintf(&full_path, "%s%s", workdir, path);
+        if (gitsi_path_changed(full_path, since))atomic_store(&is_changed, true);
+        free(full_path);
+    }
+    return atomic_load(&is_changed);
+}
+
+/* After actions that only write the index, i.e. staging, `add -p` or a
+ * commit, the workdir is the same as before and does not have to be walked
+ * again. The index section only needs HEAD and the index. A workspace or
+ * untracked entry can only change for a path whose index entry changed, which
+ * differs between the HEAD tree of the last status and the index now, or was
+ * in the last index section, or for one of the `paths` that changed in the
+ * workdir. Only these paths are read from the workdir, the other entries are
+ * kept. The index is read again from disk, so that changes of other programs
+ * are compared too. Returns false if the full status has to be read */
+bool gitsi_reload_paths(gitsi_context *context, char *const *paths, size_t path_count) {
+    if (context->loader.is_running || context->rename_mode == GITSI_RENAMES_WORKDIR ||
+        context->repo_index == NULL || context->entries.count == 0 || context->status_failed)return false;
+    if (git_index_read(context->repo_index, true) != 0)return false;
+    git_oid head_tree;
+    gitsi_head_tree_id(context->repo, &head_tree);
+    bool head_moved = !git_oid_equal(&head_tree, &context->status_head_tree);
+    if (path_count == 0 && !head_moved &&
+        git_oid_equal(git_index_checksum(context->repo_index), &context->status_index_checksum))return true;
+    
+    // If HEAD moved, the index is compared with the tree of the last status
+    git_diff *diff = NULL;
+    if (head_moved) {
+        git_tree *tree = NULL;
+        if (!git_oid_is_zero(&context->status_head_tree) &&
+            git_tree_lookup(&tree, context->repo, &context->status_head_tree) != 0)return false;
+        int error = git_diff_tree_to_index(&diff, context->repo, tree, context->repo_index, NULL);
+        git_tree_free(tree);
+        if (error != 0)return false;
+    }
+    
+    git_status_options statusopt = GIT_STATUS_OPTIONS_INIT;
+    statusopt.show = GIT_STATUS_SHOW_INDEX_ONLY;
+    statusopt.flags = GIT_STATUS_OPT_SORT_CASE_SENSITIVELY;
+    git_status_list *index_status = NULL;
+    int error = git_status_list_new(&index_status, context->repo, &statusopt);
+    if (error != 0) {
+        git_diff_free(diff);
+        return false;
+    }
+    
+    // The paths of the index section now are read too, so that their flags
+    // can be combined with the ones of the workdir
+    gitsi_entries *entries = &context->entries;
+    size_t diff_count = diff != NULL ? git_diff_num_deltas(diff) : 0;
+    size_t index_count = git_status_list_entrycount(index_status);
+    const char **changed = calloc(2 * (diff_count + index_count + entries->count) + path_count + 1, sizeof(char*));
+    size_t changed_count = 0;
+    for (size_t i = 0; i < path_count; i++) {
+        changed[changed_count++] = paths[i];
+    }
+    for (size_t i = 0; i < diff_count + index_count; i++) {
+        const git_diff_delta *delta = i < diff_count ? git_diff_get_delta(diff, i) : git_status_byindex(index_status, i - diff_count)->head_to_index;
+        if (delta == NULL)continue;
+        changed[changed_count++] = delta->old_file.path;
+        changed[changed_count++] = delta->new_file.path;
+    }
+    char **untracked_dirs = calloc(entries->count + 1, sizeof(char*));
+    size_t dir_count = 0;
+    for (uint32_t i = 0; i < entries->count; i++) {
+        enum GITSI_STATUS_TYPE type = gitsi_entry_type(context, i);
+        const char *path = gitsi_entry_path(context, i);
+        if (type == STATUS_TYPE_INDEX) {
+            changed[changed_count++] = path;
+            const char *old_path = gitsi_entry_old_path(context, i);
+            if (old_path != NULL)changed[changed_count++] = old_path;
+        } else if (type == STATUS_TYPE_UNTRACKED && path[strlen(path) - 1] == '/') {
+            untracked_dirs[dir_count++] = (char*)path;
+        }
+    }
+    qsort(untracked_dirs, dir_count, sizeof(char*), gitsi_string_compare);
+    
+    char **pathspec = calloc(2 * changed_count + 1, sizeof(char*));
+    size_t pathspec_count = 0;
+    if (changed_count <= INDEX_RELOAD_LIMIT) {
+        for (size_t i = 0; i < changed_count; i++) {
+            gitsi_reload_pathspec(context, untracked_dirs, dir_count, changed[i], pathspec, &pathspec_count);
+        }
+    }
+    qsort(pathspec, pathspec_count, sizeof(char*), gitsi_string_compare);
+    size_t unique = 0;
+    for (size_t i = 0; i < pathspec_count; i++) {
+        if (unique > 0 && strcmp(pathspec[unique - 1], pathspec[i]) == 0) {
+            free(pathspec[i]);
+            continue;
+        }
+        pathspec[unique++] = pathspec[i];
+    }
+    pathspec_count = unique;
+    
+    // Without any changed path there is nothing to read from the workdir, an
+    // empty pathspec would read all of it
+    bool is_reloaded = changed_count <= INDEX_RELOAD_LIMIT;
+    GITSI_LOG(GITSI_LOG_DEBUG, "reload: %zu changed paths, %zu pathspecs%s", changed_count, pathspec_count,
+              is_reloaded ? "" : ", reading the full status");
+    git_status_list *workdir_status = NULL;
+    if (is_reloaded && pathspec_count > 0) {
+        statusopt.show = GIT_STATUS_SHOW_WORKDIR_ONLY;
+        statusopt.flags = GIT_STATUS_OPT_INCLUDE_UNTRACKED | GIT_STATUS_OPT_SORT_CASE_SENSITIVELY |
+        GIT_STATUS_OPT_DISABLE_PATHSPEC_MATCH;
+        statusopt.pathspec.strings = pathspec;
+        statusopt.pathspec.count = pathspec_count;
+        error = git_status_list_new(&workdir_status, context->repo, &statusopt);
+        // The full status reports the error
+        if (error != 0)is_reloaded = false;
+    }
+    
+    if (is_reloaded) {
+        gitsi_entries reloaded = { 0 };
+        gitsi_status_request request = gitsi_status_request_for(context, context->repo, context->repo_index, &reloaded);
+        request.previous = entries;
+        request.pathspec = pathspec;
+        request.pathspec_count = pathspec_count;
+        git_oid_cpy(&request.index_checksum, git_index_checksum(context->repo_index));
+        git_oid_cpy(&request.head_tree, &head_tree);
+        gitsi_status_view index_view, workdir_view;
+        gitsi_status_view_init(&index_view, &index_status, 1);
+        gitsi_status_view_init(&workdir_view, &workdir_status, 1);
+        gitsi_classify_status(&request, &index_view, workdir_status != NULL ? &workdir_view : NULL);
+        gitsi_status_view_free(&index_view);
+        gitsi_status_view_free(&workdir_view);
+        gitsi_free_entries(context);
+        context->entries = reloaded;
+        gitsi_status_taken(context, &request);
+    }
+    
+    for (size_t i = 0; i < pathspec_count; i++) {
+        free(pathspec[i]);
+    }
+    free(pathspec);
+    free(untracked_dirs);
+    free(changed);
+    git_status_list_free(workdir_status);
+    git_status_list_free(index_status);
+    git_diff_free(diff);
+    return is_reloaded;
+}
+
+/* Go through all entries and filter them by filename. The results are stored
+ * in `context->rows` */
+void gitsi_filter_entries(gitsi_context *context) {
+    // Directory rows are rebuilt below, so remember which one was selected
+    char *selected_directory = NULL;
+    enum GITSI_STATUS_TYPE selected_type = STATUS_TYPE_CATEGORY;
+    if (gitsi_row_is_directory(context->position)) {
+        selected_directory = strdup(gitsi_row_path(context, context->position));
+        selected_type = gitsi_row_type(context, context->position);
+        context->position = ROW_NONE;
+    }
+    // We're lazy. Instead of having to use realloc, we just reserve as much space for filtered
+    // rows as there are entries
+    free(context->rows);
+    context->rows = calloc(context->entries.count, sizeof(gitsi_row));
+    context->row_count = 0;
+    gitsi_filter *filter = gitsi_current_filter(context);
+    const uint32_t *order = gitsi_sort_entries(context);
+    for (uint32_t i = 0; i < context->entries.count; ++i) {
+        uint32_t entry = order[i];
+        // Headlines always match
+        bool is_headline = gitsi_entry_type(context, entry) == STATUS_TYPE_CATEGORY;
+        // the actual match
+        if (is_headline || gitsi_entry_is_visible(context, filter, entry)) {
+            context->rows[context->row_count] = entry;
+            context->row_count += 1;
+        }
+    }
+    
+    // The rows changed, so all cached row texts are stale now
+    context->list_generation += 1;
+    
+    if (context->is_tree_mode) {
+        gitsi_tree_build(context);
+    } else if (context->tree != NULL) {
+        gitsi_tree_free(context->tree);
+        context->tree = NULL;
+    }
+    
+    if (selected_directory != NULL) {
+        for (size_t i = 0; i < context->row_count; ++i) {
+            gitsi_row row = context->rows[i];
+            if (gitsi_row_is_directory(row) && gitsi_row_type(context, row) == selected_type &&
+                strcmp(gitsi_row_path(context, row), selected_directory) == 0) {
+                context->position = row;
+                break;
+            }
+        }
+        free(selected_directory);
+        if (context->position == ROW_NONE) {
+            gitsi_select_first_entry(context);
+        }
+    }
+}
+
+/* Print the startup timings of --trace */
+void gitsi_print_trace(gitsi_context *context) {
+    if (!context->is_trace)return;
+    fprintf(stderr, "first frame: %.1f ms\n", context->first_frame_at - context->started_at);
+    if (context->status_at > 0) {
+        fprintf(stderr, "full status: %.1f ms (%u entries%s)\n", context->status_at - context->started_at,
+                context->entries.count, context->loader.from_daemon ? ", from the daemon" : "");
+    }
+}
+
+/* Show the entries of a status that was just read. Without any, the list
+ * is empty and says why */
+void gitsi_show_status(gitsi_context *context) {
+    if (context->status_at == 0) {
+        context->status_at = gitsi_now_ms();
+    }
+    if (context->grep.is_active) {
+        gitsi_grep_start(context);
+    }
+    gitsi_filter_entries(context);
+    gitsi_carry_restore(context);
+}
+
+/* Read the status again after the index or HEAD changed. Unlike the daemon,
+ * gitsi does not watch the workdir, so if anything in it changed since the
+ * last status, it is read in full */
+bool gitsi_reload_index(gitsi_context *context) {
+    time_t checked_at = time(NULL);
+    if (context->repo_index == NULL)return false;
+    double started_at = gitsi_now_ms();
+    bool is_changed = gitsi_workdir_changed(context, context->status_read_at);
+    GITSI_LOG(GITSI_LOG_DEBUG, "reload: workdir compared in %.1f ms%s", gitsi_now_ms() - started_at,
+              is_changed ? ", it changed, reading the full status" : "");
+    if (is_changed)return false;
+    if (!gitsi_reload_paths(context, NULL, 0))return false;
+    context->status_read_at = checked_at;
+    return true;
+}
+
+/* Perform the git status and filter it */
+void gitsi_update_status(gitsi_context *context) {
+    double started_at = gitsi_now_ms();
+    gitsi_get_repository_status(context);
+    gitsi_read_branch(context);
+    gitsi_show_status(context);
+    context->status_work_ms += gitsi_now_ms() - started_at;
+}
+
+/* Update the status after an action that only wrote the index or HEAD */
+void gitsi_update_index(gitsi_context *context) {
+    double started_at = gitsi_now_ms();
+    if (!gitsi_reload_index(context)) {
+        context->status_work_ms += gitsi_now_ms() - started_at;
+        gitsi_update_status(context);
+        return;
+    }
+    gitsi_read_branch(context);
+    gitsi_show_status(context);
+    context->status_work_ms += gitsi_now_ms() - started_at;
+}
+
+// We need forward declarations here as the functions call each other
+void gitsi_checkout_entry(gitsi_context *context, gitsi_row row);
+
+// Staging hashes the files with a pool of workers, see Staging
+bool gitsi_stage_entries(gitsi_context *context, const uint32_t *leaves, size_t count, bool in_background);
+
+/* Stage everything below a directory row of the tree */
+bool gitsi_stage_directory(gitsi_context *context, gitsi_row row, bool in_background) {
+    uint32_t *leaves;
+    size_t count = gitsi_tree_collect(gitsi_row_node(context, row), &leaves);
+    bool is_done = gitsi_stage_entries(context, leaves, count, in_background);
+    free(leaves);
+    return is_done;
+}
+
+/* Stage or add an entry depending on the type of the file / entry. Returns
+ * false if it is staged in the background */
+bool gitsi_stage_entry(gitsi_context *context, gitsi_row row, bool in_background) {
+    if (gitsi_row_type(context, row) == STATUS_TYPE_CATEGORY)return true;
+    if (gitsi_row_is_directory(row)) {
+        return gitsi_stage_directory(context, row, in_background);
+    }
+    uint32_t entry = row;
+    return gitsi_stage_entries(context, &entry, 1, in_background);
+}
+
+/* Stage all marked entries as one batch */
+bool gitsi_stage_marked(gitsi_context *context, bool in_background) {
+    if (context->stage.is_running)return false;
+    gitsi_tree_mark_leaves(context);
+    uint32_t *leaves = calloc(context->entries.count + 1, sizeof(uint32_t));
+    size_t count = 0;
+    size_t words = gitsi_bit_words(context->entries.count);
+    for (size_t word = 0; word < words; word++) {
+        uint64_t bits = context->entries.marked[word];
+        while (bits != 0) {
+            leaves[count++] = (uint32_t)(word * 64 + (size_t)__builtin_ctzll(bits));
+            bits &= bits - 1;
+        }
+    }
+    context->stage.clears_marks = true;
+    bool is_done = gitsi_stage_entries(context, leaves, count, in_background);
+    free(leaves);
+    return is_done;
+}
+
+/* Unstage an entry that is in the workspace */
+void gitsi_unstage_workspace(gitsi_context *context, gitsi_row row) {
+    
+    // if the entry is a deleted entry, what we really want to call
+    // is reset as we want to eradicate the deletion
+    // The same goes for the old path of a rename
+    if (context->entries.git_statuses[row] == GIT_STATUS_WT_DELETED ||
+        gitsi_entry_old_path(context, row) != NULL) {
+        gitsi_checkout_entry(context, row);
+        return;
+    }
+    
+    // Unstage in the workspace means delete
+    int error = git_index_remove_bypath(context->repo_index, gitsi_entry_path(context, row));
+    gitsi_check_error("git index remove bypath", error);
+}
+
+/* Unstage an entry that is on the index */
+void gitsi_unstage_index(gitsi_context *context, gitsi_row row) {
+    // Unstage in the index means workspace. This is kinda complicated.
+    // Renames reset both paths
+    const char *old_filename = gitsi_entry_old_path(context, row);
+    char *paths[] = { (char*)gitsi_entry_path(context, row), (char*)old_filename, };
+    
+    git_strarray pathspecs = { .strings = paths, .count = old_filename != NULL ? 2 : 1 };
+    git_reference *head;
+    git_object *head_commit;
+    
+    git_repository_head(&head, context->repo);
+    git_reference_peel(&head_commit, head, GIT_OBJ_COMMIT);
+    git_reset_default(context->repo, head_commit, &pathspecs);
+}
+
+/* Unstage an entry that is untracked. I.e. delete it */
+void gitsi_unstage_untracked(gitsi_context *context, gitsi_row row) {
+    const char *filename = gitsi_entry_path(context, row);
+    char *message;
+    asprintf(&message, "Delete File '%s'?", filename);
+    bool result = gitsi_dialog(context, (const char*)message);
+    free(message);
+    char *buffer;
+    asprintf(&buffer, "%s/%s", context->repo_dir, filename);
+    if (result) {
+        switch (util_is_regular_file(context->repo_dir, filename)) {
+            case FILE_TYPE_FILE:
+                remove(buffer);
+                break;
+            case FILE_TYPE_DIRECTORY: {
+                nftw(buffer, unlink_cb, 64, FTW_DEPTH | FTW_PHYS);
+                break;
+            }
+            case FILE_TYPE_OTHER:
+                return;
+        }
+        // build the full path
+    }
+    free(buffer);
+}
+
+/* Reset a list of index entries to HEAD with one call */
+void gitsi_reset_entries(gitsi_context *context, const uint32_t *leaves, size_t count) {
+    // Renames need room for both of their paths
+    char **paths = calloc(2 * count + 1, sizeof(char*));
+    size_t path_count = 0;
+    for (size_t i = 0; i < count; i++) {
+        paths[path_count++] = (char*)gitsi_entry_path(context, leaves[i]);
+        if (gitsi_entry_old_path(context, leaves[i]) != NULL) {
+            paths[path_count++] = (char*)gitsi_entry_old_path(context, leaves[i]);
+        }
+    }
+    git_strarray pathspecs = { .strings = paths, .count = path_count };
+    git_reference *head;
+    git_object *head_commit;
+    int error = git_repository_head(&head, context->repo);
+    gitsi_check_error("git repository head", error);
+    error = git_reference_peel(&head_commit, head, GIT_OBJ_COMMIT);
+    gitsi_check_error("git reference peel", error);
+    git_reset_default(context->repo, head_commit, &pathspecs);
+    git_object_free(head_commit);
+    git_reference_free(head);
+    free(paths);
+}
+
+/* Delete a list of untracked files and directories from the disk */
+void gitsi_delete_entries(gitsi_context *context, const uint32_t *leaves, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        const char *filename = gitsi_entry_path(context, leaves[i]);
+        char *buffer;
+        asprintf(&buffer, "%s/%s", context->repo_dir, filename);
+        switch (util_is_regular_file(context->repo_dir, filename)) {
+            case FILE_TYPE_FILE:
+                remove(buffer);
+                break;
+            case FILE_TYPE_DIRECTORY:
+                nftw(buffer, unlink_cb, 64, FTW_DEPTH | FTW_PHYS);
+                break;
+            case FILE_TYPE_OTHER:
+                break;
+        }
+        free(buffer);
+    }
+}
+
+/* Remove all changes of a list of entries with one checkout. Renames in the
+ * workspace restore the old path, in the index the new path is reset as well */
+void gitsi_checkout_entries(gitsi_context *context, const uint32_t *leaves, size_t count) {
+    char **paths = calloc(2 * count + 1, sizeof(char*));
+    size_t path_count = 0;
+    for (size_t i = 0; i < count; i++) {
+        const char *old_filename = gitsi_entry_old_path(context, leaves[i]);
+        if (old_filename == NULL || gitsi_entry_type(context, leaves[i]) == STATUS_TYPE_INDEX) {
+            paths[path_count++] = (char*)gitsi_entry_path(context, leaves[i]);
+        }
+        if (old_filename != NULL) {
+            paths[path_count++] = (char*)old_filename;
+        }
+    }
+    if (path_count > 0) {
+        git_checkout_options opts;
+        git_checkout_init_options(&opts, GIT_CHECKOUT_OPTIONS_VERSION);
+        opts.checkout_strategy = GIT_CHECKOUT_FORCE;
+        opts.paths.strings = paths;
+        opts.paths.count = path_count;
+        git_checkout_head(context->repo, &opts);
+    }
+    free(paths);
+}
+
+/* Unstage or delete everything below a directory row of the tree. Index entries
+ * are reset with one call, everything else is written with a single index write */
+void gitsi_unstage_directory(gitsi_context *context, gitsi_row row) {
+    uint32_t *leaves;
+    gitsi_tree_node *node = gitsi_row_node(context, row);
+    size_t count = gitsi_tree_collect(node, &leaves);
+    switch (node->type) {
+        case STATUS_TYPE_INDEX:
+            gitsi_reset_entries(context, leaves, count);
+            break;
+        case STATUS_TYPE_WORKSPACE: {
+            // Deletions and renames are restored, everything else is removed from the index
+            uint32_t *restore = calloc(count + 1, sizeof(uint32_t));
+            size_t restore_count = 0;
+            for (size_t i = 0; i < count; i++) {
+                if (context->entries.git_statuses[leaves[i]] == GIT_STATUS_WT_DELETED ||
+                    gitsi_entry_old_path(context, leaves[i]) != NULL) {
+                    restore[restore_count++] = leaves[i];
+                } else {
+                    int error = git_index_remove_bypath(context->repo_index, gitsi_entry_path(context, leaves[i]));
+                    gitsi_check_error("git index remove bypath", error);
+                }
+            }
+            int error = git_index_write(context->repo_index);
+            gitsi_check_error("git index write", error);
+            gitsi_checkout_entries(context, restore, restore_count);
+            free(restore);
+            break;
+        }
+        case STATUS_TYPE_UNTRACKED: {
+            char *message;
+            asprintf(&message, "Delete %zu files in '%s'?", count, node->path);
+            bool result = gitsi_dialog(context, (const char*)message);
+            free(message);
+            if (result) {
+                gitsi_delete_entries(context, leaves, count);
+            }
+            break;
+        }
+        case STATUS_TYPE_CATEGORY:
+            break;
+    }
+    free(leaves);
+}
+
+/* Unstage or delete an entry, depending on the type of a file */
+void gitsi_unstage_entry(gitsi_context *context, gitsi_row row) {
+    enum GITSI_STATUS_TYPE type = gitsi_row_type(context, row);
+    if (type == STATUS_TYPE_CATEGORY)return;
+    if (gitsi_row_is_directory(row)) {
+        gitsi_unstage_directory(context, row);
+        return;
+    }
+    switch (type) {
+        case STATUS_TYPE_WORKSPACE:
+            gitsi_unstage_workspace(context, row);
+            break;
+        case STATUS_TYPE_INDEX:
+            gitsi_unstage_index(context, row);
+            break;
+        case STATUS_TYPE_UNTRACKED:
+            gitsi_unstage_untracked(context, row);
+            break;
+        case STATUS_TYPE_CATEGORY:
+            break;
+    }
+    // Write out
+    int error = git_index_write(context->repo_index);
+    gitsi_check_error("git index write", error);
+}
+
+/* Checkout an entry, i.e. remove all changes. Directory rows of the tree
+ * check out everything below them */
+void gitsi_checkout_entry(gitsi_context *context, gitsi_row row) {
+    if (gitsi_row_is_directory(row)) {
+        uint32_t *leaves;
+        size_t count = gitsi_tree_collect(gitsi_row_node(context, row), &leaves);
+        gitsi_checkout_entries(context, leaves, count);
+        free(leaves);
+        return;
+    }
+    gitsi_checkout_entries(context, &row, 1);
+}
+
+/* Perform action `action` on all marked entries */
+void gitsi_action_on_marked(gitsi_context *context, 
+                            void action (gitsi_context *context, gitsi_row row)) {
+    size_t cursor_pos = gitsi_position_index(context);
+    
+    // After the action, many marked items, including probably cursor pos
+    // may have moved. We need a new position.
+    // We use the first non-marked item (including position) after position
+    bool found = false;
+    for (size_t i = cursor_pos; i < context->row_count; ++i) {
+        if (gitsi_row_type(context, context->rows[i]) == STATUS_TYPE_CATEGORY)continue;
+        if (gitsi_row_marked(context, context->rows[i]))continue;
+        cursor_pos = i;
+        found = true;
+        break;
+    }
+    
+    // Walk the bitset a word at a time, most words are empty
+    gitsi_tree_mark_leaves(context);
+    size_t words = gitsi_bit_words(context->entries.count);
+    for (size_t word = 0; word < words; word++) {
+        uint64_t bits = context->entries.marked[word];
+        while (bits != 0) {
+            uint32_t entry = (uint32_t)(word * 64 + (size_t)__builtin_ctzll(bits));
+            bits &= bits - 1;
+            action(context, entry);
+            gitsi_entry_set_marked(context, entry, false);
+        }
+    }
+    // Set the new position
+    if (found == false) {
+        gitsi_select_first_entry(context);
+    } else {
+        context->position = context->rows[cursor_pos];
+    }
+}
+
+// --------------------------------------------------
+#pragma mark Batch Mode
+// --------------------------------------------------
+
+int gitsi_batch_path_compare(const void *a, const void *b) {
+    return strcmp(((const gitsi_batch_path*)a)->path, ((const gitsi_batch_path*)b)->path);
+}
+
+/* Load the status and sort its paths. Renames can be found by both paths */
+void gitsi_batch_load(gitsi_context *context, gitsi_batch *batch) {
+    gitsi_get_repository_status(context);
+    gitsi_entries *entries = &context->entries;
+    free(batch->paths);
+    free(batch->entries);
+    free(batch->matched_by);
+    batch->paths = calloc(2 * (size_t)entries->count + 1, sizeof(gitsi_batch_path));
+    batch->entries = calloc((size_t)entries->count + 1, sizeof(uint32_t));
+    batch->matched_by = calloc((size_t)entries->count + 1, sizeof(uint32_t));
+    batch->path_count = 0;
+    batch->entry_count = 0;
+    for (uint32_t i = 0; i < entries->count; i++) {
+        if (gitsi_entry_type(context, i) == STATUS_TYPE_CATEGORY)continue;
+        batch->paths[batch->path_count++] = (gitsi_batch_path){ gitsi_entry_path(context, i), i };
+        if (gitsi_entry_old_path(context, i) != NULL) {
+            batch->paths[batch->path_count++] = (gitsi_batch_path){ gitsi_entry_old_path(context, i), i };
+        }
+    }
+    qsort(batch->paths, batch->path_count, sizeof(gitsi_batch_path), gitsi_batch_path_compare);
+    batch->is_stale = false;
+}
+
+/* Whether a command works on entries of a section. `stage` adds workspace
+ * and untracked files, `unstage` resets the index, `discard` checks out
+ * workspace files like `x` and `delete` removes untracked files */
+bool gitsi_batch_accepts(enum GITSI_BATCH_COMMAND command, enum GITSI_STATUS_TYPE type) {
+    switch (command) {
+        case BATCH_STAGE: return type == STATUS_TYPE_WORKSPACE || type == STATUS_TYPE_UNTRACKED;
+        case BATCH_UNSTAGE: return type == STATUS_TYPE_INDEX;
+        case BATCH_DISCARD: return type == STATUS_TYPE_WORKSPACE;
+        case BATCH_DELETE: return type == STATUS_TYPE_UNTRACKED;
+        case BATCH_NONE: return false;
+    }
+    return false;
+}
+
+/* Add an entry to the current run, every entry is only acted on once. Returns
+ * 1 if the entry was not yet counted for the current command */
+size_t gitsi_batch_select(gitsi_context *context, gitsi_batch *batch, uint32_t entry) {
+    if (!gitsi_batch_accepts(batch->command, gitsi_entry_type(context, entry)))return 0;
+    uint32_t matched_by = batch->matched_by[entry];
+    if (matched_by == batch->serial)return 0;
+    if (matched_by < batch->run_serial) {
+        batch->entries[batch->entry_count++] = entry;
+    }
+    batch->matched_by[entry] = batch->serial;
+    return 1;
+}
+
+/* Select the entries matching a pathspec. Literal paths, the common case
+ * when scripts stage thousands of files, are a binary search for the path
+ * and everything below it. Wildcards are matched with libgit2 */
+size_t gitsi_batch_match(gitsi_context *context, gitsi_batch *batch, const char *pathspec, const char **error) {
+    size_t matches = 0;
+    size_t length = strlen(pathspec);
+    while (length > 0 && pathspec[length - 1] == '/')length--;
+    
+    if (strpbrk(pathspec, "*?[\\") != NULL) {
+        git_pathspec *spec = NULL;
+        git_strarray arr = { .strings = (char**)&pathspec, .count = 1 };
+        if (git_pathspec_new(&spec, &arr) != 0) {
+            *error = "invalid-pathspec";
+            return 0;
+        }
+        for (size_t i = 0; i < batch->path_count; i++) {
+            if (git_pathspec_matches_path(spec, GIT_PATHSPEC_DEFAULT, batch->paths[i].path)) {
+                matches += gitsi_batch_select(context, batch, batch->paths[i].entry);
+            }
+        }
+        git_pathspec_free(spec);
+    } else if (length == 0 || (length == 1 && pathspec[0] == '.')) {
+        for (size_t i = 0; i < batch->path_count; i++) {
+            matches += gitsi_batch_select(context, batch, batch->paths[i].entry);
+        }
+    } else {
+        size_t low = 0, high = batch->path_count;
+        while (low < high) {
+            size_t middle = low + (high - low) / 2;
+            if (strncmp(batch->paths[middle].path, pathspec, length) < 0) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        // All paths with the pathspec as prefix follow each other
+        for (size_t i = low; i < batch->path_count; i++) {
+            const char *path = batch->paths[i].path;
+            if (strncmp(path, pathspec, length) != 0)break;
+            if (path[length] != '\0' && path[length] != '/')continue;
+            matches += gitsi_batch_select(context, batch, batch->paths[i].entry);
+        }
+    }
+    if (matches == 0 && *error == NULL)*error = "no-match";
+    return matches;
+}
+
+/* Apply the current run with one operation, then report its commands */
+void gitsi_batch_flush(gitsi_context *context, gitsi_batch *batch) {
+    if (batch->entry_count > 0) {
+        switch (batch->command) {
+            case BATCH_STAGE:
+                gitsi_stage_entries(context, batch->entries, batch->entry_count, false);
+                break;
+            case BATCH_UNSTAGE:
+                gitsi_reset_entries(context, batch->entries, batch->entry_count);
+                break;
+            case BATCH_DISCARD:
+                gitsi_checkout_entries(context, batch->entries, batch->entry_count);
+                break;
+            case BATCH_DELETE:
+                gitsi_delete_entries(context, batch->entries, batch->entry_count);
+                break;
+            case BATCH_NONE:
+                break;
+        }
+        batch->is_stale = true;
+        batch->entry_count = 0;
+    }
+    batch->run_serial = batch->serial + 1;
+    for (size_t i = 0; i < batch->result_count; i++) {
+        gitsi_batch_result *result = &batch->results[i];
+        if (result->error != NULL) {
+            printf("error %s %s\n", result->error, result->line);
+            batch->failed = true;
+        } else {
+            printf("ok %zu %s\n", result->matches, result->line);
+        }
+        free(result->line);
+    }
+    batch->result_count = 0;
+    fflush(stdout);
+}
+
+/* Parse one command line and add it to the current run */
+void gitsi_batch_add(gitsi_context *context, gitsi_batch *batch, const char *line) {
+    size_t length = strcspn(line, " \t");
+    const char *pathspec = line + length;
+    while (*pathspec == ' ' || *pathspec == '\t')pathspec++;
+    
+    enum GITSI_BATCH_COMMAND command = BATCH_STAGE;
+    while (command < BATCH_NONE && (strlen(batch_command_names[command]) != length ||
+                                    strncmp(line, batch_command_names[command], length) != 0)) {
+        command++;
+    }
+    const char *error = NULL;
+    if (command == BATCH_NONE) {
+        error = "unknown-command";
+    } else if (*pathspec == '\0') {
+        error = "missing-pathspec";
+    } else if (command != batch->command) {
+        gitsi_batch_flush(context, batch);
+        batch->command = command;
+    }
+    if (batch->is_stale) {
+        gitsi_batch_load(context, batch);
+    }
+    
+    size_t matches = 0;
+    batch->serial += 1;
+    if (error == NULL) {
+        matches = gitsi_batch_match(context, batch, pathspec, &error);
+    }
+    if (batch->result_count == batch->result_capacity) {
+        batch->result_capacity = batch->result_capacity == 0 ? 64 : batch->result_capacity * 2;
+        batch->results = realloc(batch->results, batch->result_capacity * sizeof(gitsi_batch_result));
+    }
+    batch->results[batch->result_count++] = (gitsi_batch_result){ strdup(line), matches, error };
+}
+
+/* The next line of the batch input, without the line break. Before it waits
+ * for more input, the current run is applied and answered. Returns NULL at
+ * the end of the input */
+char *gitsi_batch_read_line(gitsi_context *context, gitsi_batch *batch) {
+    while (true) {
+        char *start = batch->input + batch->input_start;
+        char *end = memchr(start, '\n', batch->input_length - batch->input_start);
+        if (end != NULL) {
+            *end = '\0';
+            batch->input_start = (size_t)(end - batch->input) + 1;
+            return start;
+        }
+        struct pollfd ready = { .fd = batch->input_fd, .events = POLLIN };
+        if (poll(&ready, 1, 0) == 0)gitsi_batch_flush(context, batch);
+        
+        // Move the partial line to the front and make room for more
+        batch->input_length -= batch->input_start;
+        memmove(batch->input, start, batch->input_length);
+        batch->input_start = 0;
+        if (batch->input_capacity - batch->input_length < BATCH_READ_SIZE) {
+            batch->input_capacity = batch->input_length + BATCH_READ_SIZE * 2;
+            batch->input = realloc(batch->input, batch->input_capacity + 1);
+        }
+        ssize_t length = read(batch->input_fd, batch->input + batch->input_length, BATCH_READ_SIZE);
+        if (length < 0 && errno == EINTR)continue;
+        if (length <= 0) {
+            // The last line might not have a line break
+            if (batch->input_length == 0)return NULL;
+            batch->input[batch->input_length] = '\0';
+            batch->input_start = batch->input_length;
+            return batch->input;
+        }
+        batch->input_length += (size_t)length;
+    }
+}
+
+/* Read commands from the batch file or stdin and apply them. Every command
+ * is answered with a line on stdout, `ok <matches> <command>` or
+ * `error <reason> <command>` */
+int gitsi_run_batch(gitsi_context *context) {
+    int input = STDIN_FILENO;
+    if (context->batch_path != NULL && strcmp(context->batch_path, "-") != 0) {
+        input = open(context->batch_path, O_RDONLY);
+        if (input < 0) {
+            fprintf(stderr, "Could not open %s: %s\n", context->batch_path, strerror(errno));
+            gitsi_cleanup(context);
+            return 1;
+        }
+    }
+    gitsi_batch batch = { .command = BATCH_NONE, .run_serial = 1, .input_fd = input };
+    batch.input_capacity = BATCH_READ_SIZE;
+    batch.input = malloc(batch.input_capacity + 1);
+    gitsi_batch_load(context, &batch);
+    
+    char *line;
+    while ((line = gitsi_batch_read_line(context, &batch)) != NULL) {
+        size_t length = strlen(line);
+        while (length > 0 && line[length - 1] == '\r') {
+            line[--length] = '\0';
+        }
+        const char *command = line;
+        while (*command == ' ' || *command == '\t')command++;
+        // Empty lines and comments are skipped
+        if (*command == '\0' || *command == '#')continue;
+        gitsi_batch_add(context, &batch, command);
+    }
+    gitsi_batch_flush(context, &batch);
+    
+    if (input != STDIN_FILENO)close(input);
+    free(batch.input);
+    free(batch.results);
+    free(batch.entries);
+    free(batch.matched_by);
+    free(batch.paths);
+    gitsi_cleanup(context);
+    return batch.failed ? 1 : 0;
+}
+
+// --------------------------------------------------
+#pragma mark Diffstat
+// --------------------------------------------------
+
+/* Create the pipe that background workers use to wake up the main loop */
+void gitsi_wakeup_init(gitsi_context *context) {
+    if (pipe(context->wake_pipe) != 0) {
+        context->wake_pipe[0] = context->wake_pipe[1] = -1;
+        return;
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(context->wake_pipe[i], F_SETFL, O_NONBLOCK);
+        // Background jobs and external commands must not inherit it
+        fcntl(context->wake_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+}
+
+/* Wake up the main loop. If the pipe is full, it is awake anyway */
+void gitsi_wakeup(gitsi_context *context) {
+    if (context->wake_pipe[1] < 0)return;
+    char byte = 1;
+    ssize_t written = write(context->wake_pipe[1], &byte, 1);
+    (void)written;
+}
+
+size_t gitsi_diffstat_hash(const gitsi_diffstat_key *key) {
+    // FNV-1a over the key. Keys are zeroed before they are filled in
+    const unsigned char *bytes = (const unsigned char *)key;
+    size_t hash = 2166136261u;
+    for (size_t i = 0; i < sizeof(gitsi_diffstat_key); i++) {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* Find the slot of `key` in the cache, or the free slot where it belongs */
+gitsi_diffstat_slot *gitsi_diffstat_slot_for(gitsi_diffstat *diffstat, const gitsi_diffstat_key *key) {
+    size_t mask = diffstat->cache_capacity - 1;
+    size_t slot = gitsi_diffstat_hash(key) & mask;
+    while (diffstat->cache[slot].is_used &&
+           memcmp(&diffstat->cache[slot].key, key, sizeof(gitsi_diffstat_key)) != 0) {
+        slot = (slot + 1) & mask;
+    }
+    return &diffstat->cache[slot];
+}
+
+/* Remember a result. The cache is dropped when it gets too big, the
+ * files on screen are computed again quickly enough */
+void gitsi_diffstat_cache_insert(gitsi_diffstat *diffstat, const gitsi_diffstat_key *key,
+                                 const gitsi_diffstat_result *result) {
+    if (diffstat->cache_count >= DIFFSTAT_CACHE_MAX) {
+        memset(diffstat->cache, 0, diffstat->cache_capacity * sizeof(gitsi_diffstat_slot));
+        diffstat->cache_count = 0;
+    }
+    if (diffstat->cache_count * 2 >= diffstat->cache_capacity) {
+        gitsi_diffstat_slot *old_cache = diffstat->cache;
+        size_t old_capacity = diffstat->cache_capacity;
+        diffstat->cache_capacity = old_capacity > 0 ? old_capacity * 2 : 1024;
+        diffstat->cache = calloc(diffstat->cache_capacity, sizeof(gitsi_diffstat_slot));
+        for (size_t i = 0; i < old_capacity; i++) {
+            if (!old_cache[i].is_used)continue;
+            *gitsi_diffstat_slot_for(diffstat, &old_cache[i].key) = old_cache[i];
+        }
+        free(old_cache);
+    }
+    gitsi_diffstat_slot *slot = gitsi_diffstat_slot_for(diffstat, key);
+    if (!slot->is_used) {
+        diffstat->cache_count += 1;
+    }
+    slot->is_used = true;
+    slot->key = *key;
+    slot->result = *result;
+}
+
+/* Read a whole file of the workdir */
+char *gitsi_read_file(const char *path, size_t size, size_t *length) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)return NULL;
+    char *buffer = malloc(size + 1);
+    size_t total = 0;
+    while (total < size) {
+        ssize_t count = read(fd, buffer + total, size - total);
+        if (count <= 0)break;
+        total += (size_t)count;
+    }
+    close(fd);
+    *length = total;
+    return buffer;
+}
+
+/* Compute the line counts of a request, or take them from the cache. Returns
+ * false if there is nothing to count, i.e. for untracked directories */
+bool gitsi_diffstat_compute(gitsi_diffstat *diffstat, git_repository *repo,
+                            const gitsi_diffstat_request *request, gitsi_diffstat_result *result) {
+    gitsi_diffstat_key key;
+    memset(&key, 0, sizeof(gitsi_diffstat_key));
+    git_oid_cpy(&key.old_id, &request->old_id);
+    
+    char *full_path = NULL;
+    struct stat file_stat;
+    bool has_file = false;
+    if (request->type == STATUS_TYPE_INDEX) {
+        git_oid_cpy(&key.new_id, &request->new_id);
+    } else {
+        asprintf(&full_path, "%s%s", git_repository_workdir(repo), request->path);
+        if (lstat(full_path, &file_stat) == 0) {
+            if (!S_ISREG(file_stat.st_mode)) {
+                free(full_path);
+                return false;
+            }
+            has_file = true;
+#ifdef __APPLE__
+            key.mtime_seconds = file_stat.st_mtimespec.tv_sec;
+            key.mtime_nanoseconds = file_stat.st_mtimespec.tv_nsec;
+#else
+            key.mtime_seconds = file_stat.st_mtim.tv_sec;
+            key.mtime_nanoseconds = file_stat.st_mtim.tv_nsec;
+#endif
+            key.size = file_stat.st_size;
+            key.inode = file_stat.st_ino;
+        }
+    }
+    
+    if (diffstat->cache_capacity > 0) {
+        gitsi_diffstat_slot *slot = gitsi_diffstat_slot_for(diffstat, &key);
+        if (slot->is_used) {
+            *result = slot->result;
+            free(full_path);
+            return true;
+        }
+    }
+    
+    git_blob *old_blob = NULL, *new_blob = NULL;
+    if (!git_oid_iszero(&request->old_id)) {
+        git_blob_lookup(&old_blob, repo, &request->old_id);
+    }
+    git_patch *patch = NULL;
+    int error;
+    if (request->type == STATUS_TYPE_INDEX) {
+        if (!git_oid_iszero(&request->new_id)) {
+            git_blob_lookup(&new_blob, repo, &request->new_id);
+        }
+        error = git_patch_from_blobs(&patch, old_blob, request->path, new_blob, request->path, NULL);
+    } else {
+        // A deleted file counts as empty
+        size_t length = 0;
+        char *content = has_file ? gitsi_read_file(full_path, (size_t)file_stat.st_size, &length) : NULL;
+        error = git_patch_from_blob_and_buffer(&patch, old_blob, request->path, content, length, request->path, NULL);
+        free(content);
+    }
+    
+    bool computed = false;
+    if (error == 0 && patch != NULL) {
+        size_t context_lines;
+        memset(result, 0, sizeof(gitsi_diffstat_result));
+        result->is_binary = (git_patch_get_delta(patch)->flags & GIT_DIFF_FLAG_BINARY) != 0;
+        git_patch_line_stats(&context_lines, &result->lines_added, &result->lines_removed, patch);
+        gitsi_diffstat_cache_insert(diffstat, &key, result);
+        computed = true;
+    }
+    git_patch_free(patch);
+    git_blob_free(old_blob);
+    git_blob_free(new_blob);
+    free(full_path);
+    return computed;
+}
+
+/* Take the next request that is not done yet. The rows on screen come first.
+ * Called with the lock held */
+bool gitsi_diffstat_next(gitsi_diffstat *diffstat, size_t *index) {
+    while (diffstat->priority_count > 0) {
+        size_t candidate = diffstat->priority[--diffstat->priority_count];
+        if (candidate < diffstat->request_count && !diffstat->requests[candidate].is_done) {
+            *index = candidate;
+            return true;
+        }
+    }
+    while (diffstat->next_request < diffstat->request_count) {
+        size_t candidate = diffstat->next_request++;
+        if (!diffstat->requests[candidate].is_done) {
+            *index = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* The diffstat worker thread */
+void *gitsi_diffstat_worker(void *payload) {
+    gitsi_context *context = payload;
+    gitsi_diffstat *diffstat = &context->diffstat;
+    git_repository *repo = NULL;
+    if (git_repository_open(&repo, diffstat->repo_path) != 0) {
+        return NULL;
+    }
+    
+    pthread_mutex_lock(&diffstat->lock);
+    while (!diffstat->should_stop) {
+        size_t index;
+        if (!gitsi_diffstat_next(diffstat, &index)) {
+            pthread_cond_wait(&diffstat->wakeup, &diffstat->lock);
+            continue;
+        }
+        // The requests may be replaced while we compute, so work on a copy
+        gitsi_diffstat_request request = diffstat->requests[index];
+        request.path = strdup(request.path);
+        size_t generation = diffstat->generation;
+        pthread_mutex_unlock(&diffstat->lock);
+        
+        gitsi_diffstat_result result;
+        bool computed = gitsi_diffstat_compute(diffstat, repo, &request, &result);
+        free(request.path);
+        
+        pthread_mutex_lock(&diffstat->lock);
+        if (generation != diffstat->generation)continue;
+        diffstat->requests[index].is_done = true;
+        if (computed) {
+            diffstat->requests[index].result = result;
+        }
+        if (!diffstat->has_results) {
+            diffstat->has_results = true;
+            gitsi_wakeup(context);
+        }
+    }
+    pthread_mutex_unlock(&diffstat->lock);
+    git_repository_free(repo);
+    return NULL;
+}
+
+/* Start the diffstat worker */
+void gitsi_diffstat_start(gitsi_context *context) {
+    gitsi_diffstat *diffstat = &context->diffstat;
+    pthread_mutex_init(&diffstat->lock, NULL);
+    pthread_cond_init(&diffstat->wakeup, NULL);
+    diffstat->repo_path = strdup(git_repository_path(context->repo));
+    diffstat->is_running = pthread_create(&diffstat->thread, NULL, gitsi_diffstat_worker, context) == 0;
+}
+
+void gitsi_diffstat_free_requests(gitsi_diffstat *diffstat) {
+    for (size_t i = 0; i < diffstat->request_count; i++) {
+        free(diffstat->requests[i].path);
+    }
+    free(diffstat->requests);
+    free(diffstat->priority);
+    diffstat->requests = NULL;
+    diffstat->priority = NULL;
+    diffstat->request_count = 0;
+    diffstat->priority_count = 0;
+}
+
+/* Hand the entries of a new status to the worker */
+void gitsi_diffstat_submit(gitsi_context *context) {
+    gitsi_diffstat *diffstat = &context->diffstat;
+    if (!diffstat->is_running)return;
+    pthread_mutex_lock(&diffstat->lock);
+    gitsi_diffstat_free_requests(diffstat);
+    gitsi_entries *entries = &context->entries;
+    diffstat->requests = calloc(entries->count + 1, sizeof(gitsi_diffstat_request));
+    diffstat->priority = calloc(entries->count + 1, sizeof(size_t));
+    diffstat->request_count = entries->count;
+    for (uint32_t i = 0; i < entries->count; i++) {
+        gitsi_diffstat_request *request = &diffstat->requests[i];
+        request->type = gitsi_entry_type(context, i);
+        // Headlines have nothing to count
+        if (request->type == STATUS_TYPE_CATEGORY) {
+            request->is_done = true;
+            continue;
+        }
+        request->path = strdup(gitsi_entry_path(context, i));
+        git_oid_cpy(&request->old_id, &entries->old_ids[i]);
+        git_oid_cpy(&request->new_id, &entries->new_ids[i]);
+    }
+    diffstat->generation += 1;
+    diffstat->next_request = 0;
+    diffstat->has_results = false;
+    pthread_cond_signal(&diffstat->wakeup);
+    pthread_mutex_unlock(&diffstat->lock);
+}
+
+/* Ask the worker to compute the rows from `start` on first */
+void gitsi_diffstat_prioritize(gitsi_context *context, size_t start, size_t count) {
+    gitsi_diffstat *diffstat = &context->diffstat;
+    if (!diffstat->is_running)return;
+    size_t end = MIN(start + count, context->row_count);
+    bool is_missing = false;
+    for (size_t row = start; row < end && !is_missing; row++) {
+        gitsi_row entry = context->rows[row];
+        is_missing = !gitsi_row_is_directory(entry) && gitsi_entry_type(context, entry) != STATUS_TYPE_CATEGORY &&
+            !gitsi_bit_get(context->entries.has_diffstat, entry);
+    }
+    if (!is_missing)return;
+    pthread_mutex_lock(&diffstat->lock);
+    diffstat->priority_count = 0;
+    // The worker takes them from the end
+    for (size_t row = end; row > start; row--) {
+        gitsi_row entry = context->rows[row - 1];
+        if (gitsi_row_is_directory(entry) || gitsi_entry_type(context, entry) == STATUS_TYPE_CATEGORY ||
+            gitsi_bit_get(context->entries.has_diffstat, entry))continue;
+        if (entry >= diffstat->request_count)continue;
+        diffstat->priority[diffstat->priority_count++] = entry;
+    }
+    pthread_cond_signal(&diffstat->wakeup);
+    pthread_mutex_unlock(&diffstat->lock);
+}
+
+/* Format and draw the rows of the entries in the bitset `changed` again, while
+ * the other rows keep their cached text and what is on the list pad */
+void gitsi_list_invalidate_entries(gitsi_context *context, const uint64_t *changed) {
+    for (size_t i = 0; i < context->row_cache_size; i++) {
+        gitsi_row_cache *slot = &context->row_cache[i];
+        if (slot->generation != context->list_generation || slot->row >= context->row_count)continue;
+        gitsi_row row = context->rows[slot->row];
+        if (!gitsi_row_is_directory(row) && gitsi_bit_get(changed, row))slot->row = SIZE_MAX;
+    }
+    for (int y = 0; y < context->list_pad_height && context->list_lines != NULL; y++) {
+        gitsi_drawn_line *line = &context->list_lines[y];
+        if (line->row >= context->row_count)continue;
+        gitsi_row row = context->rows[line->row];
+        if (!gitsi_row_is_directory(row) && gitsi_bit_get(changed, row))line->row = SIZE_MAX - 1;
+    }
+}
+
+/* Copy the results of the worker into the entries and sum up the sections.
+ * Returns true if there was something new */
+bool gitsi_diffstat_collect(gitsi_context *context) {
+    gitsi_diffstat *diffstat = &context->diffstat;
+    if (!diffstat->is_running)return false;
+    pthread_mutex_lock(&diffstat->lock);
+    gitsi_entries *entries = &context->entries;
+    if (!diffstat->has_results || diffstat->request_count != entries->count) {
+        pthread_mutex_unlock(&diffstat->lock);
+        return false;
+    }
+    diffstat->has_results = false;
+    uint64_t *changed = calloc(gitsi_bit_words(entries->count) + 1, sizeof(uint64_t));
+    bool has_changed = false;
+    uint32_t category = NO_PATH;
+    uint32_t category_added = 0, category_removed = 0;
+    bool category_complete = false;
+    for (uint32_t i = 0; i <= entries->count; i++) {
+        bool is_category = i == entries->count || gitsi_entry_type(context, i) == STATUS_TYPE_CATEGORY;
+        if (is_category && category != NO_PATH &&
+            (entries->lines_added[category] != category_added || entries->lines_removed[category] != category_removed ||
+             gitsi_bit_get(entries->has_diffstat, category) != category_complete)) {
+            gitsi_bit_set(changed, category, true);
+            has_changed = true;
+        }
+        if (i == entries->count)break;
+        if (is_category) {
+            category = i;
+            // The headline is complete once all of its entries are
+            category_added = entries->lines_added[category];
+            category_removed = entries->lines_removed[category];
+            category_complete = gitsi_bit_get(entries->has_diffstat, category);
+            gitsi_bit_set(entries->has_diffstat, category, true);
+            entries->lines_added[category] = 0;
+            entries->lines_removed[category] = 0;
+            continue;
+        }
+        gitsi_diffstat_request *request = &diffstat->requests[i];
+        if (request->is_done && !gitsi_bit_get(entries->has_diffstat, i)) {
+            gitsi_bit_set(entries->has_diffstat, i, true);
+            gitsi_bit_set(entries->is_binary, i, request->result.is_binary);
+            entries->lines_added[i] = (uint32_t)request->result.lines_added;
+            entries->lines_removed[i] = (uint32_t)request->result.lines_removed;
+            gitsi_bit_set(changed, i, true);
+            has_changed = true;
+        }
+        if (category == NO_PATH)continue;
+        if (!gitsi_bit_get(entries->has_diffstat, i)) {
+            gitsi_bit_set(entries->has_diffstat, category, false);
+        }
+        entries->lines_added[category] += entries->lines_added[i];
+        entries->lines_removed[category] += entries->lines_removed[i];
+    }
+    pthread_mutex_unlock(&diffstat->lock);
+    // Only the rows with new counts have to be formatted again
+    if (has_changed)gitsi_list_invalidate_entries(context, changed);
+    free(changed);
+    return has_changed;
 }
 
-/* Open the git repository */
-void gitsi_open_repository(gitsi_context *context) {
-    int error = git_repository_open_ext(&context->repo, context->repo_dir, 0, NULL);
-    gitsi_check_error("open repository", error);
+/* Stop the worker and free everything */
+void gitsi_diffstat_stop(gitsi_context *context) {
+    gitsi_diffstat *diffstat = &context->diffstat;
+    if (!diffstat->is_running)return;
+    pthread_mutex_lock(&diffstat->lock);
+    diffstat->should_stop = true;
+    pthread_cond_signal(&diffstat->wakeup);
+    pthread_mutex_unlock(&diffstat->lock);
+    pthread_join(diffstat->thread, NULL);
+    diffstat->is_running = false;
+    gitsi_diffstat_free_requests(diffstat);
+    free(diffstat->cache);
+    diffstat->cache = NULL;
+    free(diffstat->repo_path);
+    diffstat->repo_path = NULL;
+    pthread_mutex_destroy(&diffstat->lock);
+    pthread_cond_destroy(&diffstat->wakeup);
+}
+
+// --------------------------------------------------
+#pragma mark Diff Preview
+// --------------------------------------------------
+
+/* What the preview worker collects while the diff is computed */
+typedef struct gitsi_preview_payload {
+    gitsi_preview *preview;
+    size_t generation;
+    char **lines;
+    size_t count;
+    bool is_truncated;
+} gitsi_preview_payload;
+
+/* Add a line to the preview. Tabs become spaces and control characters are
+ * replaced, so that the line takes exactly one row on screen */
+void gitsi_preview_add_line(gitsi_preview_payload *payload, char origin, const char *content, size_t length) {
+    while (length > 0 && (content[length - 1] == '\n' || content[length - 1] == '\r')) {
+        length--;
+    }
+    char *line = malloc(length * 4 + 2);
+    size_t position = 0;
+    if (origin != 0) {
+        line[position++] = origin;
+    }
+    for (size_t i = 0; i < length; i++) {
+        char ch = content[i];
+        if (ch == '\t') {
+            memcpy(line + position, "    ", 4);
+            position += 4;
+        } else {
+            line[position++] = (ch >= 0 && ch < 32) ? '?' : ch;
+        }
+    }
+    line[position] = '\0';
+    payload->lines[payload->count++] = line;
+}
+
+/* Returns true if the cursor moved on or the preview is full, then the diff
+ * is cancelled */
+bool gitsi_preview_should_stop(gitsi_preview_payload *payload) {
+    if (atomic_load(&payload->preview->request_generation) != payload->generation)return true;
+    if (payload->count >= PREVIEW_MAX_LINES) {
+        payload->is_truncated = true;
+        return true;
+    }
+    return false;
+}
+
+int gitsi_preview_file_cb(const git_diff_delta *delta, float progress, void *data) {
+    gitsi_preview_payload *payload = data;
+    if (gitsi_preview_should_stop(payload))return GIT_EUSER;
+    if (delta->flags & GIT_DIFF_FLAG_BINARY) {
+        const char binary[] = "Binary file";
+        gitsi_preview_add_line(payload, 0, binary, strlen(binary));
+    }
+    return 0;
+}
+
+int gitsi_preview_hunk_cb(const git_diff_delta *delta, const git_diff_hunk *hunk, void *data) {
+    gitsi_preview_payload *payload = data;
+    if (gitsi_preview_should_stop(payload))return GIT_EUSER;
+    gitsi_preview_add_line(payload, 0, hunk->header, hunk->header_len);
+    return 0;
+}
+
+int gitsi_preview_line_cb(const git_diff_delta *delta, const git_diff_hunk *hunk,
+                          const git_diff_line *line, void *data) {
+    gitsi_preview_payload *payload = data;
+    if (gitsi_preview_should_stop(payload))return GIT_EUSER;
+    char origin = line->origin;
+    if (origin != GIT_DIFF_LINE_ADDITION && origin != GIT_DIFF_LINE_DELETION &&
+        origin != GIT_DIFF_LINE_CONTEXT) {
+        // "\ No newline at end of file"
+        origin = 0;
+    }
+    gitsi_preview_add_line(payload, origin, line->content, line->content_len);
+    return 0;
+}
+
+/* Compute the diff of a request line by line, like `gitsi_diffstat_compute` */
+void gitsi_preview_compute(git_repository *repo, const gitsi_diffstat_request *request,
+                           gitsi_preview_payload *payload) {
+    git_blob *old_blob = NULL, *new_blob = NULL;
+    if (!git_oid_iszero(&request->old_id)) {
+        git_blob_lookup(&old_blob, repo, &request->old_id);
+    }
+    if (request->type == STATUS_TYPE_INDEX) {
+        if (!git_oid_iszero(&request->new_id)) {
+            git_blob_lookup(&new_blob, repo, &request->new_id);
+        }
+        git_diff_blobs(old_blob, request->path, new_blob, request->path, NULL, gitsi_preview_file_cb,
+                       NULL, gitsi_preview_hunk_cb, gitsi_preview_line_cb, payload);
+    } else {
+        char *full_path;
+        asprintf(&full_path, "%s%s", git_repository_workdir(repo), request->path);
+        struct stat file_stat;
+        size_t length = 0;
+        char *content = NULL;
+        bool exists = lstat(full_path, &file_stat) == 0;
+        if (exists && S_ISDIR(file_stat.st_mode)) {
+            const char directory[] = "Untracked directory";
+            gitsi_preview_add_line(payload, 0, directory, strlen(directory));
+        } else {
+            if (exists && S_ISREG(file_stat.st_mode)) {
+                content = gitsi_read_file(full_path, (size_t)file_stat.st_size, &length);
+            }
+            // A deleted file counts as empty
+            git_diff_blob_to_buffer(old_blob, request->path, content, length, request->path, NULL,
+                                    gitsi_preview_file_cb, NULL, gitsi_preview_hunk_cb,
+                                    gitsi_preview_line_cb, payload);
+        }
+        free(content);
+        free(full_path);
+    }
+    if (payload->is_truncated) {
+        const char truncated[] = "...";
+        gitsi_preview_add_line(payload, 0, truncated, strlen(truncated));
+    }
+    git_blob_free(old_blob);
+    git_blob_free(new_blob);
+}
+
+void gitsi_preview_free_lines(char **lines, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        free(lines[i]);
+    }
+    free(lines);
+}
+
+/* The preview worker thread */
+void *gitsi_preview_worker(void *data) {
+    gitsi_context *context = data;
+    gitsi_preview *preview = &context->preview;
+    git_repository *repo = NULL;
+    if (git_repository_open(&repo, preview->repo_path) != 0) {
+        return NULL;
+    }
+    size_t done_generation = 0;
+    pthread_mutex_lock(&preview->lock);
+    while (!preview->should_stop) {
+        size_t generation = atomic_load(&preview->request_generation);
+        if (generation == done_generation) {
+            pthread_cond_wait(&preview->wakeup, &preview->lock);
+            continue;
+        }
+        gitsi_diffstat_request request = preview->request;
+        request.path = strdup(request.path);
+        pthread_mutex_unlock(&preview->lock);
+        
+        // One more for the truncation marker
+        gitsi_preview_payload payload = {
+            .preview = preview,
+            .generation = generation,
+            .lines = calloc(PREVIEW_MAX_LINES + 2, sizeof(char*)),
+        };
+        gitsi_preview_compute(repo, &request, &payload);
+        free(request.path);
+        done_generation = generation;
+        
+        pthread_mutex_lock(&preview->lock);
+        if (generation != atomic_load(&preview->request_generation)) {
+            gitsi_preview_free_lines(payload.lines, payload.count);
+            continue;
+        }
+        gitsi_preview_free_lines(preview->result_lines, preview->result_count);
+        preview->result_lines = payload.lines;
+        preview->result_count = payload.count;
+        preview->result_generation = generation;
+        preview->has_result = true;
+        gitsi_wakeup(context);
+    }
+    pthread_mutex_unlock(&preview->lock);
+    git_repository_free(repo);
+    return NULL;
+}
+
+/* Show or hide the preview. The worker is started the first time */
+void gitsi_preview_toggle(gitsi_context *context) {
+    gitsi_preview *preview = &context->preview;
+    preview->is_visible = !preview->is_visible;
+    preview->is_shown = false;
+    if (preview->is_visible && !preview->is_running) {
+        pthread_mutex_init(&preview->lock, NULL);
+        pthread_cond_init(&preview->wakeup, NULL);
+        preview->repo_path = strdup(git_repository_path(context->repo));
+        preview->is_running = pthread_create(&preview->thread, NULL, gitsi_preview_worker, context) == 0;
+    }
+}
+
+/* Whether a cache slot holds the diff of `key` */
+bool gitsi_preview_matches(gitsi_preview_slot *slot, gitsi_preview_slot *key) {
+    if (!slot->is_used || slot->type != key->type || strcmp(slot->path, key->path) != 0)return false;
+    if (!git_oid_equal(&slot->old_id, &key->old_id) || !git_oid_equal(&slot->new_id, &key->new_id))return false;
+    // Index diffs only depend on the blobs, the workdir might have changed with each refresh
+    return key->type == STATUS_TYPE_INDEX || slot->status_generation == key->status_generation;
+}
+
+/* Make sure the preview shows the selected entry. Either it is in the cache,
+ * or the worker gets a new request, which cancels the one it works on */
+void gitsi_preview_update(gitsi_context *context) {
+    gitsi_preview *preview = &context->preview;
+    gitsi_row entry = context->position;
+    if (!preview->is_running)return;
+    if (entry == ROW_NONE || gitsi_row_is_directory(entry) || gitsi_entry_type(context, entry) == STATUS_TYPE_CATEGORY) {
+        preview->is_shown = false;
+        return;
+    }
+    gitsi_preview_slot key = {
+        .path = (char*)gitsi_entry_path(context, entry),
+        .type = gitsi_entry_type(context, entry),
+        .status_generation = context->status_generation,
+    };
+    git_oid_cpy(&key.old_id, &context->entries.old_ids[entry]);
+    git_oid_cpy(&key.new_id, &context->entries.new_ids[entry]);
+    if (preview->is_shown && gitsi_preview_matches(&preview->shown_key, &key) &&
+        preview->shown_key.status_generation == key.status_generation) {
+        return;
+    }
+    free(preview->shown_key.path);
+    preview->shown_key = key;
+    preview->shown_key.path = strdup(key.path);
+    preview->shown_key.is_used = true;
+    preview->is_shown = true;
     
-    if (git_repository_is_bare(context->repo)) {
-        fprintf(stderr, "Could not report status on bare repository: %s", context->repo_dir);
-        exit(1);
+    for (int i = 0; i < PREVIEW_CACHE_SIZE; i++) {
+        if (gitsi_preview_matches(&preview->cache[i], &key)) {
+            preview->cache[i].last_used = ++preview->use_counter;
+            preview->shown_slot = i;
+            return;
+        }
+    }
+    preview->shown_slot = -1;
+    free(preview->request_key.path);
+    preview->request_key = preview->shown_key;
+    preview->request_key.path = strdup(key.path);
+    pthread_mutex_lock(&preview->lock);
+    free(preview->request.path);
+    preview->request.path = strdup(gitsi_entry_path(context, entry));
+    preview->request.type = gitsi_entry_type(context, entry);
+    git_oid_cpy(&preview->request.old_id, &context->entries.old_ids[entry]);
+    git_oid_cpy(&preview->request.new_id, &context->entries.new_ids[entry]);
+    atomic_fetch_add(&preview->request_generation, 1);
+    pthread_cond_signal(&preview->wakeup);
+    pthread_mutex_unlock(&preview->lock);
+}
+
+/* Move the result of the worker into the least recently used cache slot.
+ * Returns true if the preview changed */
+bool gitsi_preview_collect(gitsi_context *context) {
+    gitsi_preview *preview = &context->preview;
+    if (!preview->is_running)return false;
+    pthread_mutex_lock(&preview->lock);
+    bool is_current = preview->has_result &&
+                      preview->result_generation == atomic_load(&preview->request_generation);
+    char **lines = preview->result_lines;
+    size_t count = preview->result_count;
+    if (preview->has_result) {
+        preview->has_result = false;
+        preview->result_lines = NULL;
+        preview->result_count = 0;
+    }
+    pthread_mutex_unlock(&preview->lock);
+    if (!is_current) {
+        gitsi_preview_free_lines(lines, count);
+        return false;
+    }
+    // The slot on screen stays
+    int oldest = -1;
+    for (int i = 0; i < PREVIEW_CACHE_SIZE; i++) {
+        if (i == preview->shown_slot)continue;
+        if (oldest < 0 || preview->cache[i].last_used < preview->cache[oldest].last_used)oldest = i;
+    }
+    gitsi_preview_slot *slot = &preview->cache[oldest];
+    free(slot->path);
+    gitsi_preview_free_lines(slot->lines, slot->line_count);
+    *slot = preview->request_key;
+    slot->path = strdup(preview->request_key.path);
+    slot->lines = lines;
+    slot->line_count = count;
+    slot->last_used = ++preview->use_counter;
+    // The cursor might have moved to an entry that was in the cache meanwhile
+    if (!preview->is_shown || preview->shown_slot >= 0 || !gitsi_preview_matches(slot, &preview->shown_key))return false;
+    preview->shown_slot = oldest;
+    return true;
+}
+
+/* Stop the preview worker and free the cache */
+void gitsi_preview_stop(gitsi_context *context) {
+    gitsi_preview *preview = &context->preview;
+    if (!preview->is_running)return;
+    pthread_mutex_lock(&preview->lock);
+    preview->should_stop = true;
+    atomic_fetch_add(&preview->request_generation, 1);
+    pthread_cond_signal(&preview->wakeup);
+    pthread_mutex_unlock(&preview->lock);
+    pthread_join(preview->thread, NULL);
+    preview->is_running = false;
+    for (int i = 0; i < PREVIEW_CACHE_SIZE; i++) {
+        free(preview->cache[i].path);
+        gitsi_preview_free_lines(preview->cache[i].lines, preview->cache[i].line_count);
+    }
+    memset(preview->cache, 0, sizeof(preview->cache));
+    gitsi_preview_free_lines(preview->result_lines, preview->result_count);
+    preview->result_lines = NULL;
+    free(preview->request.path);
+    free(preview->shown_key.path);
+    free(preview->request_key.path);
+    free(preview->repo_path);
+    preview->request.path = NULL;
+    preview->shown_key.path = NULL;
+    preview->request_key.path = NULL;
+    preview->repo_path = NULL;
+    pthread_mutex_destroy(&preview->lock);
+    pthread_cond_destroy(&preview->wakeup);
+}
+
+// --------------------------------------------------
+#pragma mark History
+// --------------------------------------------------
+
+/* The id of `path` in the tree of `commit`, zero if the path does not exist */
+void gitsi_history_path_id(const git_commit *commit, const char *path, git_oid *id) {
+    memset(id, 0, sizeof(git_oid));
+    git_tree *tree = NULL;
+    if (git_commit_tree(&tree, commit) != 0)return;
+    git_tree_entry *entry = NULL;
+    if (git_tree_entry_bypath(&entry, tree, path) == 0) {
+        git_oid_cpy(id, git_tree_entry_id(entry));
+        git_tree_entry_free(entry);
+    }
+    git_tree_free(tree);
+}
+
+/* Whether `commit` changed `path` compared to each of its parents. The walk
+ * usually reaches the first parent next, so its id is kept in `parent` and
+ * `parent_path_id` to not look up the same tree twice */
+bool gitsi_history_touches(git_commit *commit, const char *path, git_oid *parent, git_oid *parent_path_id) {
+    git_oid id;
+    if (git_oid_equal(git_commit_id(commit), parent)) {
+        git_oid_cpy(&id, parent_path_id);
+    } else {
+        gitsi_history_path_id(commit, path, &id);
+    }
+    unsigned int parent_count = git_commit_parentcount(commit);
+    if (parent_count == 0)return !git_oid_is_zero(&id);
+    bool is_changed = true;
+    for (unsigned int i = 0; i < parent_count && is_changed; i++) {
+        git_commit *parent_commit = NULL;
+        if (git_commit_parent(&parent_commit, commit, i) != 0)continue;
+        git_oid parent_id;
+        gitsi_history_path_id(parent_commit, path, &parent_id);
+        if (i == 0) {
+            git_oid_cpy(parent, git_commit_id(parent_commit));
+            git_oid_cpy(parent_path_id, &parent_id);
+        }
+        git_commit_free(parent_commit);
+        // A merge that took the file from one side did not change it
+        is_changed = !git_oid_equal(&id, &parent_id);
+    }
+    return is_changed;
+}
+
+/* The line of a commit in the history pane: id, date, author and summary */
+char *gitsi_history_line(git_commit *commit) {
+    char id[8];
+    git_oid_tostr(id, sizeof(id), git_commit_id(commit));
+    const git_signature *author = git_commit_author(commit);
+    time_t seconds = (time_t)author->when.time;
+    struct tm local;
+    char date[16] = "";
+    if (localtime_r(&seconds, &local) != NULL) {
+        strftime(date, sizeof(date), "%Y-%m-%d", &local);
+    }
+    const char *summary = git_commit_summary(commit);
+    char *line;
+    asprintf(&line, "%s %s %s: %s", id, date, author->name != NULL ? author->name : "",
+             summary != NULL ? summary : "");
+    return line;
+}
+
+/* The history worker thread. It keeps one revision walk per request and
+ * walks it in batches, so a new request or `should_stop` is noticed soon */
+void *gitsi_history_worker(void *data) {
+    gitsi_context *context = data;
+    gitsi_history *history = &context->history;
+    git_repository *repo = NULL;
+    if (git_repository_open(&repo, history->repo_path) != 0) {
+        const git_error *err = giterr_last();
+        GITSI_LOG(GITSI_LOG_ERROR, "history: open repository failed: %s", err != NULL ? err->message : "unknown error");
+        pthread_mutex_lock(&history->lock);
+        history->error = strdup(err != NULL ? err->message : "unknown error");
+        pthread_mutex_unlock(&history->lock);
+        gitsi_wakeup(context);
+        return NULL;
+    }
+    git_revwalk *walk = NULL;
+    char *path = NULL;
+    size_t generation = 0;
+    size_t found = 0;
+    size_t walked = 0;
+    bool is_complete = true;
+    git_oid parent, parent_path_id;
+    pthread_mutex_lock(&history->lock);
+    while (!history->should_stop) {
+        size_t requested = atomic_load(&history->request_generation);
+        if (requested != generation) {
+            generation = requested;
+            free(path);
+            path = history->request_path != NULL ? strdup(history->request_path) : NULL;
+            git_revwalk_free(walk);
+            walk = NULL;
+            found = 0;
+            walked = 0;
+            memset(&parent, 0, sizeof(parent));
+            // Sorting resets the walk, so it goes before the start
+            is_complete = path == NULL || git_revwalk_new(&walk, repo) != 0;
+            if (!is_complete) {
+                git_revwalk_sorting(walk, GIT_SORT_NONE);
+                is_complete = git_revwalk_push_head(walk) != 0;
+            }
+        } else if (is_complete || found >= history->wanted) {
+            pthread_cond_wait(&history->wakeup, &history->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&history->lock);
+        
+        char **lines = calloc(HISTORY_WALK_BATCH, sizeof(char*));
+        size_t count = 0;
+        for (size_t step = 0; step < HISTORY_WALK_BATCH && !is_complete; step++) {
+            if (generation != atomic_load(&history->request_generation))break;
+            git_oid id;
+            if (git_revwalk_next(&id, walk) != 0) {
+                is_complete = true;
+                break;
+            }
+            walked += 1;
+            git_commit *commit = NULL;
+            if (git_commit_lookup(&commit, repo, &id) != 0)continue;
+            if (gitsi_history_touches(commit, path, &parent, &parent_path_id)) {
+                lines[count++] = gitsi_history_line(commit);
+            }
+            git_commit_free(commit);
+        }
+        found += count;
+        
+        pthread_mutex_lock(&history->lock);
+        if (generation != atomic_load(&history->request_generation)) {
+            gitsi_preview_free_lines(lines, count);
+            continue;
+        }
+        // The main thread did not collect the last batch yet
+        if (history->has_result && history->result_generation != generation) {
+            gitsi_preview_free_lines(history->result_lines, history->result_count);
+            history->result_lines = NULL;
+            history->result_count = 0;
+        }
+        if (count > 0) {
+            history->result_lines = realloc(history->result_lines, (history->result_count + count) * sizeof(char*));
+            memcpy(history->result_lines + history->result_count, lines, count * sizeof(char*));
+            history->result_count += count;
+        }
+        free(lines);
+        history->result_generation = generation;
+        history->result_walked = walked;
+        history->result_complete = is_complete;
+        history->has_result = true;
+        gitsi_wakeup(context);
+    }
+    pthread_mutex_unlock(&history->lock);
+    free(path);
+    git_revwalk_free(walk);
+    git_repository_free(repo);
+    return NULL;
+}
+
+/* Show or hide the history. It shares the pane with the diff preview, so
+ * that one is hidden. The worker is started the first time and again after
+ * it failed */
+void gitsi_history_toggle(gitsi_context *context) {
+    gitsi_history *history = &context->history;
+    history->is_visible = !history->is_visible;
+    if (history->is_visible && context->preview.is_visible) {
+        gitsi_preview_toggle(context);
+    }
+    if (history->is_visible && !history->is_running) {
+        free(history->failure);
+        history->failure = NULL;
+        pthread_mutex_init(&history->lock, NULL);
+        pthread_cond_init(&history->wakeup, NULL);
+        history->repo_path = strdup(git_repository_path(context->repo));
+        int error = pthread_create(&history->thread, NULL, gitsi_history_worker, context);
+        history->is_running = error == 0;
+        // Without a worker, the next toggle starts over
+        if (!history->is_running) {
+            asprintf(&history->failure, "no worker: %s", strerror(error));
+            pthread_mutex_destroy(&history->lock);
+            pthread_cond_destroy(&history->wakeup);
+            free(history->repo_path);
+            history->repo_path = NULL;
+        }
+    }
+}
+
+/* The path whose history is shown for a row. A file that was renamed in the
+ * index has its history under the old name. NULL if there is none */
+const char *gitsi_history_path(gitsi_context *context, gitsi_row row) {
+    enum GITSI_STATUS_TYPE type = gitsi_row_type(context, row);
+    if (type == STATUS_TYPE_CATEGORY || type == STATUS_TYPE_UNTRACKED)return NULL;
+    if (!gitsi_row_is_directory(row) && type == STATUS_TYPE_INDEX) {
+        const char *old_path = gitsi_entry_old_path(context, row);
+        if (old_path != NULL)return old_path;
+    }
+    return gitsi_row_path(context, row);
+}
+
+/* Make sure the history is of the selected entry and that the worker looks
+ * for enough commits to fill the pane below the scroll position. A new
+ * commit starts the walk again */
+void gitsi_history_update(gitsi_context *context, int height) {
+    gitsi_history *history = &context->history;
+    if (!history->is_running)return;
+    const char *path = gitsi_history_path(context, context->position);
+    // HEAD can only have moved if the status was read again
+    git_oid head;
+    git_oid_cpy(&head, &history->head_id);
+    if (history->status_generation != context->status_generation) {
+        history->status_generation = context->status_generation;
+        memset(&head, 0, sizeof(head));
+        git_reference_name_to_id(&head, context->repo, "HEAD");
+    }
+    bool is_same = (path == NULL ? history->shown_path == NULL :
+                    history->shown_path != NULL && strcmp(path, history->shown_path) == 0) &&
+                   git_oid_equal(&head, &history->head_id);
+    size_t wanted = history->scroll + (size_t)MAX(height, 0) + HISTORY_PAGE;
+    if (is_same && wanted <= history->requested)return;
+    if (!is_same) {
+        free(history->shown_path);
+        history->shown_path = path != NULL ? strdup(path) : NULL;
+        git_oid_cpy(&history->head_id, &head);
+        gitsi_preview_free_lines(history->lines, history->count);
+        history->lines = NULL;
+        history->count = 0;
+        history->capacity = 0;
+        history->walked = 0;
+        history->is_complete = path == NULL;
+        history->scroll = 0;
+        wanted = (size_t)MAX(height, 0) + HISTORY_PAGE;
+    }
+    history->requested = wanted;
+    pthread_mutex_lock(&history->lock);
+    history->wanted = wanted;
+    if (!is_same) {
+        free(history->request_path);
+        history->request_path = path != NULL ? strdup(path) : NULL;
+        atomic_fetch_add(&history->request_generation, 1);
+    }
+    pthread_cond_signal(&history->wakeup);
+    pthread_mutex_unlock(&history->lock);
+}
+
+/* Append the commits the worker found. Returns true if the history changed */
+bool gitsi_history_collect(gitsi_context *context) {
+    gitsi_history *history = &context->history;
+    if (!history->is_running)return false;
+    pthread_mutex_lock(&history->lock);
+    // The worker gave up, the pane shows why
+    if (history->error != NULL) {
+        char *error = history->error;
+        history->error = NULL;
+        pthread_mutex_unlock(&history->lock);
+        gitsi_history_stop(context);
+        free(history->failure);
+        history->failure = error;
+        return true;
+    }
+    bool is_current = history->has_result &&
+                      history->result_generation == atomic_load(&history->request_generation);
+    char **lines = history->result_lines;
+    size_t count = history->result_count;
+    size_t walked = history->result_walked;
+    bool is_complete = history->result_complete;
+    if (history->has_result) {
+        history->has_result = false;
+        history->result_lines = NULL;
+        history->result_count = 0;
+    }
+    pthread_mutex_unlock(&history->lock);
+    if (!is_current) {
+        gitsi_preview_free_lines(lines, count);
+        return false;
+    }
+    if (history->count + count > history->capacity) {
+        history->capacity = MAX(history->capacity * 2, history->count + count);
+        history->lines = realloc(history->lines, history->capacity * sizeof(char*));
+    }
+    if (count > 0) {
+        memcpy(history->lines + history->count, lines, count * sizeof(char*));
+        history->count += count;
+    }
+    history->walked = walked;
+    history->is_complete = is_complete;
+    free(lines);
+    return true;
+}
+
+/* Scroll the history by a page. Scrolling down asks the worker for more */
+void gitsi_history_scroll(gitsi_context *context, size_t page, bool is_down) {
+    gitsi_history *history = &context->history;
+    if (!history->is_visible)return;
+    if (is_down) {
+        size_t last = history->count > 0 ? history->count - 1 : 0;
+        history->scroll = MIN(history->scroll + page, last);
+    } else {
+        history->scroll = history->scroll > page ? history->scroll - page : 0;
+    }
+}
+
+/* Stop the history worker and free the commits. The history is left as
+ * before its first start */
+void gitsi_history_stop(gitsi_context *context) {
+    gitsi_history *history = &context->history;
+    if (!history->is_running)return;
+    pthread_mutex_lock(&history->lock);
+    history->should_stop = true;
+    atomic_fetch_add(&history->request_generation, 1);
+    pthread_cond_signal(&history->wakeup);
+    pthread_mutex_unlock(&history->lock);
+    pthread_join(history->thread, NULL);
+    history->is_running = false;
+    gitsi_preview_free_lines(history->result_lines, history->result_count);
+    gitsi_preview_free_lines(history->lines, history->count);
+    free(history->request_path);
+    free(history->shown_path);
+    free(history->repo_path);
+    free(history->error);
+    history->error = NULL;
+    // A later toggle starts a new worker from here
+    history->should_stop = false;
+    history->has_result = false;
+    history->result_lines = NULL;
+    history->result_count = 0;
+    history->lines = NULL;
+    history->count = 0;
+    history->capacity = 0;
+    history->requested = 0;
+    history->walked = 0;
+    history->is_complete = false;
+    history->scroll = 0;
+    history->status_generation = 0;
+    memset(&history->head_id, 0, sizeof(history->head_id));
+    history->request_path = NULL;
+    history->shown_path = NULL;
+    history->repo_path = NULL;
+    pthread_mutex_destroy(&history->lock);
+    pthread_cond_destroy(&history->wakeup);
+}
+
+// --------------------------------------------------
+#pragma mark Upstream
+// --------------------------------------------------
+
+/* The upstream worker thread. It counts the commits between the tips of the
+ * latest request, older requests are skipped */
+void *gitsi_upstream_worker(void *data) {
+    gitsi_context *context = data;
+    gitsi_upstream *upstream = &context->upstream;
+    git_repository *repo = NULL;
+    if (git_repository_open(&repo, upstream->repo_path) != 0) {
+        return NULL;
+    }
+    pthread_mutex_lock(&upstream->lock);
+    while (!upstream->should_stop) {
+        if (!upstream->has_request) {
+            pthread_cond_wait(&upstream->wakeup, &upstream->lock);
+            continue;
+        }
+        upstream->has_request = false;
+        git_oid local_id, upstream_id;
+        git_oid_cpy(&local_id, &upstream->request_local_id);
+        git_oid_cpy(&upstream_id, &upstream->request_upstream_id);
+        pthread_mutex_unlock(&upstream->lock);
+        
+        size_t ahead = 0, behind = 0;
+        bool is_counted = git_graph_ahead_behind(&ahead, &behind, repo, &local_id, &upstream_id) == 0;
+        
+        pthread_mutex_lock(&upstream->lock);
+        if (!is_counted)continue;
+        git_oid_cpy(&upstream->result_local_id, &local_id);
+        git_oid_cpy(&upstream->result_upstream_id, &upstream_id);
+        upstream->result_ahead = ahead;
+        upstream->result_behind = behind;
+        upstream->has_result = true;
+        gitsi_wakeup(context);
+    }
+    pthread_mutex_unlock(&upstream->lock);
+    git_repository_free(repo);
+    return NULL;
+}
+
+/* Whether the counts were made for the tips the branch and upstream have now */
+bool gitsi_upstream_is_counted(gitsi_upstream *upstream) {
+    return upstream->has_counts &&
+           git_oid_equal(&upstream->counted_local_id, &upstream->local_id) &&
+           git_oid_equal(&upstream->counted_upstream_id, &upstream->upstream_id);
+}
+
+/* Ask the worker for the counts if one of the tips moved since they were
+ * counted. The worker is started the first time */
+void gitsi_upstream_update(gitsi_context *context) {
+    gitsi_upstream *upstream = &context->upstream;
+    if (upstream->name == NULL || upstream->is_gone || gitsi_upstream_is_counted(upstream))return;
+    if (upstream->is_requested &&
+        git_oid_equal(&upstream->requested_local_id, &upstream->local_id) &&
+        git_oid_equal(&upstream->requested_upstream_id, &upstream->upstream_id)) {
+        return;
+    }
+    if (!upstream->is_running) {
+        pthread_mutex_init(&upstream->lock, NULL);
+        pthread_cond_init(&upstream->wakeup, NULL);
+        upstream->repo_path = strdup(git_repository_path(context->repo));
+        upstream->is_running = pthread_create(&upstream->thread, NULL, gitsi_upstream_worker, context) == 0;
+        if (!upstream->is_running)return;
+    }
+    upstream->is_requested = true;
+    git_oid_cpy(&upstream->requested_local_id, &upstream->local_id);
+    git_oid_cpy(&upstream->requested_upstream_id, &upstream->upstream_id);
+    pthread_mutex_lock(&upstream->lock);
+    upstream->has_request = true;
+    git_oid_cpy(&upstream->request_local_id, &upstream->local_id);
+    git_oid_cpy(&upstream->request_upstream_id, &upstream->upstream_id);
+    pthread_cond_signal(&upstream->wakeup);
+    pthread_mutex_unlock(&upstream->lock);
+}
+
+/* Take the counts of the worker. Returns true if the header changed */
+bool gitsi_upstream_collect(gitsi_context *context) {
+    gitsi_upstream *upstream = &context->upstream;
+    if (!upstream->is_running)return false;
+    pthread_mutex_lock(&upstream->lock);
+    bool has_result = upstream->has_result;
+    if (has_result) {
+        upstream->has_result = false;
+        upstream->has_counts = true;
+        git_oid_cpy(&upstream->counted_local_id, &upstream->result_local_id);
+        git_oid_cpy(&upstream->counted_upstream_id, &upstream->result_upstream_id);
+        upstream->ahead = upstream->result_ahead;
+        upstream->behind = upstream->result_behind;
+    }
+    pthread_mutex_unlock(&upstream->lock);
+    return has_result && gitsi_upstream_is_counted(upstream);
+}
+
+/* Stop the upstream worker and forget the upstream */
+void gitsi_upstream_stop(gitsi_context *context) {
+    gitsi_upstream *upstream = &context->upstream;
+    free(upstream->name);
+    free(upstream->branch_ref);
+    free(upstream->upstream_ref);
+    upstream->name = NULL;
+    upstream->branch_ref = NULL;
+    upstream->upstream_ref = NULL;
+    if (!upstream->is_running)return;
+    pthread_mutex_lock(&upstream->lock);
+    upstream->should_stop = true;
+    pthread_cond_signal(&upstream->wakeup);
+    pthread_mutex_unlock(&upstream->lock);
+    pthread_join(upstream->thread, NULL);
+    upstream->is_running = false;
+    free(upstream->repo_path);
+    upstream->repo_path = NULL;
+    pthread_mutex_destroy(&upstream->lock);
+    pthread_cond_destroy(&upstream->wakeup);
+}
+
+// --------------------------------------------------
+#pragma mark Daemon
+// --------------------------------------------------
+
+/* The path of the daemon socket for a git directory, which ends with a slash.
+ * NULL if it is too long for a socket address */
+char *gitsi_daemon_socket_path(const char *git_dir) {
+    char *path;
+    asprintf(&path, "%s%s", git_dir, DAEMON_SOCKET_NAME);
+    if (strlen(path) >= sizeof(((struct sockaddr_un*)NULL)->sun_path)) {
+        free(path);
+        return NULL;
+    }
+    return path;
+}
+
+/* Connect to the daemon socket, -1 if no daemon is listening */
+int gitsi_daemon_connect(const char *socket_path) {
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    strcpy(address.sun_path, socket_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)return -1;
+    if (connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Write all of the buffer. A peer that went away is an error, not a SIGPIPE */
+bool gitsi_send_all(int fd, const void *buffer, size_t length) {
+    const char *bytes = buffer;
+    while (length > 0) {
+        ssize_t written = send(fd, bytes, length, MSG_NOSIGNAL);
+        if (written < 0 && errno == EINTR)continue;
+        if (written <= 0)return false;
+        bytes += written;
+        length -= (size_t)written;
+    }
+    return true;
+}
+
+/* Read all of the buffer. Fails on the end of the stream or the timeout */
+bool gitsi_receive_all(int fd, void *buffer, size_t length) {
+    char *bytes = buffer;
+    while (length > 0) {
+        ssize_t received = recv(fd, bytes, length, 0);
+        if (received < 0 && errno == EINTR)continue;
+        if (received <= 0)return false;
+        bytes += received;
+        length -= (size_t)received;
+    }
+    return true;
+}
+
+/* Send the entries of the context to a client */
+bool gitsi_daemon_send_entries(int fd, gitsi_context *context) {
+    gitsi_entries *entries = &context->entries;
+    gitsi_daemon_header header = {
+        .magic = DAEMON_MAGIC,
+        .version = DAEMON_VERSION,
+        .count = entries->count,
+        .renames_skipped = context->renames_skipped,
+        .paths_length = entries->paths_length,
+    };
+    git_oid_cpy(&header.index_checksum, &context->status_index_checksum);
+    git_oid_cpy(&header.head_tree, &context->status_head_tree);
+    size_t count = entries->count;
+    return gitsi_send_all(fd, &header, sizeof(header)) &&
+    gitsi_send_all(fd, entries->paths, entries->paths_length) &&
+    gitsi_send_all(fd, entries->path_offsets, count * sizeof(uint32_t)) &&
+    gitsi_send_all(fd, entries->path_lengths, count * sizeof(uint32_t)) &&
+    gitsi_send_all(fd, entries->old_path_offsets, count * sizeof(uint32_t)) &&
+    gitsi_send_all(fd, entries->kinds, count * sizeof(uint8_t)) &&
+    gitsi_send_all(fd, entries->git_statuses, count * sizeof(uint16_t)) &&
+    gitsi_send_all(fd, entries->old_ids, count * sizeof(git_oid)) &&
+    gitsi_send_all(fd, entries->new_ids, count * sizeof(git_oid));
+}
+
+/* Are the entries of an answer of the daemon safe to use? Every path has to be
+ * within the paths and end at its length */
+bool gitsi_daemon_entries_valid(const gitsi_entries *entries) {
+    for (uint32_t i = 0; i < entries->count; i++) {
+        uint32_t offset = entries->path_offsets[i];
+        uint32_t length = entries->path_lengths[i];
+        if (length == 0 || offset >= entries->paths_length || length >= entries->paths_length - offset ||
+            entries->paths[offset + length] != '\0' || memchr(entries->paths + offset, '\0', length) != NULL)return false;
+        if (entries->old_path_offsets[i] != NO_PATH && entries->old_path_offsets[i] >= entries->paths_length)return false;
+        if ((entries->kinds[i] >> 2) > DESCRIPTION_NONE)return false;
+    }
+    return true;
+}
+
+/* Ask the daemon of the git directory for the status. Returns false if there
+ * is no daemon or its answer is not valid, the status has to be read then */
+bool gitsi_daemon_fetch(const char *git_dir, gitsi_status_request *request) {
+    char *socket_path = gitsi_daemon_socket_path(git_dir);
+    if (socket_path == NULL)return false;
+    int fd = gitsi_daemon_connect(socket_path);
+    free(socket_path);
+    if (fd < 0)return false;
+    struct timeval timeout = { .tv_sec = DAEMON_CLIENT_TIMEOUT };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    
+    gitsi_daemon_request question = {
+        .magic = DAEMON_MAGIC,
+        .version = DAEMON_VERSION,
+        .rename_mode = request->rename_mode,
+        .rename_threshold = request->rename_threshold,
+        .preload_index = request->preload_index,
+        .rename_limit = request->rename_limit,
+        .thread_count = request->thread_count,
+    };
+    gitsi_daemon_header header;
+    gitsi_entries *entries = request->entries;
+    bool is_received = gitsi_send_all(fd, &question, sizeof(question)) &&
+    gitsi_receive_all(fd, &header, sizeof(header)) &&
+    memcmp(header.magic, DAEMON_MAGIC, sizeof(header.magic)) == 0 && header.version == DAEMON_VERSION &&
+    header.count <= DAEMON_MAX_ENTRIES && header.paths_length <= DAEMON_MAX_PATHS_LENGTH;
+    if (is_received) {
+        size_t count = header.count;
+        gitsi_entries_reserve(entries, header.count);
+        entries->paths = malloc(header.paths_length + 1);
+        entries->paths[header.paths_length] = '\0';
+        entries->paths_length = entries->paths_capacity = header.paths_length;
+        is_received = gitsi_receive_all(fd, entries->paths, header.paths_length) &&
+        gitsi_receive_all(fd, entries->path_offsets, count * sizeof(uint32_t)) &&
+        gitsi_receive_all(fd, entries->path_lengths, count * sizeof(uint32_t)) &&
+        gitsi_receive_all(fd, entries->old_path_offsets, count * sizeof(uint32_t)) &&
+        gitsi_receive_all(fd, entries->kinds, count * sizeof(uint8_t)) &&
+        gitsi_receive_all(fd, entries->git_statuses, count * sizeof(uint16_t)) &&
+        gitsi_receive_all(fd, entries->old_ids, count * sizeof(git_oid)) &&
+        gitsi_receive_all(fd, entries->new_ids, count * sizeof(git_oid));
+        entries->count = header.count;
+        is_received = is_received && gitsi_daemon_entries_valid(entries);
+    }
+    close(fd);
+    if (!is_received) {
+        GITSI_LOG(GITSI_LOG_INFO, "daemon: no valid answer, reading the status");
+        gitsi_entries_free(entries);
+        return false;
+    }
+    request->renames_skipped = header.renames_skipped != 0;
+    git_oid_cpy(&request->index_checksum, &header.index_checksum);
+    git_oid_cpy(&request->head_tree, &header.head_tree);
+    return true;
+}
+
+#ifdef __linux__
+#define DAEMON_WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_FROM | \
+                             IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF)
+
+/* Is an entry of a directory listing a directory itself? Some file systems
+ * do not say, then it has to be looked at */
+bool gitsi_is_directory_entry(const char *directory, const struct dirent *item) {
+    if (item->d_type != DT_UNKNOWN)return item->d_type == DT_DIR;
+    struct stat st;
+    char *path;
+    asprintf(&path, "%s%s", directory, item->d_name);
+    bool is_directory = lstat(path, &st) == 0 && S_ISDIR(st.st_mode);
+    free(path);
+    return is_directory;
+}
+
+/* Watch a directory. `path` is taken over */
+void gitsi_daemon_add_watch(gitsi_daemon *daemon, const char *directory, char *path, bool is_git) {
+    int wd = inotify_add_watch(daemon->notify_fd, directory, DAEMON_WATCH_EVENTS | IN_ONLYDIR);
+    if (wd < 0) {
+        // Without a watch, changes below the directory would go unnoticed
+        if (errno != ENOENT)daemon->is_watching = false;
+        free(path);
+        return;
+    }
+    if ((size_t)wd >= daemon->watch_capacity) {
+        size_t capacity = MAX((size_t)wd + 1, daemon->watch_capacity * 2);
+        daemon->watches = realloc(daemon->watches, capacity * sizeof(gitsi_daemon_watch));
+        memset(daemon->watches + daemon->watch_capacity, 0, (capacity - daemon->watch_capacity) * sizeof(gitsi_daemon_watch));
+        daemon->watch_capacity = capacity;
+    }
+    free(daemon->watches[wd].path);
+    daemon->watches[wd] = (gitsi_daemon_watch){ .path = path, .is_git = is_git, .is_used = true };
+}
+
+/* Watch a directory of the workdir and everything below it. Ignored
+ * directories are skipped unless they contain tracked files */
+void gitsi_daemon_watch_tree(gitsi_context *context, gitsi_daemon *daemon, const char *path) {
+    char *directory;
+    asprintf(&directory, "%s%s", context->repo_dir, path);
+    DIR *dir = opendir(directory);
+    if (dir == NULL) {
+        free(directory);
+        return;
+    }
+    gitsi_daemon_add_watch(daemon, directory, strdup(path), false);
+    struct dirent *item;
+    while ((item = readdir(dir)) != NULL && daemon->is_watching) {
+        if (strcmp(item->d_name, ".") == 0 || strcmp(item->d_name, "..") == 0 ||
+            strcmp(item->d_name, ".git") == 0)continue;
+        if (!gitsi_is_directory_entry(directory, item))continue;
+        char *child;
+        asprintf(&child, "%s%s/", path, item->d_name);
+        int ignored = 0;
+        size_t position;
+        if (git_ignore_path_is_ignored(&ignored, context->repo, child) != 0 || !ignored ||
+            git_index_find_prefix(&position, context->repo_index, child) == 0) {
+            gitsi_daemon_watch_tree(context, daemon, child);
+        }
+        free(child);
+    }
+    closedir(dir);
+    free(directory);
+}
+
+/* Watch a directory of the git directory and everything below it */
+void gitsi_daemon_watch_git(gitsi_daemon *daemon, const char *directory) {
+    DIR *dir = opendir(directory);
+    if (dir == NULL)return;
+    gitsi_daemon_add_watch(daemon, directory, strdup(directory), true);
+    struct dirent *item;
+    while ((item = readdir(dir)) != NULL) {
+        if (strcmp(item->d_name, ".") == 0 || strcmp(item->d_name, "..") == 0 ||
+            !gitsi_is_directory_entry(directory, item))continue;
+        char *child;
+        asprintf(&child, "%s%s/", directory, item->d_name);
+        gitsi_daemon_watch_git(daemon, child);
+        free(child);
+    }
+    closedir(dir);
+}
+
+/* Remember a path of the workdir that changed */
+void gitsi_daemon_changed(gitsi_daemon *daemon, const char *path, const char *name) {
+    if (daemon->changed_count == daemon->changed_capacity) {
+        daemon->changed_capacity = daemon->changed_capacity == 0 ? 64 : daemon->changed_capacity * 2;
+        daemon->changed = realloc(daemon->changed, daemon->changed_capacity * sizeof(char*));
+    }
+    asprintf(&daemon->changed[daemon->changed_count++], "%s%s", path, name);
+    // Beyond that, a reload reads the full status anyway
+    if (daemon->changed_count > INDEX_RELOAD_LIMIT)daemon->is_stale = true;
+}
+
+/* Read the pending events of the watches */
+void gitsi_daemon_read_events(gitsi_context *context, gitsi_daemon *daemon) {
+    char buffer[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t length;
+    while ((length = read(daemon->notify_fd, buffer, sizeof(buffer))) > 0) {
+        for (char *next = buffer; next < buffer + length;) {
+            const struct inotify_event *event = (const struct inotify_event*)next;
+            next += sizeof(struct inotify_event) + event->len;
+            if (event->mask & IN_Q_OVERFLOW) {
+                daemon->is_stale = true;
+                continue;
+            }
+            if (event->wd < 0 || (size_t)event->wd >= daemon->watch_capacity ||
+                !daemon->watches[event->wd].is_used)continue;
+            gitsi_daemon_watch *watch = &daemon->watches[event->wd];
+            if (event->mask & IN_IGNORED) {
+                free(watch->path);
+                memset(watch, 0, sizeof(gitsi_daemon_watch));
+                continue;
+            }
+            if (event->len == 0)continue;
+            bool is_new_directory = (event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO));
+            char *child = NULL;
+            if (is_new_directory)asprintf(&child, "%s%s/", watch->path, event->name);
+            // The index or a ref of the git directory
+            if (watch->is_git) {
+                daemon->index_changed = true;
+                // Below the git directory itself only refs and info are watched
+                bool is_root = strcmp(watch->path, git_repository_path(context->repo)) == 0;
+                if (is_new_directory && (!is_root || strcmp(event->name, "info") == 0))gitsi_daemon_watch_git(daemon, child);
+                // The cone of a sparse checkout and the excludes decide which
+                // files are read, a reload of some paths would keep the old ones
+                if (strcmp(event->name, "sparse-checkout") == 0 || strcmp(event->name, "exclude") == 0 ||
+                    strcmp(event->name, "config") == 0 || strcmp(event->name, "config.worktree") == 0) {
+                    daemon->is_stale = true;
+                }
+            } else if (strcmp(event->name, ".git") != 0) {
+                gitsi_daemon_changed(daemon, watch->path, event->name);
+                if (is_new_directory)gitsi_daemon_watch_tree(context, daemon, child);
+                // The watches below a moved directory still have the old paths
+                if ((event->mask & IN_ISDIR) && (event->mask & IN_MOVED_FROM))daemon->is_stale = true;
+            }
+            free(child);
+        }
+    }
+}
+
+/* Watch the workdir, and the git directory for the index, HEAD and the
+ * config. Branches can be nested, i.e. refs/heads/feature/name, so all of
+ * refs is watched. info has the cone of a sparse checkout */
+void gitsi_daemon_watch_repository(gitsi_context *context, gitsi_daemon *daemon) {
+    daemon->notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (daemon->notify_fd < 0)return;
+    daemon->is_watching = true;
+    gitsi_daemon_watch_tree(context, daemon, "");
+    const char *git_dir = git_repository_path(context->repo);
+    gitsi_daemon_add_watch(daemon, git_dir, strdup(git_dir), true);
+    char *refs;
+    asprintf(&refs, "%srefs/", git_dir);
+    gitsi_daemon_watch_git(daemon, refs);
+    free(refs);
+    char *info;
+    asprintf(&info, "%sinfo/", git_dir);
+    gitsi_daemon_watch_git(daemon, info);
+    free(info);
+}
+#else
+void gitsi_daemon_read_events(gitsi_context *context, gitsi_daemon *daemon) {}
+void gitsi_daemon_watch_repository(gitsi_context *context, gitsi_daemon *daemon) {}
+#endif
+
+/* Bring the status of the daemon up to date. Only the paths that changed
+ * are read again, if the watches saw all of them */
+void gitsi_daemon_refresh(gitsi_context *context, gitsi_daemon *daemon) {
+    GITSI_LOG(GITSI_LOG_DEBUG, "daemon: %zu changed paths%s%s", daemon->changed_count,
+              daemon->index_changed ? ", index changed" : "", daemon->is_stale ? ", stale" : "");
+    if (!daemon->is_watching || daemon->is_stale ||
+        ((daemon->changed_count > 0 || daemon->index_changed) &&
+         !gitsi_reload_paths(context, daemon->changed, daemon->changed_count))) {
+        gitsi_get_repository_status(context);
+    }
+    for (size_t i = 0; i < daemon->changed_count; i++) {
+        free(daemon->changed[i]);
+    }
+    daemon->changed_count = 0;
+    daemon->index_changed = false;
+    daemon->is_stale = false;
+}
+
+/* Answer a client with the current status */
+void gitsi_daemon_serve(gitsi_context *context, gitsi_daemon *daemon, int fd) {
+    struct timeval timeout = { .tv_sec = 1 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    gitsi_daemon_request request;
+    if (!gitsi_receive_all(fd, &request, sizeof(request)) ||
+        memcmp(request.magic, DAEMON_MAGIC, sizeof(request.magic)) != 0 || request.version != DAEMON_VERSION)return;
+    if (request.rename_mode > GITSI_RENAMES_WORKDIR)return;
+    // They change how fast the status is read, not what it is
+    context->status_threads = (size_t)request.thread_count;
+    context->preload_index = request.preload_index != 0;
+    if (request.rename_mode != context->rename_mode || request.rename_limit != context->rename_limit ||
+        request.rename_threshold != context->rename_threshold) {
+        context->rename_mode = (enum GITSI_RENAMES)request.rename_mode;
+        context->rename_limit = request.rename_limit;
+        context->rename_threshold = (uint16_t)request.rename_threshold;
+        daemon->is_stale = true;
+    }
+    // The client may have just changed something, its events are queued by now
+    gitsi_daemon_read_events(context, daemon);
+    gitsi_daemon_refresh(context, daemon);
+    gitsi_daemon_send_entries(fd, context);
+}
+
+volatile sig_atomic_t daemon_stop_received = false;
+
+void daemon_stop_handler(int sig_num) {
+    daemon_stop_received = true;
+}
+
+/* Run --daemon: listen on the socket in the git directory, keep the status
+ * up to date and hand it to every gitsi that starts in the repository. The
+ * daemon detaches once it is ready and exits after an hour without clients */
+int gitsi_run_daemon(gitsi_context *context) {
+    gitsi_daemon daemon = { .listen_fd = -1, .notify_fd = -1 };
+    daemon.socket_path = gitsi_daemon_socket_path(git_repository_path(context->repo));
+    if (daemon.socket_path == NULL) {
+        fprintf(stderr, "The path of the git directory is too long for a socket\n");
+        return 1;
+    }
+    int fd = gitsi_daemon_connect(daemon.socket_path);
+    if (fd >= 0) {
+        close(fd);
+        printf("A gitsi daemon is already running for %s\n", context->repo_dir);
+        free(daemon.socket_path);
+        return 0;
+    }
+    // A socket without a daemon is left over
+    unlink(daemon.socket_path);
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    strcpy(address.sun_path, daemon.socket_path);
+    daemon.listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (daemon.listen_fd < 0 || bind(daemon.listen_fd, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+        listen(daemon.listen_fd, 16) != 0) {
+        fprintf(stderr, "Could not listen on %s: %s\n", daemon.socket_path, strerror(errno));
+        return 1;
+    }
+    
+    int error = git_repository_index(&context->repo_index, context->repo);
+    gitsi_check_error("git repository index", error);
+    gitsi_daemon_watch_repository(context, &daemon);
+    if (!daemon.is_watching) {
+        fprintf(stderr, "Could not watch the workdir, every status is read in full\n");
+    }
+    gitsi_get_repository_status(context);
+    printf("gitsi daemon for %s listening on %s\n", context->repo_dir, daemon.socket_path);
+    fflush(stdout);
+    
+    // Detach from the terminal
+    pid_t pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "Could not start the daemon: %s\n", strerror(errno));
+        return 1;
+    }
+    if (pid > 0)_exit(0);
+    setsid();
+    int null_fd = open("/dev/null", O_RDWR);
+    if (null_fd >= 0) {
+        dup2(null_fd, STDIN_FILENO);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        if (null_fd > STDERR_FILENO)close(null_fd);
+    }
+    signal(SIGINT, daemon_stop_handler);
+    signal(SIGTERM, daemon_stop_handler);
+    signal(SIGHUP, SIG_IGN);
+    
+    double last_client_at = gitsi_now_ms();
+    while (!daemon_stop_received) {
+        bool has_changes = daemon.changed_count > 0 || daemon.index_changed || daemon.is_stale;
+        struct pollfd fds[2] = {
+            { .fd = daemon.listen_fd, .events = POLLIN },
+            { .fd = daemon.notify_fd, .events = POLLIN },
+        };
+        int ready = poll(fds, daemon.notify_fd >= 0 ? 2 : 1, has_changes ? DAEMON_SETTLE_TIME : DAEMON_IDLE_TIMEOUT);
+        if (ready < 0 && errno != EINTR)break;
+        if (ready == 0) {
+            // Quiet for a while. Keep the status warm, or give up without clients
+            if (has_changes) {
+                gitsi_daemon_refresh(context, &daemon);
+            } else if (gitsi_now_ms() - last_client_at >= DAEMON_IDLE_TIMEOUT) {
+                break;
+            }
+            continue;
+        }
+        if (ready > 0 && daemon.notify_fd >= 0 && (fds[1].revents & POLLIN)) {
+            gitsi_daemon_read_events(context, &daemon);
+        }
+        if (ready > 0 && (fds[0].revents & POLLIN)) {
+            int client = accept(daemon.listen_fd, NULL, NULL);
+            if (client >= 0) {
+                gitsi_daemon_serve(context, &daemon, client);
+                close(client);
+                last_client_at = gitsi_now_ms();
+            }
+        }
     }
     
-    // The `repo_dir` is now the common repo dir that git detected
-    free(context->repo_dir);
-    context->repo_dir = NULL;
-    context->repo_dir = git_repository_workdir(context->repo);
+    unlink(daemon.socket_path);
+    close(daemon.listen_fd);
+    if (daemon.notify_fd >= 0)close(daemon.notify_fd);
+    for (size_t i = 0; i < daemon.watch_capacity; i++) {
+        free(daemon.watches[i].path);
+    }
+    free(daemon.watches);
+    for (size_t i = 0; i < daemon.changed_count; i++) {
+        free(daemon.changed[i]);
+    }
+    free(daemon.changed);
+    free(daemon.socket_path);
+    gitsi_cleanup(context);
+    return 0;
 }
 
-/* Go through all the entries in the context and free them */
-void gitsi_free_entries(gitsi_context *context) {
-    // As the `position` points to one of our entries, it also needs to be cleared
-    context->position = NULL;
-    for (size_t i = 0; i < context->entry_count; ++i) {
-        // Not all categories are always there, but we always alloc the space for 3 categories
-        // So the last [1-3] entries might never have been allocated
-        if (context->entries[i] == NULL)continue;
-        free((char*)context->entries[i]->filename);
-        free((char*)context->entries[i]->description);
-        free(context->entries[i]);
-        // Here, we explicitly don't set context->entries[i] to NULL as that would also set
-        // context->entries[0] to NULL, and then the next `if` context->entries != NULL would
-        // result in false, as context->entries == context->entries[0].
+// --------------------------------------------------
+#pragma mark Status Loader
+// --------------------------------------------------
+
+/* Read the status with a repository of its own */
+void *gitsi_status_loader_worker(void *payload) {
+    gitsi_context *context = payload;
+    gitsi_status_loader *loader = &context->loader;
+    // A daemon of the repository already has the status
+    loader->from_daemon = gitsi_daemon_fetch(loader->repo_path, &loader->request);
+    GITSI_LOG(GITSI_LOG_INFO, "loader: %s", loader->from_daemon ? "status from the daemon" : "reading the status");
+    if (!loader->from_daemon) {
+        git_repository *repo = NULL;
+        git_index *index = NULL;
+        int error = git_repository_open(&repo, loader->repo_path);
+        if (!gitsi_status_failed(&loader->request, "open repository", error)) {
+            error = git_repository_index(&index, repo);
+        }
+        if (!gitsi_status_failed(&loader->request, "git repository index", error)) {
+            loader->request.repo = repo;
+            loader->request.index = index;
+            gitsi_read_status(&loader->request);
+        }
+        git_index_free(index);
+        git_repository_free(repo);
     }
-    if (context->entries != NULL) {
-        free(context->entries);
-        context->entries = NULL;
-        context->entry_count = 0;
+    atomic_store(&loader->is_done, true);
+    gitsi_wakeup(context);
+    return NULL;
+}
+
+/* Start reading the first status in the background, so that the main loop
+ * can draw the first frame right away */
+void gitsi_status_loader_start(gitsi_context *context) {
+    gitsi_status_loader *loader = &context->loader;
+    loader->repo_path = strdup(git_repository_path(context->repo));
+    loader->request = gitsi_status_request_for(context, NULL, NULL, &loader->entries);
+    context->status_read_at = time(NULL);
+    atomic_store(&loader->is_done, false);
+    loader->is_running = pthread_create(&loader->thread, NULL, gitsi_status_loader_worker, context) == 0;
+    if (!loader->is_running) {
+        free(loader->repo_path);
+        loader->repo_path = NULL;
+        gitsi_update_status(context);
+        gitsi_select_first_entry(context);
     }
+}
+
+/* Wait for the worker and drop what it read. A status that is read on the
+ * main thread replaces it */
+void gitsi_status_loader_stop(gitsi_context *context) {
+    gitsi_status_loader *loader = &context->loader;
+    if (!loader->is_running)return;
+    pthread_join(loader->thread, NULL);
+    loader->is_running = false;
+    gitsi_entries_free(&loader->entries);
+    free(loader->request.error);
+    loader->request.error = NULL;
+    free(loader->repo_path);
+    loader->repo_path = NULL;
+}
+
+/* Take over the status once the worker is done */
+bool gitsi_status_loader_collect(gitsi_context *context) {
+    gitsi_status_loader *loader = &context->loader;
+    if (!loader->is_running || !atomic_load(&loader->is_done))return false;
+    pthread_join(loader->thread, NULL);
+    loader->is_running = false;
+    free(loader->repo_path);
+    loader->repo_path = NULL;
     
-    if (context->filtered_entries != NULL) {
-        free(context->filtered_entries);
-        context->filtered_entries = NULL;
-        context->filtered_entry_count = 0;
+    gitsi_free_entries(context);
+    context->entries = loader->entries;
+    memset(&loader->entries, 0, sizeof(gitsi_entries));
+    // The worker used an index of its own, the actions use this one
+    if (context->repo_index == NULL) {
+        int error = git_repository_index(&context->repo_index, context->repo);
+        gitsi_check_error("git repository index", error);
+    }
+    gitsi_status_taken(context, &loader->request);
+    gitsi_show_status(context);
+    if (context->position == ROW_NONE) {
+        gitsi_select_first_entry(context);
     }
+    return true;
 }
 
-/* free all the git structures as well as the entries */
-void gitsi_cleanup(gitsi_context *context) {
-    git_repository_free(context->repo);
-    git_index_free(context->repo_index);
-    context->repo_index = NULL;
-    context->repo = NULL;
-    gitsi_free_entries(context);
-    git_libgit2_shutdown();
+// --------------------------------------------------
+#pragma mark Content Search
+// --------------------------------------------------
+
+/* Does the memory contain `term`? Binary content never matches */
+bool gitsi_grep_buffer(const char *buffer, size_t length, const char *term, size_t term_length) {
+    if (memchr(buffer, '\0', MIN(length, GREP_BINARY_CHECK)) != NULL)return false;
+    return memmem(buffer, length, term, term_length) != NULL;
 }
 
-/* Add an entry to our list of entries, called when git status is performed */
-void gitsi_add_entry(const char *filename, const char *description,
-                     enum GITSI_STATUS_TYPE type, gitsi_context *context, size_t pos,
-                     git_status_t git_status) {
-    context->entries[pos] = calloc(1, sizeof(gitsi_status_entry));
-    if (filename != NULL)
-        context->entries[pos]->filename = strdup(filename);
-    else
-        context->entries[pos]->filename = NULL;
-    if (description != NULL)
-        context->entries[pos]->description = strdup(description);
-    else
-        context->entries[pos]->description = NULL;
-    context->entries[pos]->type = type;
-    context->entries[pos]->git_status = git_status;
-}
-
-/* Use libgit to get the repository status */
-void gitsi_get_repository_status(gitsi_context *context) {
-    if(context->entries != NULL) {
-        gitsi_free_entries(context);
+/* Search a file of the workspace. It is read in blocks rather than mapped, as
+ * a file that is truncated while it is searched would fault in the mapping.
+ * The end of a block is kept, so that a term across two blocks is found */
+bool gitsi_grep_file(const char *path, const char *term, size_t term_length) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)return false;
+    struct stat file_stat;
+    // Untracked directories and empty files have nothing to search
+    if (fstat(fd, &file_stat) != 0 || !S_ISREG(file_stat.st_mode) || file_stat.st_size == 0) {
+        close(fd);
+        return false;
     }
-    if (context->repo_index != NULL) {
-        git_index_free(context->repo_index);
-        context->repo_index = NULL;
+    char *buffer = malloc(GREP_READ_SIZE + term_length);
+    size_t kept = 0, offset = 0;
+    bool found = false;
+    while (!found) {
+        ssize_t length = read(fd, buffer + kept, GREP_READ_SIZE);
+        if (length < 0 && errno == EINTR)continue;
+        if (length <= 0)break;
+        // Binary content never matches
+        if (offset < GREP_BINARY_CHECK &&
+            memchr(buffer + kept, '\0', MIN((size_t)length, GREP_BINARY_CHECK - offset)) != NULL)break;
+        offset += (size_t)length;
+        size_t filled = kept + (size_t)length;
+        found = memmem(buffer, filled, term, term_length) != NULL;
+        kept = MIN(filled, term_length > 0 ? term_length - 1 : 0);
+        memmove(buffer, buffer + filled - kept, kept);
     }
-    int error = git_repository_index(&context->repo_index, context->repo);
-    gitsi_check_error("git repository index", error);
-    
-    git_status_options statusopt = GIT_STATUS_OPTIONS_INIT;
-    statusopt.show = GIT_STATUS_SHOW_INDEX_AND_WORKDIR;
-    statusopt.flags = GIT_STATUS_OPT_INCLUDE_UNTRACKED |
-    GIT_STATUS_OPT_RENAMES_HEAD_TO_INDEX |
-    GIT_STATUS_OPT_SORT_CASE_SENSITIVELY;
-    git_status_list *status = NULL;
-    error = git_status_list_new(&status, context->repo, &statusopt);
-    gitsi_check_error("git status list", error);
-    
-    size_t i, entry_count = 0, maxi = git_status_list_entrycount(status);
-    const git_status_entry *s;
-    const char *old_path, *new_path, *actual_path;
-    bool category = false;
-    
-//    size_t number_of_categories = 3;
-    // We account for off-by-one for the number of categories (+ 1)
-    // And for the number of entries (+ 1)
-    // So we reserver the number of categories + the number of entries + 2 off-by-ones
-//    size_t number_of_entries = 2 + maxi + number_of_categories;
-    
-    // It seems the `git_status_list_entrycount` function does not consider the
-    // `untracked`. We could realloc accordingly, but instead we will just pre-allocate
-    // 512 items and hope for the best.
-    size_t number_of_entries = 512;
-    
-    context->entries = calloc(number_of_entries, sizeof(gitsi_status_entry*));
-    
+    free(buffer);
+    close(fd);
+    return found;
+}
+
+/* Search a blob of the index */
+bool gitsi_grep_blob(git_repository *repo, const git_oid *id, const char *term, size_t term_length) {
+    git_blob *blob = NULL;
+    if (git_oid_iszero(id) || git_blob_lookup(&blob, repo, id) != 0)return false;
+    bool found = false;
+    if (!git_blob_is_binary(blob)) {
+        found = gitsi_grep_buffer(git_blob_rawcontent(blob), (size_t)git_blob_rawsize(blob), term, term_length);
+    }
+    git_blob_free(blob);
+    return found;
+}
+
+/* A worker of the content search. Every worker has its own repository handle
+ * for the blobs and takes the next item until there are none left */
+void *gitsi_grep_worker(void *payload) {
+    gitsi_context *context = payload;
+    gitsi_grep *grep = &context->grep;
+    git_repository *repo = NULL;
+    git_repository_open(&repo, grep->repo_path);
+    const char *workdir = repo != NULL ? git_repository_workdir(repo) : NULL;
+    size_t term_length = strlen(grep->term);
     
-    // Index
-    for (i = 0; i < maxi; ++i) {
-        const char *istatus = NULL;
-        
-        s = git_status_byindex(status, i);
-        
-        if (s->status == GIT_STATUS_CURRENT)
-            continue;
-        
-        if (s->status & GIT_STATUS_INDEX_NEW)
-            istatus = "new file";
-        if (s->status & GIT_STATUS_INDEX_MODIFIED)
-            istatus = "modified";
-        if (s->status & GIT_STATUS_INDEX_DELETED)
-            istatus = "deleted";
-        if (s->status & GIT_STATUS_INDEX_RENAMED)
-            istatus = "renamed";
-        if (s->status & GIT_STATUS_INDEX_TYPECHANGE)
-            istatus = "typechange";
-        
-        if (istatus == NULL)
-            continue;
-        
-        if (!category) {
-            category = true;
-            gitsi_add_entry("Index", NULL, STATUS_TYPE_CATEGORY, context, entry_count, GIT_STATUS_IGNORED);
-            entry_count += 1;
+    while (!atomic_load(&grep->should_stop)) {
+        uint32_t index = atomic_fetch_add(&grep->next_item, 1);
+        if (index >= grep->item_count)break;
+        gitsi_grep_item *item = &grep->items[index];
+        bool found = false;
+        if (item->path != NULL && repo != NULL) {
+            if (item->is_blob) {
+                found = gitsi_grep_blob(repo, &item->id, grep->term, term_length);
+            } else {
+                char *full_path;
+                asprintf(&full_path, "%s%s", workdir, item->path);
+                found = gitsi_grep_file(full_path, grep->term, term_length);
+                free(full_path);
+            }
         }
-        
-        old_path = s->head_to_index->old_file.path;
-        new_path = s->head_to_index->new_file.path;
-        if (old_path && new_path && strcmp(old_path, new_path)) {
-            actual_path = old_path;
-        } else {
-            actual_path = old_path ? old_path : new_path;
+        bool should_wake = false;
+        if (found) {
+            pthread_mutex_lock(&grep->lock);
+            if (grep->found_count == grep->found_capacity) {
+                grep->found_capacity = grep->found_capacity == 0 ? 64 : grep->found_capacity * 2;
+                grep->found = realloc(grep->found, grep->found_capacity * sizeof(uint32_t));
+            }
+            grep->found[grep->found_count++] = index;
+            // The main loop is only woken up for the first of a batch of matches
+            should_wake = grep->found_count == 1;
+            pthread_mutex_unlock(&grep->lock);
+        }
+        // The last one tells the main loop that the search is complete
+        if (atomic_fetch_add(&grep->done_count, 1) + 1 == grep->item_count) {
+            should_wake = true;
         }
-        gitsi_add_entry(actual_path, istatus, STATUS_TYPE_INDEX, context, entry_count, s->status);
-        entry_count += 1;
+        if (should_wake)gitsi_wakeup(context);
+    }
+    git_repository_free(repo);
+    return NULL;
+}
+
+/* Stop the workers and forget the items. The matches stay */
+void gitsi_grep_stop(gitsi_context *context) {
+    gitsi_grep *grep = &context->grep;
+    atomic_store(&grep->should_stop, true);
+    for (size_t i = 0; i < grep->thread_count; i++) {
+        pthread_join(grep->threads[i], NULL);
+    }
+    // The lock lives as long as a search was started
+    if (grep->repo_path != NULL) {
+        pthread_mutex_destroy(&grep->lock);
     }
+    grep->thread_count = 0;
+    for (uint32_t i = 0; i < grep->item_count; i++) {
+        free(grep->items[i].path);
+    }
+    free(grep->items);
+    grep->items = NULL;
+    grep->item_count = 0;
+    free(grep->found);
+    grep->found = NULL;
+    grep->found_count = 0;
+    grep->found_capacity = 0;
+    free(grep->repo_path);
+    grep->repo_path = NULL;
+}
+
+/* Start searching the entries for `grep->term`. The list is empty at first and
+ * the matches come in while the workers find them */
+void gitsi_grep_start(gitsi_context *context) {
+    gitsi_grep *grep = &context->grep;
+    gitsi_grep_stop(context);
+    gitsi_entries *entries = &context->entries;
+    free(grep->matched);
+    grep->matched = calloc(gitsi_bit_words(entries->count) + 1, sizeof(uint64_t));
+    grep->match_count = 0;
+    grep->is_active = true;
+    grep->is_finished = false;
     
-    category = false;
+    grep->items = calloc(entries->count + 1, sizeof(gitsi_grep_item));
+    grep->item_count = entries->count;
+    for (uint32_t i = 0; i < entries->count; i++) {
+        enum GITSI_STATUS_TYPE type = gitsi_entry_type(context, i);
+        if (type == STATUS_TYPE_CATEGORY)continue;
+        if (grep->scope != STATUS_TYPE_CATEGORY && type != grep->scope)continue;
+        gitsi_grep_item *item = &grep->items[i];
+        item->path = strdup(gitsi_entry_path(context, i));
+        item->is_blob = type == STATUS_TYPE_INDEX;
+        git_oid_cpy(&item->id, &entries->new_ids[i]);
+    }
     
-    // Workspace
-    for (i = 0; i < maxi; ++i) {
-        const char *wstatus = NULL;
-        
-        s = git_status_byindex(status, i);
-        
-        if (s->status == GIT_STATUS_CURRENT || s->index_to_workdir == NULL)
-            continue;
-        
-        if (s->status & GIT_STATUS_WT_MODIFIED)
-            wstatus = "modified";
-        if (s->status & GIT_STATUS_WT_DELETED)
-            wstatus = "deleted";
-        if (s->status & GIT_STATUS_WT_RENAMED)
-            wstatus = "renamed";
-        if (s->status & GIT_STATUS_WT_TYPECHANGE)
-            wstatus = "typechange";
-        
-        if (wstatus == NULL)
-            continue;
-        
-        if (!category) {
-            category = true;
-            gitsi_add_entry("Workspace", NULL, STATUS_TYPE_CATEGORY, context, entry_count, GIT_STATUS_IGNORED);
-            entry_count += 1;
+    grep->repo_path = strdup(git_repository_path(context->repo));
+    atomic_store(&grep->next_item, 0);
+    atomic_store(&grep->done_count, 0);
+    atomic_store(&grep->should_stop, false);
+    pthread_mutex_init(&grep->lock, NULL);
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t thread_count = processors > 0 ? MIN((size_t)processors, GREP_MAX_THREADS) : 1;
+    thread_count = MIN(thread_count, MAX(grep->item_count, 1));
+    for (size_t i = 0; i < thread_count; i++) {
+        if (pthread_create(&grep->threads[grep->thread_count], NULL, gitsi_grep_worker, context) != 0)break;
+        grep->thread_count += 1;
+    }
+    // Without a single worker there's nothing that would ever finish
+    if (grep->thread_count == 0 || grep->item_count == 0) {
+        grep->is_finished = true;
+    }
+}
+
+/* Take the matches of the workers into the list. Returns true if something changed */
+bool gitsi_grep_collect(gitsi_context *context) {
+    gitsi_grep *grep = &context->grep;
+    if (!grep->is_active || grep->thread_count == 0)return false;
+    pthread_mutex_lock(&grep->lock);
+    size_t found_count = grep->found_count;
+    for (size_t i = 0; i < found_count; i++) {
+        gitsi_bit_set(grep->matched, grep->found[i], true);
+    }
+    grep->found_count = 0;
+    pthread_mutex_unlock(&grep->lock);
+    grep->match_count += found_count;
+    bool is_finished = atomic_load(&grep->done_count) >= grep->item_count;
+    if (found_count == 0 && !is_finished)return false;
+    if (is_finished) {
+        gitsi_grep_stop(context);
+        grep->is_finished = true;
+    }
+    if (found_count > 0) {
+        size_t index;
+        gitsi_filter_entries(context);
+        if (!gitsi_find_position(context, &index)) {
+            gitsi_select_first_entry(context);
         }
-        
-        old_path = s->index_to_workdir->old_file.path;
-        new_path = s->index_to_workdir->new_file.path;
-        if (old_path && new_path && strcmp(old_path, new_path)) {
-            actual_path = old_path;
-        } else {
-            actual_path = old_path ? old_path : new_path;
+    }
+    return true;
+}
+
+/* Stop searching and show all entries again */
+void gitsi_grep_clear(gitsi_context *context) {
+    gitsi_grep *grep = &context->grep;
+    gitsi_grep_stop(context);
+    free(grep->matched);
+    grep->matched = NULL;
+    grep->match_count = 0;
+    grep->is_active = false;
+    strcpy(grep->term, "");
+    gitsi_filter_entries(context);
+}
+
+/* Logic to enter the text of the content search */
+void gitsi_process_grep_input(gitsi_context *context, enum key_stroke key, int ch) {
+    gitsi_grep *grep = &context->grep;
+    size_t length = strlen(grep->term);
+    if (key == K_ENTER) {
+        grep->is_input = false;
+        if (length == 0) {
+            gitsi_grep_clear(context);
+            return;
         }
-        gitsi_add_entry(actual_path, wstatus, STATUS_TYPE_WORKSPACE, context, entry_count, s->status);
-        entry_count += 1;
+        gitsi_grep_start(context);
+        gitsi_filter_entries(context);
+    } else if (key == K_ESC) {
+        grep->is_input = false;
+        gitsi_grep_clear(context);
+    } else if (key == K_BACKSPACE) {
+        if (length > 0)grep->term[length - 1] = '\0';
+    } else if (ch >= 32 && ch < 127 && length < MAX_INPUT_CHARS - 1) {
+        grep->term[length] = (char)ch;
+        grep->term[length + 1] = '\0';
     }
-    
-    category = false;
-    
-    // Untracked
-    for (i = 0; i < maxi; ++i) {
-        s = git_status_byindex(status, i);
-        if (s->status == GIT_STATUS_WT_NEW) {
-            if (!category) {
-                category = true;
-                gitsi_add_entry("Untracked", NULL, STATUS_TYPE_CATEGORY, context, entry_count, GIT_STATUS_IGNORED);
-                entry_count += 1;
-            }
-            gitsi_add_entry(s->index_to_workdir->old_file.path, "untracked", STATUS_TYPE_UNTRACKED, context, entry_count, s->status);
-            entry_count += 1;
+}
+
+// --------------------------------------------------
+#pragma mark Staging
+// --------------------------------------------------
+
+/* The largest files first, so that a huge file does not start last */
+int gitsi_stage_item_compare(const void *a, const void *b) {
+    int64_t x = ((const gitsi_stage_item *)a)->size, y = ((const gitsi_stage_item *)b)->size;
+    return x < y ? 1 : (x > y ? -1 : strcmp(((const gitsi_stage_item *)a)->path, ((const gitsi_stage_item *)b)->path));
+}
+
+/* Count the bytes that were hashed. The main loop shows the progress every
+ * few megabytes */
+void gitsi_stage_progress(gitsi_context *context, uint64_t bytes) {
+    unsigned long long before = atomic_fetch_add(&context->stage.done_bytes, bytes);
+    if (before / STAGE_PROGRESS_BYTES != (before + bytes) / STAGE_PROGRESS_BYTES) {
+        gitsi_wakeup(context);
+    }
+}
+
+/* Stream a regular file into the object database in chunks, so that huge
+ * files are never in memory as a whole and can be cancelled */
+enum GITSI_STAGE_RESULT gitsi_stage_stream_file(gitsi_context *context, git_odb *odb, int fd,
+                                                gitsi_stage_item *item, char *buffer, uint64_t *streamed) {
+    git_odb_stream *stream = NULL;
+    if (git_odb_open_wstream(&stream, odb, item->file_stat.st_size, GIT_OBJECT_BLOB) != 0)return STAGE_RESULT_FALLBACK;
+    uint64_t remaining = (uint64_t)item->file_stat.st_size;
+    bool failed = false;
+    while (remaining > 0 && !failed) {
+        if (atomic_load(&context->stage.should_stop)) {
+            failed = true;
+            break;
         }
+        ssize_t length = read(fd, buffer, (size_t)MIN(remaining, STAGE_CHUNK_SIZE));
+        if (length < 0 && errno == EINTR)continue;
+        // The file got shorter while it was read
+        failed = length <= 0 || git_odb_stream_write(stream, buffer, (size_t)length) != 0;
+        if (failed)break;
+        remaining -= (uint64_t)length;
+        *streamed += (uint64_t)length;
+        gitsi_stage_progress(context, (uint64_t)length);
     }
-    
-    context->entry_count = entry_count;
-    git_status_list_free(status);
+    if (!failed) {
+        failed = git_odb_stream_finalize_write(&item->id, stream) != 0;
+    }
+    git_odb_stream_free(stream);
+    return failed ? STAGE_RESULT_FALLBACK : STAGE_RESULT_HASHED;
 }
 
-/* Go through all entries and filter them by filename. The results are stored
- * in `context->filtered_entries` */
-void gitsi_filter_entries(gitsi_context *context) {
-    if (context->filtered_entries != NULL) {
-        free(context->filtered_entries);
-        context->filtered_entries = NULL;
+/* Write the blob of a file of the batch. The stat data is taken from the
+ * open file before it is read, so that a change while it is read makes the
+ * next status compare the content again */
+enum GITSI_STAGE_RESULT gitsi_stage_hash_file(gitsi_context *context, git_repository *repo, git_odb *odb,
+                                              gitsi_stage_item *item, char *buffer, uint64_t *streamed) {
+    char *full_path;
+    asprintf(&full_path, "%s%s", git_repository_workdir(repo), item->path);
+    int fd = open(full_path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        bool is_missing = errno == ENOENT || errno == ENOTDIR;
+        bool is_link = !is_missing && lstat(full_path, &item->file_stat) == 0 && S_ISLNK(item->file_stat.st_mode);
+        free(full_path);
+        if (is_missing)return STAGE_RESULT_MISSING;
+        // The blob of a link is its target
+        if (is_link && git_blob_create_from_workdir(&item->id, repo, item->path) == 0)return STAGE_RESULT_HASHED;
+        return STAGE_RESULT_FALLBACK;
     }
-    // We're lazy. Instead of having to use realloc, we just reserve as much space for filtered
-    // items as for normal items
-    context->filtered_entries = calloc(context->entry_count, sizeof(gitsi_status_entry*));
-    context->filtered_entry_count = 0;
-    for (size_t i = 0; i < context->entry_count; ++i) {
-        // Empty search terms match all
-        bool has_search_term = strlen(context->search_term) == 0;
-        // Headlines always match
-        bool is_headline = context->entries[i]->type == STATUS_TYPE_CATEGORY;
-        // the actual match
-        bool match_term = strstr(context->entries[i]->filename, context->search_term) != NULL;
-        if (has_search_term || match_term || is_headline) {
-            context->filtered_entries[context->filtered_entry_count] = context->entries[i];
-            context->filtered_entry_count += 1;
+    free(full_path);
+    enum GITSI_STAGE_RESULT result = STAGE_RESULT_FALLBACK;
+    if (fstat(fd, &item->file_stat) == 0 && S_ISREG(item->file_stat.st_mode)) {
+        // Files with eol conversion or a filter driver are converted by libgit2
+        git_filter_list *filters = NULL;
+        if (git_filter_list_load(&filters, repo, NULL, item->path, GIT_FILTER_TO_ODB, GIT_FILTER_DEFAULT) != 0) {
+            result = STAGE_RESULT_FALLBACK;
+        } else if (filters != NULL) {
+            git_filter_list_free(filters);
+            bool is_hashed = git_blob_create_from_workdir(&item->id, repo, item->path) == 0;
+            result = is_hashed ? STAGE_RESULT_HASHED : STAGE_RESULT_FALLBACK;
+        } else {
+            result = gitsi_stage_stream_file(context, odb, fd, item, buffer, streamed);
         }
     }
+    close(fd);
+    return result;
 }
 
-/* Perform the git status and filter it */
-void gitsi_update_status(gitsi_context *context) {
-    gitsi_get_repository_status(context);
-    if (context->entry_count == 0) {
-        gitsi_curses_stop(false);
-        printf("No entries found\n");
-        exit(0);
+/* Hash the next files of the batch with a repository handle until there are
+ * none left */
+void gitsi_stage_hash_items(gitsi_context *context, git_repository *repo, git_odb *odb) {
+    gitsi_stage *stage = &context->stage;
+    char *buffer = malloc(STAGE_CHUNK_SIZE);
+    while (!atomic_load(&stage->should_stop)) {
+        uint32_t index = atomic_fetch_add(&stage->next_item, 1);
+        if (index >= stage->item_count)break;
+        gitsi_stage_item *item = &stage->items[index];
+        uint64_t streamed = 0;
+        item->result = odb != NULL ? gitsi_stage_hash_file(context, repo, odb, item, buffer, &streamed) : STAGE_RESULT_FALLBACK;
+        if ((uint64_t)item->size > streamed) {
+            gitsi_stage_progress(context, (uint64_t)item->size - streamed);
+        }
+        // The last one tells the main loop that the batch is complete
+        uint32_t done = atomic_fetch_add(&stage->done_count, 1) + 1;
+        if (done == stage->item_count || done % 64 == 0)gitsi_wakeup(context);
     }
-    gitsi_filter_entries(context);
+    free(buffer);
 }
 
-// We need forward declarations here as the functions call each other
-void gitsi_checkout_entry(gitsi_context *context, gitsi_status_entry *entry);
+/* A worker of a staging batch. Every worker has its own repository handle */
+void *gitsi_stage_worker(void *payload) {
+    gitsi_context *context = payload;
+    git_repository *repo = NULL;
+    git_odb *odb = NULL;
+    if (git_repository_open(&repo, context->stage.repo_path) == 0) {
+        git_repository_odb(&odb, repo);
+    }
+    gitsi_stage_hash_items(context, repo, odb);
+    git_odb_free(odb);
+    git_repository_free(repo);
+    return NULL;
+}
 
-/* Stage or add an entry depending on the type of the file / entry */
-void gitsi_stage_entry(gitsi_context *context, gitsi_status_entry *entry) {
-    if (entry->type == STATUS_TYPE_CATEGORY)return;
-    
-    // if the entry is a deleted entry, what we really want to call
-    // is git_index_remove_bypath
-    if (entry->git_status == GIT_STATUS_WT_DELETED && entry->type == STATUS_TYPE_WORKSPACE) {
-        int error = git_index_remove_bypath(context->repo_index, entry->filename);
-        gitsi_check_error("git index remove bypath", error);
+/* The index entry of a hashed file. Without core.filemode, the executable
+ * bit of the file does not count and the mode of the index is kept */
+void gitsi_stage_index_entry(gitsi_context *context, const gitsi_stage_item *item, git_index_entry *entry) {
+    const struct stat *file_stat = &item->file_stat;
+    memset(entry, 0, sizeof(git_index_entry));
+#ifdef __APPLE__
+    entry->ctime.seconds = (int32_t)file_stat->st_ctimespec.tv_sec;
+    entry->ctime.nanoseconds = (uint32_t)file_stat->st_ctimespec.tv_nsec;
+    entry->mtime.seconds = (int32_t)file_stat->st_mtimespec.tv_sec;
+    entry->mtime.nanoseconds = (uint32_t)file_stat->st_mtimespec.tv_nsec;
+#else
+    entry->ctime.seconds = (int32_t)file_stat->st_ctim.tv_sec;
+    entry->ctime.nanoseconds = (uint32_t)file_stat->st_ctim.tv_nsec;
+    entry->mtime.seconds = (int32_t)file_stat->st_mtim.tv_sec;
+    entry->mtime.nanoseconds = (uint32_t)file_stat->st_mtim.tv_nsec;
+#endif
+    entry->dev = (uint32_t)file_stat->st_dev;
+    entry->ino = (uint32_t)file_stat->st_ino;
+    entry->uid = (uint32_t)file_stat->st_uid;
+    entry->gid = (uint32_t)file_stat->st_gid;
+    entry->file_size = (uint32_t)file_stat->st_size;
+    git_oid_cpy(&entry->id, &item->id);
+    entry->path = item->path;
+    if (S_ISLNK(file_stat->st_mode)) {
+        entry->mode = GIT_FILEMODE_LINK;
+    } else if (context->stage.trust_filemode) {
+        entry->mode = file_stat->st_mode & S_IXUSR ? GIT_FILEMODE_BLOB_EXECUTABLE : GIT_FILEMODE_BLOB;
+    } else {
+        const git_index_entry *existing = git_index_get_bypath(context->repo_index, item->path, 0);
+        bool is_executable = existing != NULL && existing->mode == GIT_FILEMODE_BLOB_EXECUTABLE;
+        entry->mode = is_executable ? GIT_FILEMODE_BLOB_EXECUTABLE : GIT_FILEMODE_BLOB;
     }
-    
+}
+
+/* Update the index with the blobs of the batch and write it once. Files the
+ * workers could not hash are added by libgit2 */
+void gitsi_stage_apply(gitsi_context *context) {
+    gitsi_stage *stage = &context->stage;
     int error;
-    switch (util_is_regular_file(context->repo_dir, entry->filename)) {
-        case FILE_TYPE_FILE:
-            error = git_index_add_bypath(context->repo_index, entry->filename);
-            gitsi_check_error("git index write", error);
-            break;
-        case FILE_TYPE_DIRECTORY: {
-            git_strarray arr = { .strings = (char**)&entry->filename, .count = 1};
-            error = git_index_add_all(context->repo_index, &arr, 0, NULL, NULL);
-            gitsi_check_error("git index write", error);
-            break;
+    for (size_t i = 0; i < stage->removal_count; i++) {
+        error = git_index_remove_bypath(context->repo_index, stage->removals[i]);
+        gitsi_check_error("git index remove bypath", error);
+    }
+    char **fallbacks = calloc(stage->item_count + 1, sizeof(char*));
+    size_t fallback_count = 0;
+    for (uint32_t i = 0; i < stage->item_count; i++) {
+        gitsi_stage_item *item = &stage->items[i];
+        if (item->result == STAGE_RESULT_HASHED) {
+            git_index_entry entry;
+            gitsi_stage_index_entry(context, item, &entry);
+            error = git_index_add(context->repo_index, &entry);
+            gitsi_check_error("git index add", error);
+        } else if (item->result == STAGE_RESULT_MISSING) {
+            error = git_index_remove_bypath(context->repo_index, item->path);
+            gitsi_check_error("git index remove bypath", error);
+        } else {
+            fallbacks[fallback_count++] = item->path;
         }
-        case FILE_TYPE_OTHER:
-            return;
+    }
+    if (fallback_count > 0) {
+        git_strarray arr = { .strings = fallbacks, .count = fallback_count };
+        error = git_index_add_all(context->repo_index, &arr, GIT_INDEX_ADD_DISABLE_PATHSPEC_MATCH, NULL, NULL);
+        gitsi_check_error("git index add all", error);
     }
     error = git_index_write(context->repo_index);
     gitsi_check_error("git index write", error);
+    free(fallbacks);
 }
 
-/* Unstage an entry that is in the workspace */
-void gitsi_unstage_workspace(gitsi_context *context, gitsi_status_entry *entry) {
+/* Wait for the workers and apply the batch unless it was cancelled */
+void gitsi_stage_finish(gitsi_context *context) {
+    gitsi_stage *stage = &context->stage;
+    for (size_t i = 0; i < stage->thread_count; i++) {
+        pthread_join(stage->threads[i], NULL);
+    }
+    stage->thread_count = 0;
+    bool is_cancelled = atomic_load(&stage->should_stop);
+    if (!is_cancelled) {
+        gitsi_stage_apply(context);
+        // The marks of `S` are only done once their batch is written
+        if (stage->clears_marks)gitsi_entries_set_all_marked(context, false);
+    }
+    stage->clears_marks = false;
+    GITSI_LOG(GITSI_LOG_INFO, "stage: %u files, %zu removals, %llu bytes %s after %.1f ms", stage->item_count,
+              stage->removal_count, (unsigned long long)stage->total_bytes, is_cancelled ? "cancelled" : "written",
+              gitsi_now_ms() - stage->started_at);
+    for (uint32_t i = 0; i < stage->item_count; i++) {
+        free(stage->items[i].path);
+    }
+    free(stage->items);
+    stage->items = NULL;
+    stage->item_count = 0;
+    for (size_t i = 0; i < stage->removal_count; i++) {
+        free(stage->removals[i]);
+    }
+    free(stage->removals);
+    stage->removals = NULL;
+    stage->removal_count = 0;
+    free(stage->repo_path);
+    stage->repo_path = NULL;
+    stage->is_running = false;
+}
+
+/* Stop the workers of a batch in the background. The blobs that were
+ * already written stay in the object database, the index is not touched */
+void gitsi_stage_cancel(gitsi_context *context) {
+    if (!context->stage.is_running)return;
+    atomic_store(&context->stage.should_stop, true);
+    gitsi_stage_finish(context);
+}
+
+/* Add a file to the batch */
+void gitsi_stage_add_item(gitsi_stage *stage, size_t *capacity, char *path) {
+    if (stage->item_count == *capacity) {
+        *capacity = MAX(*capacity * 2, 64);
+        stage->items = realloc(stage->items, *capacity * sizeof(gitsi_stage_item));
+    }
+    stage->items[stage->item_count++] = (gitsi_stage_item){ .path = path };
+}
+
+/* Add the files of untracked directories to the batch. They are listed with
+ * a status of only these directories, which leaves out ignored files */
+void gitsi_stage_add_directories(gitsi_context *context, size_t *capacity, char **directories, size_t count) {
+    git_status_options statusopt = GIT_STATUS_OPTIONS_INIT;
+    statusopt.show = GIT_STATUS_SHOW_WORKDIR_ONLY;
+    statusopt.flags = GIT_STATUS_OPT_INCLUDE_UNTRACKED | GIT_STATUS_OPT_RECURSE_UNTRACKED_DIRS |
+    GIT_STATUS_OPT_DISABLE_PATHSPEC_MATCH;
+    statusopt.pathspec.strings = directories;
+    statusopt.pathspec.count = count;
+    git_status_list *status = NULL;
+    int error = git_status_list_new(&status, context->repo, &statusopt);
+    gitsi_check_error("git status list", error);
+    size_t maxi = git_status_list_entrycount(status);
+    for (size_t i = 0; i < maxi; i++) {
+        const git_status_entry *s = git_status_byindex(status, i);
+        if (s->status != GIT_STATUS_WT_NEW || s->index_to_workdir == NULL)continue;
+        // A nested repository is still a directory, which libgit2 adds
+        char *path = strdup(s->index_to_workdir->new_file.path);
+        size_t length = strlen(path);
+        if (length > 1 && path[length - 1] == '/')path[length - 1] = '\0';
+        gitsi_stage_add_item(&context->stage, capacity, path);
+    }
+    git_status_list_free(status);
+}
+
+/* Stage a list of workspace or untracked entries. The blobs of large batches
+ * are written by a pool of workers, small ones right here, then the index is
+ * updated and written once.
+ * With `in_background`, large batches return right away and show their
+ * progress in the status bar until they are collected by the main loop.
+ * Returns true if the batch was written already */
+bool gitsi_stage_entries(gitsi_context *context, const uint32_t *leaves, size_t count, bool in_background) {
+    gitsi_stage *stage = &context->stage;
+    if (stage->is_running)return false;
+    stage->started_at = gitsi_now_ms();
+    stage->position_index = gitsi_position_index(context);
+    stage->removals = calloc(2 * count + 1, sizeof(char*));
+    char **directories = calloc(count + 1, sizeof(char*));
+    size_t directory_count = 0, capacity = 0;
+    for (size_t i = 0; i < count; i++) {
+        const char *filename = gitsi_entry_path(context, leaves[i]);
+        const char *old_filename = gitsi_entry_old_path(context, leaves[i]);
+        enum GITSI_STATUS_TYPE type = gitsi_entry_type(context, leaves[i]);
+        // Deletions have to be removed, everything else is added
+        if (context->entries.git_statuses[leaves[i]] == GIT_STATUS_WT_DELETED && type == STATUS_TYPE_WORKSPACE) {
+            stage->removals[stage->removal_count++] = strdup(filename);
+            continue;
+        }
+        // The old path of a rename is gone from the workspace
+        if (old_filename != NULL && type == STATUS_TYPE_WORKSPACE) {
+            stage->removals[stage->removal_count++] = strdup(old_filename);
+        }
+        // Untracked directories end with a slash which the pathspec does not want
+        char *path = strdup(filename);
+        size_t length = strlen(path);
+        if (length > 1 && path[length - 1] == '/') {
+            path[length - 1] = '\0';
+            directories[directory_count++] = path;
+        } else {
+            gitsi_stage_add_item(stage, &capacity, path);
+        }
+    }
+    if (directory_count > 0) {
+        gitsi_stage_add_directories(context, &capacity, directories, directory_count);
+    }
+    for (size_t i = 0; i < directory_count; i++) {
+        free(directories[i]);
+    }
+    free(directories);
     
-    // if the entry is a deleted entry, what we really want to call
-    // is reset as we want to eradicate the deletion
-    if (entry->git_status == GIT_STATUS_WT_DELETED && entry->type == STATUS_TYPE_WORKSPACE) {
-        gitsi_checkout_entry(context, entry);
-        return;
+    stage->total_bytes = 0;
+    for (uint32_t i = 0; i < stage->item_count; i++) {
+        char *full_path;
+        asprintf(&full_path, "%s%s", context->repo_dir, stage->items[i].path);
+        struct stat file_stat;
+        if (lstat(full_path, &file_stat) == 0 && S_ISREG(file_stat.st_mode)) {
+            stage->items[i].size = file_stat.st_size;
+            stage->total_bytes += (uint64_t)file_stat.st_size;
+        }
+        free(full_path);
+    }
+    if (stage->item_count > 1) {
+        qsort(stage->items, stage->item_count, sizeof(gitsi_stage_item), gitsi_stage_item_compare);
+    }
+    git_config *config = NULL;
+    int filemode = 1;
+    if (git_repository_config_snapshot(&config, context->repo) == 0 &&
+        git_config_get_bool(&filemode, config, "core.filemode") != 0) {
+        filemode = 1;
     }
+    git_config_free(config);
+    stage->trust_filemode = filemode != 0;
     
-    // Unstage in the workspace means delete
-    int error = git_index_remove_bypath(context->repo_index, entry->filename);
-    gitsi_check_error("git index remove bypath", error);
+    atomic_store(&stage->next_item, 0);
+    atomic_store(&stage->done_count, 0);
+    atomic_store(&stage->done_bytes, 0);
+    atomic_store(&stage->should_stop, false);
+    stage->is_running = true;
+    // Small batches cost less than a repository handle and a thread per worker
+    bool is_large = stage->item_count >= STAGE_BACKGROUND_FILES || stage->total_bytes >= STAGE_BACKGROUND_BYTES;
+    if (is_large) {
+        stage->repo_path = strdup(git_repository_path(context->repo));
+        long processors = sysconf(_SC_NPROCESSORS_ONLN);
+        size_t thread_count = processors > 0 ? MIN((size_t)processors, STAGE_MAX_THREADS) : 1;
+        thread_count = MIN(thread_count, stage->item_count);
+        for (size_t i = 0; i < thread_count; i++) {
+            if (pthread_create(&stage->threads[stage->thread_count], NULL, gitsi_stage_worker, context) != 0)break;
+            stage->thread_count += 1;
+        }
+    }
+    // Without a worker, the files are hashed right here
+    if (stage->thread_count == 0) {
+        git_odb *odb = NULL;
+        git_repository_odb(&odb, context->repo);
+        gitsi_stage_hash_items(context, context->repo, odb);
+        git_odb_free(odb);
+    }
+    if (in_background && stage->thread_count > 0) {
+        GITSI_LOG(GITSI_LOG_INFO, "stage: %u files in the background", stage->item_count);
+        return false;
+    }
+    gitsi_stage_finish(context);
+    return true;
 }
 
-/* Unstage an entry that is on the index */
-void gitsi_unstage_index(gitsi_context *context, gitsi_status_entry *entry) {
-    // Unstage in the index means workspace. This is kinda complicated.
-    char *paths[] = { (char*)entry->filename, };
+/* Write the index once a batch in the background is done. Until then, only
+ * the progress changes. Returns true if something has to be drawn */
+bool gitsi_stage_collect(gitsi_context *context) {
+    gitsi_stage *stage = &context->stage;
+    if (!stage->is_running)return false;
+    if (atomic_load(&stage->done_count) < stage->item_count)return true;
+    size_t position = stage->position_index;
+    gitsi_stage_finish(context);
+    gitsi_update_index(context);
+    gitsi_select_entry_by_index(context, position);
+    return true;
+}
+
+// --------------------------------------------------
+#pragma mark Background Jobs
+// --------------------------------------------------
+
+/* Append a line to the output pane. The oldest line is dropped when the ring is full */
+void gitsi_output_append(gitsi_context *context, const char *line) {
+    gitsi_output *output = &context->output;
+    if (output->count == OUTPUT_LINES) {
+        free(output->lines[output->first]);
+        output->lines[output->first] = strdup(line);
+        output->first = (output->first + 1) % OUTPUT_LINES;
+    } else {
+        output->lines[(output->first + output->count) % OUTPUT_LINES] = strdup(line);
+        output->count += 1;
+    }
+    // Keep the view on the same lines if the user scrolled up
+    if (output->scroll > 0 && output->scroll < output->count) {
+        output->scroll += 1;
+    }
+}
+
+/* Move the current partial line of a job into the output pane */
+void gitsi_job_flush_line(gitsi_context *context, gitsi_job *job) {
+    char *line;
+    job->line[job->line_length] = '\0';
+    asprintf(&line, "[%d] %s", job->id, job->line);
+    gitsi_output_append(context, line);
+    free(line);
+    job->line_length = 0;
+}
+
+/* Start `git <arguments>` in the repository without a terminal. Output of stdout and
+ * stderr goes to the output pane. Returns false if the job could not be started */
+bool gitsi_job_start(gitsi_context *context, const char *arguments, enum GITSI_REFRESH refresh) {
+    gitsi_job *job = NULL;
+    for (size_t i = 0; i < MAX_JOBS; i++) {
+        if (context->jobs[i].is_running)continue;
+        // Reuse the slot of the job that finished first
+        if (job == NULL || context->jobs[i].id < job->id) {
+            job = &context->jobs[i];
+        }
+    }
+    if (job == NULL) {
+        gitsi_output_append(context, "Too many jobs are running");
+        context->output.is_visible = true;
+        return false;
+    }
+    
+    int fds[2];
+    if (pipe(fds) != 0) {
+        gitsi_output_append(context, "Could not create a pipe for the job");
+        return false;
+    }
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    
+    char *command;
+    asprintf(&command, "cd '%s' && git %s", context->repo_dir, arguments);
+    char *argv[] = { (char*)"/bin/sh", (char*)"-c", command, NULL };
+    
+    // Jobs have no terminal. Git must not wait for a password prompt that nobody sees
+    size_t environment_count = 0;
+    while (environ[environment_count] != NULL)environment_count++;
+    char **environment = calloc(environment_count + 2, sizeof(char*));
+    memcpy(environment, environ, environment_count * sizeof(char*));
+    environment[environment_count] = (char*)"GIT_TERMINAL_PROMPT=0";
+    
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], STDERR_FILENO);
+    posix_spawn_file_actions_addclose(&actions, fds[1]);
+    posix_spawnattr_t attributes;
+    posix_spawnattr_init(&attributes);
+#ifdef POSIX_SPAWN_SETSID
+    // Without a controlling terminal ssh can't ask for a passphrase on top of the UI
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSID);
+#else
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETPGROUP);
+#endif
     
-    git_strarray pathspecs = { .strings = paths, .count = 1 };
-    git_reference *head;
-    git_object *head_commit;
+    pid_t pid;
+    int error = posix_spawn(&pid, argv[0], &actions, &attributes, argv, environment);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attributes);
+    free(environment);
+    free(command);
+    close(fds[1]);
+    if (error != 0) {
+        close(fds[0]);
+        GITSI_LOG(GITSI_LOG_WARN, "could not start git %s: %s", arguments, strerror(error));
+        gitsi_output_append(context, "Could not start the job");
+        return false;
+    }
     
-    git_repository_head(&head, context->repo);
-    git_reference_peel(&head_commit, head, GIT_OBJ_COMMIT);
-    git_reset_default(context->repo, head_commit, &pathspecs);
+    free(job->title);
+    memset(job, 0, sizeof(gitsi_job));
+    job->id = ++context->job_counter;
+    job->pid = pid;
+    job->fd = fds[0];
+    asprintf(&job->title, "git %s", arguments);
+    job->refresh = refresh;
+    job->is_running = true;
+    GITSI_LOG(GITSI_LOG_INFO, "job %d started: %s", job->id, job->title);
+    
+    char *line;
+    asprintf(&line, "[%d] $ %s", job->id, job->title);
+    gitsi_output_append(context, line);
+    free(line);
+    context->output.is_visible = true;
+    context->output.scroll = 0;
+    return true;
 }
 
-/* Unstage an entry that is untracked. I.e. delete it */
-void gitsi_unstage_untracked(gitsi_context *context, gitsi_status_entry *entry) {
-    char *message;
-    asprintf(&message, "Delete File '%s'?", entry->filename);
-    bool result = gitsi_dialog(context, (const char*)message);
-    free(message);
-    char *buffer;
-    asprintf(&buffer, "%s/%s", context->repo_dir, entry->filename);
-    if (result) {
-        switch (util_is_regular_file(context->repo_dir, entry->filename)) {
-            case FILE_TYPE_FILE:
-                remove(buffer);
-                break;
-            case FILE_TYPE_DIRECTORY: {
-                nftw(buffer, unlink_cb, 64, FTW_DEPTH | FTW_PHYS);
-                break;
+/* Read whatever output the job has. Returns false on end of file */
+bool gitsi_job_read(gitsi_context *context, gitsi_job *job) {
+    char buffer[4096];
+    while (true) {
+        ssize_t length = read(job->fd, buffer, sizeof(buffer));
+        if (length < 0 && errno == EINTR)continue;
+        if (length < 0)return true;
+        if (length == 0)return false;
+        for (ssize_t i = 0; i < length; i++) {
+            char c = buffer[i];
+            if (c == '\n') {
+                gitsi_job_flush_line(context, job);
+            } else if (c == '\r') {
+                // Progress output overwrites the current line
+                job->line_length = 0;
+            } else if (c == '\t') {
+                if (job->line_length < sizeof(job->line) - 1)job->line[job->line_length++] = ' ';
+            } else if ((unsigned char)c >= 32) {
+                if (job->line_length == sizeof(job->line) - 1) {
+                    gitsi_job_flush_line(context, job);
+                }
+                job->line[job->line_length++] = c;
             }
-            case FILE_TYPE_OTHER:
-                return;
         }
-        // build the full path
     }
-    free(buffer);
 }
 
-/* Unstage or delete an entry, depending on the type of a file */
-void gitsi_unstage_entry(gitsi_context *context, gitsi_status_entry *entry) {
-    if (entry->type == STATUS_TYPE_CATEGORY)return;
-    switch (entry->type) {
-        case STATUS_TYPE_WORKSPACE:
-            gitsi_unstage_workspace(context, entry);
-            break;
-        case STATUS_TYPE_INDEX:
-            gitsi_unstage_index(context, entry);
-            break;
-        case STATUS_TYPE_UNTRACKED:
-            gitsi_unstage_untracked(context, entry);
-            break;
-        case STATUS_TYPE_CATEGORY:
-            break;
+/* Called once the process of a job exited, with the status from `waitpid` */
+void gitsi_job_finish(gitsi_context *context, gitsi_job *job, int status) {
+    if (job->fd >= 0) {
+        gitsi_job_read(context, job);
+        close(job->fd);
+        job->fd = -1;
     }
-    // Write out
-    int error = git_index_write(context->repo_index);
-    gitsi_check_error("git index write", error);
-}
-
-/* Checkout an entry, i.e. remove all changes */
-void gitsi_checkout_entry(gitsi_context *context, gitsi_status_entry *entry) {
-    git_checkout_options opts;
-    git_checkout_init_options(&opts, GIT_CHECKOUT_OPTIONS_VERSION);
-    opts.checkout_strategy = GIT_CHECKOUT_FORCE;
+    if (job->line_length > 0) {
+        gitsi_job_flush_line(context, job);
+    }
+    job->exit_status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    job->is_running = false;
     
-    char *paths[] = { (char*)entry->filename, };
-    opts.paths.strings = paths;
-    opts.paths.count = 1;
+    GITSI_LOG(GITSI_LOG_INFO, "job %d exited with %d: %s", job->id, job->exit_status, job->title);
+    char *line;
+    asprintf(&line, "[%d] %s %s (%d)", job->id, job->title,
+             job->exit_status == 0 ? "finished" : "failed", job->exit_status);
+    gitsi_output_append(context, line);
+    free(line);
     
-    int error = git_checkout_head(context->repo, &opts);
+    if (job->refresh == GITSI_REFRESH_STATUS) {
+        size_t pos = gitsi_position_index(context);
+        gitsi_update_status(context);
+        gitsi_select_entry_by_index(context, pos);
+    } else {
+        // A push moves the upstream of the branch
+        gitsi_read_branch(context);
+    }
 }
 
-/* Perform action `action` on all marked entries */
-void gitsi_action_on_marked(gitsi_context *context, 
-                            void action (gitsi_context *context, gitsi_status_entry *entry)) {
-    size_t cursor_pos = gitsi_position_index(context);
-    
-    // After the action, many marked items, including probably cursor pos
-    // may have moved. We need a new position.
-    // We use the first non-marked item (including position) after position
-    bool found = false;
-    for (size_t i = cursor_pos; i < context->filtered_entry_count; ++i) {
-        if (context->filtered_entries[i]->type == STATUS_TYPE_CATEGORY)continue;
-        if (context->filtered_entries[i]->marked == true)continue;
-        cursor_pos = i;
-        found = true;
-        break;
+/* The number of jobs that are still running */
+size_t gitsi_jobs_running(gitsi_context *context) {
+    size_t count = 0;
+    for (size_t i = 0; i < MAX_JOBS; i++) {
+        if (context->jobs[i].is_running)count++;
     }
-    
-    for (size_t i = 0; i < context->entry_count; i++) {
-        gitsi_status_entry *entry = context->entries[i];
-        if (entry->marked == true) {
-            action(context, entry);
-            entry->marked = false;
+    return count;
+}
+
+/* Wait up to `timeout_ms` for input on the terminal or output of a job. Job output is
+ * read and finished jobs are reaped. Returns true if the screen has to be updated */
+bool gitsi_jobs_poll(gitsi_context *context, int timeout_ms) {
+    struct pollfd fds[MAX_JOBS + 2];
+    gitsi_job *jobs[MAX_JOBS + 2];
+    nfds_t count = 0;
+    fds[count].fd = STDIN_FILENO;
+    fds[count].events = POLLIN;
+    jobs[count++] = NULL;
+    fds[count].fd = context->wake_pipe[0];
+    fds[count].events = POLLIN;
+    jobs[count++] = NULL;
+    for (size_t i = 0; i < MAX_JOBS; i++) {
+        if (!context->jobs[i].is_running || context->jobs[i].fd < 0)continue;
+        fds[count].fd = context->jobs[i].fd;
+        fds[count].events = POLLIN;
+        jobs[count++] = &context->jobs[i];
+    }
+    // With running jobs, we also have to look for processes that exited without
+    // closing the pipe (i.e. a background ssh master keeps it open)
+    if (gitsi_jobs_running(context) > 0) {
+        timeout_ms = MIN(timeout_ms, 100);
+    }
+    if (poll(fds, count, timeout_ms) < 0) {
+        return false;
+    }
+    bool changed = false;
+    // One of the workers has results
+    if (fds[1].revents != 0) {
+        char buffer[64];
+        while (read(context->wake_pipe[0], buffer, sizeof(buffer)) > 0);
+        changed = gitsi_status_loader_collect(context);
+        changed = gitsi_diffstat_collect(context) || changed;
+        changed = gitsi_preview_collect(context) || changed;
+        changed = gitsi_history_collect(context) || changed;
+        changed = gitsi_upstream_collect(context) || changed;
+        changed = gitsi_grep_collect(context) || changed;
+        changed = gitsi_stage_collect(context) || changed;
+    }
+    for (nfds_t i = 2; i < count; i++) {
+        if (fds[i].revents == 0)continue;
+        changed = true;
+        // The output is closed, the process is reaped below once it exited
+        if (!gitsi_job_read(context, jobs[i])) {
+            close(jobs[i]->fd);
+            jobs[i]->fd = -1;
         }
     }
-    // Set the new position
-    if (found == false) {
-        gitsi_select_first_entry(context);
-    } else {
-        context->position = context->filtered_entries[cursor_pos];
+    for (size_t i = 0; i < MAX_JOBS; i++) {
+        gitsi_job *job = &context->jobs[i];
+        if (!job->is_running)continue;
+        int status;
+        if (waitpid(job->pid, &status, WNOHANG) == job->pid) {
+            gitsi_job_finish(context, job, status);
+            changed = true;
+        }
     }
+    return changed;
 }
 
+// --------------------------------------------------
+#pragma mark External Commands
+// --------------------------------------------------
+
 /* perform git diff and display it in a pager */
-void gitsi_perform_diff(gitsi_context *context, gitsi_status_entry *entry) {
+void gitsi_perform_diff(gitsi_context *context, gitsi_row row) {
     const char param_index[] = "--cached";
     const char param_workspace[] = "";
     const char param_untracked[] = "--no-index /dev/null";
     const char *param;
     
-    switch (entry->type) {
+    switch (gitsi_row_type(context, row)) {
         case STATUS_TYPE_INDEX: param = param_index; break;
         case STATUS_TYPE_WORKSPACE: param = param_workspace; break;
         case STATUS_TYPE_UNTRACKED: param = param_untracked; break;
@@ -885,7 +7531,7 @@ void gitsi_perform_diff(gitsi_context *context, gitsi_status_entry *entry) {
     }
     
     char *buffer;
-    asprintf(&buffer, "/bin/sh -c \"cd '%s' && git diff %s '%s'\"", context->repo_dir, param, entry->filename);
+    asprintf(&buffer, "/bin/sh -c \"cd '%s' && git diff %s '%s'\"", context->repo_dir, param, gitsi_row_path(context, row));
     
     gitsi_curses_stop(false);
     char *oldenv_org = getenv("GIT_PAGER");
@@ -903,11 +7549,11 @@ void gitsi_perform_diff(gitsi_context *context, gitsi_status_entry *entry) {
 }
 
 /* perform git add -p */
-void gitsi_perform_gitp(gitsi_context *context, gitsi_status_entry *entry) {
+void gitsi_perform_gitp(gitsi_context *context, gitsi_row row) {
     char *buffer;
     asprintf(&buffer, "/bin/sh -c \"cd '%s' && git add -p '%s'\"",
              context->repo_dir,
-             entry->filename);
+             gitsi_row_path(context, row));
     
     gitsi_curses_stop(false);
     system("clear");
@@ -929,33 +7575,19 @@ void gitsi_perform_commit(gitsi_context *context, bool amend) {
     free(buffer);
 }
 
-/* perform a git push */
+/* perform a git push in the background */
 void gitsi_perform_push(gitsi_context *context) {
-    char *buffer;
-    asprintf(&buffer, "/bin/sh -c \"cd '%s' && git push\"", context->repo_dir);
-    
-    gitsi_curses_stop(false);
-    system("clear");
-    system(buffer);
-    gitsi_curses_start(context);
-    free(buffer);
+    gitsi_job_start(context, "push", GITSI_REFRESH_NONE);
 }
 
-/* perform a git push -u */
+/* perform a git push -u in the background */
 void gitsi_perform_pushu(gitsi_context *context) {
-    char *buffer;
-    asprintf(&buffer, "/bin/sh -c \"cd '%s' && git push -u origin HEAD\"", context->repo_dir);
-    
-    gitsi_curses_stop(false);
-    system("clear");
-    system(buffer);
-    gitsi_curses_start(context);
-    free(buffer);
+    gitsi_job_start(context, "push -u origin HEAD", GITSI_REFRESH_NONE);
 }
 
-void gitsi_perform_edit(gitsi_context *context, gitsi_status_entry *entry) {
+void gitsi_perform_edit(gitsi_context *context, gitsi_row row) {
     char *buffer;
-    asprintf(&buffer, "/bin/sh -c \"cd '%s' && vi '%s'\"", context->repo_dir, entry->filename);
+    asprintf(&buffer, "/bin/sh -c \"cd '%s' && vi '%s'\"", context->repo_dir, gitsi_row_path(context, row));
     
     gitsi_curses_stop(false);
     system("clear");
@@ -964,7 +7596,14 @@ void gitsi_perform_edit(gitsi_context *context, gitsi_status_entry *entry) {
     free(buffer);
 }
 
+/* Run a git command. Commands run in the background with their output in the output
+ * pane. Commands that start with `!` need the terminal (i.e. `:!rebase -i`) */
 void gitsi_perform_command(gitsi_context *context, const char *command) {
+    if (command[0] != '!') {
+        gitsi_job_start(context, command, GITSI_REFRESH_STATUS);
+        return;
+    }
+    command += 1;
     char *buffer;
     asprintf(&buffer, "/bin/sh -c \"cd '%s'; git %s\"", context->repo_dir, command);
     
@@ -973,6 +7612,10 @@ void gitsi_perform_command(gitsi_context *context, const char *command) {
     system(buffer);
     gitsi_curses_start(context);
     free(buffer);
+    
+    size_t pos = gitsi_position_index(context);
+    gitsi_update_status(context);
+    gitsi_select_entry_by_index(context, pos);
 }
 
 // --------------------------------------------------
@@ -981,8 +7624,8 @@ void gitsi_perform_command(gitsi_context *context, const char *command) {
 
 /* Dynamically return the action for the S and U key (depending on the entry type) */
 void gitsi_action_names(gitsi_context *context, const char** first, const char** second) {
-    if (context->position == NULL) return;
-    switch (context->position->type) {
+    if (context->position == ROW_NONE) return;
+    switch (gitsi_row_type(context, context->position)) {
         case STATUS_TYPE_INDEX:
             *first = "";
             *second = "unstage";
@@ -1000,193 +7643,654 @@ void gitsi_action_names(gitsi_context *context, const char** first, const char**
     }
 }
 
-/* print the search bar at the bottom */
-void gitsi_print_status_search(gitsi_context *context, size_t row) {
-    const char title[] = "/";
-    mvprintw((int)row, 1, "%s%s", title, context->search_term);
-    const char search_help[] = "[Enter: back to list] [Escape: Cancel]";
-    const char search_help_short[] = "[ENTER|ESC]";
-    const int length_help = strlen(search_help);
-    const int length_help_short = strlen(search_help_short);
-    if ((context->max_x - (strlen(context->search_term) + 4)) > length_help) {
-        mvprintw((int)row, context->max_x - (length_help + 1), search_help);
-    } else {
-        mvprintw((int)row, context->max_x - (length_help_short + 1), search_help_short);
+/* print the search bar at the bottom */
+void gitsi_print_status_search(gitsi_context *context, size_t row) {
+    const char title[] = "/";
+    mvprintw((int)row, 1, "%s%s%s", title, context->search_term,
+             context->filter.is_invalid ? "  [invalid filter]" : "");
+    const char search_help[] = "[Enter: back to list] [Escape: Cancel]";
+    const char search_help_short[] = "[ENTER|ESC]";
+    const int length_help = strlen(search_help);
+    const int length_help_short = strlen(search_help_short);
+    if ((context->max_x - (strlen(context->search_term) + 4)) > length_help) {
+        mvprintw((int)row, context->max_x - (length_help + 1), search_help);
+    } else {
+        mvprintw((int)row, context->max_x - (length_help_short + 1), search_help_short);
+    }
+}
+
+/* Print the input or the progress of the content search at the bottom */
+void gitsi_print_grep(gitsi_context *context, size_t row) {
+    gitsi_grep *grep = &context->grep;
+    const char *scope = grep->scope == STATUS_TYPE_CATEGORY ? "all" : status_type_names[grep->scope];
+    char *title;
+    if (grep->is_input) {
+        asprintf(&title, "grep %s: %s", scope, grep->term);
+    } else if (grep->is_finished) {
+        asprintf(&title, "grep %s '%s': %zu files", scope, grep->term, grep->match_count);
+    } else {
+        asprintf(&title, "grep %s '%s': %zu files, %u / %u searched", scope, grep->term, grep->match_count,
+                 MIN(atomic_load(&grep->done_count), grep->item_count), grep->item_count);
+    }
+    mvaddnstr((int)row, 1, title, MAX(context->max_x - 2, 0));
+    const char *help = grep->is_input ? "[Enter: search] [Escape: Cancel]" : "[Escape: show all]";
+    int length_help = (int)strlen(help);
+    if (context->max_x - (int)strlen(title) - 4 > length_help) {
+        mvaddstr((int)row, context->max_x - (length_help + 1), help);
+    }
+    free(title);
+}
+
+/* Print the progress of a batch that is staged in the background */
+void gitsi_print_stage(gitsi_context *context, size_t row) {
+    gitsi_stage *stage = &context->stage;
+    char done_size[16], total_size[16];
+    gitsi_format_size((int64_t)MIN(atomic_load(&stage->done_bytes), stage->total_bytes), done_size, sizeof(done_size));
+    gitsi_format_size((int64_t)stage->total_bytes, total_size, sizeof(total_size));
+    char *title;
+    asprintf(&title, "staging: %u / %u files, %s / %s", MIN(atomic_load(&stage->done_count), stage->item_count),
+             stage->item_count, done_size, total_size);
+    mvaddnstr((int)row, 1, title, MAX(context->max_x - 2, 0));
+    const char help[] = "[Escape: cancel]";
+    int length_help = (int)strlen(help);
+    if (context->max_x - (int)strlen(title) - 4 > length_help) {
+        mvaddstr((int)row, context->max_x - (length_help + 1), help);
+    }
+    free(title);
+}
+
+/* Print the command bar at the bottom */
+void gitsi_print_command(gitsi_context *context, size_t row) {
+    const char title[] = ":";
+    mvprintw((int)row, 1, "%s%s", title, context->command_term);
+    const char search_command[] = "[Enter: run GIT command] [Escape: Cancel]";
+    const char search_command_short[] = "[ENTER|ESC]";
+    const int length_command = strlen(search_command);
+    const int length_command_short = strlen(search_command_short);
+    if ((context->max_x - (strlen(context->command_term) + 4)) > length_command) {
+        mvprintw((int)row, context->max_x - (length_command + 1), search_command);
+    } else {
+        mvprintw((int)row, context->max_x - (length_command_short + 1), search_command_short);
+    }
+}
+
+/* Dynamically print the bottom status help. It will print as many help
+ * entries as possible with the given width */
+void gitsi_print_status_help(gitsi_context *context, size_t row) {
+    // Tell the user that renames are not shown because there were too many candidates
+    char help_help[64];
+    snprintf(help_help, sizeof(help_help), "%s%s%s%s[h: HELP]",
+             context->renames_skipped ? "[renames skipped] " : "",
+             context->sort.key != GITSI_SORT_PATH ? "[sort: " : "",
+             context->sort.key != GITSI_SORT_PATH ? sort_names[context->sort.key] : "",
+             context->sort.key != GITSI_SORT_PATH ? "] " : "");
+    const char *action_add_name = "";
+    const char *action_del_name = "";
+    gitsi_action_names(context, &action_add_name, &action_del_name);
+    
+    size_t help_position = context->max_x - (1 + strlen(help_help));
+    int remaining_space = (int)help_position;
+    size_t current_x_position = 1;
+    for (size_t i = 0; i < help_entries_length; i++) {
+        char *title;
+        
+        const char *name = help_entries[i].name;
+        if (strcmp(name, "ACTION_A") == 0) {
+            name = action_add_name;
+        }
+        else if (strcmp(name, "ACTION_B") == 0) {
+            name = action_del_name;
+        }
+        if (strlen(name) == 0)continue;
+        asprintf(&title, "[%s: %s] ", help_entries[i].key, name);
+        remaining_space -= strlen(title);
+        if (remaining_space < 0) {
+            free(title);
+            break;
+        }
+        mvprintw((int)row, (int)current_x_position, title);
+        current_x_position += strlen(title);
+        free(title);
+    }
+    mvprintw((int)row, 1 + (int)help_position, help_help);
+}
+
+/* Print the status bar at the bottom. Either help or search */
+void gitsi_print_statusbar(gitsi_context *context) {
+    attrset(A_BOLD | A_STANDOUT);
+    gitsi_clear_line(context, context->max_y - 1);
+    if (context->is_search || strlen(context->search_term) > 0) {
+        gitsi_print_status_search(context, context->max_y - 1);
+    } else if (context->is_in_command_mode || strlen(context->command_term) > 0) {
+        gitsi_print_command(context, context->max_y - 1);
+    } else if (context->stage.is_running) {
+        gitsi_print_stage(context, context->max_y - 1);
+    } else if (context->grep.is_input || context->grep.is_active) {
+        gitsi_print_grep(context, context->max_y - 1);
+    } else {
+        gitsi_print_status_help(context, context->max_y - 1);
+    }
+    attrset(0);
+}
+
+/* The title of a row in the list. In tree mode this is the indented name of
+ * the tree node, otherwise the full path. Renames show both paths */
+const char *gitsi_entry_title(gitsi_context *context, gitsi_row row, char *buffer, size_t size) {
+    gitsi_tree_node *node = gitsi_row_node(context, row);
+    if (node == NULL) {
+        const char *old_filename = gitsi_entry_old_path(context, row);
+        if (old_filename != NULL) {
+            snprintf(buffer, size, "%s -> %s", old_filename, gitsi_entry_path(context, row));
+            return buffer;
+        }
+        return gitsi_entry_path(context, row);
+    }
+    const char *fold = "";
+    if (node->is_directory) {
+        fold = node->is_collapsed ? "+ " : "- ";
+    }
+    snprintf(buffer, size, "%*s%s%s%s", (int)(node->depth * 2), "", fold, node->name,
+             node->is_directory ? "/" : "");
+    return buffer;
+}
+
+/* The description of a row. Directories show the aggregated counts */
+const char *gitsi_entry_description(gitsi_context *context, gitsi_row row, char *buffer, size_t size) {
+    if (gitsi_row_is_directory(row)) {
+        gitsi_tree_describe(gitsi_row_node(context, row), buffer, size);
+        return buffer;
+    }
+    enum GITSI_DESCRIPTION description = gitsi_entry_kind(context, row);
+    return description != DESCRIPTION_NONE ? status_descriptions[description] : "";
+}
+
+/* The added and removed lines of an entry, or the totals of a section. Empty
+ * while the diffstat worker did not get to it yet */
+void gitsi_entry_diffstat(gitsi_context *context, gitsi_row row, char *buffer, size_t size) {
+    buffer[0] = '\0';
+    if (gitsi_row_is_directory(row))return;
+    gitsi_entries *entries = &context->entries;
+    bool has_diffstat = gitsi_bit_get(entries->has_diffstat, row);
+    uint32_t added = entries->lines_added[row], removed = entries->lines_removed[row];
+    if (gitsi_entry_type(context, row) == STATUS_TYPE_CATEGORY) {
+        if (added == 0 && removed == 0 && !has_diffstat)return;
+        snprintf(buffer, size, "+%u -%u%s", added, removed, has_diffstat ? "" : " ...");
+        return;
+    }
+    if (!has_diffstat)return;
+    if (gitsi_bit_get(entries->is_binary, row)) {
+        snprintf(buffer, size, "binary");
+    } else if (added > 0 || removed > 0) {
+        snprintf(buffer, size, "+%u -%u", added, removed);
+    }
+}
+
+/* The length of the title of a row, without formatting it */
+size_t gitsi_entry_title_length(gitsi_context *context, gitsi_row row) {
+    gitsi_tree_node *node = gitsi_row_node(context, row);
+    if (node == NULL) {
+        const char *old_filename = gitsi_entry_old_path(context, row);
+        if (old_filename != NULL) {
+            return strlen(old_filename) + 4 + strlen(gitsi_entry_path(context, row));
+        }
+        return strlen(gitsi_entry_path(context, row));
+    }
+    return node->depth * 2 + strlen(node->name) + (node->is_directory ? 3 : 0);
+}
+
+/* Forget what is on the list pad so that the next frame redraws every line.
+ * Needed after the help screen, a resize or a restart of curses */
+void gitsi_list_invalidate(gitsi_context *context) {
+    context->list_drawn_generation = 0;
+    if (context->list_pad != NULL) {
+        touchwin(context->list_pad);
+    }
+}
+
+/* The height of the output pane of the background jobs, 0 if it is hidden */
+int gitsi_output_height(gitsi_context *context) {
+    if (!context->output.is_visible || context->max_y < 12)return 0;
+    return MIN(12, context->max_y / 3);
+}
+
+/* Whether the pane of the diff preview or the history is shown */
+bool gitsi_pane_is_visible(gitsi_context *context) {
+    return context->preview.is_visible || context->history.is_visible;
+}
+
+/* Whether the pane is next to the list instead of below it */
+bool gitsi_preview_is_side(gitsi_context *context) {
+    return gitsi_pane_is_visible(context) && context->max_x >= PREVIEW_SIDE_MIN_WIDTH;
+}
+
+/* The height of the pane below the list, 0 if it is hidden or on the side */
+int gitsi_preview_height(gitsi_context *context) {
+    if (!gitsi_pane_is_visible(context) || gitsi_preview_is_side(context) || context->max_y < 12)return 0;
+    return (context->max_y - 1 - HEADER_HEIGHT - gitsi_output_height(context)) / 2;
+}
+
+/* The number of lines the list can use */
+int gitsi_list_height(gitsi_context *context) {
+    return context->max_y - 1 - HEADER_HEIGHT - gitsi_output_height(context) - gitsi_preview_height(context);
+}
+
+/* The number of columns the list can use */
+int gitsi_list_width(gitsi_context *context) {
+    return gitsi_preview_is_side(context) ? context->max_x / 2 : context->max_x;
+}
+
+/* The position of the pane, either on the right side of the list or below it.
+ * Returns the height, which includes the title line */
+int gitsi_pane_frame(gitsi_context *context, int *top, int *left, int *width) {
+    int height;
+    if (gitsi_preview_is_side(context)) {
+        *top = HEADER_HEIGHT;
+        *left = gitsi_list_width(context);
+        height = gitsi_list_height(context);
+        mvvline(*top, *left, ACS_VLINE, height);
+        *left += 1;
+    } else {
+        *top = HEADER_HEIGHT + gitsi_list_height(context);
+        *left = 0;
+        height = gitsi_preview_height(context);
+    }
+    *width = context->max_x - *left;
+    return height;
+}
+
+/* Print the title line of the pane */
+void gitsi_print_pane_title(gitsi_context *context, int top, int left, int width, const char *title) {
+    attrset(A_BOLD);
+    if (context->has_color)color_set(GITSI_COLOR_TITLE, 0);
+    mvhline(top, left, ' ', width);
+    mvaddnstr(top, left + 1, title, width - 1);
+    attrset(0);
+}
+
+/* Print the diff preview of the selected entry, either on the right side of
+ * the list or below it */
+void gitsi_print_preview(gitsi_context *context) {
+    gitsi_preview *preview = &context->preview;
+    if (!preview->is_visible)return;
+    gitsi_preview_update(context);
+    int top, left, width;
+    int height = gitsi_pane_frame(context, &top, &left, &width);
+    if (height <= 0 || width <= 1)return;
+    
+    gitsi_print_pane_title(context, top, left, width, preview->is_shown ? preview->shown_key.path : "No file selected");
+    
+    gitsi_preview_slot *slot = preview->is_shown && preview->shown_slot >= 0 ? &preview->cache[preview->shown_slot] : NULL;
+    for (int y = 1; y < height; y++) {
+        mvhline(top + y, left, ' ', width);
+        if (preview->is_shown && slot == NULL) {
+            if (y == 1)mvaddnstr(top + y, left + 1, "Loading...", width - 1);
+            continue;
+        }
+        if (slot == NULL || (size_t)(y - 1) >= slot->line_count)continue;
+        const char *line = slot->lines[y - 1];
+        if (context->has_color) {
+            if (line[0] == '+') {
+                color_set(GITSI_COLOR_INDEX, 0);
+            } else if (line[0] == '-') {
+                color_set(GITSI_COLOR_UNTRACKED, 0);
+            } else if (line[0] == '@') {
+                color_set(GITSI_COLOR_TITLE, 0);
+            }
+        }
+        mvaddnstr(top + y, left + 1, line, width - 1);
+        attrset(0);
+    }
+}
+
+/* Print the commits that changed the selected entry in the pane of the
+ * diff preview. More are requested while the pane is filled */
+void gitsi_print_history(gitsi_context *context) {
+    gitsi_history *history = &context->history;
+    if (!history->is_visible)return;
+    int top, left, width;
+    int height = gitsi_pane_frame(context, &top, &left, &width);
+    gitsi_history_update(context, height - 1);
+    if (height <= 0 || width <= 1)return;
+    
+    char *title;
+    if (history->failure != NULL) {
+        asprintf(&title, "The history could not be read: %s", history->failure);
+    } else if (history->shown_path == NULL) {
+        bool is_untracked = gitsi_row_type(context, context->position) == STATUS_TYPE_UNTRACKED;
+        title = strdup(is_untracked ? "Untracked files have no history" : "No file selected");
+    } else if (!history->is_complete) {
+        asprintf(&title, "History of %s  (%zu commits searched)", history->shown_path, history->walked);
+    } else {
+        asprintf(&title, "History of %s  (%zu commits)", history->shown_path, history->count);
+    }
+    gitsi_print_pane_title(context, top, left, width, title);
+    free(title);
+    
+    for (int y = 1; y < height; y++) {
+        mvhline(top + y, left, ' ', width);
+        size_t index = history->scroll + (size_t)(y - 1);
+        if (index >= history->count) {
+            if (index == history->count && history->shown_path != NULL && !history->is_complete) {
+                mvaddnstr(top + y, left + 1, "Loading...", width - 1);
+            }
+            continue;
+        }
+        const char *line = history->lines[index];
+        mvaddnstr(top + y, left + 1, line, width - 1);
+        // The abbreviated commit id
+        if (context->has_color) {
+            color_set(GITSI_COLOR_INDEX, 0);
+            mvaddnstr(top + y, left + 1, line, MIN(7, width - 1));
+            attrset(0);
+        }
+    }
+}
+
+/* Print the header with the branch, its upstream and the repository. The
+ * upstream is written like `git status -sb` does. While the first status is
+ * read in the background, it says so */
+void gitsi_print_header(gitsi_context *context) {
+    gitsi_upstream *upstream = &context->upstream;
+    gitsi_upstream_update(context);
+    char *tracking;
+    if (upstream->name == NULL) {
+        tracking = strdup("");
+    } else if (upstream->is_gone) {
+        asprintf(&tracking, "...%s [gone]", upstream->name);
+    } else if (!gitsi_upstream_is_counted(upstream) || (upstream->ahead == 0 && upstream->behind == 0)) {
+        asprintf(&tracking, "...%s", upstream->name);
+    } else if (upstream->behind == 0) {
+        asprintf(&tracking, "...%s [ahead %zu]", upstream->name, upstream->ahead);
+    } else if (upstream->ahead == 0) {
+        asprintf(&tracking, "...%s [behind %zu]", upstream->name, upstream->behind);
+    } else {
+        asprintf(&tracking, "...%s [ahead %zu, behind %zu]", upstream->name, upstream->ahead, upstream->behind);
+    }
+    attrset(A_BOLD);
+    if (context->has_color)color_set(GITSI_COLOR_TITLE, 0);
+    gitsi_clear_line(context, 0);
+    char *header;
+    asprintf(&header, " %s%s  %s%s", context->branch != NULL ? context->branch : "", tracking,
+             context->repo_dir, context->loader.is_running ? "  Loading status..." : "");
+    free(tracking);
+    mvaddnstr(0, 0, header, context->max_x);
+    free(header);
+    attrset(0);
+}
+
+/* Print the output pane between the list and the status bar. The first line
+ * shows the state of the jobs, the rest is the output */
+void gitsi_print_output(gitsi_context *context) {
+    int height = gitsi_output_height(context);
+    if (height == 0)return;
+    int top = HEADER_HEIGHT + gitsi_list_height(context) + gitsi_preview_height(context);
+    gitsi_output *output = &context->output;
+    
+    attrset(A_BOLD);
+    if (context->has_color)color_set(GITSI_COLOR_TITLE, 0);
+    gitsi_clear_line(context, top);
+    int x = 1;
+    mvaddnstr(top, x, "Jobs", context->max_x - x);
+    x += 5;
+    for (size_t i = 0; i < MAX_JOBS && x < context->max_x; i++) {
+        gitsi_job *job = &context->jobs[i];
+        if (job->id == 0)continue;
+        char *title;
+        if (job->is_running) {
+            asprintf(&title, "[%d %s: running] ", job->id, job->title);
+        } else {
+            asprintf(&title, "[%d %s: exit %d] ", job->id, job->title, job->exit_status);
+        }
+        mvaddnstr(top, x, title, context->max_x - x);
+        x += (int)strlen(title);
+        free(title);
+    }
+    attrset(0);
+    
+    size_t visible = (size_t)height - 1;
+    if (output->scroll + visible > output->count) {
+        output->scroll = output->count > visible ? output->count - visible : 0;
+    }
+    for (size_t y = 0; y < visible; y++) {
+        int row = top + 1 + (int)y;
+        move(row, 0);
+        clrtoeol();
+        // The last line is at the bottom, unless the user scrolled up
+        long line = (long)output->count - (long)output->scroll - (long)visible + (long)y;
+        if (line < 0)continue;
+        mvaddnstr(row, 1, output->lines[(output->first + (size_t)line) % OUTPUT_LINES], context->max_x - 1);
+    }
+}
+
+/* Make sure the pad and the caches fit the current screen size */
+void gitsi_list_prepare(gitsi_context *context, int height, int width) {
+    if (context->list_pad != NULL && context->list_pad_height == height && context->list_pad_width == width) {
+        return;
+    }
+    if (context->list_pad != NULL) {
+        delwin(context->list_pad);
+    }
+    context->list_pad = newpad(height, width);
+    scrollok(context->list_pad, TRUE);
+    context->list_pad_height = height;
+    context->list_pad_width = width;
+    
+    context->list_lines = realloc(context->list_lines, (size_t)height * sizeof(gitsi_drawn_line));
+    
+    // The ring holds twice the visible rows, so that scrolling back and forth
+    // does not format the same rows over and over again
+    for (size_t i = 0; i < context->row_cache_size; i++) {
+        free(context->row_cache[i].text);
     }
+    free(context->row_cache);
+    context->row_cache_size = (size_t)height * 2;
+    context->row_cache = calloc(context->row_cache_size, sizeof(gitsi_row_cache));
+    gitsi_list_invalidate(context);
 }
 
-/* Print the command bar at the bottom */
-void gitsi_print_command(gitsi_context *context, size_t row) {
-    const char title[] = ":";
-    mvprintw((int)row, 1, "%s%s", title, context->command_term);
-    const char search_command[] = "[Enter: run GIT command] [Escape: Cancel]";
-    const char search_command_short[] = "[ENTER|ESC]";
-    const int length_command = strlen(search_command);
-    const int length_command_short = strlen(search_command_short);
-    if ((context->max_x - (strlen(context->command_term) + 4)) > length_command) {
-        mvprintw((int)row, context->max_x - (length_command + 1), search_command);
+/* Format a row, or return the cached text if the row was formatted before.
+ * The text contains the title, padded to the longest title, and the description */
+const char *gitsi_format_row(gitsi_context *context, size_t row) {
+    gitsi_row_cache *slot = &context->row_cache[row % context->row_cache_size];
+    if (slot->generation == context->list_generation && slot->row == row) {
+        return slot->text;
+    }
+    char title_buffer[1024];
+    char description_buffer[256];
+    char diffstat_buffer[64];
+    char metadata_buffer[64] = "";
+    gitsi_row entry = context->rows[row];
+    bool is_headline = gitsi_row_type(context, entry) == STATUS_TYPE_CATEGORY;
+    const char *title;
+    const char *description = "";
+    gitsi_entry_diffstat(context, entry, diffstat_buffer, sizeof(diffstat_buffer));
+    if (is_headline) {
+        title = gitsi_entry_path(context, entry);
     } else {
-        mvprintw((int)row, context->max_x - (length_command_short + 1), search_command_short);
+        title = gitsi_entry_title(context, entry, title_buffer, sizeof(title_buffer));
+        description = gitsi_entry_description(context, entry, description_buffer, sizeof(description_buffer));
+        if (context->sort.show_metadata) {
+            gitsi_entry_metadata(context, entry, metadata_buffer, sizeof(metadata_buffer));
+        }
     }
+    int width = is_headline ? 0 : (int)context->list_title_width;
+    // The descriptions are at most as long as "typechange"
+    int description_width = is_headline ? 0 : 10;
+    size_t needed = (size_t)snprintf(NULL, 0, "%-*s %-*s %s%s", width, title, description_width, description,
+                                     metadata_buffer, diffstat_buffer) + 1;
+    if (needed > slot->capacity) {
+        slot->capacity = needed;
+        slot->text = realloc(slot->text, needed);
+    }
+    snprintf(slot->text, slot->capacity, "%-*s %-*s %s%s", width, title, description_width, description,
+             metadata_buffer, diffstat_buffer);
+    slot->row = row;
+    slot->generation = context->list_generation;
+    return slot->text;
 }
 
-/* Dynamically print the bottom status help. It will print as many help
- * entries as possible with the given width */
-void gitsi_print_status_help(gitsi_context *context, size_t row) {
-    const char *help_help = "[h: HELP]";
-    const char *action_add_name = "";
-    const char *action_del_name = "";
-    gitsi_action_names(context, &action_add_name, &action_del_name);
+/* Draw one line of the list pad */
+void gitsi_draw_list_line(gitsi_context *context, int y, size_t row, int state) {
+    WINDOW *pad = context->list_pad;
+    const int lpos = 6;
+    wattrset(pad, 0);
+    if (row == SIZE_MAX) {
+        wmove(pad, y, 0);
+        wclrtoeol(pad);
+        return;
+    }
+    enum GITSI_STATUS_TYPE type = gitsi_row_type(context, context->rows[row]);
+    bool is_selected = (state & GITSI_LINE_SELECTED) != 0;
+    bool is_marked = (state & GITSI_LINE_MARKED) != 0;
     
-    size_t help_position = context->max_x - (1 + strlen(help_help));
-    int remaining_space = (int)help_position;
-    size_t current_x_position = 1;
-    for (size_t i = 0; i < help_entries_length; i++) {
-        char *title;
-        
-        const char *name = help_entries[i].name;
-        if (strcmp(name, "ACTION_A") == 0) {
-            name = action_add_name;
+    if (context->has_color == true && !is_selected) {
+        if (type == STATUS_TYPE_INDEX) {
+            wcolor_set(pad, GITSI_COLOR_INDEX, 0);
+        } else if (type == STATUS_TYPE_CATEGORY) {
+            wcolor_set(pad, GITSI_COLOR_TITLE, 0);
+        } else if (type == STATUS_TYPE_WORKSPACE) {
+            wcolor_set(pad, GITSI_COLOR_WORKSPACE, 0);
+        } else if (type == STATUS_TYPE_UNTRACKED) {
+            wcolor_set(pad, GITSI_COLOR_UNTRACKED, 0);
         }
-        else if (strcmp(name, "ACTION_B") == 0) {
-            name = action_del_name;
-        }
-        if (strlen(name) == 0)continue;
-        asprintf(&title, "[%s: %s] ", help_entries[i].key, name);
-        remaining_space -= strlen(title);
-        if (remaining_space < 0) {
-            free(title);
-            break;
-        }
-        mvprintw((int)row, (int)current_x_position, title);
-        current_x_position += strlen(title);
-        free(title);
     }
-    mvprintw((int)row, 1 + (int)help_position, help_help);
-}
-
-/* Print the status bar at the bottom. Either help or search */
-void gitsi_print_statusbar(gitsi_context *context) {
-    attrset(A_BOLD | A_STANDOUT);
-    gitsi_clear_line(context, context->max_y - 1);
-    if (context->is_search || strlen(context->search_term) > 0) {
-        gitsi_print_status_search(context, context->max_y - 1);
-    } else if (context->is_in_command_mode || strlen(context->command_term) > 0) {
-        gitsi_print_command(context, context->max_y - 1);
-    } else {
-        gitsi_print_status_help(context, context->max_y - 1);
+    if ((state & GITSI_LINE_VISUAL) != 0 && (is_marked || is_selected)) {
+        wcolor_set(pad, GITSI_COLOR_VISUAL_SELECT, 0);
     }
-    attrset(0);
+    if (is_selected)wattron(pad, A_STANDOUT);
+    
+    // hline draws with the current attributes and never writes past the width
+    mvwhline(pad, y, 0, ' ', context->list_pad_width);
+    const char *text = gitsi_format_row(context, row);
+    if (type == STATUS_TYPE_CATEGORY) {
+        if (lpos < context->list_pad_width) {
+            mvwaddnstr(pad, y, lpos, text, context->list_pad_width - lpos);
+        }
+    } else if (lpos + 2 < context->list_pad_width) {
+        mvwaddch(pad, y, lpos, is_marked ? '*' : ' ');
+        mvwaddnstr(pad, y, lpos + 2, text, context->list_pad_width - (lpos + 2));
+    }
+    wattrset(pad, 0);
 }
 
-/* Print / scroll the current list of entries */
+/* Print / scroll the current list of entries. The list is drawn into a pad that
+ * is as high as the screen. Rows are formatted when they scroll into view and
+ * scrolling moves the pad contents, so that only new lines have to be drawn */
 void gitsi_print_list(gitsi_context *context) {
-    const size_t status_bar_height = 2;
-    const size_t lpos = 6;
-    size_t count = context->filtered_entry_count;
-    gitsi_status_entry **entries = context->filtered_entries;
+    const int lpos = 6;
+    int list_height = gitsi_list_height(context);
+    int list_width = gitsi_list_width(context);
+    if (list_height <= 0 || list_width <= 0)return;
+    gitsi_list_prepare(context, list_height, list_width);
+    WINDOW *pad = context->list_pad;
+    size_t count = context->row_count;
+    gitsi_row *rows = context->rows;
     
     size_t cursor_pos = gitsi_position_index(context);
     
-    // determine the beginning and end of the displayed page
+    // determine the beginning of the displayed page
     // based on cursor_position and height of screen
-    size_t list_height = context->max_y - status_bar_height;
-    // Have to be signed so we can see if we're <0
-    int lowerlimit = (int)(cursor_pos - list_height / 2);
-    int upperlimit = (int)(count - (list_height / 2));
-    size_t start_pos = MAX(MIN(lowerlimit, upperlimit), 0);
-    size_t length = list_height;
-    
-    // if all items fit on the list, ignore scrolling
-    if (count < list_height)start_pos = 0;
+    size_t height = (size_t)list_height;
+    size_t start_pos = 0;
+    if (count > height) {
+        size_t lowerlimit = cursor_pos > height / 2 ? cursor_pos - height / 2 : 0;
+        size_t upperlimit = count - height;
+        start_pos = MIN(lowerlimit, upperlimit);
+    }
     
-    // line number calculation. We have to iterate up to the middle, at least once
-    int middle = 0;
-    for (size_t i = start_pos; i < count; ++i) {
-        if (entries[i]->type == STATUS_TYPE_CATEGORY)continue;
-        if (i > (start_pos + length))break;
-        middle += 1;
-        if (context->position == entries[i]) {
-            break;
+    // The title column is as wide as the longest title of all rows
+    if (context->list_title_generation != context->list_generation) {
+        context->list_title_width = 0;
+        for (size_t i = 0; i < count; ++i) {
+            if (gitsi_row_type(context, rows[i]) == STATUS_TYPE_CATEGORY)continue;
+            context->list_title_width = MAX(context->list_title_width, gitsi_entry_title_length(context, rows[i]));
         }
+        context->list_title_generation = context->list_generation;
     }
     
-    // We also have to calculate the longest title and the longest description
-    // so that we can align the fields
-    size_t longest_title = 0;
-    size_t longest_description = 0;
-    for (size_t i = start_pos; i < count; ++i) {
-        if (entries[i]->type == STATUS_TYPE_CATEGORY) { continue; }
-        if (entries[i]->filename != NULL) {
-            size_t l = strlen(entries[i]->filename);
-            if (l > longest_title) {
-                longest_title = l;
+    // Scroll the pad if the rows are the same and only the page moved
+    if (context->list_drawn_generation == context->list_generation && start_pos != context->list_drawn_start) {
+        long delta = (long)start_pos - (long)context->list_drawn_start;
+        if (labs(delta) < list_height) {
+            wscrl(pad, (int)delta);
+            if (delta > 0) {
+                memmove(context->list_lines, context->list_lines + delta,
+                        (size_t)(list_height - delta) * sizeof(gitsi_drawn_line));
+                for (int y = list_height - (int)delta; y < list_height; y++) {
+                    context->list_lines[y].row = SIZE_MAX - 1;
+                }
+            } else {
+                memmove(context->list_lines - delta, context->list_lines,
+                        (size_t)(list_height + delta) * sizeof(gitsi_drawn_line));
+                for (int y = 0; y < -delta; y++) {
+                    context->list_lines[y].row = SIZE_MAX - 1;
+                }
             }
+        } else {
+            context->list_drawn_generation = 0;
         }
-        if (entries[i]->description != NULL) {
-            size_t l = strlen(entries[i]->description);
-            if (l > longest_description) {
-                longest_description = l;
-            }
+    }
+    if (context->list_drawn_generation != context->list_generation) {
+        for (int y = 0; y < list_height; y++) {
+            context->list_lines[y].row = SIZE_MAX - 1;
         }
     }
     
+    // line numbers are relative to the selected row
+    int middle = 0;
+    for (size_t i = start_pos; i < count && i <= cursor_pos; ++i) {
+        if (gitsi_row_type(context, rows[i]) != STATUS_TYPE_CATEGORY)middle += 1;
+    }
     
     int linum_pos = 1;
-    for (size_t i = start_pos; i < count; ++i) {
-        if (i > (start_pos + length))break;
-        int pos = ((int)i) - (int)start_pos;
-        bool is_selected = context->position == entries[i];
-        bool is_marked = entries[i]->marked;
-        
-        if (context->has_color == true && !is_selected) {
-            if (entries[i]->type == STATUS_TYPE_INDEX) {
-                color_set(GITSI_COLOR_INDEX, 0);
-            } else if (entries[i]->type == STATUS_TYPE_CATEGORY) {
-                color_set(GITSI_COLOR_TITLE, 0);
-            } else if (entries[i]->type == STATUS_TYPE_WORKSPACE) {
-                color_set(GITSI_COLOR_WORKSPACE, 0);
-            } else if (entries[i]->type == STATUS_TYPE_UNTRACKED) {
-                color_set(GITSI_COLOR_UNTRACKED, 0);
-            }
+    for (int y = 0; y < list_height; y++) {
+        size_t row = start_pos + (size_t)y;
+        int state = 0;
+        if (row >= count) {
+            row = SIZE_MAX;
+        } else {
+            if (context->position == rows[row])state |= GITSI_LINE_SELECTED;
+            if (gitsi_row_marked(context, rows[row]))state |= GITSI_LINE_MARKED;
+            if (context->is_visual_mark_mode)state |= GITSI_LINE_VISUAL;
         }
-        
-        if (context->is_visual_mark_mode == true && (is_marked || is_selected)) {
-            color_set(GITSI_COLOR_VISUAL_SELECT, 0);
+        gitsi_drawn_line *line = &context->list_lines[y];
+        if (line->row != row || line->state != state) {
+            gitsi_draw_list_line(context, y, row, state);
+            line->row = row;
+            line->state = state;
         }
-        if (is_selected)attron(A_STANDOUT);
-        
-        gitsi_clear_line(context, pos);
-        if (entries[i]->type == STATUS_TYPE_CATEGORY) {
-            mvprintw(pos, lpos, entries[i]->filename);
-            color_set(GITSI_COLOR_VISUAL_SELECT, 0);
-            mvprintw(pos, 0, "    ");
+        if (row == SIZE_MAX)continue;
+        // The gutter changes with every move of the cursor, it's always drawn
+        wattrset(pad, 0);
+        wcolor_set(pad, GITSI_COLOR_VISUAL_SELECT, 0);
+        if (gitsi_row_type(context, rows[row]) == STATUS_TYPE_CATEGORY) {
+            mvwaddnstr(pad, y, 0, "    ", MIN(4, context->list_pad_width));
         } else {
-            const char* filename = entries[i]->filename;
-            if (filename == NULL)filename = "";
-            const char* description = entries[i]->description;
-            if (description == NULL)description = "";
-            size_t c = lpos;
-            const char *marker = is_marked ? "*" : " ";
-            mvprintw(pos, c, marker);
-            c += strlen(marker);
-            c += 1;
-            mvprintw(pos, c, filename);
-            c += longest_title + 1;
-            mvprintw(pos, c, description);
-            
-            color_set(GITSI_COLOR_VISUAL_SELECT, 0);
-            mvprintw(pos, 0, "%3d ", abs(middle - linum_pos));
+            char gutter[16];
+            snprintf(gutter, sizeof(gutter), "%3d ", abs(middle - linum_pos));
+            mvwaddnstr(pad, y, 0, gutter, MIN(lpos - 2, context->list_pad_width));
             linum_pos += 1;
         }
-        
-        attrset(0);
+        wattrset(pad, 0);
     }
     
-    // clear the remaining lines
-    for (size_t i = (count - start_pos); i < (size_t)context->max_y; i++) {
-        gitsi_clear_line(context, i);
+    // An empty status says why there is nothing to show
+    if (context->entries.count == 0 && !context->loader.is_running) {
+        const char *message = context->status_failed ? "The status could not be read" : "Nothing to commit, working tree clean";
+        mvwaddnstr(pad, 0, lpos, message, MAX(context->list_pad_width - lpos, 0));
+        context->list_lines[0].row = SIZE_MAX - 1;
+    }
+    // The pending count for j/k/C-d/C-u is shown in the top right corner
+    if (context->number_stack_count > 0 && context->number_stack_count < context->list_pad_width) {
+        mvwaddstr(pad, 0, context->list_pad_width - context->number_stack_count, context->number_stack);
+        context->list_lines[0].row = SIZE_MAX - 1;
     }
+    
+    context->list_drawn_start = start_pos;
+    context->list_drawn_generation = context->list_generation;
+    pnoutrefresh(pad, 0, 0, HEADER_HEIGHT, 0, HEADER_HEIGHT + list_height - 1, context->list_pad_width - 1);
+    
+    gitsi_diffstat_prioritize(context, start_pos, height);
 }
 
 /* Print the full help screen (i.e. `h` key) */
@@ -1205,6 +8309,25 @@ void gitsi_print_full_help(gitsi_context *context) {
     mvprintw((int)i, 2, "Use 1-9 before j/k/C-d/C-u to repeat the action [like vi]");
 }
 
+/* Stream the status to stdout for scripts. No threads or curses are
+ * started, the entries are written while the status is classified */
+int gitsi_write_status(gitsi_context *context) {
+    // Scripts read the whole status, so write it in large blocks
+    setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+    gitsi_status_request request = gitsi_status_request_for(context, NULL, NULL, &context->entries);
+    if (gitsi_daemon_fetch(git_repository_path(context->repo), &request)) {
+        for (uint32_t i = 0; i < context->entries.count; i++) {
+            if (gitsi_entry_type(context, i) != STATUS_TYPE_CATEGORY)gitsi_write_entry(context, i);
+        }
+    } else if (!gitsi_get_repository_status(context)) {
+        gitsi_cleanup(context);
+        return 1;
+    }
+    bool failed = fflush(stdout) != 0 || ferror(stdout);
+    gitsi_cleanup(context);
+    return failed ? 1 : 0;
+}
+
 // --------------------------------------------------
 #pragma mark Main Logic
 // --------------------------------------------------
@@ -1213,10 +8336,18 @@ void gitsi_print_full_help(gitsi_context *context) {
 void gitsi_print_main(gitsi_context *context) {
     if (context->is_in_help == true) {
         gitsi_print_full_help(context);
+        gitsi_list_invalidate(context);
     } else {
-        gitsi_print_list(context);
+        // stdscr goes first, the list pad is copied on top of it
+        gitsi_print_header(context);
+        gitsi_print_preview(context);
+        gitsi_print_history(context);
+        gitsi_print_output(context);
         gitsi_print_statusbar(context);
+        wnoutrefresh(stdscr);
+        gitsi_print_list(context);
     }
+    doupdate();
 }
 
 /* Logic to handle searching */
@@ -1225,17 +8356,9 @@ void gitsi_process_search(gitsi_context *context, enum key_stroke key, int ch) {
     if (key == K_ENTER) {
         context->is_search = false;
         // if the position is not part of the search anymore, change position to first
-        bool found = false;
-        if (context->position != NULL) {
-            for (size_t i = 0; i < context->filtered_entry_count; i++) {
-                if (context->filtered_entries[i] == context->position) {
-                    found = true;
-                    break;
-                }
-            }
-            if (found == false) {
-                gitsi_select_first_entry(context);
-            }
+        size_t index = 0;
+        if (context->position != ROW_NONE && !gitsi_find_position(context, &index)) {
+            gitsi_select_first_entry(context);
         }
         return;
     }
@@ -1250,7 +8373,11 @@ void gitsi_process_search(gitsi_context *context, enum key_stroke key, int ch) {
         }
     }
     else {
-        sprintf(context->search_term, "%s%c", context->search_term, ch);
+        size_t length = strlen(context->search_term);
+        if (length < MAX_INPUT_CHARS - 1) {
+            context->search_term[length] = (char)ch;
+            context->search_term[length + 1] = '\0';
+        }
     }
     gitsi_filter_entries(context);
 }
@@ -1277,7 +8404,11 @@ void gitsi_process_command_input(gitsi_context *context, enum key_stroke key, in
         }
     }
     else {
-        sprintf(context->command_term, "%s%c", context->command_term, ch);
+        size_t length = strlen(context->command_term);
+        if (length < MAX_INPUT_CHARS - 1) {
+            context->command_term[length] = (char)ch;
+            context->command_term[length + 1] = '\0';
+        }
     }
 }
 
@@ -1294,9 +8425,12 @@ void sigint_handler(int sig_num) {
 
 void gitsi_process_input(gitsi_context *context, int input_char) {
     enum key_stroke key = translate_key(context, input_char);
+    GITSI_LOG(GITSI_LOG_DEBUG, "key %i%s", input_char, key == K_OTHER ? " (unbound)" : "");
     
     if (context->is_search) {
         gitsi_process_search(context, key, input_char);
+    } else if (context->grep.is_input) {
+        gitsi_process_grep_input(context, key, input_char);
     } else if (context->is_in_command_mode) {
         gitsi_process_command_input(context, key, input_char);
     } else if (context->is_in_help) {
@@ -1313,22 +8447,47 @@ void gitsi_process_input(gitsi_context *context, int input_char) {
         } else if (key == K_SLASH) {
             context->is_search = true;
         } else if (key == K_ESC) {
-            if (strlen(context->search_term) > 0) {
+            if (context->stage.is_running) {
+                gitsi_stage_cancel(context);
+            }
+            else if (strlen(context->search_term) > 0) {
                 strcpy(context->search_term, "");
                 gitsi_filter_entries(context);
             }
+            else if (context->grep.is_active) {
+                gitsi_grep_clear(context);
+            }
             else if (context->is_visual_mark_mode == true) {
                 context->is_visual_mark_mode = false;
-                for (size_t i = 0; i < context->entry_count; i++) {
-                    context->entries[i]->marked = false;
+                gitsi_entries_set_all_marked(context, false);
+                for (size_t i = 0; context->tree != NULL && i < context->tree->directory_node_count; i++) {
+                    context->tree->directory_nodes[i]->marked = false;
                 }
             }
         } else if (key == K_Q) {
+            size_t running = gitsi_jobs_running(context);
+            if (running > 0) {
+                char *message;
+                asprintf(&message, "%zu jobs are still running. Quit anyway?", running);
+                bool result = gitsi_dialog(context, message);
+                free(message);
+                if (!result)return;
+            }
             sigint_received = true;
             return;
         } else if (key == K_H || key == K_HELP) {
             context->is_in_help = true;
         }
+        else if (context->stage.is_running && key != K_J && key != K_K && key != K_ARROW_DOWN &&
+                 key != K_ARROW_UP && key != K_S_O && key != K_LBRACE && key != K_RBRACE) {
+            // Nothing may touch the index until the batch is written
+            return;
+        }
+        else if (context->loader.is_running && key != K_S_O && key != K_LBRACE && key != K_RBRACE &&
+                 key != K_COMMAND && key != K_P && key != K_S_P) {
+            // There is no list yet, only the output pane and commands work
+            return;
+        }
         else if (key == K_J || key == K_ARROW_DOWN) {
             for (int i = 0; i < iteration_count; i++) {
                 gitsi_select_entry(context, 1);
@@ -1357,68 +8516,114 @@ void gitsi_process_input(gitsi_context *context, int input_char) {
         }
         else if (key == K_S) {
             size_t pos = gitsi_position_index(context);
-            gitsi_stage_entry(context, context->position);
-            gitsi_update_status(context);
-            gitsi_select_entry_by_index(context, pos);
+            // Large batches are staged in the background, they reload once done
+            if (gitsi_stage_entry(context, context->position, context->replay_screen == NULL)) {
+                gitsi_update_index(context);
+                gitsi_select_entry_by_index(context, pos);
+            }
         }
         else if (key == K_U) {
             size_t pos = gitsi_position_index(context);
+            // Only unstaging from the index leaves the workdir alone
+            bool is_index = gitsi_row_type(context, context->position) == STATUS_TYPE_INDEX;
             gitsi_unstage_entry(context, context->position);
-            gitsi_update_status(context);
+            if (is_index) {
+                gitsi_update_index(context);
+            } else {
+                gitsi_update_status(context);
+            }
             gitsi_select_entry_by_index(context, pos);
         }
         else if (key == K_S_S) {
-            gitsi_action_on_marked(context, &gitsi_stage_entry);
-            gitsi_update_status(context);
+            size_t pos = gitsi_position_index(context);
+            if (gitsi_stage_marked(context, context->replay_screen == NULL)) {
+                gitsi_update_index(context);
+                gitsi_select_entry_by_index(context, pos);
+            }
         }
         else if (key == K_S_U) {
             gitsi_action_on_marked(context, &gitsi_unstage_entry);
             gitsi_update_status(context);
         }
         else if (key == K_I) {
-            if (context->position != NULL) {
+            if (context->position != ROW_NONE) {
                 gitsi_perform_gitp(context, context->position);
-                gitsi_update_status(context);
+                gitsi_update_index(context);
             }
         }
         else if (key == K_R) {
             gitsi_update_status(context);
         }
+        else if (key == K_S_R) {
+            context->rename_mode = (context->rename_mode + 1) % (GITSI_RENAMES_WORKDIR + 1);
+            size_t pos = gitsi_position_index(context);
+            context->position = ROW_NONE;
+            gitsi_update_status(context);
+            gitsi_select_entry_by_index(context, pos);
+        }
         else if (key == K_C) {
             gitsi_perform_commit(context, false);
-            gitsi_update_status(context);
+            gitsi_update_index(context);
         }
         else if (key == K_S_C) {
             gitsi_perform_commit(context, true);
-            gitsi_update_status(context);
+            gitsi_update_index(context);
         }
         else if (key == K_P) {
             gitsi_perform_push(context);
-            gitsi_update_status(context);
         }
         else if (key == K_S_P) {
             gitsi_perform_pushu(context);
-            gitsi_update_status(context);
+        }
+        else if (key == K_S_O) {
+            context->output.is_visible = !context->output.is_visible;
+        }
+        else if (key == K_S_D) {
+            // The diff preview and the history share the pane
+            context->history.is_visible = false;
+            gitsi_preview_toggle(context);
+        }
+        else if (key == K_S_L) {
+            gitsi_history_toggle(context);
+        }
+        else if (key == K_LBRACKET || key == K_RBRACKET) {
+            int height = gitsi_preview_is_side(context) ? gitsi_list_height(context) : gitsi_preview_height(context);
+            gitsi_history_scroll(context, (size_t)MAX(height - 2, 1), key == K_RBRACKET);
+        }
+        else if (key == K_F || key == K_S_F) {
+            // The workers read the text, so they have to stop before it is edited
+            gitsi_grep_stop(context);
+            context->grep.scope = key == K_F ? gitsi_row_type(context, context->position) : STATUS_TYPE_CATEGORY;
+            context->grep.is_input = true;
+            strcpy(context->grep.term, "");
+        }
+        else if (key == K_LBRACE || key == K_RBRACE) {
+            size_t page = (size_t)MAX(gitsi_output_height(context) - 2, 1);
+            if (key == K_LBRACE) {
+                context->output.scroll += page;
+            } else {
+                context->output.scroll = context->output.scroll > page ? context->output.scroll - page : 0;
+            }
         }
         else if (key == K_X) {
-            if (context->position == NULL)return;
-            if (context->position->type == STATUS_TYPE_UNTRACKED)return;
+            if (context->position == ROW_NONE)return;
+            if (gitsi_row_type(context, context->position) == STATUS_TYPE_UNTRACKED)return;
             bool shouldCheckout = gitsi_dialog(context, "Do you really want to reset all changes to this file?");
             if (shouldCheckout == true) {
                 size_t pos = gitsi_position_index(context);
                 gitsi_checkout_entry(context, context->position);
-                context->position = NULL;
+                context->position = ROW_NONE;
                 gitsi_update_status(context);
                 gitsi_select_entry_by_index(context, pos);
             }
         }
         else if (key == K_D) {
-            if (context->position != NULL) {
+            if (context->position != ROW_NONE) {
                 gitsi_perform_diff(context, context->position);
             }
         }
         else if (key == K_E) {
-            if (context->position != NULL) {
+            if (context->position != ROW_NONE) {
                 gitsi_perform_edit(context, context->position);
                 gitsi_update_status(context);
             }
@@ -1436,27 +8641,66 @@ void gitsi_process_input(gitsi_context *context, int input_char) {
             gitsi_select_category(context, STATUS_TYPE_UNTRACKED);
         }
         else if (key == K_M) {
-            if (context->position != NULL) {
-                context->position->marked = !context->position->marked;
+            if (context->position != ROW_NONE) {
+                bool marked = !gitsi_row_marked(context, context->position);
+                gitsi_row_set_marked(context, context->position, marked);
+                // Marking a directory marks everything below it
+                if (gitsi_row_is_directory(context->position)) {
+                    uint32_t *leaves;
+                    size_t count = gitsi_tree_collect(gitsi_row_node(context, context->position), &leaves);
+                    for (size_t i = 0; i < count; i++) {
+                        gitsi_entry_set_marked(context, leaves[i], marked);
+                    }
+                    free(leaves);
+                }
             }
         }
+        else if (key == K_STAR) {
+            gitsi_mark_matches(context);
+        }
+        else if (key == K_T) {
+            context->is_tree_mode = !context->is_tree_mode;
+            gitsi_filter_entries(context);
+        }
+        else if (key == K_COMMA) {
+            context->sort.key = (context->sort.key + 1) % sort_names_length;
+            gitsi_filter_entries(context);
+        }
+        else if (key == K_SEMICOLON) {
+            context->sort.show_metadata = !context->sort.show_metadata;
+            gitsi_filter_entries(context);
+        }
+        else if (key == K_O || key == K_ARROW_LEFT || key == K_ARROW_RIGHT) {
+            if (!context->is_tree_mode || context->position == ROW_NONE)return;
+            gitsi_tree_node *node = gitsi_row_node(context, context->position);
+            // On a file, left collapses the directory that contains it
+            if (!gitsi_row_is_directory(context->position)) {
+                if (key != K_ARROW_LEFT || node == NULL || node->parent == NULL ||
+                    node->parent->row == ROW_NONE)return;
+                node = node->parent;
+                context->position = node->row;
+            }
+            bool collapsed = node->is_collapsed;
+            if (key == K_O)collapsed = !collapsed;
+            else collapsed = key == K_ARROW_LEFT;
+            gitsi_tree_set_collapsed(context, node, collapsed);
+            gitsi_filter_entries(context);
+        }
         else if (key == K_S_V) {
             // Only if visual mark mode was off, do we modify the current position
-            if (!context->is_visual_mark_mode && context->position != NULL) {
-                context->position->marked = !context->position->marked;
+            if (!context->is_visual_mark_mode && context->position != ROW_NONE) {
+                gitsi_row_set_marked(context, context->position, !gitsi_row_marked(context, context->position));
             }
             context->is_visual_mark_mode = !context->is_visual_mark_mode;
         }
         else if (key == K_S_M) {
             // get the current section from position, and iterate over all in section
-            if (context->position != NULL && context->position->type != STATUS_TYPE_CATEGORY) {
-                enum GITSI_STATUS_TYPE type = context->position->type;
-                bool flag = !context->position->marked;
-                for (size_t i = 0; i < context->entry_count; i++) {
-                    if (context->entries[i]->type == type) {
-                        context->entries[i]->marked = flag;
-                    }
-                }
+            if (gitsi_row_type(context, context->position) != STATUS_TYPE_CATEGORY) {
+                enum GITSI_STATUS_TYPE type = gitsi_row_type(context, context->position);
+                bool flag = !gitsi_row_marked(context, context->position);
+                uint32_t first, end;
+                gitsi_entries_section(context, type, &first, &end);
+                gitsi_bit_set_range(context->entries.marked, first, end, flag);
             }
         }
     }
@@ -1472,6 +8716,84 @@ void gitsi_process_input(gitsi_context *context, int input_char) {
 }
 
 
+/* The direction of a key that moves the selection by one line, 0 for other keys */
+int gitsi_unit_motion(enum key_stroke key) {
+    if (key == K_J || key == K_ARROW_DOWN)return 1;
+    if (key == K_K || key == K_ARROW_UP)return -1;
+    return 0;
+}
+
+/* Read the next key if there is one, without waiting. During a replay the
+ * keys of the current line of the session are waiting */
+int gitsi_pending_key(gitsi_context *context) {
+    gitsi_replay *replay = context->replay;
+    if (replay != NULL) {
+        if (replay->next == replay->key_count || replay->keys[replay->next] == REPLAY_BATCH_END)return ERR;
+        return replay->keys[replay->next++];
+    }
+    timeout(0);
+    return getch();
+}
+
+/* Process `ch` and every key that is already waiting, so that one frame is drawn
+ * for the whole batch. Held down j / k keys are folded into one movement and
+ * pasted or quickly typed filter text is filtered once. A batch is one line
+ * of the --record file */
+void gitsi_process_pending_input(gitsi_context *context, int ch) {
+    size_t processed = 0;
+    while (ch != ERR && processed < MAX_INPUT_BATCH && sigint_received == false) {
+        enum key_stroke key = translate_key(context, ch);
+        bool is_list = !context->is_search && !context->grep.is_input &&
+            !context->is_in_command_mode && !context->is_in_help;
+        
+        // Visual mark mode marks every row on the way, so it moves step by step
+        if (is_list && context->number_stack_count == 0 && gitsi_unit_motion(key) != 0 && !context->loader.is_running) {
+            int steps = 0;
+            while (ch != ERR && gitsi_unit_motion(key) != 0 && processed < MAX_INPUT_BATCH) {
+                gitsi_record_key(context, ch);
+                steps += gitsi_unit_motion(key);
+                processed++;
+                ch = gitsi_pending_key(context);
+                key = translate_key(context, ch);
+            }
+            gitsi_move_selection(context, steps);
+            continue;
+        }
+        
+        if (context->is_search && ((ch >= 32 && ch < 127) || key == K_BACKSPACE)) {
+            size_t length = strlen(context->search_term);
+            while (ch != ERR && ((ch >= 32 && ch < 127) || key == K_BACKSPACE) && processed < MAX_INPUT_BATCH) {
+                gitsi_record_key(context, ch);
+                if (key == K_BACKSPACE) {
+                    if (length > 0)length--;
+                } else if (length < MAX_INPUT_CHARS - 1) {
+                    context->search_term[length++] = (char)ch;
+                }
+                processed++;
+                ch = gitsi_pending_key(context);
+                key = translate_key(context, ch);
+            }
+            context->search_term[length] = '\0';
+            gitsi_filter_entries(context);
+            continue;
+        }
+        
+        gitsi_record_key(context, ch);
+        gitsi_process_input(context, ch);
+        processed++;
+        ch = gitsi_pending_key(context);
+    }
+    // Whatever did not fit into this batch is handled after the next frame
+    if (ch != ERR && context->replay != NULL) {
+        context->replay->next--;
+    } else if (ch != ERR) {
+        ungetch(ch);
+    }
+    if (context->record_file != NULL && processed > 0) {
+        fputc('\n', context->record_file);
+    }
+}
+
 /* Main function to process the user input and act
  * accordingly */
 void gitsi_main_loop(gitsi_context *context) {
@@ -1479,27 +8801,252 @@ void gitsi_main_loop(gitsi_context *context) {
     
     while(true) {
         getmaxyx(stdscr, context->max_y, context->max_x);
-        gitsi_print_main(context);
-        
         if (context->number_stack_count > 0) {
-            context->number_stack[context->number_stack_count + 1] = '\0';
-            mvaddstr(0, context->max_x - context->number_stack_count, context->number_stack);
+            context->number_stack[context->number_stack_count] = '\0';
+        }
+        gitsi_print_main(context);
+        if (context->first_frame_at == 0) {
+            context->first_frame_at = gitsi_now_ms();
         }
         
         while (true) {
-            timeout(100);
+            // Keys that curses already buffered don't wake up poll
+            timeout(0);
             ch = getch();
             // The user pressed CTRL-C, we want to clean up
             if (sigint_received == true) {
                 return;
             }
             if (ch != ERR)break;
+            // Wait for the next key or for output of the background jobs
+            if (gitsi_jobs_poll(context, 1000))break;
+            if (sigint_received == true) {
+                return;
+            }
         }
         
-        gitsi_process_input(context, ch);
+        if (ch != ERR) {
+            gitsi_process_pending_input(context, ch);
+        }
     }
 }
 
+// --------------------------------------------------
+#pragma mark Replay
+// --------------------------------------------------
+
+/* Append a key to the session */
+void gitsi_replay_add_key(gitsi_replay *replay, int ch) {
+    if (replay->key_count == replay->key_capacity) {
+        replay->key_capacity = replay->key_capacity == 0 ? 256 : replay->key_capacity * 2;
+        replay->keys = realloc(replay->keys, replay->key_capacity * sizeof(int));
+    }
+    replay->keys[replay->key_count++] = ch;
+}
+
+/* Read a session in the format of --record. The keys of a line arrive at
+ * once, like held down or pasted keys, and lines starting with `#` are
+ * comments. Returns false with the line number in `error_line` if an escape
+ * is invalid */
+bool gitsi_replay_load(gitsi_replay *replay, const char *path, size_t *error_line) {
+    FILE *file = fopen(path, "r");
+    *error_line = 0;
+    if (file == NULL)return false;
+    char *line = NULL;
+    size_t capacity = 0;
+    size_t line_number = 0;
+    bool is_valid = true;
+    while (is_valid && getline(&line, &capacity, file) >= 0) {
+        line_number++;
+        if (line[0] == '#')continue;
+        // An invalid escape can leave `c` on the terminator, so it ends the line first
+        for (const char *c = line; is_valid && *c != '\0' && *c != '\n'; c++) {
+            if (*c != '\\') {
+                gitsi_replay_add_key(replay, (unsigned char)*c);
+                continue;
+            }
+            c++;
+            if (*c == 'e') {
+                gitsi_replay_add_key(replay, 27);
+            } else if (*c == 'r') {
+                gitsi_replay_add_key(replay, 13);
+            } else if (*c == '\\') {
+                gitsi_replay_add_key(replay, '\\');
+            } else if (*c >= '0' && *c <= '9') {
+                char *end = NULL;
+                long code = strtol(c, &end, 10);
+                is_valid = *end == ';' && code <= KEY_MAX;
+                if (is_valid)gitsi_replay_add_key(replay, (int)code);
+                c = end;
+            } else {
+                is_valid = false;
+            }
+        }
+        if (replay->key_count > 0 && replay->keys[replay->key_count - 1] != REPLAY_BATCH_END) {
+            gitsi_replay_add_key(replay, REPLAY_BATCH_END);
+        }
+    }
+    free(line);
+    fclose(file);
+    if (!is_valid)*error_line = line_number;
+    return is_valid;
+}
+
+/* Add the time of a phase of a key */
+void gitsi_replay_sample(gitsi_replay *replay, enum GITSI_REPLAY_PHASE phase, double ms) {
+    replay->samples[phase][replay->sample_counts[phase]++] = ms;
+}
+
+int gitsi_double_compare(const void *a, const void *b) {
+    double left = *(const double *)a, right = *(const double *)b;
+    return left < right ? -1 : left > right;
+}
+
+/* Print the percentiles of every phase and a histogram of all of them next to
+ * each other, with a bucket per power of two microseconds */
+void gitsi_replay_report(gitsi_replay *replay) {
+    printf("%-8s %8s %10s %10s %10s %10s %10s\n", "phase", "frames", "mean ms", "p50 ms", "p90 ms", "p99 ms", "max ms");
+    size_t buckets[REPLAY_PHASES][REPLAY_BUCKETS] = { { 0 } };
+    size_t first_bucket = REPLAY_BUCKETS, last_bucket = 0;
+    for (size_t phase = 0; phase < REPLAY_PHASES; phase++) {
+        double *samples = replay->samples[phase];
+        size_t count = replay->sample_counts[phase];
+        if (count == 0) {
+            printf("%-8s %8zu\n", replay_phase_names[phase], count);
+            continue;
+        }
+        qsort(samples, count, sizeof(double), gitsi_double_compare);
+        double sum = 0;
+        for (size_t i = 0; i < count; i++) {
+            sum += samples[i];
+            size_t bucket = 0;
+            while (bucket + 1 < REPLAY_BUCKETS && samples[i] * 1000.0 >= (double)(2u << bucket))bucket++;
+            buckets[phase][bucket] += 1;
+            first_bucket = MIN(first_bucket, bucket);
+            last_bucket = MAX(last_bucket, bucket);
+        }
+        printf("%-8s %8zu %10.3f %10.3f %10.3f %10.3f %10.3f\n", replay_phase_names[phase], count, sum / (double)count,
+               samples[count / 2], samples[count * 90 / 100], samples[count * 99 / 100], samples[count - 1]);
+    }
+    if (first_bucket == REPLAY_BUCKETS)return;
+    printf("\n%-14s", "latency");
+    for (size_t phase = 0; phase < REPLAY_PHASES; phase++) {
+        printf(" %8s", replay_phase_names[phase]);
+    }
+    printf("\n");
+    for (size_t bucket = first_bucket; bucket <= last_bucket; bucket++) {
+        if (bucket + 1 == REPLAY_BUCKETS) {
+            printf(">= %8u us", 2u << (bucket - 1));
+        } else {
+            printf(" < %8u us", 2u << bucket);
+        }
+        for (size_t phase = 0; phase < REPLAY_PHASES; phase++) {
+            printf(" %8zu", buckets[phase][bucket]);
+        }
+        printf("\n");
+    }
+}
+
+/* Run --replay: read the status, then feed every line of the session through
+ * the batched input handling and draw a frame after each batch, on a screen
+ * that writes to /dev/null. The diffstat worker is not started, so that the
+ * times only depend on the keys. Finished workers and jobs are collected
+ * between batches, outside of the measurement. Fails if a dialog finds no
+ * answer in the session */
+int gitsi_run_replay(gitsi_context *context) {
+    gitsi_replay replay = { 0 };
+    size_t error_line = 0;
+    if (!gitsi_replay_load(&replay, context->replay_path, &error_line)) {
+        if (error_line > 0) {
+            fprintf(stderr, "Invalid escape in line %zu of %s\n", error_line, context->replay_path);
+        } else {
+            fprintf(stderr, "Could not read %s: %s\n", context->replay_path, strerror(errno));
+        }
+        free(replay.keys);
+        return 1;
+    }
+    FILE *screen_output = fopen("/dev/null", "w");
+    FILE *screen_input = fopen("/dev/null", "r");
+    const char *terminal = getenv("TERM") != NULL ? getenv("TERM") : "xterm";
+    context->replay_screen = screen_output != NULL && screen_input != NULL ?
+        newterm(terminal, screen_output, screen_input) : NULL;
+    if (context->replay_screen == NULL) {
+        fprintf(stderr, "Could not create a screen for %s\n", terminal);
+        return 1;
+    }
+    for (size_t phase = 0; phase < REPLAY_PHASES; phase++) {
+        replay.samples[phase] = calloc(replay.key_count + 1, sizeof(double));
+    }
+    
+    gitsi_read_branch(context);
+    gitsi_wakeup_init(context);
+    gitsi_curses_start(context);
+    resizeterm(REPLAY_LINES, REPLAY_COLUMNS);
+    double started_at = gitsi_now_ms();
+    gitsi_update_status(context);
+    gitsi_select_first_entry(context);
+    double status_ms = gitsi_now_ms() - started_at;
+    getmaxyx(stdscr, context->max_y, context->max_x);
+    gitsi_print_main(context);
+    
+    size_t replayed = 0, frames = 0;
+    context->replay = &replay;
+    started_at = gitsi_now_ms();
+    while (replay.next < replay.key_count && sigint_received == false && !replay.is_failed) {
+        int ch = replay.keys[replay.next++];
+        if (ch == REPLAY_BATCH_END)continue;
+        size_t first = replay.next - 1;
+        context->status_work_ms = 0;
+        double key_started_at = gitsi_now_ms();
+        gitsi_process_pending_input(context, ch);
+        double rendered_at = gitsi_now_ms();
+        getmaxyx(stdscr, context->max_y, context->max_x);
+        if (context->number_stack_count > 0) {
+            context->number_stack[context->number_stack_count] = '\0';
+        }
+        gitsi_print_main(context);
+        double finished_at = gitsi_now_ms();
+        
+        double input_ms = rendered_at - key_started_at;
+        gitsi_replay_sample(&replay, REPLAY_INPUT, input_ms - context->status_work_ms);
+        if (context->status_work_ms > 0) {
+            gitsi_replay_sample(&replay, REPLAY_STATUS, context->status_work_ms);
+        }
+        gitsi_replay_sample(&replay, REPLAY_RENDER, finished_at - rendered_at);
+        gitsi_replay_sample(&replay, REPLAY_TOTAL, finished_at - key_started_at);
+        for (size_t i = first; i < replay.next; i++) {
+            if (replay.keys[i] != REPLAY_BATCH_END)replayed++;
+        }
+        frames++;
+        gitsi_jobs_poll(context, 0);
+    }
+    double replay_ms = gitsi_now_ms() - started_at;
+    context->replay = NULL;
+    
+    gitsi_curses_stop(false);
+    delscreen(context->replay_screen);
+    context->replay_screen = NULL;
+    fclose(screen_output);
+    fclose(screen_input);
+    int result = 0;
+    if (replay.is_failed) {
+        fprintf(stderr, "%s ended while a dialog waited for an answer, after %zu keys\n",
+                context->replay_path, replayed);
+        result = 1;
+    } else {
+        printf("%s: %zu keys in %zu frames in %.1f ms, the first status took %.1f ms (%u entries)\n\n",
+               context->replay_path, replayed, frames, replay_ms, status_ms, context->entries.count);
+        gitsi_replay_report(&replay);
+    }
+    
+    for (size_t phase = 0; phase < REPLAY_PHASES; phase++) {
+        free(replay.samples[phase]);
+    }
+    free(replay.keys);
+    gitsi_cleanup(context);
+    return result;
+}
+
 int main(int argc, char *argv[]) {
     for (int argi = 1; argi < argc; argi++) {
         if (strcmp(argv[argi], "--debug-terminal") == 0)
@@ -1513,31 +9060,56 @@ int main(int argc, char *argv[]) {
     signal(SIGINT, sigint_handler);
     
     gitsi_context context = {
+        .started_at = gitsi_now_ms(),
         .repo = NULL,
         .has_color = false,
-        .position = NULL,
+        .position = ROW_NONE,
         .search_term = "",
-        .filtered_entries = NULL,
+        .rows = NULL,
         .is_search = false,
         .is_in_help = false,
         .is_visual_mark_mode = false,
         .number_stack_count = 0,
-    };
+        .rename_mode = GITSI_RENAMES_INDEX,
+        .rename_limit = DEFAULT_RENAME_LIMIT,
+        .rename_threshold = DEFAULT_RENAME_THRESHOLD,
+        .wake_pipe = { -1, -1 },
 #if DEBUG
-    context.logfile = fopen(LOGFILE_NAME, "w");
+        .log_level = GITSI_LOG_DEBUG,
 #endif
+    };
     git_libgit2_init();
     gitsi_parse_parameters(&context, argc, argv);
+    gitsi_log_start(context.log_level);
     gitsi_open_repository(&context);
+    if (context.output_format != GITSI_OUTPUT_NONE) {
+        return gitsi_write_status(&context);
+    }
+    if (context.is_batch) {
+        return gitsi_run_batch(&context);
+    }
+    if (context.is_daemon) {
+        return gitsi_run_daemon(&context);
+    }
+    if (context.replay_path != NULL) {
+        return gitsi_run_replay(&context);
+    }
+    if (context.record_path != NULL) {
+        context.record_file = fopen(context.record_path, "w");
+        if (context.record_file == NULL) {
+            fprintf(stderr, "Could not write %s: %s\n", context.record_path, strerror(errno));
+            return 1;
+        }
+    }
+    gitsi_read_branch(&context);
+    gitsi_wakeup_init(&context);
+    gitsi_diffstat_start(&context);
     gitsi_curses_start(&context);
-    gitsi_update_status(&context);
-    gitsi_select_first_entry(&context);
+    gitsi_status_loader_start(&context);
     gitsi_main_loop(&context);
     gitsi_curses_stop(false);
+    gitsi_print_trace(&context);
     gitsi_cleanup(&context);
-#if DEBUG
-    fclose(context.logfile);
-#endif
     return 0;
 }
 
@@ -1548,13 +9120,17 @@ int debug_main(int argc, char *argv[]) {
     gitsi_context context = {
         .repo = NULL,
         .has_color = false,
-        .position = NULL,
+        .position = ROW_NONE,
         .search_term = "",
-        .filtered_entries = NULL,
+        .rows = NULL,
         .is_search = false,
         .is_in_help = false,
         .is_visual_mark_mode = false,
         .number_stack_count = 0,
+        .rename_mode = GITSI_RENAMES_INDEX,
+        .rename_limit = DEFAULT_RENAME_LIMIT,
+        .rename_threshold = DEFAULT_RENAME_THRESHOLD,
+        .wake_pipe = { -1, -1 },
     };
     context.repo_dir = strdup("test_repository");
     git_libgit2_init();
@@ -1568,8 +9144,8 @@ int debug_main(int argc, char *argv[]) {
     strcpy(context.search_term, "main");
     gitsi_filter_entries(&context);
     
-    for (size_t i=0; i<context.filtered_entry_count; i++) {
-        printf("%s\n", context.filtered_entries[i]->filename);
+    for (size_t i=0; i<context.row_count; i++) {
+        printf("%s\n", gitsi_row_path(&context, context.rows[i]));
     }
     
     gitsi_cleanup(&context);